@@ -29,7 +29,15 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
 #include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice-glue/thread.h>
 #ifdef HAVE_OPENSSL
 #include <openssl/sha.h>
 #else
@@ -53,6 +61,140 @@
 #define ASR_PAYLOAD_PACKET_SIZE 1450
 #define ASR_PAYLOAD_CHUNK_SIZE 131072
 #define ASR_CHECKSUM_CHUNK_SIZE 131072
+#define ASR_PAYLOAD_RING_SIZE 8
+#define ASR_PAYLOAD_MAX_HASHERS 8
+#define ASR_SOURCE_RELEASE_SIZE (8 * 1024 * 1024)
+
+/* The filesystem image. Images opened from the filesystem are mapped, so OOB
+ * replies and payload chunks are sent straight from the page cache; pages
+ * that have been sent are given back, which keeps concurrent restores of
+ * large images from pushing everything else out of memory. Zip entries are
+ * read through the file handle. */
+struct asr_source {
+	ipsw_file_handle_t file;
+	uint64_t size;
+	unsigned char* map;
+#ifdef WIN32
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	uint64_t released;
+};
+
+static struct asr_source* asr_source_open(ipsw_file_handle_t file)
+{
+	struct asr_source* src = (struct asr_source*)calloc(1, sizeof(struct asr_source));
+	if (!src) {
+		return NULL;
+	}
+	src->file = file;
+	src->size = ipsw_file_size(file);
+
+	int fd = ipsw_file_get_fd(file);
+	if (fd < 0 || src->size == 0 || src->size > (uint64_t)SIZE_MAX) {
+		return src;
+	}
+#ifdef WIN32
+	src->mapping = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+	if (src->mapping) {
+		src->map = (unsigned char*)MapViewOfFile(src->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!src->map) {
+			CloseHandle(src->mapping);
+			src->mapping = NULL;
+		}
+	}
+#else
+	void* map = mmap(NULL, (size_t)src->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED) {
+		src->map = (unsigned char*)map;
+		src->fd = fd;
+	}
+#endif
+	if (src->map) {
+		debug("DEBUG: %s: mapped %" PRIu64 " bytes of filesystem image\n", __func__, src->size);
+	}
+	return src;
+}
+
+static void asr_source_close(struct asr_source* src)
+{
+	if (!src) {
+		return;
+	}
+	if (src->map) {
+#ifdef WIN32
+		UnmapViewOfFile(src->map);
+		CloseHandle(src->mapping);
+#else
+		munmap(src->map, (size_t)src->size);
+#endif
+	}
+	free(src);
+}
+
+static size_t asr_source_page_size(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwPageSize;
+#else
+	long pagesize = sysconf(_SC_PAGESIZE);
+	return (pagesize > 0) ? (size_t)pagesize : 4096;
+#endif
+}
+
+/* Faults in the given range of a mapped image ahead of the sender */
+static void asr_source_prefetch(struct asr_source* src, uint64_t offset, uint64_t length)
+{
+	size_t pagesize = asr_source_page_size();
+	uint64_t start = offset - (offset % pagesize);
+#if !defined(WIN32) && defined(MADV_WILLNEED)
+	madvise(src->map + start, (size_t)(offset + length - start), MADV_WILLNEED);
+#endif
+	volatile unsigned char sum = 0;
+	uint64_t pos;
+	for (pos = start; pos < offset + length; pos += pagesize) {
+		sum += src->map[pos];
+	}
+	(void)sum;
+}
+
+/* Gives back the pages of a mapped image below offset */
+static void asr_source_release(struct asr_source* src, uint64_t offset)
+{
+	if (offset < src->size && offset - src->released < ASR_SOURCE_RELEASE_SIZE) {
+		return;
+	}
+	size_t pagesize = asr_source_page_size();
+	uint64_t end = (offset < src->size) ? offset - (offset % pagesize) : src->size;
+	if (end <= src->released) {
+		return;
+	}
+#ifdef WIN32
+	/* unlocking pages that aren't locked removes them from the working set */
+	VirtualUnlock(src->map + src->released, (SIZE_T)(end - src->released));
+#else
+#ifdef MADV_DONTNEED
+	madvise(src->map + src->released, (size_t)(end - src->released), MADV_DONTNEED);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(src->fd, (off_t)src->released, (off_t)(end - src->released), POSIX_FADV_DONTNEED);
+#endif
+#endif
+	src->released = end;
+}
+
+static struct asr_source* asr_get_source(asr_client_t asr, ipsw_file_handle_t file)
+{
+	if (asr->source && asr->source->file == file) {
+		return asr->source;
+	}
+	asr_source_close(asr->source);
+	asr->source = asr_source_open(file);
+	return asr->source;
+}
 
 int asr_open_with_timeout(idevice_t device, asr_client_t* asr)
 {
@@ -86,6 +228,7 @@ int asr_open_with_timeout(idevice_t device, asr_client_t* asr)
 	asr_client_t asr_loc = (asr_client_t)malloc(sizeof(struct asr_client));
 	memset(asr_loc, '\0', sizeof(struct asr_client));
 	asr_loc->connection = connection;
+	conn_writer_init(&asr_loc->writer, connection, ASR_BUFFER_SIZE);
 
 	/* receive Initiate command message */
 	plist_t data = NULL;
@@ -181,12 +324,8 @@ int asr_send(asr_client_t asr, plist_t data)
 
 int asr_send_buffer(asr_client_t asr, const char* data, uint32_t size)
 {
-	uint32_t bytes = 0;
-	idevice_error_t device_error = IDEVICE_E_SUCCESS;
-
-	device_error = idevice_connection_send(asr->connection, data, size, &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != size) {
-		error("ERROR: Unable to send data to ASR. Sent %u of %u bytes.\n", bytes, size);
+	if (conn_writer_send(&asr->writer, data, size) < 0) {
+		error("ERROR: Unable to send data to ASR\n");
 		return -1;
 	}
 
@@ -200,14 +339,15 @@ void asr_free(asr_client_t asr)
 			idevice_disconnect(asr->connection);
 			asr->connection = NULL;
 		}
+		conn_writer_cleanup(&asr->writer);
+		asr_source_close(asr->source);
 		free(asr);
 		asr = NULL;
 	}
 }
 
-int asr_perform_validation(asr_client_t asr, const char* filesystem)
+int asr_perform_validation(asr_client_t asr, ipsw_file_handle_t file)
 {
-	FILE* file = NULL;
 	uint64_t length = 0;
 	char* command = NULL;
 	plist_t node = NULL;
@@ -216,20 +356,11 @@ int asr_perform_validation(asr_client_t asr, const char* filesystem)
 	plist_t payload_info = NULL;
 	int attempts = 0;
 
-	file = fopen(filesystem, "rb");
 	if (file == NULL) {
 		return -1;
 	}
 
-#ifdef WIN32
-	length = _lseeki64(fileno(file), 0, SEEK_END);
-	_lseeki64(fileno(file), 0, SEEK_SET);
-	rewind(file);
-#else
-	fseeko(file, 0, SEEK_END);
-	length = ftello(file);
-	fseeko(file, 0, SEEK_SET);
-#endif
+	length = ipsw_file_size(file);
 
 	payload_info = plist_new_dict();
 	plist_dict_set_item(payload_info, "Port", plist_new_uint(1));
@@ -296,7 +427,7 @@ int asr_perform_validation(asr_client_t asr, const char* filesystem)
 	return 0;
 }
 
-int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file)
+int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, ipsw_file_handle_t file)
 {
 	char* oob_data = NULL;
 	uint64_t oob_offset = 0;
@@ -318,100 +449,379 @@ int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file)
 	}
 	plist_get_uint_val(oob_offset_node, &oob_offset);
 
-	oob_data = (char*) malloc(oob_length);
-	if (oob_data == NULL) {
+	struct asr_source* src = asr_get_source(asr, file);
+	if (!src) {
 		error("ERROR: Out of memory\n");
 		return -1;
 	}
+	if (oob_offset > src->size || oob_length > src->size - oob_offset) {
+		error("ERROR: OOB data request beyond end of filesystem image\n");
+		return -1;
+	}
 
-#ifdef WIN32
-	rewind(file);
-	_lseeki64(fileno(file), oob_offset, SEEK_SET);
-#else
-	fseeko(file, oob_offset, SEEK_SET);
-#endif
-	if (fread(oob_data, 1, oob_length, file) != oob_length) {
-		error("ERROR: Unable to read OOB data from filesystem offset: %s\n", strerror(errno));
-		free(oob_data);
+	if (src->map) {
+		if (asr_send_buffer(asr, (const char*)src->map + oob_offset, oob_length) < 0) {
+			error("ERROR: Unable to send OOB data to ASR\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	/* OOB requests come in a steady stream, so the read buffer is reused */
+	if (oob_length > UINT32_MAX) {
+		error("ERROR: OOB data request too large\n");
+		return -1;
+	}
+	oob_data = conn_writer_scratch(&asr->writer, (uint32_t)oob_length);
+	if (oob_data == NULL) {
+		return -1;
+	}
+
+	if (ipsw_file_seek(file, oob_offset, SEEK_SET) < 0) {
+		error("ERROR: Unable to seek to OOB data offset %" PRIu64 "\n", oob_offset);
+		return -1;
+	}
+	int64_t ir = ipsw_file_read(file, oob_data, oob_length);
+	if (ir < 0 || (uint64_t)ir != oob_length) {
+		error("ERROR: Unable to read OOB data from filesystem offset %" PRIu64 "\n", oob_offset);
 		return -1;
 	}
 
 	if (asr_send_buffer(asr, oob_data, oob_length) < 0) {
 		error("ERROR: Unable to send OOB data to ASR\n");
-		free(oob_data);
 		return -1;
 	}
-	free(oob_data);
 	return 0;
 }
 
-int asr_send_payload(asr_client_t asr, const char* filesystem)
+struct asr_payload_pipeline {
+	asr_client_t asr;
+	ipsw_file_handle_t file;
+	struct asr_source* src;
+	uint64_t length;
+	uint64_t num_chunks;
+	int ring_size;
+	/* chunk buffers with room for the checksum, or just the checksums if
+	 * the chunks are sent from the mapped image */
+	char** slots;
+	unsigned char* trailers;
+	uint8_t* hashed;
+	uint64_t read_count;
+	uint64_t hash_next;
+	uint64_t hashed_count;
+	uint64_t sent_count;
+	int failed;
+	mutex_t mutex;
+	cond_t read_cond;
+	cond_t hash_cond;
+	cond_t send_cond;
+	uint64_t read_time;
+	uint64_t hash_time;
+	uint64_t send_time;
+};
+
+static uint32_t asr_payload_chunk_size(struct asr_payload_pipeline* p, uint64_t chunk)
 {
-	char *data = NULL;
-	FILE* file = NULL;
-	uint64_t i, length, bytes = 0;
-	double progress = 0;
+	if (chunk == p->num_chunks-1) {
+		return (uint32_t)(p->length - chunk*ASR_PAYLOAD_CHUNK_SIZE);
+	}
+	return ASR_PAYLOAD_CHUNK_SIZE;
+}
 
-	file = fopen(filesystem, "rb");
-	if (file == NULL) {
-		error("ERROR: Unable to open filesystem image %s: %s\n", filesystem, strerror(errno));
-		return -1;
+static unsigned char* asr_payload_chunk_data(struct asr_payload_pipeline* p, uint64_t chunk)
+{
+	if (p->src->map) {
+		return p->src->map + chunk*ASR_PAYLOAD_CHUNK_SIZE;
 	}
+	return (unsigned char*)p->slots[chunk % p->ring_size];
+}
 
-#ifdef WIN32
-	length = _lseeki64(fileno(file), 0, SEEK_END);
-	_lseeki64(fileno(file), 0, SEEK_SET);
-	rewind(file);
-#else
-	fseeko(file, 0, SEEK_END);
-	length = ftello(file);
-	fseeko(file, 0, SEEK_SET);
-#endif
+static unsigned char* asr_payload_chunk_trailer(struct asr_payload_pipeline* p, uint64_t chunk)
+{
+	if (p->src->map) {
+		return p->trailers + (chunk % p->ring_size) * 20;
+	}
+	return (unsigned char*)p->slots[chunk % p->ring_size] + asr_payload_chunk_size(p, chunk);
+}
 
-	data = (char*)malloc(ASR_PAYLOAD_CHUNK_SIZE + 20);
+static void asr_payload_fail(struct asr_payload_pipeline* p)
+{
+	mutex_lock(&p->mutex);
+	p->failed = 1;
+	cond_signal(&p->read_cond);
+	cond_signal(&p->hash_cond);
+	cond_signal(&p->send_cond);
+	mutex_unlock(&p->mutex);
+}
 
-	SHA_CTX sha1;
+static void* asr_payload_reader(void* arg)
+{
+	struct asr_payload_pipeline* p = (struct asr_payload_pipeline*)arg;
+	uint64_t chunk;
 
-	if (asr->checksum_chunks) {
-		SHA1_Init(&sha1);
+	for (chunk = 0; chunk < p->num_chunks; chunk++) {
+		mutex_lock(&p->mutex);
+		while (!p->failed && chunk - p->sent_count >= (uint64_t)p->ring_size) {
+			cond_wait(&p->read_cond, &p->mutex);
+		}
+		int failed = p->failed;
+		mutex_unlock(&p->mutex);
+		if (failed) {
+			break;
+		}
+
+		uint32_t size = asr_payload_chunk_size(p, chunk);
+		uint64_t start = get_monotonic_time_us();
+		if (p->src->map) {
+			asr_source_prefetch(p->src, chunk*ASR_PAYLOAD_CHUNK_SIZE, size);
+		} else if (ipsw_file_read(p->file, p->slots[chunk % p->ring_size], size) != size) {
+			error("ERROR: Unable to read filesystem\n");
+			asr_payload_fail(p);
+			break;
+		}
+
+		mutex_lock(&p->mutex);
+		p->read_time += get_monotonic_time_us() - start;
+		p->read_count = chunk+1;
+		cond_signal((p->asr->checksum_chunks) ? &p->hash_cond : &p->send_cond);
+		mutex_unlock(&p->mutex);
 	}
 
-	int size = 0;
-	i = length;
-	int retry = 3;
-	while(i > 0 && retry >= 0) {
-		size = ASR_PAYLOAD_CHUNK_SIZE;
-		if (i < ASR_PAYLOAD_CHUNK_SIZE) {
-			size = i;
+	return NULL;
+}
+
+/* Any number of hashers take the chunks in order, but they can finish in any
+ * order. hashed_count only moves past chunks whose checksum is complete. */
+static void* asr_payload_hasher(void* arg)
+{
+	struct asr_payload_pipeline* p = (struct asr_payload_pipeline*)arg;
+
+	mutex_lock(&p->mutex);
+	while (1) {
+		while (!p->failed && p->hash_next < p->num_chunks && p->hash_next >= p->read_count) {
+			cond_wait(&p->hash_cond, &p->mutex);
+		}
+		if (p->failed || p->hash_next >= p->num_chunks) {
+			/* there is no broadcast, pass the wakeup on to the next hasher */
+			cond_signal(&p->hash_cond);
+			break;
+		}
+		uint64_t chunk = p->hash_next++;
+		if (p->hash_next < p->read_count) {
+			cond_signal(&p->hash_cond);
+		}
+		mutex_unlock(&p->mutex);
+
+		uint32_t size = asr_payload_chunk_size(p, chunk);
+		uint64_t start = get_monotonic_time_us();
+		SHA1(asr_payload_chunk_data(p, chunk), size, asr_payload_chunk_trailer(p, chunk));
+		uint64_t elapsed = get_monotonic_time_us() - start;
+
+		mutex_lock(&p->mutex);
+		p->hash_time += elapsed;
+		p->hashed[chunk % p->ring_size] = 1;
+		int advanced = 0;
+		while (p->hashed_count < p->num_chunks && p->hashed[p->hashed_count % p->ring_size]) {
+			p->hashed[p->hashed_count % p->ring_size] = 0;
+			p->hashed_count++;
+			advanced = 1;
+		}
+		if (advanced) {
+			cond_signal(&p->send_cond);
 		}
+	}
+	mutex_unlock(&p->mutex);
+
+	return NULL;
+}
+
+static double asr_throughput(uint64_t bytes, uint64_t usecs)
+{
+	if (usecs == 0) {
+		return 0;
+	}
+	return ((double)bytes / 1048576.0) / ((double)usecs / 1000000.0);
+}
 
-		if (fread(data, 1, size, file) != (size_t)size) {
-			error("Error reading filesystem\n");
-			retry--;
-			continue;
+int asr_send_payload(asr_client_t asr, ipsw_file_handle_t file)
+{
+	struct asr_payload_pipeline p;
+	THREAD_T reader = THREAD_T_NULL;
+	THREAD_T hashers[ASR_PAYLOAD_MAX_HASHERS];
+	int num_hashers = 0;
+	uint64_t chunk, bytes = 0;
+	double progress = 0;
+	int res = 0;
+	int i;
+
+	memset(&p, '\0', sizeof(p));
+	p.asr = asr;
+	p.file = file;
+	p.src = asr_get_source(asr, file);
+	if (!p.src) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	if (!p.src->map && ipsw_file_seek(file, 0, SEEK_SET) < 0) {
+		error("ERROR: Unable to seek to start of filesystem image\n");
+		return -1;
+	}
+	p.length = ipsw_file_size(file);
+	p.num_chunks = (p.length + ASR_PAYLOAD_CHUNK_SIZE - 1) / ASR_PAYLOAD_CHUNK_SIZE;
+
+	if (asr->checksum_chunks) {
+		/* the reader and the sender keep a core busy each */
+		num_hashers = get_cpu_count() - 2;
+		if (num_hashers < 1) {
+			num_hashers = 1;
+		} else if (num_hashers > ASR_PAYLOAD_MAX_HASHERS) {
+			num_hashers = ASR_PAYLOAD_MAX_HASHERS;
 		}
+	}
+	/* every hasher needs a chunk of its own on top of the ones in flight */
+	p.ring_size = ASR_PAYLOAD_RING_SIZE + num_hashers;
+	if (p.src->map) {
+		/* without buffers to fill the reader can prefault further ahead */
+		p.ring_size += ASR_SOURCE_RELEASE_SIZE / ASR_PAYLOAD_CHUNK_SIZE;
+#if !defined(WIN32) && defined(MADV_SEQUENTIAL)
+		madvise(p.src->map, (size_t)p.src->size, MADV_SEQUENTIAL);
+#endif
+	}
+	p.hashed = (uint8_t*)calloc(p.ring_size, sizeof(uint8_t));
+	if (p.src->map) {
+		/* remains zeroed without checksums, as the chunk buffers would */
+		p.trailers = (unsigned char*)calloc(p.ring_size, 20);
+	} else {
+		p.slots = (char**)calloc(p.ring_size, sizeof(char*));
+	}
+	if (!p.hashed || (!p.trailers && !p.slots)) {
+		error("ERROR: Out of memory\n");
+		free(p.slots);
+		free(p.trailers);
+		free(p.hashed);
+		return -1;
+	}
 
-		if (asr->checksum_chunks) {
-			SHA1((unsigned char*)data, size, (unsigned char*)(data+size));
+	/* every chunk is followed by 20 bytes of room for its SHA1 checksum */
+	for (i = 0; p.slots && i < p.ring_size; i++) {
+		p.slots[i] = (char*)calloc(1, ASR_PAYLOAD_CHUNK_SIZE + 20);
+		if (!p.slots[i]) {
+			error("ERROR: Out of memory\n");
+			while (--i >= 0) {
+				free(p.slots[i]);
+			}
+			free(p.slots);
+			free(p.hashed);
+			return -1;
+		}
+	}
+	mutex_init(&p.mutex);
+	cond_init(&p.read_cond);
+	cond_init(&p.hash_cond);
+	cond_init(&p.send_cond);
+
+	uint64_t total_start = get_monotonic_time_us();
+
+	if (thread_new(&reader, asr_payload_reader, &p) != 0) {
+		error("ERROR: Unable to start filesystem reader thread\n");
+		reader = THREAD_T_NULL;
+		res = -1;
+	} else {
+		for (i = 0; i < num_hashers; i++) {
+			if (thread_new(&hashers[i], asr_payload_hasher, &p) != 0) {
+				break;
+			}
+		}
+		if (i < num_hashers) {
+			if (i == 0) {
+				error("ERROR: Unable to start checksum thread\n");
+				asr_payload_fail(&p);
+				res = -1;
+			}
+			/* fewer hashers are fine */
+			num_hashers = i;
+		}
+	}
+
+	for (chunk = 0; res == 0 && chunk < p.num_chunks; chunk++) {
+		mutex_lock(&p.mutex);
+		while (!p.failed && chunk >= ((asr->checksum_chunks) ? p.hashed_count : p.read_count)) {
+			cond_wait(&p.send_cond, &p.mutex);
+		}
+		int failed = p.failed;
+		mutex_unlock(&p.mutex);
+		if (failed) {
+			res = -1;
+			break;
 		}
 
-		if (asr_send_buffer(asr, data, size+20) < 0) {
+		uint32_t size = asr_payload_chunk_size(&p, chunk);
+		uint64_t start = get_monotonic_time_us();
+		int sent;
+		if (p.src->map) {
+			/* the chunk goes out straight from the mapping, copying
+			 * it to save the trailer its own send isn't worth it */
+			struct conn_iovec iov[2] = {
+				{ asr_payload_chunk_data(&p, chunk), size },
+				{ asr_payload_chunk_trailer(&p, chunk), 20 }
+			};
+			sent = conn_writer_sendv(&asr->writer, iov, 2);
+		} else {
+			sent = asr_send_buffer(asr, p.slots[chunk % p.ring_size], size+20);
+		}
+		if (sent < 0) {
 			error("ERROR: Unable to send filesystem payload\n");
-			retry--;
-			continue;
+			asr_payload_fail(&p);
+			res = -1;
+			break;
+		}
+		if (p.src->map) {
+			asr_source_release(p.src, (chunk+1)*ASR_PAYLOAD_CHUNK_SIZE);
 		}
 
+		mutex_lock(&p.mutex);
+		p.send_time += get_monotonic_time_us() - start;
+		p.sent_count = chunk+1;
+		cond_signal(&p.read_cond);
+		mutex_unlock(&p.mutex);
+
 		bytes += size;
-		progress = ((double)bytes / (double)length);
+		progress = ((double)bytes / (double)p.length);
 		if (asr->progress_cb && ((int)(progress*100) > asr->lastprogress)) {
 			asr->progress_cb(progress, asr->progress_cb_data);
 			asr->lastprogress = (int)(progress*100);
 		}
+	}
 
-		i -= size;
+	if (reader != THREAD_T_NULL) {
+		thread_join(reader);
+		thread_free(reader);
+	}
+	for (i = 0; i < num_hashers; i++) {
+		thread_join(hashers[i]);
+		thread_free(hashers[i]);
 	}
 
-	free(data);
-	fclose(file);
-	return 0;
+	if (res == 0) {
+		uint64_t total_time = get_monotonic_time_us() - total_start;
+		info("Sent %" PRIu64 " bytes at %.1f MB/s (read %.1f MB/s", bytes, asr_throughput(bytes, total_time), asr_throughput(bytes, p.read_time));
+		if (asr->checksum_chunks) {
+			/* hash_time adds up the time of all hashers */
+			info(", checksum %.1f MB/s on %d thread%s", asr_throughput(bytes, p.hash_time / num_hashers), num_hashers, (num_hashers == 1) ? "" : "s");
+		}
+		info(", send %.1f MB/s)\n", asr_throughput(bytes, p.send_time));
+	}
+
+	cond_destroy(&p.read_cond);
+	cond_destroy(&p.hash_cond);
+	cond_destroy(&p.send_cond);
+	mutex_destroy(&p.mutex);
+	for (i = 0; p.slots && i < p.ring_size; i++) {
+		free(p.slots[i]);
+	}
+	free(p.slots);
+	free(p.trailers);
+	free(p.hashed);
+
+	return res;
 }
@@ -30,14 +30,22 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 
+#include "ipsw.h"
+#include "conn_writer.h"
+
 typedef void (*asr_progress_cb_t)(double, void*);
 
+struct asr_source;
+
 struct asr_client {
 	idevice_connection_t connection;
+	struct conn_writer writer;
 	uint8_t checksum_chunks;
 	int lastprogress;
 	asr_progress_cb_t progress_cb;
 	void* progress_cb_data;
+	/* the filesystem image, kept between validation and payload */
+	struct asr_source* source;
 };
 typedef struct asr_client *asr_client_t;
 
@@ -47,9 +55,9 @@ int asr_send(asr_client_t asr, plist_t data);
 int asr_receive(asr_client_t asr, plist_t* data);
 int asr_send_buffer(asr_client_t asr, const char* data, uint32_t size);
 void asr_free(asr_client_t asr);
-int asr_perform_validation(asr_client_t asr, const char* filesystem);
-int asr_send_payload(asr_client_t asr, const char* filesystem);
-int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file);
+int asr_perform_validation(asr_client_t asr, ipsw_file_handle_t file);
+int asr_send_payload(asr_client_t asr, ipsw_file_handle_t file);
+int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, ipsw_file_handle_t file);
 
 
 #ifdef __cplusplus
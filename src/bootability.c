@@ -0,0 +1,138 @@
+/*
+ * bootability.c
+ * Streaming the BootabilityBundle as a cpio archive
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "bootability.h"
+#include "common.h"
+
+struct cpio_odc_header {
+	char c_magic[6];
+	char c_dev[6];
+	char c_ino[6];
+	char c_mode[6];
+	char c_uid[6];
+	char c_gid[6];
+	char c_nlink[6];
+	char c_rdev[6];
+	char c_mtime[11];
+	char c_namesize[6];
+	char c_filesize[11];
+};
+
+static void octal(char *p, int width, int v)
+{
+	char buf[32];
+	snprintf(buf, 32, "%0*o", width, v);
+	memcpy(p, buf, width);
+}
+
+static int cpio_write_file(struct conn_writer *w, const char *name, struct stat *st, ipsw_file_handle_t file)
+{
+	struct cpio_odc_header hdr;
+
+	memset(&hdr, '0', sizeof(hdr));
+	memcpy(hdr.c_magic, "070707", 6);
+	octal(hdr.c_dev, 6, st->st_dev);
+	octal(hdr.c_ino, 6, st->st_ino);
+	octal(hdr.c_mode, 6, st->st_mode);
+	octal(hdr.c_uid, 6, st->st_uid);
+	octal(hdr.c_gid, 6, st->st_gid);
+	octal(hdr.c_nlink, 6, st->st_nlink);
+	octal(hdr.c_rdev, 6, st->st_rdev);
+	octal(hdr.c_mtime, 11, st->st_mtime);
+	octal(hdr.c_namesize, 6, strlen(name) + 1);
+	if (file)
+		octal(hdr.c_filesize, 11, st->st_size);
+
+	struct conn_iovec iov[2] = {
+		{ &hdr, sizeof(hdr) },
+		{ name, strlen(name) + 1 }
+	};
+	if (conn_writer_writev(w, iov, 2) < 0) {
+		return -1;
+	}
+	if (!file) {
+		return 0;
+	}
+
+	/* inflate straight into the send buffer */
+	uint64_t left = st->st_size;
+	while (left > 0) {
+		uint32_t n = 0;
+		char *dst = conn_writer_reserve(w, &n);
+		if (!dst) {
+			return -1;
+		}
+		if (n > left) {
+			n = (uint32_t)left;
+		}
+		int64_t r = ipsw_file_read(file, dst, n);
+		if (r <= 0) {
+			error("ERROR: expected %ld bytes but got %ld for file %s\n", (long)st->st_size, (long)(st->st_size - left), name);
+			return -1;
+		}
+		conn_writer_commit(w, (uint32_t)r);
+		left -= r;
+	}
+
+	return 0;
+}
+
+static int bootability_send_one(void *ctx, ipsw_archive_t ipsw, const char *name, struct stat *stat, ipsw_file_handle_t file)
+{
+	struct conn_writer *w = (struct conn_writer *)ctx;
+	const char *prefix = "BootabilityBundle/Restore/Bootability/";
+	const char *subpath;
+
+	if (!strcmp(name, "BootabilityBundle/Restore/Firmware/Bootability.dmg.trustcache")) {
+		subpath = "Bootability.trustcache";
+	} else if (strncmp(name, prefix, strlen(prefix))) {
+		return 0;
+	} else {
+		subpath = name + strlen(prefix);
+	}
+
+	debug("DEBUG: BootabilityBundle send m=%07o s=%10ld %s\n", stat->st_mode, (long)stat->st_size, subpath);
+
+	stat->st_uid = stat->st_gid = 0;
+
+	return cpio_write_file(w, subpath, stat, file);
+}
+
+int bootability_bundle_send(ipsw_archive_t ipsw, struct conn_writer* w)
+{
+	int ret = ipsw_stream_contents(ipsw, "BootabilityBundle/Restore/", bootability_send_one, w);
+	if (ret >= 0) {
+		struct stat st = {.st_nlink = 1};
+		ret = cpio_write_file(w, "TRAILER!!!", &st, NULL);
+	}
+	if (ret >= 0) {
+		ret = conn_writer_flush(w);
+	}
+	return ret;
+}
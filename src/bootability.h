@@ -0,0 +1,44 @@
+/*
+ * bootability.h
+ * Streaming the BootabilityBundle as a cpio archive (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_BOOTABILITY_H
+#define IDEVICERESTORE_BOOTABILITY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "ipsw.h"
+#include "conn_writer.h"
+
+/* The bundle is written through one buffer, so headers, names and file data
+ * go out in large contiguous sends no matter how small the files are */
+#define BOOTABILITY_SEND_BUFFER_SIZE (1024 * 1024)
+
+/* Writes BootabilityBundle/Restore of ipsw to w as an odc cpio archive,
+ * trailer included, and flushes it */
+int bootability_bundle_send(ipsw_archive_t ipsw, struct conn_writer* w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * build_manifest.c
+ * Shared, indexed BuildManifest
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "build_manifest.h"
+#include "common.h"
+
+struct build_manifest_data {
+	char* key;
+	void* data;
+	void (*free_func)(void*);
+	struct build_manifest_data* next;
+};
+
+struct build_manifest_identity {
+	plist_t node;
+	unsigned int order;
+	const char* hardware_model;
+	const char* variant;
+	/* sorted by name */
+	struct build_manifest_component* components;
+	unsigned int num_components;
+	/* attached by the users of the manifest, guarded by manifests_mutex */
+	struct build_manifest_data* data;
+};
+
+struct build_manifest {
+	plist_t plist;
+	int tss_enabled;
+	mutex_t mutex;
+	int refcount;
+	/* sorted by hardware model, then by position in BuildIdentities */
+	struct build_manifest_identity* identities;
+	unsigned int num_identities;
+	struct build_manifest* next;
+};
+
+/* live manifests, so components can be looked up by their build identity */
+static thread_once_t manifests_once = THREAD_ONCE_INIT;
+static mutex_t manifests_mutex;
+static struct build_manifest* manifests = NULL;
+
+static void manifests_init(void)
+{
+	mutex_init(&manifests_mutex);
+}
+
+static int component_cmp(const void* a, const void* b)
+{
+	return strcmp(((const struct build_manifest_component*)a)->name, ((const struct build_manifest_component*)b)->name);
+}
+
+static int identity_cmp(const void* a, const void* b)
+{
+	const struct build_manifest_identity* ia = (const struct build_manifest_identity*)a;
+	const struct build_manifest_identity* ib = (const struct build_manifest_identity*)b;
+	int res = strcasecmp(ia->hardware_model, ib->hardware_model);
+	if (res == 0) {
+		res = (ia->order < ib->order) ? -1 : (ia->order > ib->order);
+	}
+	return res;
+}
+
+static void build_manifest_index_components(struct build_manifest_identity* ident)
+{
+	plist_t manifest_node = plist_dict_get_item(ident->node, "Manifest");
+	if (!manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
+		return;
+	}
+	uint32_t count = plist_dict_get_size(manifest_node);
+	if (count == 0) {
+		return;
+	}
+	ident->components = (struct build_manifest_component*)calloc(count, sizeof(struct build_manifest_component));
+	if (!ident->components) {
+		return;
+	}
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(manifest_node, &iter);
+	while (iter && ident->num_components < count) {
+		char* key = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(manifest_node, iter, &key, &node);
+		if (!key) {
+			break;
+		}
+		if (!node || plist_get_node_type(node) != PLIST_DICT) {
+			free(key);
+			continue;
+		}
+		struct build_manifest_component* comp = &ident->components[ident->num_components++];
+		comp->name = key;
+		comp->node = node;
+		plist_t info_node = plist_dict_get_item(node, "Info");
+		if (info_node && plist_get_node_type(info_node) == PLIST_DICT) {
+			plist_t path_node = plist_dict_get_item(info_node, "Path");
+			if (path_node && plist_get_node_type(path_node) == PLIST_STRING) {
+				comp->path = plist_get_string_ptr(path_node, NULL);
+			}
+		}
+		plist_t digest_node = plist_dict_get_item(node, "Digest");
+		if (digest_node && plist_get_node_type(digest_node) == PLIST_DATA) {
+			comp->digest = plist_get_data_ptr(digest_node, &comp->digest_size);
+		}
+	}
+	free(iter);
+
+	qsort(ident->components, ident->num_components, sizeof(struct build_manifest_component), component_cmp);
+}
+
+static void build_manifest_index(build_manifest_t manifest)
+{
+	plist_t build_identities_array = plist_dict_get_item(manifest->plist, "BuildIdentities");
+	if (!build_identities_array || plist_get_node_type(build_identities_array) != PLIST_ARRAY) {
+		return;
+	}
+	uint32_t count = plist_array_get_size(build_identities_array);
+	if (count == 0) {
+		return;
+	}
+	manifest->identities = (struct build_manifest_identity*)calloc(count, sizeof(struct build_manifest_identity));
+	if (!manifest->identities) {
+		return;
+	}
+
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		plist_t ident = plist_array_get_item(build_identities_array, i);
+		if (!ident || plist_get_node_type(ident) != PLIST_DICT) {
+			continue;
+		}
+		plist_t info_dict = plist_dict_get_item(ident, "Info");
+		plist_t devclass = plist_dict_get_item(info_dict, "DeviceClass");
+		if (!devclass || plist_get_node_type(devclass) != PLIST_STRING) {
+			continue;
+		}
+		struct build_manifest_identity* entry = &manifest->identities[manifest->num_identities++];
+		entry->node = ident;
+		entry->order = i;
+		entry->hardware_model = plist_get_string_ptr(devclass, NULL);
+		plist_t rvariant = plist_dict_get_item(info_dict, "Variant");
+		if (rvariant && plist_get_node_type(rvariant) == PLIST_STRING) {
+			entry->variant = plist_get_string_ptr(rvariant, NULL);
+		}
+		build_manifest_index_components(entry);
+	}
+
+	qsort(manifest->identities, manifest->num_identities, sizeof(struct build_manifest_identity), identity_cmp);
+}
+
+build_manifest_t build_manifest_new(plist_t plist, int tss_enabled)
+{
+	if (!plist) {
+		return NULL;
+	}
+	build_manifest_t manifest = (build_manifest_t)calloc(1, sizeof(struct build_manifest));
+	if (!manifest) {
+		error("ERROR: Out of memory\n");
+		plist_free(plist);
+		return NULL;
+	}
+	manifest->plist = plist;
+	manifest->tss_enabled = tss_enabled;
+	manifest->refcount = 1;
+	mutex_init(&manifest->mutex);
+
+	build_manifest_index(manifest);
+
+	thread_once(&manifests_once, manifests_init);
+	mutex_lock(&manifests_mutex);
+	manifest->next = manifests;
+	manifests = manifest;
+	mutex_unlock(&manifests_mutex);
+
+	return manifest;
+}
+
+build_manifest_t build_manifest_ref(build_manifest_t manifest)
+{
+	if (manifest) {
+		mutex_lock(&manifest->mutex);
+		manifest->refcount++;
+		mutex_unlock(&manifest->mutex);
+	}
+	return manifest;
+}
+
+void build_manifest_free(build_manifest_t manifest)
+{
+	if (!manifest) {
+		return;
+	}
+	mutex_lock(&manifest->mutex);
+	int refcount = --manifest->refcount;
+	mutex_unlock(&manifest->mutex);
+	if (refcount > 0) {
+		return;
+	}
+
+	mutex_lock(&manifests_mutex);
+	build_manifest_t* pm = &manifests;
+	while (*pm && *pm != manifest) {
+		pm = &(*pm)->next;
+	}
+	if (*pm) {
+		*pm = manifest->next;
+	}
+	mutex_unlock(&manifests_mutex);
+
+	unsigned int i, j;
+	for (i = 0; i < manifest->num_identities; i++) {
+		for (j = 0; j < manifest->identities[i].num_components; j++) {
+			free(manifest->identities[i].components[j].name);
+		}
+		free(manifest->identities[i].components);
+		struct build_manifest_data* data = manifest->identities[i].data;
+		while (data) {
+			struct build_manifest_data* next = data->next;
+			if (data->free_func) {
+				data->free_func(data->data);
+			}
+			free(data->key);
+			free(data);
+			data = next;
+		}
+	}
+	free(manifest->identities);
+	plist_free(manifest->plist);
+	mutex_destroy(&manifest->mutex);
+	free(manifest);
+}
+
+plist_t build_manifest_get_plist(build_manifest_t manifest)
+{
+	return (manifest) ? manifest->plist : NULL;
+}
+
+int build_manifest_is_tss_enabled(build_manifest_t manifest)
+{
+	return (manifest) ? manifest->tss_enabled : 0;
+}
+
+plist_t build_manifest_find_identity(build_manifest_t manifest, const char* hardware_model, const char* variant)
+{
+	if (!manifest || !hardware_model) {
+		return NULL;
+	}
+
+	/* find the first identity for this hardware model */
+	unsigned int lo = 0;
+	unsigned int hi = manifest->num_identities;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (strcasecmp(manifest->identities[mid].hardware_model, hardware_model) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	unsigned int i;
+	for (i = lo; i < manifest->num_identities; i++) {
+		struct build_manifest_identity* ident = &manifest->identities[i];
+		if (strcasecmp(ident->hardware_model, hardware_model) != 0) {
+			break;
+		}
+		if (!variant) {
+			return ident->node;
+		}
+		/* a partial match is as good as a full match */
+		if (ident->variant && strstr(ident->variant, variant)) {
+			return ident->node;
+		}
+	}
+
+	return NULL;
+}
+
+int build_manifest_get_component(plist_t build_identity, const char* component, const struct build_manifest_component** comp)
+{
+	if (!build_identity || !component || !comp) {
+		return -2;
+	}
+	*comp = NULL;
+
+	thread_once(&manifests_once, manifests_init);
+
+	int res = -2;
+	mutex_lock(&manifests_mutex);
+	build_manifest_t manifest;
+	for (manifest = manifests; manifest && res == -2; manifest = manifest->next) {
+		unsigned int i;
+		for (i = 0; i < manifest->num_identities; i++) {
+			struct build_manifest_identity* ident = &manifest->identities[i];
+			if (ident->node != build_identity) {
+				continue;
+			}
+			if (!ident->components) {
+				res = -1;
+				break;
+			}
+			struct build_manifest_component key;
+			key.name = (char*)component;
+			*comp = (const struct build_manifest_component*)bsearch(&key, ident->components, ident->num_components, sizeof(struct build_manifest_component), component_cmp);
+			res = (*comp) ? 0 : -1;
+			break;
+		}
+	}
+	mutex_unlock(&manifests_mutex);
+
+	return res;
+}
+
+/* must be called with manifests_mutex held */
+static struct build_manifest_identity* build_manifest_lookup_identity(plist_t build_identity)
+{
+	build_manifest_t manifest;
+	for (manifest = manifests; manifest; manifest = manifest->next) {
+		unsigned int i;
+		for (i = 0; i < manifest->num_identities; i++) {
+			if (manifest->identities[i].node == build_identity) {
+				return &manifest->identities[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+void* build_manifest_identity_set_data(plist_t build_identity, const char* key, void* data, void (*free_func)(void*))
+{
+	if (!build_identity || !key || !data) {
+		return NULL;
+	}
+
+	thread_once(&manifests_once, manifests_init);
+
+	void* res = NULL;
+	mutex_lock(&manifests_mutex);
+	struct build_manifest_identity* ident = build_manifest_lookup_identity(build_identity);
+	if (ident) {
+		struct build_manifest_data* entry = ident->data;
+		while (entry && strcmp(entry->key, key) != 0) {
+			entry = entry->next;
+		}
+		if (entry) {
+			res = entry->data;
+		} else {
+			entry = (struct build_manifest_data*)calloc(1, sizeof(struct build_manifest_data));
+			if (entry) {
+				entry->key = strdup(key);
+			}
+			if (entry && entry->key) {
+				entry->data = data;
+				entry->free_func = free_func;
+				entry->next = ident->data;
+				ident->data = entry;
+				res = data;
+			} else {
+				free(entry);
+			}
+		}
+	}
+	mutex_unlock(&manifests_mutex);
+
+	return res;
+}
+
+void* build_manifest_identity_get_data(plist_t build_identity, const char* key)
+{
+	if (!build_identity || !key) {
+		return NULL;
+	}
+
+	thread_once(&manifests_once, manifests_init);
+
+	void* res = NULL;
+	mutex_lock(&manifests_mutex);
+	struct build_manifest_identity* ident = build_manifest_lookup_identity(build_identity);
+	if (ident) {
+		struct build_manifest_data* entry;
+		for (entry = ident->data; entry; entry = entry->next) {
+			if (!strcmp(entry->key, key)) {
+				res = entry->data;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&manifests_mutex);
+
+	return res;
+}
@@ -0,0 +1,71 @@
+/*
+ * build_manifest.h
+ * Shared, indexed BuildManifest (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_BUILD_MANIFEST_H
+#define IDEVICERESTORE_BUILD_MANIFEST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+typedef struct build_manifest* build_manifest_t;
+
+struct build_manifest_component {
+	char* name;
+	plist_t node;
+	/* Info/Path and Digest, NULL if not present */
+	const char* path;
+	const char* digest;
+	uint64_t digest_size;
+};
+
+/* Takes ownership of plist. The plist must not be modified afterwards since
+ * it is shared by every holder of a reference. */
+build_manifest_t build_manifest_new(plist_t plist, int tss_enabled);
+build_manifest_t build_manifest_ref(build_manifest_t manifest);
+void build_manifest_free(build_manifest_t manifest);
+
+plist_t build_manifest_get_plist(build_manifest_t manifest);
+int build_manifest_is_tss_enabled(build_manifest_t manifest);
+
+/* Same matching rules as build_manifest_get_build_identity_for_model_with_variant() */
+plist_t build_manifest_find_identity(build_manifest_t manifest, const char* hardware_model, const char* variant);
+
+/* Looks up a component of a build identity that belongs to a live build
+ * manifest. Returns 0 if found, -1 if the identity has no such component and
+ * -2 if the identity is not indexed (e.g. one that was created on the fly). */
+int build_manifest_get_component(plist_t build_identity, const char* component, const struct build_manifest_component** comp);
+
+/* Attaches data to a build identity of a live build manifest, it is freed
+ * with free_func along with the manifest. If there is data for key already,
+ * that is returned and the caller keeps ownership of its own data. Returns
+ * NULL if the identity is not indexed. */
+void* build_manifest_identity_set_data(plist_t build_identity, const char* key, void* data, void (*free_func)(void*));
+void* build_manifest_identity_get_data(plist_t build_identity, const char* key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
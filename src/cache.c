@@ -0,0 +1,305 @@
+/*
+ * cache.c
+ * On-disk content cache
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include "sha1.h"
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "cache.h"
+#include "locking.h"
+#include "common.h"
+
+struct cache {
+	char* path;
+	char* lock_path;
+	uint64_t max_size;
+	/* lock_file() only excludes other processes, threads are serialized by this */
+	mutex_t mutex;
+	int refcount;
+	/* makes the names of temporary files unique within the process */
+	unsigned int tmp_serial;
+};
+
+struct cache_entry {
+	char* name;
+	uint64_t size;
+	time_t mtime;
+};
+
+cache_t cache_open(const char* dir, const char* name, uint64_t max_size)
+{
+	if (!dir || !name) {
+		return NULL;
+	}
+
+	cache_t cache = (cache_t)calloc(1, sizeof(struct cache));
+	if (!cache) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	cache->refcount = 1;
+	mutex_init(&cache->mutex);
+
+	cache->path = (char*)malloc(strlen(dir) + 1 + strlen(name) + 1);
+	cache->lock_path = (char*)malloc(strlen(dir) + 1 + strlen(name) + 7);
+	if (!cache->path || !cache->lock_path) {
+		error("ERROR: Out of memory\n");
+		cache_close(cache);
+		return NULL;
+	}
+	sprintf(cache->path, "%s/%s", dir, name);
+	sprintf(cache->lock_path, "%s/.lock", cache->path);
+	cache->max_size = max_size;
+
+	struct stat fst;
+	if (stat(cache->path, &fst) != 0 && mkdir_with_parents(cache->path, 0755) != 0) {
+		error("ERROR: Unable to create cache directory %s: %s\n", cache->path, strerror(errno));
+		cache_close(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+cache_t cache_ref(cache_t cache)
+{
+	if (cache) {
+		mutex_lock(&cache->mutex);
+		cache->refcount++;
+		mutex_unlock(&cache->mutex);
+	}
+	return cache;
+}
+
+void cache_close(cache_t cache)
+{
+	if (!cache) {
+		return;
+	}
+	mutex_lock(&cache->mutex);
+	int refcount = --cache->refcount;
+	mutex_unlock(&cache->mutex);
+	if (refcount > 0) {
+		return;
+	}
+	mutex_destroy(&cache->mutex);
+	free(cache->path);
+	free(cache->lock_path);
+	free(cache);
+}
+
+void cache_key_from_data(unsigned char* key, const void* data, size_t size)
+{
+	SHA1((const unsigned char*)data, size, key);
+}
+
+static char* cache_entry_path(cache_t cache, const unsigned char* key, const char* suffix)
+{
+	char* path = (char*)malloc(strlen(cache->path) + 1 + CACHE_KEY_SIZE*2 + strlen(suffix) + 1);
+	if (!path) {
+		return NULL;
+	}
+	char* p = path + sprintf(path, "%s/", cache->path);
+	int i;
+	for (i = 0; i < CACHE_KEY_SIZE; i++) {
+		p += sprintf(p, "%02x", key[i]);
+	}
+	strcpy(p, suffix);
+	return path;
+}
+
+static int cache_entry_cmp(const void* a, const void* b)
+{
+	const struct cache_entry* ea = (const struct cache_entry*)a;
+	const struct cache_entry* eb = (const struct cache_entry*)b;
+	if (ea->mtime < eb->mtime) {
+		return -1;
+	}
+	return (ea->mtime > eb->mtime) ? 1 : 0;
+}
+
+/* Runs without the lock, entries are only ever replaced or removed as a
+ * whole, so a concurrent scan can at worst remove a little too much */
+static void cache_evict(cache_t cache)
+{
+	DIR* dirp = opendir(cache->path);
+	if (!dirp) {
+		return;
+	}
+
+	struct cache_entry* entries = NULL;
+	int num_entries = 0;
+	uint64_t total = 0;
+	struct dirent* ep;
+	while ((ep = readdir(dirp))) {
+		/* skips ".", "..", the lock file and anything not written by us */
+		if (strlen(ep->d_name) != CACHE_KEY_SIZE*2) {
+			continue;
+		}
+		char* fpath = (char*)malloc(strlen(cache->path) + 1 + strlen(ep->d_name) + 1);
+		if (!fpath) {
+			break;
+		}
+		sprintf(fpath, "%s/%s", cache->path, ep->d_name);
+		struct stat fst;
+		if (stat(fpath, &fst) != 0 || !S_ISREG(fst.st_mode)) {
+			free(fpath);
+			continue;
+		}
+		struct cache_entry* newentries = (struct cache_entry*)realloc(entries, sizeof(struct cache_entry) * (num_entries + 1));
+		if (!newentries) {
+			free(fpath);
+			break;
+		}
+		entries = newentries;
+		entries[num_entries].name = fpath;
+		entries[num_entries].size = fst.st_size;
+		entries[num_entries].mtime = fst.st_mtime;
+		num_entries++;
+		total += fst.st_size;
+	}
+	closedir(dirp);
+
+	if (total > cache->max_size) {
+		qsort(entries, num_entries, sizeof(struct cache_entry), cache_entry_cmp);
+		int i;
+		for (i = 0; i < num_entries && total > cache->max_size; i++) {
+			debug("DEBUG: %s: removing %s\n", __func__, entries[i].name);
+			if (remove(entries[i].name) == 0) {
+				total -= entries[i].size;
+			}
+		}
+	}
+
+	int i;
+	for (i = 0; i < num_entries; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
+
+int cache_get(cache_t cache, const unsigned char* key, unsigned char** data, unsigned int* size)
+{
+	if (!cache || !key || !data || !size) {
+		return -1;
+	}
+
+	char* path = cache_entry_path(cache, key, "");
+	if (!path) {
+		return -1;
+	}
+
+	/* entries are replaced by rename(), so an open file is always complete
+	 * and stays readable even if it is evicted meanwhile */
+	int res = -1;
+	FILE* f = fopen(path, "rb");
+	if (f) {
+		struct stat fst;
+		if (fstat(fileno(f), &fst) == 0 && (uint64_t)fst.st_size < 0xFFFFFFFF) {
+			/* like ipsw_extract_to_memory(), the buffer is always 0 terminated */
+			unsigned char* buf = (unsigned char*)malloc(fst.st_size + 1);
+			if (buf && fread(buf, 1, fst.st_size, f) == (size_t)fst.st_size) {
+				buf[fst.st_size] = '\0';
+				*data = buf;
+				*size = (unsigned int)fst.st_size;
+				res = 0;
+			} else {
+				free(buf);
+			}
+		}
+		fclose(f);
+		if (res == 0) {
+			/* the modification time is used to track the least recently used entries */
+			utime(path, NULL);
+		}
+	}
+	free(path);
+
+	return res;
+}
+
+int cache_put(cache_t cache, const unsigned char* key, const unsigned char* data, unsigned int size)
+{
+	if (!cache || !key || !data) {
+		return -1;
+	}
+	if (size > cache->max_size) {
+		return -1;
+	}
+
+	mutex_lock(&cache->mutex);
+	unsigned int serial = cache->tmp_serial++;
+	mutex_unlock(&cache->mutex);
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d-%u.tmp", (int)getpid(), serial);
+	char* path = cache_entry_path(cache, key, "");
+	char* tmppath = cache_entry_path(cache, key, suffix);
+	if (!path || !tmppath) {
+		free(path);
+		free(tmppath);
+		return -1;
+	}
+
+	/* write to a temporary file first so an interrupted write never leaves a
+	 * truncated entry behind, only putting it in place needs the lock */
+	int res = -1;
+	if (write_file(tmppath, data, size) == (int)size) {
+		mutex_lock(&cache->mutex);
+		lock_info_t lockinfo;
+		if (lock_file(cache->lock_path, &lockinfo) == 0) {
+			remove(path);
+			if (rename(tmppath, path) == 0) {
+				res = 0;
+			} else {
+				error("ERROR: Unable to rename %s: %s\n", tmppath, strerror(errno));
+			}
+			unlock_file(&lockinfo);
+		}
+		mutex_unlock(&cache->mutex);
+	}
+	remove(tmppath);
+
+	if (res == 0) {
+		cache_evict(cache);
+	}
+
+	free(path);
+	free(tmppath);
+
+	return res;
+}
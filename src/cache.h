@@ -0,0 +1,50 @@
+/*
+ * cache.h
+ * On-disk content cache (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef IDEVICERESTORE_CACHE_H
+#define IDEVICERESTORE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define CACHE_KEY_SIZE 20
+#define CACHE_DEFAULT_MAX_SIZE (4ULL * 1024 * 1024 * 1024)
+
+typedef struct cache* cache_t;
+
+/* Entries are stored in <dir>/<name> and shared between processes. Once the
+ * total size exceeds max_size the least recently used entries are removed. */
+cache_t cache_open(const char* dir, const char* name, uint64_t max_size);
+cache_t cache_ref(cache_t cache);
+void cache_close(cache_t cache);
+
+void cache_key_from_data(unsigned char* key, const void* data, size_t size);
+
+int cache_get(cache_t cache, const unsigned char* key, unsigned char** data, unsigned int* size);
+int cache_put(cache_t cache, const unsigned char* key, const unsigned char* data, unsigned int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * catalog.c
+ * Cached, revalidated firmware catalogs
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utime.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "catalog.h"
+#include "download.h"
+#include "common.h"
+
+struct catalog_cache {
+	char* etag;
+	char* last_modified;
+	time_t validated;
+	plist_t index;
+};
+
+/* makes the names of temporary files unique within the process */
+static thread_once_t catalog_once = THREAD_ONCE_INIT;
+static mutex_t catalog_mutex;
+static unsigned int catalog_tmp_serial = 0;
+
+static void catalog_init(void)
+{
+	mutex_init(&catalog_mutex);
+}
+
+static int catalog_cache_load(const char* path, const char* url, struct catalog_cache* cache)
+{
+	struct stat fst;
+	if (stat(path, &fst) != 0) {
+		return -1;
+	}
+	char* buf = NULL;
+	size_t len = 0;
+	if (read_file(path, (void**)&buf, &len) != 0) {
+		return -1;
+	}
+	plist_t dict = NULL;
+	plist_from_memory(buf, len, &dict);
+	free(buf);
+	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
+		plist_free(dict);
+		return -1;
+	}
+	plist_t node = plist_dict_get_item(dict, "URL");
+	const char* curl = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+	node = plist_dict_get_item(dict, "Index");
+	if (!curl || strcmp(curl, url) != 0 || !node) {
+		plist_free(dict);
+		return -1;
+	}
+	cache->index = plist_copy(node);
+	node = plist_dict_get_item(dict, "ETag");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &cache->etag);
+	}
+	node = plist_dict_get_item(dict, "LastModified");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &cache->last_modified);
+	}
+	/* the modification time tracks when the index was last validated */
+	cache->validated = fst.st_mtime;
+	plist_free(dict);
+	return 0;
+}
+
+static void catalog_cache_save(const char* path, const char* url, struct catalog_cache* cache)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "URL", plist_new_string(url));
+	if (cache->etag) {
+		plist_dict_set_item(dict, "ETag", plist_new_string(cache->etag));
+	}
+	if (cache->last_modified) {
+		plist_dict_set_item(dict, "LastModified", plist_new_string(cache->last_modified));
+	}
+	plist_dict_set_item(dict, "Index", plist_copy(cache->index));
+	char* bin = NULL;
+	uint32_t blen = 0;
+	plist_to_bin(dict, &bin, &blen);
+	plist_free(dict);
+	if (!bin) {
+		return;
+	}
+	thread_once(&catalog_once, catalog_init);
+	mutex_lock(&catalog_mutex);
+	unsigned int serial = catalog_tmp_serial++;
+	mutex_unlock(&catalog_mutex);
+	char* tmp = (char*)malloc(strlen(path) + 32);
+	if (tmp) {
+		sprintf(tmp, "%s.%d-%u.tmp", path, (int)getpid(), serial);
+		if (write_file(tmp, bin, blen) != (int)blen || rename(tmp, path) != 0) {
+			remove(tmp);
+		}
+		free(tmp);
+	}
+	free(bin);
+}
+
+int catalog_get(const char* url, const char* path, int max_age, catalog_parse_cb_t parse, void* userdata, plist_t* index)
+{
+	if (!url || !parse || !index) {
+		return -1;
+	}
+	*index = NULL;
+
+	struct catalog_cache cache;
+	memset(&cache, 0, sizeof(cache));
+	int have_cache = (path && catalog_cache_load(path, url, &cache) == 0);
+
+	if (have_cache && time(NULL) - cache.validated < max_age) {
+		debug("DEBUG: %s: using cached %s\n", __func__, url);
+		*index = cache.index;
+		free(cache.etag);
+		free(cache.last_modified);
+		return 0;
+	}
+
+	char* buf = NULL;
+	uint32_t len = 0;
+	/* without a cached index there is nothing to send, but the validators of the response are kept */
+	int res = download_to_buffer_conditional(url, (path) ? &cache.etag : NULL, (path) ? &cache.last_modified : NULL, &buf, &len);
+	if (res == 1) {
+		debug("DEBUG: %s: %s not modified\n", __func__, url);
+		utime(path, NULL);
+	} else if (res == 0) {
+		plist_t newindex = parse(buf, len, userdata);
+		free(buf);
+		if (newindex) {
+			plist_free(cache.index);
+			cache.index = newindex;
+			if (path) {
+				catalog_cache_save(path, url, &cache);
+			}
+		} else {
+			res = -1;
+		}
+	}
+	if (res < 0 && have_cache) {
+		info("NOTE: Unable to refresh %s, using cached data\n", url);
+		res = 0;
+	}
+
+	free(cache.etag);
+	free(cache.last_modified);
+	if (res < 0) {
+		plist_free(cache.index);
+		return -1;
+	}
+	*index = cache.index;
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * catalog.h
+ * Cached, revalidated firmware catalogs (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_CATALOG_H
+#define IDEVICERESTORE_CATALOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+/* Turns a downloaded catalog into the index that gets cached, NULL on error */
+typedef plist_t (*catalog_parse_cb_t)(const char* data, uint32_t size, void* userdata);
+
+/* Returns the index for url. The index cached at path is used as is while it
+ * is younger than max_age seconds, after that it is revalidated with a
+ * conditional GET and rebuilt only if the catalog changed. A stale index is
+ * returned if the server can't be reached. Without a path nothing is cached. */
+int catalog_get(const char* url, const char* path, int max_age, catalog_parse_cb_t parse, void* userdata, plist_t* index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
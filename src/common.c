@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -68,6 +69,9 @@ struct idevicerestore_mode_t idevicerestore_modes[] = {
 int idevicerestore_debug = 0;
 
 #define idevicerestore_err_buff_size 256
+/* the last error of any thread not tagged with a device, for
+ * idevicerestore_get_error(). Supervised restores tag all their threads, so
+ * one device never reports the error of another. */
 static char idevicerestore_err_buff[idevicerestore_err_buff_size] = {0, };
 
 static FILE* info_stream = NULL;
@@ -78,26 +82,267 @@ static int info_disabled = 0;
 static int error_disabled = 0;
 static int debug_disabled = 0;
 
+#ifdef _MSC_VER
+#define LOG_THREAD_LOCAL __declspec(thread)
+#else
+#define LOG_THREAD_LOCAL __thread
+#endif
+
+/* messages up to this size are formatted without allocating */
+#define LOG_LINE_SIZE 1024
+/* queued output, written by the flusher when full or after LOG_FLUSH_INTERVAL ms */
+#define LOG_QUEUE_SIZE (256 * 1024)
+#define LOG_FLUSH_INTERVAL 100
+
+struct log_thread_state {
+	uint64_t ecid;
+	/* the last message of this thread did not end with a newline */
+	int mid_line;
+	char err_buff[idevicerestore_err_buff_size];
+	char line[LOG_LINE_SIZE];
+};
+
+static LOG_THREAD_LOCAL struct log_thread_state log_state;
+
+/* each message is queued as a header followed by its text */
+struct log_entry {
+	FILE* stream;
+	size_t length;
+};
+
+struct log_queue {
+	char* data;
+	size_t length;
+};
+
+static thread_once_t log_once = THREAD_ONCE_INIT;
+static mutex_t log_mutex;
+static cond_t log_flush_cond;
+static cond_t log_space_cond;
+static struct log_queue log_queues[2];
+static int log_active = 0;
+static int log_async = 0;
+/* enable calls not undone yet, nested users share the flusher */
+static int log_async_refs = 0;
+static int log_stop = 0;
+static int log_flushing = 0;
+static THREAD_T log_thread;
+
+static void log_init(void)
+{
+	mutex_init(&log_mutex);
+	cond_init(&log_flush_cond);
+	cond_init(&log_space_cond);
+}
+
+static void log_write_queue(struct log_queue* queue)
+{
+	FILE* last = NULL;
+	size_t pos = 0;
+	while (pos < queue->length) {
+		struct log_entry entry;
+		memcpy(&entry, queue->data + pos, sizeof(entry));
+		pos += sizeof(entry);
+		if (last && last != entry.stream) {
+			fflush(last);
+		}
+		fwrite(queue->data + pos, 1, entry.length, entry.stream);
+		pos += entry.length;
+		last = entry.stream;
+	}
+	if (last) {
+		fflush(last);
+	}
+	queue->length = 0;
+}
+
+/* must be called with log_mutex held, returns with it held */
+static void log_flush_locked(void)
+{
+	while (log_flushing) {
+		cond_wait(&log_space_cond, &log_mutex);
+	}
+	struct log_queue* queue = &log_queues[log_active];
+	if (queue->length == 0) {
+		return;
+	}
+	log_active ^= 1;
+	log_flushing = 1;
+	mutex_unlock(&log_mutex);
+	log_write_queue(queue);
+	mutex_lock(&log_mutex);
+	log_flushing = 0;
+	cond_signal(&log_space_cond);
+}
+
+static void* log_flusher(void* arg)
+{
+	mutex_lock(&log_mutex);
+	while (!log_stop) {
+		cond_wait_timeout(&log_flush_cond, &log_mutex, LOG_FLUSH_INTERVAL);
+		log_flush_locked();
+	}
+	mutex_unlock(&log_mutex);
+	return NULL;
+}
+
+static void log_output(FILE* stream, const char* text, size_t length)
+{
+	thread_once(&log_once, log_init);
+	mutex_lock(&log_mutex);
+	if (!log_async) {
+		/* one write per message, so lines of different threads do not mix */
+		fwrite(text, 1, length, stream);
+		mutex_unlock(&log_mutex);
+		return;
+	}
+	size_t needed = sizeof(struct log_entry) + length;
+	while (log_async && log_queues[log_active].length + needed > LOG_QUEUE_SIZE && log_queues[log_active].length > 0) {
+		cond_signal(&log_flush_cond);
+		log_flush_locked();
+	}
+	struct log_queue* queue = &log_queues[log_active];
+	if (!log_async || needed > LOG_QUEUE_SIZE) {
+		log_flush_locked();
+		fwrite(text, 1, length, stream);
+	} else {
+		struct log_entry entry = { stream, length };
+		memcpy(queue->data + queue->length, &entry, sizeof(entry));
+		memcpy(queue->data + queue->length + sizeof(entry), text, length);
+		queue->length += needed;
+	}
+	mutex_unlock(&log_mutex);
+}
+
+/* formats a message, tagged with the device of the calling thread */
+static void log_vprintf(FILE* stream, int is_error, const char* format, va_list vargs)
+{
+	struct log_thread_state* state = &log_state;
+	char* line = state->line;
+	size_t offset = 0;
+	if (state->ecid && !state->mid_line) {
+		offset = snprintf(line, LOG_LINE_SIZE, "[%016" PRIx64 "] ", state->ecid);
+	}
+
+	va_list vargs2;
+	va_copy(vargs2, vargs);
+	int len = vsnprintf(line + offset, LOG_LINE_SIZE - offset, format, vargs);
+	if (len < 0) {
+		va_end(vargs2);
+		return;
+	}
+	if ((size_t)len >= LOG_LINE_SIZE - offset) {
+		char* big = (char*)malloc(offset + len + 1);
+		if (big) {
+			memcpy(big, line, offset);
+			vsnprintf(big + offset, len + 1, format, vargs2);
+			line = big;
+		} else {
+			len = LOG_LINE_SIZE - offset - 1;
+		}
+	}
+	va_end(vargs2);
+
+	size_t total = offset + len;
+	if (total > 0) {
+		state->mid_line = (line[total-1] != '\n');
+	}
+	if (is_error) {
+		strncpy(state->err_buff, line + offset, idevicerestore_err_buff_size - 1);
+		state->err_buff[idevicerestore_err_buff_size - 1] = '\0';
+		if (state->ecid == 0) {
+			thread_once(&log_once, log_init);
+			mutex_lock(&log_mutex);
+			memcpy(idevicerestore_err_buff, state->err_buff, idevicerestore_err_buff_size);
+			mutex_unlock(&log_mutex);
+		}
+	}
+	if (stream) {
+		log_output(stream, line, total);
+	}
+	if (line != state->line) {
+		free(line);
+	}
+}
+
+void idevicerestore_log_set_ecid(uint64_t ecid)
+{
+	log_state.ecid = ecid;
+	log_state.mid_line = 0;
+}
+
+uint64_t idevicerestore_log_get_ecid(void)
+{
+	return log_state.ecid;
+}
+
+void idevicerestore_log_set_async(int async)
+{
+	thread_once(&log_once, log_init);
+	mutex_lock(&log_mutex);
+	if (async) {
+		log_async_refs++;
+	} else if (log_async_refs > 0) {
+		log_async_refs--;
+	}
+	if (async && !log_async) {
+		static int exit_handler = 0;
+		if (!exit_handler) {
+			/* exit() does not wait for the flusher */
+			atexit(idevicerestore_log_flush);
+			exit_handler = 1;
+		}
+		int i;
+		for (i = 0; i < 2; i++) {
+			if (!log_queues[i].data) {
+				log_queues[i].data = (char*)malloc(LOG_QUEUE_SIZE);
+			}
+		}
+		log_stop = 0;
+		if (log_queues[0].data && log_queues[1].data && thread_new(&log_thread, log_flusher, NULL) == 0) {
+			log_async = 1;
+		}
+		mutex_unlock(&log_mutex);
+		return;
+	}
+	if (!async && log_async && log_async_refs == 0) {
+		log_async = 0;
+		log_stop = 1;
+		cond_signal(&log_flush_cond);
+		mutex_unlock(&log_mutex);
+		thread_join(log_thread);
+		thread_free(log_thread);
+		mutex_lock(&log_mutex);
+		/* whatever was queued after the flusher's last round */
+		log_flush_locked();
+		log_flush_locked();
+	}
+	mutex_unlock(&log_mutex);
+}
+
+void idevicerestore_log_flush(void)
+{
+	thread_once(&log_once, log_init);
+	mutex_lock(&log_mutex);
+	log_flush_locked();
+	mutex_unlock(&log_mutex);
+}
+
 void info(const char* format, ...)
 {
 	if (info_disabled) return;
 	va_list vargs;
 	va_start(vargs, format);
-	vfprintf((info_stream) ? info_stream : stdout, format, vargs);
+	log_vprintf((info_stream) ? info_stream : stdout, 0, format, vargs);
 	va_end(vargs);
 }
 
 void error(const char* format, ...)
 {
-	va_list vargs, vargs2;
+	va_list vargs;
 	va_start(vargs, format);
-	va_copy(vargs2, vargs);
-	vsnprintf(idevicerestore_err_buff, idevicerestore_err_buff_size, format, vargs);
+	log_vprintf((error_disabled) ? NULL : ((error_stream) ? error_stream : stderr), 1, format, vargs);
 	va_end(vargs);
-	if (!error_disabled) {
-		vfprintf((error_stream) ? error_stream : stderr, format, vargs2);
-	}
-	va_end(vargs2);
 }
 
 void debug(const char* format, ...)
@@ -108,12 +353,13 @@ void debug(const char* format, ...)
 	}
 	va_list vargs;
 	va_start(vargs, format);
-	vfprintf((debug_stream) ? debug_stream : stderr, format, vargs);
+	log_vprintf((debug_stream) ? debug_stream : stderr, 0, format, vargs);
 	va_end(vargs);
 }
 
 void idevicerestore_set_info_stream(FILE* strm)
 {
+	idevicerestore_log_flush();
 	if (strm) {
 		info_disabled = 0;
 		info_stream = strm;
@@ -124,6 +370,7 @@ void idevicerestore_set_info_stream(FILE* strm)
 
 void idevicerestore_set_error_stream(FILE* strm)
 {
+	idevicerestore_log_flush();
 	if (strm) {
 		error_disabled = 0;
 		error_stream = strm;
@@ -134,6 +381,7 @@ void idevicerestore_set_error_stream(FILE* strm)
 
 void idevicerestore_set_debug_stream(FILE* strm)
 {
+	idevicerestore_log_flush();
 	if (strm) {
 		debug_disabled = 0;
 		debug_stream = strm;
@@ -144,14 +392,22 @@ void idevicerestore_set_debug_stream(FILE* strm)
 
 const char* idevicerestore_get_error(void)
 {
-	if (idevicerestore_err_buff[0] == 0) {
+	struct log_thread_state* state = &log_state;
+	if (state->err_buff[0] == 0 && state->ecid == 0) {
+		/* the error happened on another thread */
+		thread_once(&log_once, log_init);
+		mutex_lock(&log_mutex);
+		memcpy(state->err_buff, idevicerestore_err_buff, idevicerestore_err_buff_size);
+		mutex_unlock(&log_mutex);
+	}
+	if (state->err_buff[0] == 0) {
 		return NULL;
 	} else {
 		char* p = NULL;
-		while ((strlen(idevicerestore_err_buff) > 0) && (p = strrchr(idevicerestore_err_buff, '\n'))) {
+		while ((strlen(state->err_buff) > 0) && (p = strrchr(state->err_buff, '\n'))) {
 			p[0] = '\0';
 		}
-		return (const char*)idevicerestore_err_buff;
+		return (const char*)state->err_buff;
 	}
 }
 
@@ -222,6 +478,7 @@ int read_file(const char* filename, void** data, size_t* size) {
 }
 
 void debug_plist(plist_t plist) {
+	if (info_disabled) return;
 	uint32_t size = 0;
 	char* data = NULL;
 	plist_to_xml(plist, &data, &size);
@@ -235,17 +492,18 @@ void debug_plist(plist_t plist) {
 void print_progress_bar(double progress) {
 #ifndef WIN32
 	if (info_disabled) return;
+	char bar[64];
 	int i = 0;
 	if(progress < 0) return;
 	if(progress > 100) progress = 100;
-	info("\r[");
 	for(i = 0; i < 50; i++) {
-		if(i < progress / 2) info("=");
-		else info(" ");
+		bar[i] = (i < progress / 2) ? '=' : ' ';
+	}
+	bar[50] = '\0';
+	info("\r[%s] %5.1f%%%s", bar, progress, (progress >= 100) ? "\n" : "");
+	if (!log_async) {
+		fflush((info_stream) ? info_stream : stdout);
 	}
-	info("] %5.1f%%", progress);
-	if(progress >= 100) info("\n");
-	fflush((info_stream) ? info_stream : stdout);
 #endif
 }
 
@@ -695,3 +953,44 @@ int _plist_dict_copy_item(plist_t target_dict, plist_t source_dict, const char *
 	plist_dict_set_item(target_dict, key, plist_copy(node));
 	return 0;
 }
+
+uint64_t get_monotonic_time_us(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000ULL + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+int get_cpu_count(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+#endif
+}
+
+uint64_t get_physical_memory(void)
+{
+#ifdef WIN32
+	MEMORYSTATUSEX ms;
+	ms.dwLength = sizeof(ms);
+	return (GlobalMemoryStatusEx(&ms)) ? (uint64_t)ms.ullTotalPhys : 0;
+#elif defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	return (pages > 0 && page_size > 0) ? (uint64_t)pages * (uint64_t)page_size : 0;
+#else
+	return 0;
+#endif
+}
@@ -37,9 +37,13 @@ extern "C" {
 
 #include <plist/plist.h>
 #include <libirecovery.h>
+#include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice-glue/thread.h>
 
 #include "idevicerestore.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "telemetry.h"
 
 #define _MODE_UNKNOWN         0
 #define _MODE_WTF             1
@@ -97,11 +101,19 @@ struct idevicerestore_client_t {
 	unsigned char* nonce;
 	int nonce_size;
 	int image4supported;
+	build_manifest_t manifest;
+	/* owned by manifest */
 	plist_t build_manifest;
 	plist_t preflight_info;
 	char* udid;
 	char* srnm;
-	char* ipsw;
+	ipsw_archive_t ipsw;
+	cache_t component_cache;
+	cache_t fwupdater_cache;
+	cache_t tss_cache;
+	telemetry_t telemetry;
+	char* metrics_path;
+	prefetch_t prefetch;
 	const char* filesystem;
 	struct dfu_client_t* dfu;
 	struct restore_client_t* restore;
@@ -118,8 +130,7 @@ struct idevicerestore_client_t {
 	int root_ticket_len;
 	idevicerestore_progress_cb_t progress_cb;
 	void* progress_cb_data;
-	irecv_device_event_context_t irecv_e_ctx;
-	void* idevice_e_ctx;
+	int device_events_subscribed;
 	mutex_t device_event_mutex;
 	cond_t device_event_cond;
 	int ignore_device_add_events;
@@ -137,6 +148,18 @@ void error(const char* format, ...);
 __attribute__((format(printf, 1, 2)))
 void debug(const char* format, ...);
 
+/* Tags the messages of the calling thread with the ECID of the device it
+ * works on, 0 removes the tag */
+void idevicerestore_log_set_ecid(uint64_t ecid);
+/* The tag of the calling thread, helper threads take it over from the
+ * thread that starts them */
+uint64_t idevicerestore_log_get_ecid(void);
+/* Queues the output and writes it from a background thread, for many
+ * concurrent restores. Calls nest, the last disable writes what is queued. */
+void idevicerestore_log_set_async(int async);
+void idevicerestore_log_flush(void);
+
+/* does nothing without info output */
 void debug_plist(plist_t plist);
 void print_progress_bar(double progress);
 int read_file(const char* filename, void** data, size_t* size);
@@ -171,6 +194,14 @@ char *get_temp_filename(const char *prefix);
 
 void idevicerestore_progress(struct idevicerestore_client_t* client, int step, double progress);
 
+int device_events_subscribe(irecv_device_event_cb_t irecv_cb, idevice_event_cb_t idevice_cb, void* userdata);
+void device_events_unsubscribe(void* userdata);
+
+uint64_t get_monotonic_time_us(void);
+int get_cpu_count(void);
+/* 0 if unknown */
+uint64_t get_physical_memory(void);
+
 #ifndef HAVE_STRSEP
 char* strsep(char** strp, const char* delim);
 #endif
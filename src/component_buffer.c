@@ -0,0 +1,203 @@
+/*
+ * component_buffer.c
+ * Firmware component buffers with room for headers
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "component_buffer.h"
+#include "mem_budget.h"
+#include "common.h"
+
+static unsigned char* component_buffer_alloc(unsigned int capacity, int* alloc)
+{
+	if (capacity >= MEM_BUDGET_MIN_SIZE) {
+		*alloc = COMPONENT_BUFFER_MEM_BUFFER;
+		return (unsigned char*)mem_buffer_alloc(capacity);
+	}
+	*alloc = COMPONENT_BUFFER_MALLOC;
+	return (unsigned char*)malloc(capacity);
+}
+
+static void component_buffer_release(struct component_buffer* cb)
+{
+	switch (cb->alloc) {
+	case COMPONENT_BUFFER_MEM_BUFFER:
+		mem_buffer_free(cb->base);
+		break;
+	case COMPONENT_BUFFER_MAPPED:
+#ifndef WIN32
+		if (cb->base) {
+			munmap(cb->base, cb->map_size);
+		}
+#endif
+		break;
+	default:
+		free(cb->base);
+		break;
+	}
+}
+
+void component_buffer_init(struct component_buffer* cb)
+{
+	memset(cb, 0, sizeof(struct component_buffer));
+}
+
+void component_buffer_free(struct component_buffer* cb)
+{
+	component_buffer_release(cb);
+	component_buffer_init(cb);
+}
+
+void component_buffer_attach(struct component_buffer* cb, unsigned char* data, unsigned int size)
+{
+	component_buffer_attach_base(cb, data, 0, size, size);
+}
+
+void component_buffer_attach_base(struct component_buffer* cb, unsigned char* base, unsigned int head, unsigned int size, unsigned int capacity)
+{
+	component_buffer_release(cb);
+	cb->base = base;
+	cb->head = head;
+	cb->size = size;
+	cb->capacity = capacity;
+	cb->alloc = COMPONENT_BUFFER_MALLOC;
+	cb->map_size = 0;
+}
+
+void component_buffer_attach_mapping(struct component_buffer* cb, unsigned char* base, size_t map_size, unsigned int head, unsigned int size)
+{
+	component_buffer_attach_base(cb, base, head, size, (map_size > UINT_MAX) ? UINT_MAX : (unsigned int)map_size);
+	cb->alloc = COMPONENT_BUFFER_MAPPED;
+	cb->map_size = map_size;
+}
+
+unsigned char* component_buffer_reserve(struct component_buffer* cb, unsigned int head, unsigned int size)
+{
+	int alloc = COMPONENT_BUFFER_MALLOC;
+	unsigned char* base = component_buffer_alloc(head + size, &alloc);
+	if (!base) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		return NULL;
+	}
+	component_buffer_attach_base(cb, base, head, size, head + size);
+	cb->alloc = alloc;
+	return base + head;
+}
+
+int component_buffer_copy(struct component_buffer* cb, const unsigned char* data, unsigned int size)
+{
+	unsigned char* dst = component_buffer_reserve(cb, COMPONENT_BUFFER_HEADROOM, size);
+	if (!dst) {
+		return -1;
+	}
+	memcpy(dst, data, size);
+	return 0;
+}
+
+unsigned char* component_buffer_data(struct component_buffer* cb)
+{
+	return (cb->base) ? cb->base + cb->head : NULL;
+}
+
+unsigned char* component_buffer_push(struct component_buffer* cb, unsigned int size)
+{
+	if (size > cb->head) {
+		unsigned int head = COMPONENT_BUFFER_HEADROOM + size;
+		unsigned int capacity = head + cb->size;
+		int alloc = COMPONENT_BUFFER_MALLOC;
+		unsigned char* base = component_buffer_alloc(capacity, &alloc);
+		if (!base) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			return NULL;
+		}
+		debug("DEBUG: %s: no room for %u bytes in front, copying %u bytes\n", __func__, size, cb->size);
+		if (cb->size > 0) {
+			memcpy(base + head, cb->base + cb->head, cb->size);
+		}
+		component_buffer_attach_base(cb, base, head, cb->size, capacity);
+		cb->alloc = alloc;
+	}
+	cb->head -= size;
+	cb->size += size;
+	return cb->base + cb->head;
+}
+
+unsigned char* component_buffer_put(struct component_buffer* cb, unsigned int size)
+{
+	unsigned int used = cb->head + cb->size;
+	if (size > cb->capacity - used && cb->alloc == COMPONENT_BUFFER_MAPPED) {
+		/* mappings can't grow */
+		int alloc = COMPONENT_BUFFER_MALLOC;
+		unsigned char* base = component_buffer_alloc(used + size, &alloc);
+		if (!base) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			return NULL;
+		}
+		debug("DEBUG: %s: no room for %u bytes after mapping, copying %u bytes\n", __func__, size, cb->size);
+		memcpy(base + cb->head, cb->base + cb->head, cb->size);
+		component_buffer_attach_base(cb, base, cb->head, cb->size, used + size);
+		cb->alloc = alloc;
+	} else if (size > cb->capacity - used) {
+		/* large buffers are remapped rather than copied by realloc() */
+		unsigned char* base = (unsigned char*)((cb->alloc == COMPONENT_BUFFER_MEM_BUFFER) ? mem_buffer_realloc(cb->base, used + size) : realloc(cb->base, used + size));
+		if (!base) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			return NULL;
+		}
+		cb->base = base;
+		cb->capacity = used + size;
+	}
+	cb->size += size;
+	return cb->base + used;
+}
+
+unsigned char* component_buffer_detach(struct component_buffer* cb, unsigned int* size)
+{
+	unsigned char* data = cb->base;
+	if (cb->alloc != COMPONENT_BUFFER_MALLOC) {
+		/* callers free() the result */
+		data = (unsigned char*)malloc(cb->size + 1);
+		if (!data) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			*size = 0;
+			component_buffer_free(cb);
+			return NULL;
+		}
+		memcpy(data, cb->base + cb->head, cb->size);
+		data[cb->size] = '\0';
+		*size = cb->size;
+		component_buffer_free(cb);
+		return data;
+	}
+	if (data && cb->head > 0) {
+		memmove(data, data + cb->head, cb->size);
+	}
+	*size = cb->size;
+	component_buffer_init(cb);
+	return data;
+}
@@ -0,0 +1,91 @@
+/*
+ * component_buffer.h
+ * Firmware component buffers with room for headers (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_COMPONENT_BUFFER_H
+#define IDEVICERESTORE_COMPONENT_BUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "cache.h"
+
+/* enough for the IMG4 sequence, "IMG4" magic and their headers */
+#define COMPONENT_BUFFER_HEADROOM 64
+/* room for the ticket after a mapped component, only touched pages cost memory */
+#define COMPONENT_BUFFER_TAILROOM (64 * 1024)
+
+/* what base was allocated with */
+#define COMPONENT_BUFFER_MALLOC 0
+#define COMPONENT_BUFFER_MEM_BUFFER 1
+#define COMPONENT_BUFFER_MAPPED 2
+
+/* A component is kept in one allocation with unused space in front of it,
+ * so headers can be put in front and the ticket appended without copying
+ * the payload. The data is at base + head. */
+struct component_buffer {
+	unsigned char* base;
+	unsigned int head;
+	unsigned int size;
+	unsigned int capacity;
+	/* COMPONENT_BUFFER_*, and the length of the mapping if mapped */
+	int alloc;
+	size_t map_size;
+	/* cache key of the unpersonalized component it was extracted as, see
+	 * ipsw_get_file_key(). Personalized outputs are cached under it. */
+	unsigned char key[CACHE_KEY_SIZE];
+	int have_key;
+};
+
+void component_buffer_init(struct component_buffer* cb);
+void component_buffer_free(struct component_buffer* cb);
+
+/* Takes ownership of a malloc()ed buffer, which has no headroom */
+void component_buffer_attach(struct component_buffer* cb, unsigned char* data, unsigned int size);
+/* Takes ownership of an allocation of capacity bytes with size bytes of data at base + head */
+void component_buffer_attach_base(struct component_buffer* cb, unsigned char* base, unsigned int head, unsigned int size, unsigned int capacity);
+/* Takes ownership of a private mapping of map_size bytes at base, like the
+ * ones ipsw_map_file() makes */
+void component_buffer_attach_mapping(struct component_buffer* cb, unsigned char* base, size_t map_size, unsigned int head, unsigned int size);
+int component_buffer_copy(struct component_buffer* cb, const unsigned char* data, unsigned int size);
+/* Replaces the data with size uninitialized bytes after head bytes of
+ * headroom, large buffers are accounted against the memory budget */
+unsigned char* component_buffer_reserve(struct component_buffer* cb, unsigned int head, unsigned int size);
+
+unsigned char* component_buffer_data(struct component_buffer* cb);
+
+/* Grow the data by size bytes at the front or the end and return the new
+ * bytes for the caller to fill in. Only the front falls back to copying the
+ * data, when there isn't enough headroom left. */
+unsigned char* component_buffer_push(struct component_buffer* cb, unsigned int size);
+unsigned char* component_buffer_put(struct component_buffer* cb, unsigned int size);
+
+/* Returns the data as a buffer to free(), moving it to the start of the
+ * allocation if there is headroom. The component buffer is empty afterwards. */
+unsigned char* component_buffer_detach(struct component_buffer* cb, unsigned int* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
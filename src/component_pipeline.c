@@ -0,0 +1,265 @@
+/*
+ * component_pipeline.c
+ * Prepares the next component while the previous one is uploaded
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "common.h"
+#include "component_buffer.h"
+#include "component_pipeline.h"
+
+enum pipeline_state {
+	PIPELINE_PENDING = 0,
+	PIPELINE_BUSY,
+	PIPELINE_READY,
+	PIPELINE_FAILED,
+	/* handed out, or skipped because the sender didn't want to wait */
+	PIPELINE_DONE
+};
+
+struct pipeline_entry {
+	char* component;
+	enum pipeline_state state;
+	struct component_buffer cb;
+};
+
+struct component_pipeline {
+	struct idevicerestore_client_t* client;
+	plist_t build_identity;
+	component_prepare_cb_t prepare;
+	THREAD_T thread;
+	int started;
+	/* cleared by the worker when it is done */
+	int have_thread;
+	mutex_t mutex;
+	/* the worker waits on work_cond, the sender on done_cond */
+	cond_t work_cond;
+	cond_t done_cond;
+	int stop;
+	struct pipeline_entry* entries;
+	unsigned int num_entries;
+	uint64_t log_ecid;
+};
+
+/* must be called with the pipeline mutex held */
+static struct pipeline_entry* component_pipeline_next_job(component_pipeline_t pipeline)
+{
+	unsigned int i;
+	unsigned int ready = 0;
+	for (i = 0; i < pipeline->num_entries; i++) {
+		struct pipeline_entry* entry = &pipeline->entries[i];
+		if (entry->state == PIPELINE_READY) {
+			ready++;
+		} else if (entry->state == PIPELINE_PENDING) {
+			/* don't run further ahead of the uploads than necessary */
+			return (ready < COMPONENT_PIPELINE_DEPTH) ? entry : NULL;
+		}
+	}
+	return NULL;
+}
+
+static int component_pipeline_has_pending(component_pipeline_t pipeline)
+{
+	unsigned int i;
+	for (i = 0; i < pipeline->num_entries; i++) {
+		if (pipeline->entries[i].state == PIPELINE_PENDING) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void* component_pipeline_thread(void* arg)
+{
+	component_pipeline_t pipeline = (component_pipeline_t)arg;
+	struct idevicerestore_client_t* client = pipeline->client;
+
+	idevicerestore_log_set_ecid(pipeline->log_ecid);
+	mutex_lock(&pipeline->mutex);
+	while (!pipeline->stop && !(client->flags & FLAG_QUIT)) {
+		struct pipeline_entry* entry = component_pipeline_next_job(pipeline);
+		if (!entry) {
+			if (!component_pipeline_has_pending(pipeline)) {
+				break;
+			}
+			cond_wait_timeout(&pipeline->work_cond, &pipeline->mutex, 1000);
+			continue;
+		}
+		entry->state = PIPELINE_BUSY;
+		mutex_unlock(&pipeline->mutex);
+
+		/* the entry stays where it is while it is busy */
+		struct component_buffer cb;
+		component_buffer_init(&cb);
+		int res = pipeline->prepare(client, pipeline->build_identity, entry->component, &cb);
+
+		mutex_lock(&pipeline->mutex);
+		if (res == 0) {
+			debug("DEBUG: %s: %s is ready\n", __func__, entry->component);
+			entry->cb = cb;
+			entry->state = PIPELINE_READY;
+		} else {
+			/* the sender will run into the same error and report it */
+			component_buffer_free(&cb);
+			entry->state = PIPELINE_FAILED;
+		}
+		cond_signal(&pipeline->done_cond);
+	}
+	pipeline->have_thread = 0;
+	cond_signal(&pipeline->done_cond);
+	mutex_unlock(&pipeline->mutex);
+
+	return NULL;
+}
+
+component_pipeline_t component_pipeline_new(struct idevicerestore_client_t* client, plist_t build_identity, component_prepare_cb_t prepare)
+{
+	if (!client || !build_identity || !prepare) {
+		return NULL;
+	}
+	component_pipeline_t pipeline = (component_pipeline_t)calloc(1, sizeof(struct component_pipeline));
+	if (!pipeline) {
+		return NULL;
+	}
+	pipeline->client = client;
+	pipeline->build_identity = build_identity;
+	pipeline->prepare = prepare;
+	mutex_init(&pipeline->mutex);
+	cond_init(&pipeline->work_cond);
+	cond_init(&pipeline->done_cond);
+	return pipeline;
+}
+
+int component_pipeline_add(component_pipeline_t pipeline, const char* component)
+{
+	if (!pipeline || !component) {
+		return -1;
+	}
+	mutex_lock(&pipeline->mutex);
+	struct pipeline_entry* entries = (struct pipeline_entry*)realloc(pipeline->entries, sizeof(struct pipeline_entry) * (pipeline->num_entries + 1));
+	if (!entries) {
+		mutex_unlock(&pipeline->mutex);
+		return -1;
+	}
+	pipeline->entries = entries;
+	struct pipeline_entry* entry = &pipeline->entries[pipeline->num_entries];
+	memset(entry, 0, sizeof(struct pipeline_entry));
+	entry->component = strdup(component);
+	if (!entry->component) {
+		mutex_unlock(&pipeline->mutex);
+		return -1;
+	}
+	pipeline->num_entries++;
+	mutex_unlock(&pipeline->mutex);
+	return 0;
+}
+
+int component_pipeline_start(component_pipeline_t pipeline)
+{
+	if (!pipeline || pipeline->num_entries == 0) {
+		return -1;
+	}
+	mutex_lock(&pipeline->mutex);
+	if (pipeline->started) {
+		mutex_unlock(&pipeline->mutex);
+		return 0;
+	}
+	pipeline->have_thread = 1;
+	pipeline->log_ecid = idevicerestore_log_get_ecid();
+	if (thread_new(&pipeline->thread, component_pipeline_thread, pipeline) != 0) {
+		pipeline->have_thread = 0;
+		mutex_unlock(&pipeline->mutex);
+		return -1;
+	}
+	pipeline->started = 1;
+	mutex_unlock(&pipeline->mutex);
+	debug("DEBUG: %s: preparing %u components\n", __func__, pipeline->num_entries);
+	return 0;
+}
+
+int component_pipeline_take(component_pipeline_t pipeline, const char* component, struct component_buffer* cb)
+{
+	if (!pipeline || !component || !cb) {
+		return -1;
+	}
+
+	int res = -1;
+	mutex_lock(&pipeline->mutex);
+	unsigned int i;
+	for (i = 0; i < pipeline->num_entries; i++) {
+		struct pipeline_entry* entry = &pipeline->entries[i];
+		if (entry->state == PIPELINE_DONE || strcmp(entry->component, component) != 0) {
+			continue;
+		}
+		if (entry->state == PIPELINE_PENDING) {
+			/* not started yet, the sender does it right away */
+			entry->state = PIPELINE_DONE;
+			break;
+		}
+		while (entry->state == PIPELINE_BUSY && pipeline->have_thread) {
+			cond_wait_timeout(&pipeline->done_cond, &pipeline->mutex, 1000);
+		}
+		if (entry->state == PIPELINE_READY) {
+			*cb = entry->cb;
+			component_buffer_init(&entry->cb);
+			res = 0;
+		}
+		entry->state = PIPELINE_DONE;
+		/* there is room for the next one now */
+		cond_signal(&pipeline->work_cond);
+		break;
+	}
+	mutex_unlock(&pipeline->mutex);
+
+	return res;
+}
+
+void component_pipeline_free(component_pipeline_t pipeline)
+{
+	if (!pipeline) {
+		return;
+	}
+	mutex_lock(&pipeline->mutex);
+	pipeline->stop = 1;
+	cond_signal(&pipeline->work_cond);
+	mutex_unlock(&pipeline->mutex);
+	if (pipeline->started) {
+		thread_join(pipeline->thread);
+		thread_free(pipeline->thread);
+	}
+
+	unsigned int i;
+	for (i = 0; i < pipeline->num_entries; i++) {
+		free(pipeline->entries[i].component);
+		component_buffer_free(&pipeline->entries[i].cb);
+	}
+	free(pipeline->entries);
+	cond_destroy(&pipeline->done_cond);
+	cond_destroy(&pipeline->work_cond);
+	mutex_destroy(&pipeline->mutex);
+	free(pipeline);
+}
@@ -0,0 +1,62 @@
+/*
+ * component_pipeline.h
+ * Prepares the next component while the previous one is uploaded (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_COMPONENT_PIPELINE_H
+#define IDEVICERESTORE_COMPONENT_PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+struct idevicerestore_client_t;
+struct component_buffer;
+
+/* how many prepared components may wait for their upload */
+#define COMPONENT_PIPELINE_DEPTH 2
+
+typedef struct component_pipeline* component_pipeline_t;
+
+/* Extracts and personalizes component into cb, ready to be sent as it is */
+typedef int (*component_prepare_cb_t)(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, struct component_buffer* cb);
+
+component_pipeline_t component_pipeline_new(struct idevicerestore_client_t* client, plist_t build_identity, component_prepare_cb_t prepare);
+
+/* Queues component, in the order they are going to be sent */
+int component_pipeline_add(component_pipeline_t pipeline, const char* component);
+
+/* Starts preparing the queued components on a background thread */
+int component_pipeline_start(component_pipeline_t pipeline);
+
+/* Hands out the prepared component, waiting for it if it is being worked on
+ * right now. Returns 0 and transfers ownership of the buffer on success, -1
+ * if the caller has to prepare it itself. */
+int component_pipeline_take(component_pipeline_t pipeline, const char* component, struct component_buffer* cb);
+
+/* Stops the background thread and frees everything not handed out */
+void component_pipeline_free(component_pipeline_t pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * component_registry.c
+ * Known firmware components and their IMG4 tags
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "component_registry.h"
+
+#define R COMPONENT_FLAG_RETAG
+
+static const struct component_info components[] = {
+	{ "ACIBT", "acib", NULL, 0 },
+	{ "ACIBTLPEM", "lpbt", NULL, 0 },
+	{ "ACIWIFI", "aciw", NULL, 0 },
+	{ "Alamo", "almo", NULL, 0 },
+	{ "ANE", "anef", NULL, 0 },
+	{ "ANS", "ansf", NULL, 0 },
+	{ "AOP", "aopf", NULL, 0 },
+	{ "Ap,AudioAccessibilityBootChime", "auac", NULL, 0 },
+	{ "Ap,AudioBootChime", "aubt", NULL, 0 },
+	{ "Ap,AudioPowerAttachChime", "aupr", NULL, 0 },
+	{ "Ap,CIO", "ciof", NULL, 0 },
+	{ "Ap,DCP2", "dcp2", NULL, R },
+	{ "Ap,HapticAssets", "hpas", NULL, 0 },
+	{ "Ap,LocalBoot", "lobo", NULL, 0 },
+	{ "Ap,LocalPolicy", "lpol", NULL, 0 },
+	{ "Ap,NextStageIM4MHash", "nsih", NULL, 0 },
+	{ "Ap,RecoveryOSPolicyNonceHash", "ronh", NULL, 0 },
+	{ "Ap,RestoreCIO", "rcio", NULL, R },
+	{ "Ap,RestoreTMU", "rtmu", NULL, R },
+	{ "Ap,Scorpius", "scpf", NULL, 0 },
+	{ "Ap,SystemVolumeCanonicalMetadata", "msys", NULL, 0 },
+	{ "Ap,TMU", "tmuf", NULL, 0 },
+	{ "Ap,VolumeUUID", "vuid", NULL, 0 },
+	{ "AppleLogo", "logo", "applelogo", 0 },
+	{ "AudioCodecFirmware", "acfw", NULL, 0 },
+	{ "AVE", "avef", NULL, 0 },
+	{ "BatteryCharging", "glyC", "glyphcharging", 0 },
+	{ "BatteryCharging0", "chg0", "batterycharging0", 0 },
+	{ "BatteryCharging1", "chg1", "batterycharging1", 0 },
+	{ "BatteryFull", "batF", "batteryfull", 0 },
+	{ "BatteryLow0", "bat0", "batterylow0", 0 },
+	{ "BatteryLow1", "bat1", "batterylow1", 0 },
+	{ "BatteryPlugin", "glyP", "glyphplugin", 0 },
+	{ "CFELoader", "cfel", NULL, 0 },
+	{ "Dali", "dali", NULL, 0 },
+	{ "DCP", "dcpf", NULL, 0 },
+	{ "DeviceTree", "dtre", "DeviceTree", 0 },
+	{ "Diags", "diag", NULL, 0 },
+	{ "EngineeringTrustCache", "dtrs", NULL, 0 },
+	{ "ExtDCP", "edcp", NULL, 0 },
+	{ "ftap", "ftap", NULL, 0 },
+	{ "ftsp", "ftsp", NULL, 0 },
+	{ "GFX", "gfxf", NULL, 0 },
+	{ "Hamm", "hamf", NULL, 0 },
+	{ "Homer", "homr", NULL, 0 },
+	{ "iBEC", "ibec", NULL, 0 },
+	{ "iBoot", "ibot", "iBoot", 0 },
+	{ "iBootData", "ibdt", NULL, 0 },
+	{ "iBootTest", "itst", NULL, 0 },
+	{ "iBSS", "ibss", NULL, 0 },
+	{ "InputDevice", "ipdf", NULL, 0 },
+	{ "ISP", "ispf", NULL, 0 },
+	{ "KernelCache", "krnl", NULL, 0 },
+	{ "LeapHaptics", "lphp", NULL, 0 },
+	{ "Liquid", "liqd", "liquiddetect", 0 },
+	{ "LLB", "illb", "LLB", 0 },
+	{ "LoadableTrustCache", "ltrs", NULL, 0 },
+	{ "LowPowerWallet0", "lpw0", "lowpowermode", 0 },
+	{ "LowPowerWallet1", "lpw1", NULL, 0 },
+	{ "LowPowerWallet2", "lpw2", NULL, 0 },
+	{ "MacEFI", "mefi", NULL, 0 },
+	{ "MtpFirmware", "mtpf", NULL, 0 },
+	{ "Multitouch", "mtfw", NULL, 0 },
+	{ "NeedService", "nsrv", "needservice", 0 },
+	{ "OS", "OS\0\0", NULL, 0 },
+	{ "OSRamdisk", "osrd", NULL, 0 },
+	{ "PersonalizedDMG", "pdmg", NULL, 0 },
+	{ "PEHammer", "hmmr", NULL, 0 },
+	{ "PERTOS", "pert", NULL, 0 },
+	{ "PHLEET", "phlt", NULL, 0 },
+	{ "PMP", "pmpf", NULL, 0 },
+	{ "RBM", "rmbt", NULL, 0 },
+	{ "Rap,SoftwareBinaryDsp1", "sbd1", NULL, 0 },
+	{ "Rap,RTKitOS", "rkos", NULL, 0 },
+	{ "Rap,RestoreRTKitOS", "rrko", NULL, 0 },
+	{ "RecoveryMode", "recm", "recoverymode", 0 },
+	{ "RestoreANS", "rans", NULL, 0 },
+	{ "RestoreDCP", "rdcp", NULL, R },
+	{ "RestoreDeviceTree", "rdtr", NULL, R },
+	{ "RestoreExtDCP", "recp", NULL, 0 },
+	{ "RestoreKernelCache", "rkrn", NULL, R },
+	{ "RestoreLogo", "rlgo", NULL, R },
+	{ "RestoreRamDisk", "rdsk", NULL, 0 },
+	{ "RestoreSEP", "rsep", "sep-firmware", R },
+	{ "RestoreTrustCache", "rtsc", NULL, R },
+	{ "rfta", "rfta", NULL, 0 },
+	{ "rfts", "rfts", NULL, 0 },
+	{ "RTP", "rtpf", NULL, 0 },
+	{ "SCAB", NULL, "SCAB", 0 },
+	{ "SCE", "scef", NULL, 0 },
+	{ "SCE1Firmware", "sc1f", NULL, 0 },
+	{ "SEP", "sepi", NULL, 0 },
+	{ "SIO", "siof", NULL, 0 },
+	{ "StaticTrustCache", "trst", NULL, 0 },
+	{ "SystemLocker", "lckr", NULL, 0 },
+	{ "SystemVolume", "isys", NULL, 0 },
+	{ "WCHFirmwareUpdater", "wchf", NULL, 0 },
+};
+
+#undef R
+
+#define NUM_COMPONENTS (sizeof(components) / sizeof(components[0]))
+
+/* open addressing, kept below half full so a lookup rarely probes twice */
+#define INDEX_SIZE 256
+
+static thread_once_t index_once = THREAD_ONCE_INIT;
+/* slot -> position in components + 1, 0 is empty */
+static uint8_t name_index[INDEX_SIZE];
+static uint8_t file_index[INDEX_SIZE];
+
+static uint32_t hash_key(const char* key, size_t len)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void index_insert(uint8_t* index, const char* key, unsigned int pos)
+{
+	uint32_t slot = hash_key(key, strlen(key)) & (INDEX_SIZE - 1);
+	while (index[slot]) {
+		slot = (slot + 1) & (INDEX_SIZE - 1);
+	}
+	index[slot] = (uint8_t)(pos + 1);
+}
+
+static void index_init(void)
+{
+	unsigned int i;
+	for (i = 0; i < NUM_COMPONENTS; i++) {
+		index_insert(name_index, components[i].name, i);
+		if (components[i].file) {
+			index_insert(file_index, components[i].file, i);
+		}
+	}
+}
+
+static const struct component_info* index_find(const uint8_t* index, const char* key, size_t len, int by_file)
+{
+	uint32_t slot = hash_key(key, len) & (INDEX_SIZE - 1);
+	while (index[slot]) {
+		const struct component_info* info = &components[index[slot] - 1];
+		const char* k = (by_file) ? info->file : info->name;
+		if (strncmp(k, key, len) == 0 && k[len] == '\0') {
+			return info;
+		}
+		slot = (slot + 1) & (INDEX_SIZE - 1);
+	}
+	return NULL;
+}
+
+const struct component_info* component_registry_lookup(const char* name)
+{
+	if (!name) {
+		return NULL;
+	}
+	thread_once(&index_once, index_init);
+	return index_find(name_index, name, strlen(name), 0);
+}
+
+const struct component_info* component_registry_lookup_file(const char* filename)
+{
+	if (!filename) {
+		return NULL;
+	}
+	thread_once(&index_once, index_init);
+
+	/* the prefix ends where the model or the image variant starts */
+	size_t len = strcspn(filename, ".@~");
+	const struct component_info* info = index_find(file_index, filename, len, 1);
+	if (info) {
+		return info;
+	}
+
+	/* anything else that starts with a known prefix */
+	unsigned int i;
+	for (i = 0; i < NUM_COMPONENTS; i++) {
+		if (components[i].file && strncmp(filename, components[i].file, strlen(components[i].file)) == 0) {
+			return &components[i];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * component_registry.h
+ * Known firmware components and their IMG4 tags (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_COMPONENT_REGISTRY_H
+#define IDEVICERESTORE_COMPONENT_REGISTRY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the IM4P payload type is rewritten to the tag when the component is stitched */
+#define COMPONENT_FLAG_RETAG (1 << 0)
+
+struct component_info {
+	const char* name;
+	/* IMG4 payload type, 4 characters, NULL if there is none */
+	const char* tag;
+	/* firmware file name prefix in all_flash manifests, if any */
+	const char* file;
+	unsigned int flags;
+};
+
+const struct component_info* component_registry_lookup(const char* name);
+
+/* Finds the component of a firmware file like "LLB.n41.RELEASE.img3" */
+const struct component_info* component_registry_lookup_file(const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
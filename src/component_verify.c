@@ -0,0 +1,459 @@
+/*
+ * component_verify.c
+ * Checks the components of a build identity against their digests
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include "sha1.h"
+#include "sha512.h"
+#define SHA_CTX SHA1_CTX
+#define SHA1_Init SHA1Init
+#define SHA1_Update SHA1Update
+#define SHA1_Final SHA1Final
+#define SHA512_CTX sha384_context
+#define SHA384_Init sha384_init
+#define SHA384_Update sha384_update
+#define SHA384_Final(out, ctx) sha384_final(ctx, out)
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+#include <plist/plist.h>
+
+#include "component_verify.h"
+#include "cache.h"
+#include "common.h"
+
+#define VERIFY_BUFSIZE (1024 * 1024)
+
+struct verify_job {
+	char* component;
+	char* path;
+	unsigned char digest[SHA384_DIGEST_LENGTH];
+	unsigned int digest_len;
+	unsigned char key[CACHE_KEY_SIZE];
+	int have_key;
+	uint64_t size;
+	int result;
+};
+
+struct verify_ctx {
+	ipsw_archive_t ipsw;
+	struct verify_job* jobs;
+	int num_jobs;
+	int next_job;
+	mutex_t mutex;
+	uint64_t total_bytes;
+	uint64_t done_bytes;
+	int progress;
+};
+
+/* one verification per process at a time, so concurrent restores of the
+ * same IPSW find the files the first one has checked */
+static thread_once_t verify_once = THREAD_ONCE_INIT;
+static mutex_t verify_mutex;
+
+static void verify_init(void)
+{
+	mutex_init(&verify_mutex);
+}
+
+static char* component_verify_set_path(const char* cache_dir, const char* ipsw_path)
+{
+	unsigned char key[CACHE_KEY_SIZE];
+	int i;
+	cache_key_from_data(key, ipsw_path, strlen(ipsw_path));
+	char* path = (char*)malloc(strlen(cache_dir) + 10 + CACHE_KEY_SIZE*2 + 7);
+	if (!path) {
+		return NULL;
+	}
+	char* p = path + sprintf(path, "%s/verified/", cache_dir);
+	for (i = 0; i < CACHE_KEY_SIZE; i++) {
+		p += sprintf(p, "%02x", key[i]);
+	}
+	strcpy(p, ".plist");
+	return path;
+}
+
+/* Returns the recorded files if the set belongs to the IPSW as it is now */
+static plist_t component_verify_set_load(const char* path, const char* ipsw_path, struct stat* ipsw_st)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	if (read_file(path, (void**)&buf, &len) != 0) {
+		return NULL;
+	}
+	plist_t dict = NULL;
+	plist_from_memory(buf, len, &dict);
+	free(buf);
+	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
+		plist_free(dict);
+		return NULL;
+	}
+	uint64_t size = 0;
+	uint64_t mtime = 0;
+	plist_t node = plist_dict_get_item(dict, "Path");
+	const char* spath = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+	node = plist_dict_get_item(dict, "Size");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &size);
+	}
+	node = plist_dict_get_item(dict, "MTime");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &mtime);
+	}
+	node = plist_dict_get_item(dict, "Components");
+	if (!spath || strcmp(spath, ipsw_path) != 0 || size != (uint64_t)ipsw_st->st_size || mtime != (uint64_t)ipsw_st->st_mtime || !node || plist_get_node_type(node) != PLIST_DICT) {
+		plist_free(dict);
+		return NULL;
+	}
+	plist_t components = plist_copy(node);
+	plist_free(dict);
+	return components;
+}
+
+static void component_verify_set_save(const char* path, const char* ipsw_path, struct stat* ipsw_st, plist_t components)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Path", plist_new_string(ipsw_path));
+	plist_dict_set_item(dict, "Size", plist_new_uint((uint64_t)ipsw_st->st_size));
+	plist_dict_set_item(dict, "MTime", plist_new_uint((uint64_t)ipsw_st->st_mtime));
+	plist_dict_set_item(dict, "Components", plist_copy(components));
+	char* bin = NULL;
+	uint32_t blen = 0;
+	plist_to_bin(dict, &bin, &blen);
+	plist_free(dict);
+	if (!bin) {
+		return;
+	}
+	char* tmp = (char*)malloc(strlen(path) + 16);
+	if (tmp) {
+		sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+		if (write_file(tmp, bin, blen) != (int)blen || rename(tmp, path) != 0) {
+			remove(tmp);
+		}
+		free(tmp);
+	}
+	free(bin);
+}
+
+static int component_verify_set_has(plist_t components, struct verify_job* job)
+{
+	plist_t entry = plist_dict_get_item(components, job->path);
+	if (!job->have_key || !entry || plist_get_node_type(entry) != PLIST_DICT) {
+		return 0;
+	}
+	uint64_t len = 0;
+	plist_t node = plist_dict_get_item(entry, "Key");
+	const char* key = (node && plist_get_node_type(node) == PLIST_DATA) ? plist_get_data_ptr(node, &len) : NULL;
+	if (!key || len != CACHE_KEY_SIZE || memcmp(key, job->key, CACHE_KEY_SIZE) != 0) {
+		return 0;
+	}
+	node = plist_dict_get_item(entry, "Digest");
+	const char* digest = (node && plist_get_node_type(node) == PLIST_DATA) ? plist_get_data_ptr(node, &len) : NULL;
+	return (digest && len == job->digest_len && memcmp(digest, job->digest, len) == 0);
+}
+
+static void component_verify_set_add(plist_t components, struct verify_job* job)
+{
+	plist_t entry = plist_new_dict();
+	plist_dict_set_item(entry, "Key", plist_new_data((char*)job->key, CACHE_KEY_SIZE));
+	plist_dict_set_item(entry, "Digest", plist_new_data((char*)job->digest, job->digest_len));
+	plist_dict_set_item(components, job->path, entry);
+}
+
+static void component_verify_progress(struct verify_ctx* ctx, uint64_t bytes)
+{
+	mutex_lock(&ctx->mutex);
+	ctx->done_bytes += bytes;
+	int progress = (ctx->total_bytes > 0) ? (int)((ctx->done_bytes * 100) / ctx->total_bytes) : 100;
+	if (progress != ctx->progress) {
+		ctx->progress = progress;
+		print_progress_bar((double)progress);
+	}
+	mutex_unlock(&ctx->mutex);
+}
+
+static int component_verify_hash(struct verify_ctx* ctx, struct verify_job* job, unsigned char* buf)
+{
+	unsigned char hash[SHA384_DIGEST_LENGTH];
+	SHA_CTX sha1ctx;
+	SHA512_CTX sha384ctx;
+	ipsw_file_handle_t file = ipsw_file_open(ctx->ipsw, job->path);
+	if (!file) {
+		error("ERROR: Unable to open %s (%s) in IPSW\n", job->component, job->path);
+		return -1;
+	}
+	if (job->digest_len == SHA384_DIGEST_LENGTH) {
+		SHA384_Init(&sha384ctx);
+	} else {
+		SHA1_Init(&sha1ctx);
+	}
+	int64_t r;
+	uint64_t done = 0;
+	while ((r = ipsw_file_read(file, buf, VERIFY_BUFSIZE)) > 0) {
+		if (job->digest_len == SHA384_DIGEST_LENGTH) {
+			SHA384_Update(&sha384ctx, buf, (size_t)r);
+		} else {
+			SHA1_Update(&sha1ctx, buf, (size_t)r);
+		}
+		done += (uint64_t)r;
+		component_verify_progress(ctx, (uint64_t)r);
+	}
+	ipsw_file_close(file);
+	if (r < 0) {
+		error("ERROR: Unable to read %s (%s) from IPSW\n", job->component, job->path);
+		return -1;
+	}
+	if (job->digest_len == SHA384_DIGEST_LENGTH) {
+		SHA384_Final(hash, &sha384ctx);
+	} else {
+		SHA1_Final(hash, &sha1ctx);
+	}
+	if (memcmp(hash, job->digest, job->digest_len) != 0) {
+		error("ERROR: %s (%s) does not match its digest in the BuildManifest, %" PRIu64 " of %" PRIu64 " bytes read\n", job->component, job->path, done, job->size);
+		return -1;
+	}
+	debug("DEBUG: %s: %s matches its digest\n", __func__, job->path);
+	return 0;
+}
+
+static void* component_verify_worker(void* arg)
+{
+	struct verify_ctx* ctx = (struct verify_ctx*)arg;
+	unsigned char* buf = (unsigned char*)malloc(VERIFY_BUFSIZE);
+	if (!buf) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		return NULL;
+	}
+	while (1) {
+		mutex_lock(&ctx->mutex);
+		if (ctx->next_job >= ctx->num_jobs) {
+			mutex_unlock(&ctx->mutex);
+			break;
+		}
+		struct verify_job* job = &ctx->jobs[ctx->next_job++];
+		mutex_unlock(&ctx->mutex);
+
+		job->result = component_verify_hash(ctx, job, buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* largest first, so one huge file doesn't end up last on a single core */
+static int component_verify_job_cmp(const void* a, const void* b)
+{
+	const struct verify_job* ja = (const struct verify_job*)a;
+	const struct verify_job* jb = (const struct verify_job*)b;
+	if (ja->size == jb->size) {
+		return 0;
+	}
+	return (ja->size < jb->size) ? 1 : -1;
+}
+
+static int component_verify_add_job(struct verify_ctx* ctx, ipsw_archive_t ipsw, const char* component, const char* path, const char* digest, uint64_t digest_len)
+{
+	int i;
+	for (i = 0; i < ctx->num_jobs; i++) {
+		if (!strcmp(ctx->jobs[i].path, path) && ctx->jobs[i].digest_len == digest_len && !memcmp(ctx->jobs[i].digest, digest, digest_len)) {
+			/* several components use the same file */
+			return 0;
+		}
+	}
+	struct verify_job* jobs = (struct verify_job*)realloc(ctx->jobs, (ctx->num_jobs + 1) * sizeof(struct verify_job));
+	if (!jobs) {
+		return -1;
+	}
+	ctx->jobs = jobs;
+	struct verify_job* job = &jobs[ctx->num_jobs++];
+	memset(job, 0, sizeof(struct verify_job));
+	job->component = strdup(component);
+	job->path = strdup(path);
+	memcpy(job->digest, digest, digest_len);
+	job->digest_len = (unsigned int)digest_len;
+	/* not checked yet */
+	job->result = 1;
+	job->have_key = (ipsw_get_file_key(ipsw, path, job->key) == 0);
+	ipsw_get_file_size(ipsw, path, &job->size);
+	return 0;
+}
+
+static void component_verify_free_jobs(struct verify_ctx* ctx)
+{
+	int i;
+	for (i = 0; i < ctx->num_jobs; i++) {
+		free(ctx->jobs[i].component);
+		free(ctx->jobs[i].path);
+	}
+	free(ctx->jobs);
+	ctx->jobs = NULL;
+	ctx->num_jobs = 0;
+}
+
+static int component_verify_run(struct verify_ctx* ctx)
+{
+	int i;
+	int num_workers = get_cpu_count();
+	if (num_workers > ctx->num_jobs) {
+		num_workers = ctx->num_jobs;
+	}
+	THREAD_T* workers = (num_workers > 1) ? (THREAD_T*)calloc(num_workers, sizeof(THREAD_T)) : NULL;
+	int started = 0;
+	while (workers && started < num_workers && thread_new(&workers[started], component_verify_worker, ctx) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		component_verify_worker(ctx);
+	}
+	for (i = 0; i < started; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+	free(workers);
+
+	int res = 0;
+	for (i = 0; i < ctx->num_jobs; i++) {
+		if (ctx->jobs[i].result != 0) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+int component_verify_build_identity(ipsw_archive_t ipsw, plist_t build_identity, const char* cache_dir)
+{
+	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
+	if (!ipsw || !manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
+		return -1;
+	}
+	if (ipsw_is_remote(ipsw)) {
+		info("Skipping component verification for remote IPSW\n");
+		return 0;
+	}
+
+	thread_once(&verify_once, verify_init);
+	mutex_lock(&verify_mutex);
+
+	const char* ipsw_path = ipsw_get_path(ipsw);
+	struct stat ipsw_st;
+	char* set_path = NULL;
+	plist_t components = NULL;
+	if (cache_dir && stat(ipsw_path, &ipsw_st) == 0) {
+		set_path = component_verify_set_path(cache_dir, ipsw_path);
+	}
+	if (set_path) {
+		components = component_verify_set_load(set_path, ipsw_path, &ipsw_st);
+	}
+	if (!components) {
+		components = plist_new_dict();
+	}
+
+	struct verify_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.ipsw = ipsw;
+	ctx.progress = -1;
+	int res = 0;
+	int skipped = 0;
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(manifest_node, &iter);
+	plist_t node = NULL;
+	char* key = NULL;
+	do {
+		node = NULL;
+		key = NULL;
+		plist_dict_next_item(manifest_node, iter, &key, &node);
+		if (key && node && plist_get_node_type(node) == PLIST_DICT) {
+			plist_t path = plist_access_path(node, 2, "Info", "Path");
+			plist_t digest = plist_dict_get_item(node, "Digest");
+			const char* comp_path = (path && plist_get_node_type(path) == PLIST_STRING) ? plist_get_string_ptr(path, NULL) : NULL;
+			uint64_t digest_len = 0;
+			const char* digest_data = (digest && plist_get_node_type(digest) == PLIST_DATA) ? plist_get_data_ptr(digest, &digest_len) : NULL;
+			if (comp_path && digest_data && (digest_len == 20 || digest_len == SHA384_DIGEST_LENGTH) && ipsw_file_exists(ipsw, comp_path)) {
+				if (component_verify_add_job(&ctx, ipsw, key, comp_path, digest_data, digest_len) < 0) {
+					error("ERROR: %s: Out of memory\n", __func__);
+					res = -1;
+				}
+			}
+		}
+		free(key);
+	} while (node);
+	free(iter);
+
+	/* drop what an earlier run has checked already */
+	int i;
+	int n = 0;
+	for (i = 0; i < ctx.num_jobs; i++) {
+		if (component_verify_set_has(components, &ctx.jobs[i])) {
+			free(ctx.jobs[i].component);
+			free(ctx.jobs[i].path);
+			skipped++;
+			continue;
+		}
+		ctx.jobs[n++] = ctx.jobs[i];
+	}
+	ctx.num_jobs = n;
+
+	if (res == 0 && ctx.num_jobs > 0) {
+		qsort(ctx.jobs, ctx.num_jobs, sizeof(struct verify_job), component_verify_job_cmp);
+		for (i = 0; i < ctx.num_jobs; i++) {
+			ctx.total_bytes += ctx.jobs[i].size;
+		}
+		info("Verifying %d components (%" PRIu64 " MB)...\n", ctx.num_jobs, ctx.total_bytes / (1024 * 1024));
+		mutex_init(&ctx.mutex);
+		res = component_verify_run(&ctx);
+		mutex_destroy(&ctx.mutex);
+
+		int added = 0;
+		for (i = 0; i < ctx.num_jobs; i++) {
+			if (ctx.jobs[i].result == 0 && ctx.jobs[i].have_key) {
+				component_verify_set_add(components, &ctx.jobs[i]);
+				added++;
+			}
+		}
+		if (set_path && added > 0) {
+			char* dir = (char*)malloc(strlen(cache_dir) + 10);
+			if (dir) {
+				sprintf(dir, "%s/verified", cache_dir);
+				mkdir_with_parents(dir, 0755);
+				free(dir);
+			}
+			component_verify_set_save(set_path, ipsw_path, &ipsw_st, components);
+		}
+	}
+	if (skipped > 0) {
+		info("%d components were verified before\n", skipped);
+	}
+
+	component_verify_free_jobs(&ctx);
+	plist_free(components);
+	free(set_path);
+	mutex_unlock(&verify_mutex);
+	return res;
+}
@@ -0,0 +1,44 @@
+/*
+ * component_verify.h
+ * Checks the components of a build identity against their digests (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef IDEVICERESTORE_COMPONENT_VERIFY_H
+#define IDEVICERESTORE_COMPONENT_VERIFY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+#include "ipsw.h"
+
+/* Hashes every file of the build identity's Manifest that has a Digest
+ * (SHA-1 or SHA-384, by its length) and compares the result, using all
+ * cores. Files that passed are recorded per IPSW in
+ * <cache_dir>/verified, so they are not read again while the IPSW stays
+ * unchanged. cache_dir may be NULL. Returns 0 if all files match, -1
+ * otherwise. */
+int component_verify_build_identity(ipsw_archive_t ipsw, plist_t build_identity, const char* cache_dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * conn_writer.c
+ * Write-combining sender for device connections
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "conn_writer.h"
+#include "common.h"
+
+void conn_writer_init(struct conn_writer* w, idevice_connection_t connection, uint32_t capacity)
+{
+	memset(w, 0, sizeof(struct conn_writer));
+	w->connection = connection;
+	w->capacity = (capacity > 0) ? capacity : CONN_WRITER_DEFAULT_SIZE;
+}
+
+void conn_writer_cleanup(struct conn_writer* w)
+{
+	free(w->buf);
+	free(w->scratch);
+	w->buf = NULL;
+	w->scratch = NULL;
+	w->len = 0;
+	w->scratch_size = 0;
+}
+
+static int conn_writer_send_raw(struct conn_writer* w, const char* data, uint32_t size)
+{
+	idevice_error_t device_error = IDEVICE_E_SUCCESS;
+	uint32_t sent = 0;
+
+	while (sent < size) {
+		uint32_t bytes = 0;
+		device_error = idevice_connection_send(w->connection, data + sent, size - sent, &bytes);
+		if (device_error != IDEVICE_E_SUCCESS || bytes == 0) {
+			break;
+		}
+		sent += bytes;
+	}
+	if (sent != size) {
+		error("ERROR: Unable to send data (%d). Sent %u of %u bytes.\n", device_error, sent, size);
+		return -1;
+	}
+	return 0;
+}
+
+static int conn_writer_alloc(struct conn_writer* w)
+{
+	if (!w->buf) {
+		w->buf = (char*)malloc(w->capacity);
+		if (!w->buf) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int conn_writer_flush(struct conn_writer* w)
+{
+	if (w->len == 0) {
+		return 0;
+	}
+	uint32_t len = w->len;
+	w->len = 0;
+	return conn_writer_send_raw(w, w->buf, len);
+}
+
+int conn_writer_write(struct conn_writer* w, const void* data, uint32_t size)
+{
+	const char* p = (const char*)data;
+
+	if (size >= w->capacity / 2) {
+		if (conn_writer_flush(w) < 0) {
+			return -1;
+		}
+		return conn_writer_send_raw(w, p, size);
+	}
+	if (conn_writer_alloc(w) < 0) {
+		return -1;
+	}
+	if (size > w->capacity - w->len && conn_writer_flush(w) < 0) {
+		return -1;
+	}
+	memcpy(w->buf + w->len, p, size);
+	w->len += size;
+	return 0;
+}
+
+int conn_writer_writev(struct conn_writer* w, const struct conn_iovec* iov, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		if (iov[i].size > 0 && conn_writer_write(w, iov[i].data, iov[i].size) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int conn_writer_sendv(struct conn_writer* w, const struct conn_iovec* iov, int count)
+{
+	if (conn_writer_writev(w, iov, count) < 0) {
+		return -1;
+	}
+	return conn_writer_flush(w);
+}
+
+int conn_writer_send(struct conn_writer* w, const void* data, uint32_t size)
+{
+	if (conn_writer_write(w, data, size) < 0) {
+		return -1;
+	}
+	return conn_writer_flush(w);
+}
+
+char* conn_writer_reserve(struct conn_writer* w, uint32_t* avail)
+{
+	if (conn_writer_alloc(w) < 0) {
+		return NULL;
+	}
+	if (w->len == w->capacity && conn_writer_flush(w) < 0) {
+		return NULL;
+	}
+	*avail = w->capacity - w->len;
+	return w->buf + w->len;
+}
+
+void conn_writer_commit(struct conn_writer* w, uint32_t size)
+{
+	w->len += size;
+}
+
+char* conn_writer_scratch(struct conn_writer* w, uint32_t size)
+{
+	if (size > w->scratch_size) {
+		char* scratch = (char*)realloc(w->scratch, size);
+		if (!scratch) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			return NULL;
+		}
+		w->scratch = scratch;
+		w->scratch_size = size;
+	}
+	return w->scratch;
+}
@@ -0,0 +1,78 @@
+/*
+ * conn_writer.h
+ * Write-combining sender for device connections (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_CONN_WRITER_H
+#define IDEVICERESTORE_CONN_WRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#define CONN_WRITER_DEFAULT_SIZE (64 * 1024)
+
+/* Small writes are collected in buf and go out as one send on flush or when
+ * the buffer is full. Writes of at least half the buffer size are sent as
+ * they are, after whatever is pending. Both buffers are allocated on first
+ * use and kept until conn_writer_cleanup(), so a writer that lives as long
+ * as its connection doesn't allocate per message. */
+struct conn_writer {
+	idevice_connection_t connection;
+	char* buf;
+	uint32_t len;
+	uint32_t capacity;
+	char* scratch;
+	uint32_t scratch_size;
+};
+
+struct conn_iovec {
+	const void* data;
+	uint32_t size;
+};
+
+void conn_writer_init(struct conn_writer* w, idevice_connection_t connection, uint32_t capacity);
+void conn_writer_cleanup(struct conn_writer* w);
+
+int conn_writer_write(struct conn_writer* w, const void* data, uint32_t size);
+int conn_writer_writev(struct conn_writer* w, const struct conn_iovec* iov, int count);
+int conn_writer_flush(struct conn_writer* w);
+
+/* writev followed by flush, for a complete message */
+int conn_writer_sendv(struct conn_writer* w, const struct conn_iovec* iov, int count);
+int conn_writer_send(struct conn_writer* w, const void* data, uint32_t size);
+
+/* Returns the free space at the end of the buffer, flushing first if it is
+ * full, so data can be produced in place. conn_writer_commit() adds the
+ * bytes actually filled in. */
+char* conn_writer_reserve(struct conn_writer* w, uint32_t* avail);
+void conn_writer_commit(struct conn_writer* w, uint32_t size);
+
+/* Work buffer of at least size bytes owned by the writer, e.g. for receiving
+ * the data that is sent back. The contents don't survive the next call. */
+char* conn_writer_scratch(struct conn_writer* w, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,8 @@
 #include "recovery.h"
 #include "idevicerestore.h"
 #include "common.h"
+#include "transition.h"
+#include "component_pipeline.h"
 
 static int dfu_progress_callback(irecv_client_t client, const irecv_event_t* event) {
 	if (event->type == IRECV_PROGRESS) {
@@ -42,8 +44,8 @@ static int dfu_progress_callback(irecv_client_t client, const irecv_event_t* eve
 
 int dfu_client_new(struct idevicerestore_client_t* client)
 {
-	int i = 0;
-	int attempts = 10;
+	unsigned int i = 0;
+	unsigned int budget = 10000;
 	irecv_client_t dfu = NULL;
 
 	if (client->dfu == NULL) {
@@ -55,17 +57,16 @@ int dfu_client_new(struct idevicerestore_client_t* client)
 		}
 	}
 
-	for (i = 1; i <= attempts; i++) {
+	/* the device may not be ready to be opened right after it showed up */
+	for (i = 0; ; i++) {
 		if (irecv_open_with_ecid(&dfu, client->ecid) == IRECV_E_SUCCESS) {
 			break;
 		}
 
-		if (i >= attempts) {
+		if (transition_backoff(i, &budget) < 0) {
 			error("ERROR: Unable to connect to device in DFU mode\n");
 			return -1;
 		}
-
-		sleep(1);
 		debug("Retrying connection...\n");
 	}
 
@@ -114,7 +115,9 @@ int dfu_send_buffer(struct idevicerestore_client_t* client, unsigned char* buffe
 
 	info("Sending data (%d bytes)...\n", size);
 
+	uint64_t begin = telemetry_begin();
 	err = irecv_send_buffer(client->dfu->client, buffer, size, 1);
+	telemetry_end(client->telemetry, "dfu_send", begin, size);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send data: %s\n", irecv_strerror(err));
 		return -1;
@@ -123,7 +126,7 @@ int dfu_send_buffer(struct idevicerestore_client_t* client, unsigned char* buffe
 	return 0;
 }
 
-int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component)
+static int dfu_prepare_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, struct component_buffer* cb)
 {
 	char* path = NULL;
 
@@ -133,14 +136,11 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 		tss = client->tss_localpolicy;
 	}
 
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-
 	if (strcmp(component, "Ap,LocalPolicy") == 0) {
 		// If Ap,LocalPolicy => Inject an empty policy
-		component_data = malloc(sizeof(lpol_file));
-		component_size = sizeof(lpol_file);
-		memcpy(component_data, lpol_file, component_size);
+		if (component_buffer_copy(cb, lpol_file, sizeof(lpol_file)) < 0) {
+			return -1;
+		}
 	} else {
 		if (tss) {
 			if (tss_response_get_path_by_entry(tss, component, &path) < 0) {
@@ -155,7 +155,7 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 			}
 		}
 
-		if (extract_component(client->ipsw, path, &component_data, &component_size) < 0) {
+		if (extract_component_buffer(client, path, cb) < 0) {
 			error("ERROR: Unable to extract component: %s\n", component);
 			free(path);
 			return -1;
@@ -164,51 +164,63 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 		path = NULL;
 	}
 
-	unsigned char* data = NULL;
-	uint32_t size = 0;
-
-	if (personalize_component(component, component_data, component_size, tss, &data, &size) < 0) {
+	if (personalize_component_buffer(client, component, cb, tss) < 0) {
 		error("ERROR: Unable to get personalized component: %s\n", component);
-		free(component_data);
+		component_buffer_free(cb);
 		return -1;
 	}
-	free(component_data);
-	component_data = NULL;
 
 	if (!client->image4supported && client->build_major > 8 && !(client->flags & FLAG_CUSTOM) && !strcmp(component, "iBEC")) {
 		unsigned char* ticket = NULL;
 		unsigned int tsize = 0;
 		if (tss_response_get_ap_ticket(client->tss, &ticket, &tsize) < 0) {
 			error("ERROR: Unable to get ApTicket from TSS request\n");
+			component_buffer_free(cb);
 			return -1;
 		}
-		uint32_t fillsize = 0;
-		if (tsize % 64 != 0) {
-			fillsize = ((tsize / 64) + 1) * 64;
-		}
+		/* the ticket goes in front, padded to 64 bytes */
+		uint32_t fillsize = ((tsize + 63) / 64) * 64;
 		debug("ticket size = %d\nfillsize = %d\n", tsize, fillsize);
-		unsigned char* newdata = (unsigned char*)malloc(size + fillsize);
-		memcpy(newdata, ticket, tsize);
-		memset(newdata + tsize, '\xFF', fillsize - tsize);
-		memcpy(newdata + fillsize, data, size);
-		free(data);
-		data = newdata;
-		size += fillsize;
+		unsigned char* p = component_buffer_push(cb, fillsize);
+		if (!p) {
+			free(ticket);
+			component_buffer_free(cb);
+			return -1;
+		}
+		memcpy(p, ticket, tsize);
+		memset(p + tsize, '\xFF', fillsize - tsize);
+		free(ticket);
 	}
 
-	info("Sending %s (%d bytes)...\n", component, size);
+	return 0;
+}
+
+static int dfu_send_prepared(struct idevicerestore_client_t* client, const char* component, struct component_buffer* cb)
+{
+	info("Sending %s (%d bytes)...\n", component, cb->size);
 
-	irecv_error_t err = irecv_send_buffer(client->dfu->client, data, size, 1);
+	uint64_t begin = telemetry_begin();
+	irecv_error_t err = irecv_send_buffer(client->dfu->client, component_buffer_data(cb), cb->size, 1);
+	telemetry_end(client->telemetry, "dfu_send", begin, cb->size);
+	component_buffer_free(cb);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send %s component: %s\n", component, irecv_strerror(err));
-		free(data);
 		return -1;
 	}
 
-	free(data);
 	return 0;
 }
 
+int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component)
+{
+	struct component_buffer cb;
+	component_buffer_init(&cb);
+	if (dfu_prepare_component(client, build_identity, component, &cb) < 0) {
+		return -1;
+	}
+	return dfu_send_prepared(client, component, &cb);
+}
+
 int dfu_get_cpid(struct idevicerestore_client_t* client, unsigned int* cpid)
 {
 	if(client->dfu == NULL) {
@@ -344,6 +356,21 @@ int dfu_send_command(struct idevicerestore_client_t* client, const char* command
 	return 0;
 }
 
+static int dfu_is_loaded_by_iboot_stage1(plist_t node)
+{
+	plist_t iboot_node = plist_access_path(node, 2, "Info", "IsLoadedByiBoot");
+	plist_t iboot_stg1_node = plist_access_path(node, 2, "Info", "IsLoadedByiBootStage1");
+	uint8_t is_stg1 = 0;
+	uint8_t b = 0;
+	if (iboot_stg1_node && plist_get_node_type(iboot_stg1_node) == PLIST_BOOLEAN) {
+		plist_get_bool_val(iboot_stg1_node, &is_stg1);
+	}
+	if (iboot_node && plist_get_node_type(iboot_node) == PLIST_BOOLEAN && is_stg1) {
+		plist_get_bool_val(iboot_node, &b);
+	}
+	return b;
+}
+
 int dfu_send_iboot_stage1_components(struct idevicerestore_client_t* client, plist_t build_identity)
 {
 	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
@@ -352,8 +379,26 @@ int dfu_send_iboot_stage1_components(struct idevicerestore_client_t* client, pli
 		return -1;
 	}
 
+	/* the next component is extracted and personalized while the previous one is uploaded */
+	component_pipeline_t pipeline = component_pipeline_new(client, build_identity, dfu_prepare_component);
 	plist_dict_iter iter = NULL;
 	plist_dict_new_iter(manifest_node, &iter);
+	while (pipeline && iter) {
+		char *key = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(manifest_node, iter, &key, &node);
+		if (key == NULL)
+			break;
+		if (dfu_is_loaded_by_iboot_stage1(node)) {
+			component_pipeline_add(pipeline, key);
+		}
+		free(key);
+	}
+	free(iter);
+	component_pipeline_start(pipeline);
+
+	iter = NULL;
+	plist_dict_new_iter(manifest_node, &iter);
 	int err = 0;
 	while (iter) {
 		char *key = NULL;
@@ -362,26 +407,29 @@ int dfu_send_iboot_stage1_components(struct idevicerestore_client_t* client, pli
 		if (key == NULL)
 			break;
 
-		plist_t iboot_node = plist_access_path(node, 2, "Info", "IsLoadedByiBoot");
-		plist_t iboot_stg1_node = plist_access_path(node, 2, "Info", "IsLoadedByiBootStage1");
-		uint8_t is_stg1 = 0;
-		if (iboot_stg1_node && plist_get_node_type(iboot_stg1_node) == PLIST_BOOLEAN) {
-			plist_get_bool_val(iboot_stg1_node, &is_stg1);
-		}
-		if (iboot_node && plist_get_node_type(iboot_node) == PLIST_BOOLEAN && is_stg1) {
-			uint8_t b = 0;
-			plist_get_bool_val(iboot_node, &b);
-			if (b) {
-				debug("DEBUG: %s is loaded by iBoot Stage 1.\n", key);
-				if (dfu_send_component_and_command(client, build_identity, key, "firmware") < 0) {
-					error("ERROR: Unable to send component '%s' to device.\n", key);
-					err++;
-				}
+		if (dfu_is_loaded_by_iboot_stage1(node)) {
+			debug("DEBUG: %s is loaded by iBoot Stage 1.\n", key);
+			struct component_buffer cb;
+			component_buffer_init(&cb);
+			int res = 0;
+			if (component_pipeline_take(pipeline, key, &cb) < 0) {
+				res = dfu_prepare_component(client, build_identity, key, &cb);
+			}
+			if (res == 0) {
+				res = dfu_send_prepared(client, key, &cb);
+			}
+			if (res == 0) {
+				res = dfu_send_command(client, "firmware");
+			}
+			if (res < 0) {
+				error("ERROR: Unable to send component '%s' to device.\n", key);
+				err++;
 			}
 		}
 		free(key);
 	}
 	free(iter);
+	component_pipeline_free(pipeline);
 
 	return (err) ? -1 : 0;
 }
@@ -416,8 +464,7 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 	if (client->build_major > 8) {
 		/* reconnect */
 		debug("Waiting for device to disconnect...\n");
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-		if (client->mode != MODE_UNKNOWN || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "ibss-disconnect", TRANSITION_MODE(MODE_UNKNOWN), 10000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			if (!(client->flags & FLAG_QUIT)) {
 				error("ERROR: Device did not disconnect. Possibly invalid iBSS. Reset device and try again.\n");
@@ -425,8 +472,7 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 			return -1;
 		}
 		debug("Waiting for device to reconnect...\n");
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-		if ((client->mode != MODE_DFU && client->mode != MODE_RECOVERY) || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "ibss-reconnect", TRANSITION_MODE(MODE_DFU) | TRANSITION_MODE(MODE_RECOVERY), 10000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			if (!(client->flags & FLAG_QUIT)) {
 				error("ERROR: Device did not reconnect in DFU or recovery mode. Possibly invalid iBSS. Reset device and try again.\n");
@@ -475,6 +521,7 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 				return -1;
 			}
 			fixup_tss(client->tss);
+			prefetch_update_tss(client->prefetch, client->tss);
 		}
 
 		if (irecv_usb_set_configuration(client->dfu->client, 1) < 0) {
@@ -576,8 +623,7 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 	}
 
 	debug("Waiting for device to disconnect...\n");
-	cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-	if (client->mode != MODE_UNKNOWN || (client->flags & FLAG_QUIT)) {
+	if (transition_wait(client, "dfu-disconnect", TRANSITION_MODE(MODE_UNKNOWN), 10000) < 0) {
 		mutex_unlock(&client->device_event_mutex);
 		if (!(client->flags & FLAG_QUIT)) {
 			error("ERROR: Device did not disconnect. Possibly invalid %s. Reset device and try again.\n", (client->build_major > 8) ? "iBEC" : "iBSS");
@@ -585,8 +631,7 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 		return -1;
 	}
 	debug("Waiting for device to reconnect in recovery mode...\n");
-	cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-	if (client->mode != MODE_RECOVERY || (client->flags & FLAG_QUIT)) {
+	if (transition_wait(client, "dfu-recovery", TRANSITION_MODE(MODE_RECOVERY), 10000) < 0) {
 		mutex_unlock(&client->device_event_mutex);
 		if (!(client->flags & FLAG_QUIT)) {
 			error("ERROR: Device did not reconnect in recovery mode. Possibly invalid %s. Reset device and try again.\n", (client->build_major > 8) ? "iBEC" : "iBSS");
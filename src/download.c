@@ -19,31 +19,157 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
+#include <plist/plist.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include "sha1.h"
+#define SHA_CTX SHA1_CTX
+#define SHA1_Init SHA1Init
+#define SHA1_Update SHA1Update
+#define SHA1_Final SHA1Final
+#endif
 
 #include "download.h"
 #include "common.h"
 
-typedef struct {
-	int length;
-	char* content;
-} curl_response;
+#define DOWNLOAD_BUFFER_MIN 4096
 
-static size_t download_write_buffer_callback(char* data, size_t size, size_t nmemb, curl_response* response) {
+int download_buffer_reserve(struct download_buffer* buffer, size_t size)
+{
+	/* one extra byte for the terminating NUL */
+	if (size + 1 <= buffer->capacity) {
+		return 0;
+	}
+	size_t capacity = (buffer->capacity < DOWNLOAD_BUFFER_MIN) ? DOWNLOAD_BUFFER_MIN : buffer->capacity;
+	while (capacity < size + 1) {
+		capacity *= 2;
+	}
+	char* data = (char*)realloc(buffer->data, capacity);
+	if (!data) {
+		return -1;
+	}
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+static size_t download_buffer_write_callback(char* data, size_t size, size_t nmemb, void* userdata)
+{
+	struct download_buffer* buffer = (struct download_buffer*)userdata;
 	size_t total = size * nmemb;
-	if (total != 0) {
-		response->content = realloc(response->content, response->length + total + 1);
-		memcpy(response->content + response->length, data, total);
-		response->content[response->length + total] = '\0';
-		response->length += total;
+	if (total == 0) {
+		return 0;
+	}
+	if (buffer->length == 0 && buffer->handle) {
+		/* the headers are complete with the first chunk of the body */
+#if LIBCURL_VERSION_NUM >= 0x073700
+		curl_off_t clen = -1;
+		if (curl_easy_getinfo((CURL*)buffer->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &clen) == CURLE_OK && clen > 0 && clen < 0x40000000) {
+#else
+		double clen = -1;
+		if (curl_easy_getinfo((CURL*)buffer->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &clen) == CURLE_OK && clen > 0 && clen < 0x40000000) {
+#endif
+			download_buffer_reserve(buffer, (size_t)clen);
+		}
+	}
+	if (download_buffer_reserve(buffer, buffer->length + total) < 0) {
+		return 0;
 	}
+	memcpy(buffer->data + buffer->length, data, total);
+	buffer->length += total;
+	buffer->data[buffer->length] = '\0';
 	return total;
 }
 
-int download_to_buffer(const char* url, char** buf, uint32_t* length)
+void download_buffer_attach(struct download_buffer* buffer, void* handle)
+{
+	buffer->handle = handle;
+	download_buffer_reset(buffer);
+	curl_easy_setopt((CURL*)handle, CURLOPT_WRITEFUNCTION, &download_buffer_write_callback);
+	curl_easy_setopt((CURL*)handle, CURLOPT_WRITEDATA, buffer);
+}
+
+void download_buffer_reset(struct download_buffer* buffer)
+{
+	buffer->length = 0;
+	if (download_buffer_reserve(buffer, 0) == 0) {
+		buffer->data[0] = '\0';
+	}
+}
+
+char* download_buffer_take(struct download_buffer* buffer, size_t* length)
+{
+	char* data = buffer->data;
+	if (length) {
+		*length = buffer->length;
+	}
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->capacity = 0;
+	return data;
+}
+
+void download_buffer_free(struct download_buffer* buffer)
+{
+	free(buffer->data);
+	memset(buffer, 0, sizeof(struct download_buffer));
+}
+
+struct download_validators {
+	char* etag;
+	char* last_modified;
+};
+
+static char* download_header_value(const char* buffer, size_t len, size_t namelen)
+{
+	const char* p = buffer + namelen;
+	const char* end = buffer + len;
+	while (p < end && *p == ' ') p++;
+	while (end > p && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) end--;
+	char* value = (char*)malloc(end - p + 1);
+	if (value) {
+		memcpy(value, p, end - p);
+		value[end - p] = '\0';
+	}
+	return value;
+}
+
+static size_t download_validators_header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+	struct download_validators* validators = (struct download_validators*)userdata;
+	size_t total = size * nitems;
+	if (total > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+		/* a new response after a redirect */
+		free(validators->etag);
+		free(validators->last_modified);
+		validators->etag = NULL;
+		validators->last_modified = NULL;
+	} else if (total > 5 && strncasecmp(buffer, "ETag:", 5) == 0) {
+		free(validators->etag);
+		validators->etag = download_header_value(buffer, total, 5);
+	} else if (total > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0) {
+		free(validators->last_modified);
+		validators->last_modified = download_header_value(buffer, total, 14);
+	}
+	return total;
+}
+
+int download_to_buffer_conditional(const char* url, char** etag, char** last_modified, char** buf, uint32_t* length)
 {
 	int res = 0;
 	CURL* handle = curl_easy_init();
@@ -52,10 +178,12 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 		return -1;
 	}
 
-	curl_response response;
-	response.length = 0;
-	response.content = malloc(1);
-	response.content[0] = '\0';
+	struct download_buffer response = DOWNLOAD_BUFFER_INIT;
+
+	struct download_validators validators;
+	validators.etag = NULL;
+	validators.last_modified = NULL;
+	struct curl_slist* headers = NULL;
 
 	if (idevicerestore_debug)
 		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
@@ -63,8 +191,7 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	/* disable SSL verification to allow download from untrusted https locations */
 	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
 
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, (curl_write_callback)&download_write_buffer_callback);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response);
+	download_buffer_attach(&response, handle);
 	if (strncmp(url, "https://api.ipsw.me/", 20) == 0) {
 		curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING " idevicerestore/" PACKAGE_VERSION);
 	} else {
@@ -73,36 +200,91 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(handle, CURLOPT_URL, url);
 
+	if (etag || last_modified) {
+		char hdr[512];
+		if (etag && *etag) {
+			snprintf(hdr, sizeof(hdr), "If-None-Match: %s", *etag);
+			headers = curl_slist_append(headers, hdr);
+		}
+		if (last_modified && *last_modified) {
+			snprintf(hdr, sizeof(hdr), "If-Modified-Since: %s", *last_modified);
+			headers = curl_slist_append(headers, hdr);
+		}
+		if (headers) {
+			curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+		}
+		curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &download_validators_header_callback);
+		curl_easy_setopt(handle, CURLOPT_HEADERDATA, &validators);
+	}
+
+	long code = 0;
 	curl_easy_perform(handle);
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
 	curl_easy_cleanup(handle);
+	curl_slist_free_all(headers);
 
-	if (response.length > 0) {
-		*length = response.length;
-		*buf = response.content;
+	if (code == 304 && headers) {
+		res = 1;
+	} else if (response.length > 0 && (code == 0 || (code >= 200 && code < 300))) {
+		/* code is 0 for non-HTTP URLs */
+		*length = (uint32_t)response.length;
+		*buf = download_buffer_take(&response, NULL);
+		if (etag) {
+			free(*etag);
+			*etag = validators.etag;
+			validators.etag = NULL;
+		}
+		if (last_modified) {
+			free(*last_modified);
+			*last_modified = validators.last_modified;
+			validators.last_modified = NULL;
+		}
 	} else {
 		res = -1;
 	}
+	download_buffer_free(&response);
+	free(validators.etag);
+	free(validators.last_modified);
 
 	return res;
 }
 
-static int lastprogress = 0;
+int download_to_buffer(const char* url, char** buf, uint32_t* length)
+{
+	return download_to_buffer_conditional(url, NULL, NULL, buf, length);
+}
 
 static int download_progress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
 {
+	int* lastprogress = (int*)clientp;
 	double p = (dlnow / dltotal) * 100;
 
 	if (p < 100.0) {
-		if ((int)p > lastprogress) {
+		if ((int)p > *lastprogress) {
 			info("downloading: %d%%\n", (int)p);
-			lastprogress = (int)p;
+			*lastprogress = (int)p;
 		}
 	}
 
 	return 0;
 }
 
-int download_to_file(const char* url, const char* filename, int enable_progress)
+struct download_file {
+	FILE* f;
+	SHA_CTX* sha1ctx;
+};
+
+static size_t download_write_file_callback(char* data, size_t size, size_t nmemb, void* userdata)
+{
+	struct download_file* dlf = (struct download_file*)userdata;
+	size_t total = fwrite(data, size, nmemb, dlf->f) * size;
+	if (total > 0) {
+		SHA1_Update(dlf->sha1ctx, (const void*)data, total);
+	}
+	return total;
+}
+
+static int download_to_file_hashed(const char* url, const char* filename, int enable_progress, SHA_CTX* sha1ctx)
 {
 	int res = 0;
 	CURL* handle = curl_easy_init();
@@ -117,7 +299,7 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 		return -1;
 	}
 
-	lastprogress = 0;
+	int lastprogress = 0;
 
 	if (idevicerestore_debug)
 		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
@@ -125,11 +307,21 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 	/* disable SSL verification to allow download from untrusted https locations */
 	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
 
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, f);
+	struct download_file dlf;
+	dlf.f = f;
+	dlf.sha1ctx = sha1ctx;
+	if (sha1ctx) {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &download_write_file_callback);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, &dlf);
+	} else {
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, f);
+	}
 
-	if (enable_progress > 0)
+	if (enable_progress > 0) {
 		curl_easy_setopt(handle, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback)&download_progress);
+		curl_easy_setopt(handle, CURLOPT_PROGRESSDATA, &lastprogress);
+	}
 
 	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, enable_progress > 0 ? 0: 1);
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
@@ -154,3 +346,646 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 
 	return res;
 }
+
+int download_to_file(const char* url, const char* filename, int enable_progress)
+{
+	return download_to_file_hashed(url, filename, enable_progress, NULL);
+}
+
+static char* download_journal_path(const char* filename)
+{
+	char* path = (char*)malloc(strlen(filename) + 9);
+	if (path) {
+		sprintf(path, "%s.journal", filename);
+	}
+	return path;
+}
+
+int download_is_incomplete(const char* filename)
+{
+	char* path = download_journal_path(filename);
+	if (!path) {
+		return 0;
+	}
+	int res = (access(path, F_OK) == 0);
+	free(path);
+	return res;
+}
+
+#ifndef WIN32
+#define DOWNLOAD_SEGMENT_SIZE (16 * 1024 * 1024)
+#define DOWNLOAD_CONNECTIONS 4
+#define DOWNLOAD_SEGMENT_RETRIES 5
+
+enum {
+	SEGMENT_PENDING = 0,
+	SEGMENT_ACTIVE,
+	SEGMENT_DONE
+};
+
+struct download_probe {
+	uint64_t length;
+	int accept_ranges;
+	char* validator;
+	char* effective_url;
+};
+
+/* SHA1 can't be computed per range and combined, so the digest follows the
+ * file front to back: data at the cursor is hashed as it arrives, segments
+ * that completed ahead of it are read back (from the page cache) once the
+ * cursor gets there. */
+struct download_hash {
+	SHA_CTX ctx;
+	uint64_t hashed;
+};
+
+struct download_slot {
+	CURL* handle;
+	struct download_hash* hash;
+	int fd;
+	int active;
+	/* the response code was checked with the first data */
+	int checked;
+	uint32_t segment;
+	uint64_t offset;
+	uint64_t pos;
+	uint64_t end;
+	/* size of the whole file, 0 if unknown */
+	uint64_t length;
+};
+
+static size_t download_probe_header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+	struct download_probe* probe = (struct download_probe*)userdata;
+	size_t total = size * nitems;
+	size_t len = total;
+	while (len > 0 && (buffer[len-1] == '\r' || buffer[len-1] == '\n')) {
+		len--;
+	}
+
+	if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+		/* a new response after a redirect, forget about the previous one */
+		probe->accept_ranges = 0;
+		free(probe->validator);
+		probe->validator = NULL;
+	} else if (len > 14 && strncasecmp(buffer, "Accept-Ranges:", 14) == 0) {
+		const char* p = buffer + 14;
+		while (*p == ' ') p++;
+		probe->accept_ranges = (strncasecmp(p, "bytes", 5) == 0);
+	} else if ((len > 5 && strncasecmp(buffer, "ETag:", 5) == 0) || (len > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0 && !probe->validator)) {
+		free(probe->validator);
+		probe->validator = (char*)malloc(len + 1);
+		if (probe->validator) {
+			memcpy(probe->validator, buffer, len);
+			probe->validator[len] = '\0';
+		}
+	}
+
+	return total;
+}
+
+static int download_probe_url(const char* url, struct download_probe* probe)
+{
+	memset(probe, 0, sizeof(struct download_probe));
+
+	CURL* handle = curl_easy_init();
+	if (handle == NULL) {
+		error("ERROR: could not initialize CURL\n");
+		return -1;
+	}
+
+	if (idevicerestore_debug)
+		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
+	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
+	curl_easy_setopt(handle, CURLOPT_NOBODY, 1);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &download_probe_header_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, probe);
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
+	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(handle, CURLOPT_URL, url);
+
+	int res = -1;
+	long code = 0;
+	if (curl_easy_perform(handle) == CURLE_OK
+	    && curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code) == CURLE_OK && code == 200) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+		curl_off_t length = -1;
+		curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+#else
+		double length = -1;
+		curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+#endif
+		char* effective_url = NULL;
+		curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+		if (length > 0) {
+			probe->length = (uint64_t)length;
+			probe->effective_url = strdup((effective_url) ? effective_url : url);
+			res = 0;
+		}
+	}
+	curl_easy_cleanup(handle);
+
+	return res;
+}
+
+/* returns the number of completed segments, or -1 if the journal is missing or belongs to another download */
+static int download_journal_load(const char* journal, const char* url, const struct download_probe* probe, unsigned char* state, uint32_t num_segments)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	if (read_file(journal, (void**)&buf, &len) != 0) {
+		return -1;
+	}
+	plist_t dict = NULL;
+	plist_from_memory(buf, len, &dict);
+	free(buf);
+	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
+		plist_free(dict);
+		return -1;
+	}
+
+	int res = -1;
+	plist_t node = plist_dict_get_item(dict, "URL");
+	const char* jurl = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+	node = plist_dict_get_item(dict, "Validator");
+	const char* jvalidator = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : "";
+	node = plist_dict_get_item(dict, "Segments");
+	uint64_t jsegments_len = 0;
+	const char* jsegments = (node && plist_get_node_type(node) == PLIST_DATA) ? plist_get_data_ptr(node, &jsegments_len) : NULL;
+	if (jurl && !strcmp(jurl, url)
+	    && _plist_dict_get_uint(dict, "Length") == probe->length
+	    && _plist_dict_get_uint(dict, "SegmentSize") == DOWNLOAD_SEGMENT_SIZE
+	    && !strcmp(jvalidator, (probe->validator) ? probe->validator : "")
+	    && jsegments && jsegments_len == num_segments) {
+		uint32_t i;
+		res = 0;
+		for (i = 0; i < num_segments; i++) {
+			state[i] = (jsegments[i]) ? SEGMENT_DONE : SEGMENT_PENDING;
+			if (state[i] == SEGMENT_DONE) {
+				res++;
+			}
+		}
+	}
+	plist_free(dict);
+
+	return res;
+}
+
+/* the journal must not claim segments that are still in the page cache only */
+static int download_sync_data(int fd)
+{
+#ifdef HAVE_FDATASYNC
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+static int download_journal_save(const char* journal, const char* url, const struct download_probe* probe, const unsigned char* state, uint32_t num_segments)
+{
+	char* done = (char*)malloc(num_segments);
+	if (!done) {
+		return -1;
+	}
+	uint32_t i;
+	for (i = 0; i < num_segments; i++) {
+		done[i] = (state[i] == SEGMENT_DONE);
+	}
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "URL", plist_new_string(url));
+	plist_dict_set_item(dict, "Length", plist_new_uint(probe->length));
+	plist_dict_set_item(dict, "SegmentSize", plist_new_uint(DOWNLOAD_SEGMENT_SIZE));
+	plist_dict_set_item(dict, "Validator", plist_new_string((probe->validator) ? probe->validator : ""));
+	plist_dict_set_item(dict, "Segments", plist_new_data(done, num_segments));
+	free(done);
+
+	char* bin = NULL;
+	uint32_t blen = 0;
+	plist_to_bin(dict, &bin, &blen);
+	plist_free(dict);
+	if (!bin) {
+		return -1;
+	}
+
+	/* a journal that claims more than what is on disk would leave holes in the file */
+	int res = -1;
+	char* tmp = (char*)malloc(strlen(journal) + 5);
+	if (tmp) {
+		sprintf(tmp, "%s.tmp", journal);
+		if (write_file(tmp, bin, blen) == (int)blen && rename(tmp, journal) == 0) {
+			res = 0;
+		} else {
+			remove(tmp);
+		}
+		free(tmp);
+	}
+	free(bin);
+
+	return res;
+}
+
+static size_t download_segment_write_callback(char* data, size_t size, size_t nmemb, void* userdata)
+{
+	struct download_slot* slot = (struct download_slot*)userdata;
+	size_t total = size * nmemb;
+	if (!slot->checked) {
+		/* an error page or the whole file must neither be written nor hashed */
+		long code = 0;
+		curl_easy_getinfo(slot->handle, CURLINFO_RESPONSE_CODE, &code);
+		if (code != 206 && !(code == 200 && slot->offset == 0 && slot->length > 0 && slot->end == slot->length)) {
+			debug("DEBUG: %s: unexpected HTTP %ld for range at %" PRIu64 "\n", __func__, code, slot->offset);
+			return 0;
+		}
+		slot->checked = 1;
+	}
+	if (slot->pos + total > slot->end) {
+		/* the server ignored the range */
+		return 0;
+	}
+	if (slot->hash && slot->pos <= slot->hash->hashed && slot->hash->hashed < slot->pos + total) {
+		size_t skip = (size_t)(slot->hash->hashed - slot->pos);
+		SHA1_Update(&slot->hash->ctx, (const void*)(data + skip), total - skip);
+		slot->hash->hashed += total - skip;
+	}
+	size_t written = 0;
+	while (written < total) {
+		ssize_t w = pwrite(slot->fd, data + written, total - written, (off_t)slot->pos);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		}
+		if (w <= 0) {
+			error("ERROR: Unable to write downloaded data: %s\n", strerror(errno));
+			return 0;
+		}
+		written += w;
+		slot->pos += w;
+	}
+	return total;
+}
+
+static void download_slot_start(CURLM* multi, struct download_slot* slot, const char* url, uint64_t length, uint32_t segment)
+{
+	char range[64];
+	slot->segment = segment;
+	slot->offset = (uint64_t)segment * DOWNLOAD_SEGMENT_SIZE;
+	slot->pos = slot->offset;
+	slot->end = slot->offset + DOWNLOAD_SEGMENT_SIZE;
+	if (slot->end > length) {
+		slot->end = length;
+	}
+	slot->length = length;
+	slot->checked = 0;
+	snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, slot->offset, slot->end - 1);
+
+	if (idevicerestore_debug)
+		curl_easy_setopt(slot->handle, CURLOPT_VERBOSE, 1);
+	curl_easy_setopt(slot->handle, CURLOPT_SSL_VERIFYPEER, 0);
+	curl_easy_setopt(slot->handle, CURLOPT_WRITEFUNCTION, &download_segment_write_callback);
+	curl_easy_setopt(slot->handle, CURLOPT_WRITEDATA, slot);
+	curl_easy_setopt(slot->handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
+	curl_easy_setopt(slot->handle, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(slot->handle, CURLOPT_RANGE, range);
+	curl_easy_setopt(slot->handle, CURLOPT_URL, url);
+	/* drop stalled connections, the segment is retried */
+	curl_easy_setopt(slot->handle, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+	curl_easy_setopt(slot->handle, CURLOPT_LOW_SPEED_TIME, 30L);
+
+	curl_multi_add_handle(multi, slot->handle);
+	slot->active = 1;
+}
+
+/* hashes completed data at the cursor, at most one segment per call unless all is set */
+static int download_hash_catch_up(struct download_hash* hash, int fd, const unsigned char* state, uint64_t length, int all)
+{
+	unsigned char buf[65536];
+	while (hash->hashed < length && state[hash->hashed / DOWNLOAD_SEGMENT_SIZE] == SEGMENT_DONE) {
+		uint64_t end = (hash->hashed / DOWNLOAD_SEGMENT_SIZE + 1) * DOWNLOAD_SEGMENT_SIZE;
+		if (end > length) {
+			end = length;
+		}
+		while (hash->hashed < end) {
+			size_t chunk = (end - hash->hashed > sizeof(buf)) ? sizeof(buf) : (size_t)(end - hash->hashed);
+			ssize_t r = pread(fd, buf, chunk, (off_t)hash->hashed);
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			if (r <= 0) {
+				error("ERROR: Unable to read back downloaded data: %s\n", strerror(errno));
+				return -1;
+			}
+			SHA1_Update(&hash->ctx, (const void*)buf, (size_t)r);
+			hash->hashed += r;
+		}
+		if (!all) {
+			break;
+		}
+	}
+	return 0;
+}
+
+static int download_segments(const char* url, const char* filename, const struct download_probe* probe, int enable_progress, unsigned char* sha1)
+{
+	uint32_t num_segments = (uint32_t)((probe->length + DOWNLOAD_SEGMENT_SIZE - 1) / DOWNLOAD_SEGMENT_SIZE);
+	unsigned char* state = (unsigned char*)calloc(num_segments, 1);
+	unsigned char* retries = (unsigned char*)calloc(num_segments, 1);
+	char* journal = download_journal_path(filename);
+	if (!state || !retries || !journal) {
+		error("ERROR: Out of memory\n");
+		free(state);
+		free(retries);
+		free(journal);
+		return -1;
+	}
+
+	int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		error("ERROR: cannot open '%s' for writing\n", filename);
+		free(state);
+		free(retries);
+		free(journal);
+		return -1;
+	}
+
+	struct stat fst;
+	int completed = download_journal_load(journal, url, probe, state, num_segments);
+	if (completed < 0 || fstat(fd, &fst) != 0 || (uint64_t)fst.st_size != probe->length) {
+		/* nothing from a previous attempt can be trusted */
+		memset(state, SEGMENT_PENDING, num_segments);
+		completed = 0;
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)probe->length) != 0) {
+			error("ERROR: Unable to allocate %" PRIu64 " bytes for '%s': %s\n", probe->length, filename, strerror(errno));
+			close(fd);
+			free(state);
+			free(retries);
+			free(journal);
+			return -1;
+		}
+	} else if (completed > 0) {
+		info("Resuming download, %d of %u segments already done\n", completed, num_segments);
+	}
+	download_journal_save(journal, url, probe, state, num_segments);
+
+	struct download_hash hash;
+	SHA1_Init(&hash.ctx);
+	hash.hashed = 0;
+
+	CURLM* multi = curl_multi_init();
+	struct download_slot slots[DOWNLOAD_CONNECTIONS];
+	memset(slots, 0, sizeof(slots));
+	int i;
+	for (i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+		slots[i].handle = curl_easy_init();
+		slots[i].fd = fd;
+		slots[i].hash = (sha1) ? &hash : NULL;
+	}
+
+	int res = 0;
+	int lastprogress = -1;
+	uint32_t next = 0;
+	uint64_t done_bytes = 0;
+	uint32_t seg;
+	for (seg = 0; seg < num_segments; seg++) {
+		if (state[seg] == SEGMENT_DONE) {
+			/* the last segment is usually shorter */
+			uint64_t offset = (uint64_t)seg * DOWNLOAD_SEGMENT_SIZE;
+			done_bytes += (probe->length - offset < DOWNLOAD_SEGMENT_SIZE) ? probe->length - offset : DOWNLOAD_SEGMENT_SIZE;
+		}
+	}
+	while (1) {
+		int active = 0;
+		for (i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+			if (!slots[i].active && slots[i].handle && res == 0) {
+				while (next < num_segments && state[next] != SEGMENT_PENDING) {
+					next++;
+				}
+				if (next < num_segments) {
+					state[next] = SEGMENT_ACTIVE;
+					download_slot_start(multi, &slots[i], probe->effective_url, probe->length, next);
+				}
+			}
+			active += slots[i].active;
+		}
+		if (active == 0) {
+			break;
+		}
+
+		int running = 0;
+		curl_multi_perform(multi, &running);
+
+		CURLMsg* msg;
+		int queued = 0;
+		while ((msg = curl_multi_info_read(multi, &queued))) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			struct download_slot* slot = NULL;
+			for (i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+				if (slots[i].handle == msg->easy_handle) {
+					slot = &slots[i];
+					break;
+				}
+			}
+			if (!slot) {
+				continue;
+			}
+			long code = 0;
+			curl_easy_getinfo(slot->handle, CURLINFO_RESPONSE_CODE, &code);
+			int ok = (msg->data.result == CURLE_OK && slot->pos == slot->end && (code == 206 || (code == 200 && slot->offset == 0 && slot->end == probe->length)));
+			curl_multi_remove_handle(multi, slot->handle);
+			slot->active = 0;
+
+			if (ok) {
+				state[slot->segment] = SEGMENT_DONE;
+				done_bytes += slot->end - slot->offset;
+				if (download_sync_data(fd) == 0) {
+					download_journal_save(journal, url, probe, state, num_segments);
+				}
+			} else if (retries[slot->segment]++ < DOWNLOAD_SEGMENT_RETRIES) {
+				debug("DEBUG: %s: retrying segment %u (curl error %d, HTTP %ld)\n", __func__, slot->segment, msg->data.result, code);
+				state[slot->segment] = SEGMENT_PENDING;
+				if (slot->segment < next) {
+					next = slot->segment;
+				}
+			} else {
+				error("ERROR: Download of '%s' failed (curl error %d, HTTP %ld)\n", url, msg->data.result, code);
+				state[slot->segment] = SEGMENT_PENDING;
+				res = -1;
+			}
+		}
+
+		if (sha1 && res == 0 && download_hash_catch_up(&hash, fd, state, probe->length, 0) < 0) {
+			res = -1;
+		}
+
+		if (enable_progress > 0) {
+			uint64_t now = done_bytes;
+			for (i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+				if (slots[i].active) {
+					now += slots[i].pos - slots[i].offset;
+				}
+			}
+			int p = (int)((now * 100) / probe->length);
+			if (p < 100 && p > lastprogress) {
+				info("downloading: %d%%\n", p);
+				lastprogress = p;
+			}
+		}
+
+		if (running > 0) {
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	for (i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+		if (slots[i].handle) {
+			curl_easy_cleanup(slots[i].handle);
+		}
+	}
+	curl_multi_cleanup(multi);
+
+	uint32_t s;
+	for (s = 0; s < num_segments; s++) {
+		if (state[s] != SEGMENT_DONE) {
+			res = -1;
+			break;
+		}
+	}
+	if (sha1 && res == 0) {
+		if (download_hash_catch_up(&hash, fd, state, probe->length, 1) < 0 || hash.hashed != probe->length) {
+			res = -1;
+		} else {
+			SHA1_Final(sha1, &hash.ctx);
+		}
+	}
+	if (fsync(fd) != 0 && res == 0) {
+		error("ERROR: Unable to write '%s': %s\n", filename, strerror(errno));
+		res = -1;
+	}
+	close(fd);
+
+	if (res == 0) {
+		remove(journal);
+	} else {
+		/* keep the file and the journal around for the next attempt */
+		info("Download of '%s' interrupted, it will be resumed next time\n", filename);
+	}
+	free(state);
+	free(retries);
+	free(journal);
+
+	return res;
+}
+
+int download_get_range_info(const char* url, uint64_t* length, char** validator, char** effective_url)
+{
+	struct download_probe probe;
+	if (download_probe_url(url, &probe) < 0 || !probe.accept_ranges) {
+		free(probe.validator);
+		free(probe.effective_url);
+		return -1;
+	}
+	*length = probe.length;
+	*validator = probe.validator;
+	*effective_url = probe.effective_url;
+	return 0;
+}
+
+int download_range_to_fd(const char* url, uint64_t offset, uint64_t length, int fd)
+{
+	if (!url || length == 0) {
+		return -1;
+	}
+
+	struct download_slot slot;
+	memset(&slot, 0, sizeof(slot));
+	slot.fd = fd;
+	slot.handle = curl_easy_init();
+	if (!slot.handle) {
+		error("ERROR: could not initialize CURL\n");
+		return -1;
+	}
+
+	char range[64];
+	snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, offset, offset + length - 1);
+
+	int res = -1;
+	int attempt;
+	for (attempt = 0; attempt < DOWNLOAD_SEGMENT_RETRIES && res < 0; attempt++) {
+		slot.offset = offset;
+		slot.pos = offset;
+		slot.end = offset + length;
+		slot.checked = 0;
+		if (idevicerestore_debug)
+			curl_easy_setopt(slot.handle, CURLOPT_VERBOSE, 1);
+		curl_easy_setopt(slot.handle, CURLOPT_SSL_VERIFYPEER, 0);
+		curl_easy_setopt(slot.handle, CURLOPT_WRITEFUNCTION, &download_segment_write_callback);
+		curl_easy_setopt(slot.handle, CURLOPT_WRITEDATA, &slot);
+		curl_easy_setopt(slot.handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
+		curl_easy_setopt(slot.handle, CURLOPT_FOLLOWLOCATION, 1);
+		curl_easy_setopt(slot.handle, CURLOPT_RANGE, range);
+		curl_easy_setopt(slot.handle, CURLOPT_URL, url);
+		curl_easy_setopt(slot.handle, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+		curl_easy_setopt(slot.handle, CURLOPT_LOW_SPEED_TIME, 30L);
+
+		long code = 0;
+		CURLcode cres = curl_easy_perform(slot.handle);
+		curl_easy_getinfo(slot.handle, CURLINFO_RESPONSE_CODE, &code);
+		if (cres == CURLE_OK && code == 206 && slot.pos == slot.end) {
+			res = 0;
+		} else {
+			debug("DEBUG: %s: range %s failed (curl error %d, HTTP %ld)\n", __func__, range, cres, code);
+		}
+	}
+	curl_easy_cleanup(slot.handle);
+
+	return res;
+}
+#else
+int download_get_range_info(const char* url, uint64_t* length, char** validator, char** effective_url)
+{
+	return -1;
+}
+
+int download_range_to_fd(const char* url, uint64_t offset, uint64_t length, int fd)
+{
+	return -1;
+}
+#endif
+
+static int download_to_file_with_sha1(const char* url, const char* filename, int enable_progress, unsigned char* sha1)
+{
+	if (!sha1) {
+		return download_to_file_hashed(url, filename, enable_progress, NULL);
+	}
+	SHA_CTX sha1ctx;
+	SHA1_Init(&sha1ctx);
+	int res = download_to_file_hashed(url, filename, enable_progress, &sha1ctx);
+	SHA1_Final(sha1, &sha1ctx);
+	return res;
+}
+
+int download_to_file_resumable(const char* url, const char* filename, int enable_progress, unsigned char* sha1)
+{
+#ifdef WIN32
+	return download_to_file_with_sha1(url, filename, enable_progress, sha1);
+#else
+	struct download_probe probe;
+	if (download_probe_url(url, &probe) < 0 || !probe.accept_ranges || probe.length <= DOWNLOAD_SEGMENT_SIZE) {
+		debug("DEBUG: %s: no range support for %s, downloading in one go\n", __func__, url);
+		free(probe.validator);
+		free(probe.effective_url);
+		char* journal = download_journal_path(filename);
+		if (journal) {
+			remove(journal);
+			free(journal);
+		}
+		return download_to_file_with_sha1(url, filename, enable_progress, sha1);
+	}
+
+	int res = download_segments(url, filename, &probe, enable_progress, sha1);
+	free(probe.validator);
+	free(probe.effective_url);
+
+	return res;
+#endif
+}
@@ -27,10 +27,49 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
+
+/* Response body collected from a curl handle. It grows geometrically and
+ * reserves the announced Content-Length up front, data is always NUL
+ * terminated once attached. */
+struct download_buffer {
+	char* data;
+	size_t length;
+	size_t capacity;
+	void* handle;
+};
+#define DOWNLOAD_BUFFER_INIT { NULL, 0, 0, NULL }
+
+/* Installs the write callback on the (CURL*) handle and empties the buffer */
+void download_buffer_attach(struct download_buffer* buffer, void* handle);
+int download_buffer_reserve(struct download_buffer* buffer, size_t size);
+void download_buffer_reset(struct download_buffer* buffer);
+/* Hands the data over to the caller, the buffer is empty afterwards */
+char* download_buffer_take(struct download_buffer* buffer, size_t* length);
+void download_buffer_free(struct download_buffer* buffer);
 
 int download_to_buffer(const char* url, char** buf, uint32_t* length);
+/* Sends If-None-Match/If-Modified-Since for the given validators and
+ * replaces them with the ones from the response. Returns 0 if the resource
+ * was downloaded, 1 if it has not been modified and -1 on error. */
+int download_to_buffer_conditional(const char* url, char** etag, char** last_modified, char** buf, uint32_t* length);
 int download_to_file(const char* url, const char* filename, int enable_progress);
 
+/* Downloads url in byte ranges over several connections and keeps a journal
+ * next to filename, so an interrupted download continues where it stopped.
+ * Falls back to download_to_file() if the server does not support ranges.
+ * If sha1 is not NULL it receives the SHA1 of the file, computed while
+ * downloading. */
+int download_to_file_resumable(const char* url, const char* filename, int enable_progress, unsigned char* sha1);
+/* Returns 1 if filename is a partial download that can be resumed */
+int download_is_incomplete(const char* filename);
+
+/* Size, validator (ETag or Last-Modified header, may be NULL) and final URL
+ * after redirects of url. Fails if the server doesn't accept range requests. */
+int download_get_range_info(const char* url, uint64_t* length, char** validator, char** effective_url);
+/* Writes length bytes of url starting at offset to the same offset of fd */
+int download_range_to_fd(const char* url, uint64_t offset, uint64_t length, int fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,8 +27,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifndef WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#endif
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice-glue/socket.h>
+#include <libimobiledevice-glue/thread.h>
 
 #include "common.h"
 #include "idevicerestore.h"
@@ -44,9 +49,9 @@
 #define FDR_PROXY_MSG 0x105
 #define FDR_PLIST_MSG 0xbbaa
 
-static uint64_t conn_port;
-static int ctrlprotoversion = 2;
-static int serial;
+#define FDR_PROXY_BUFSIZE 1048576
+/* upper bound for the rest of a message once its first bytes arrived */
+#define FDR_RECV_TIMEOUT 20000
 
 static int fdr_receive_plist(fdr_client_t fdr, plist_t* data);
 static int fdr_send_plist(fdr_client_t fdr, plist_t data);
@@ -55,14 +60,18 @@ static int fdr_sync_handshake(fdr_client_t fdr);
 static int fdr_handle_sync_cmd(fdr_client_t fdr);
 static int fdr_handle_plist_cmd(fdr_client_t fdr);
 static int fdr_handle_proxy_cmd(fdr_client_t fdr);
+static int fdr_proxy_relay(fdr_client_t fdr);
+#ifndef WIN32
+static int fdr_relay_add(fdr_client_t fdr);
+static void* fdr_relay_thread(void* arg);
+#endif
 
-int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
+static int fdr_connect_port(idevice_t device, fdr_type_t type, uint16_t port, int ctrlprotoversion, fdr_client_t* fdr)
 {
 	int res = -1, i = 0;
 	int attempts = 10;
 	idevice_connection_t connection = NULL;
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
-	uint16_t port = (type == FDR_CONN ? conn_port : CTRL_PORT);
 
 	*fdr = NULL;
 
@@ -89,8 +98,14 @@ int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
 		return -1;
 	}
 	fdr_loc->connection = connection;
+	fdr_loc->proxy_fd = -1;
+	fdr_loc->recv_timeout = FDR_RECV_TIMEOUT;
+	fdr_loc->log_ecid = idevicerestore_log_get_ecid();
+	conn_writer_init(&fdr_loc->writer, connection, 0);
 	fdr_loc->device = device;
 	fdr_loc->type = type;
+	fdr_loc->conn_port = port;
+	fdr_loc->ctrlprotoversion = ctrlprotoversion;
 
 	/* Do handshake */
 	if (type == FDR_CTRL)
@@ -108,6 +123,16 @@ int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
 	return 0;
 }
 
+int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
+{
+	if (type != FDR_CTRL) {
+		/* data connections are opened by the control channel on the port it negotiated */
+		error("ERROR: %s: FDR connections can only be opened through the control channel\n", __func__);
+		return -1;
+	}
+	return fdr_connect_port(device, type, CTRL_PORT, 2, fdr);
+}
+
 void fdr_disconnect(fdr_client_t fdr)
 {
 	if (!fdr)
@@ -126,6 +151,12 @@ void fdr_free(fdr_client_t fdr)
 		return;
 
 	fdr_disconnect(fdr);
+	if (fdr->proxy_fd >= 0) {
+		socket_close(fdr->proxy_fd);
+		fdr->proxy_fd = -1;
+	}
+	free(fdr->proxy_host);
+	conn_writer_cleanup(&fdr->writer);
 
 	free(fdr);
 	fdr = NULL;
@@ -142,7 +173,7 @@ int fdr_poll_and_handle_message(fdr_client_t fdr)
 		return -1;
 	}
 
-	device_error = idevice_connection_receive_timeout(fdr->connection, (char *)&cmd, sizeof(cmd), &bytes, 20000);
+	device_error = idevice_connection_receive_timeout(fdr->connection, (char *)&cmd, sizeof(cmd), &bytes, fdr->recv_timeout);
 #ifdef HAVE_IDEVICE_E_TIMEOUT
 	if (device_error == IDEVICE_E_TIMEOUT || (device_error == IDEVICE_E_SUCCESS && bytes != sizeof(cmd)))
 #else
@@ -183,9 +214,14 @@ void *fdr_listener_thread(void *cdata)
 	fdr_client_t fdr = cdata;
 	int res;
 
+	if (fdr) {
+		idevicerestore_log_set_ecid(fdr->log_ecid);
+	}
 	while (fdr && fdr->connection) {
 		debug("FDR %p waiting for message...\n", fdr);
 		res = fdr_poll_and_handle_message(fdr);
+		if (res == 0 && fdr->proxy_fd >= 0)
+			res = fdr_proxy_relay(fdr);
 		if (fdr->type == FDR_CTRL && res >= 0)
 			continue; // main thread should always retry
 		if (res != 0)
@@ -196,32 +232,45 @@ void *fdr_listener_thread(void *cdata)
 	return (void *)(intptr_t)res;
 }
 
+/* the relay's buffer if it is big enough, otherwise the writer's scratch buffer, which is kept for the next message */
+static char* fdr_receive_buffer(fdr_client_t fdr, uint32_t size)
+{
+	if (fdr->recv_buf && size <= fdr->recv_bufsize) {
+		return fdr->recv_buf;
+	}
+	return conn_writer_scratch(&fdr->writer, size);
+}
+
 static int fdr_receive_plist(fdr_client_t fdr, plist_t* data)
 {
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	uint32_t len, bytes = 0;
 	char* buf = NULL;
 
-	device_error = idevice_connection_receive(fdr->connection, (char*)&len, sizeof(len), &bytes);
-	if (device_error != IDEVICE_E_SUCCESS) {
+	device_error = idevice_connection_receive_timeout(fdr->connection, (char*)&len, sizeof(len), &bytes, fdr->recv_timeout);
+	if (device_error != IDEVICE_E_SUCCESS || bytes != sizeof(len)) {
 		error("ERROR: Unable to receive packet length from FDR (%d)\n", device_error);
 		return -1;
 	}
 
-	buf = calloc(1, len);
+	buf = fdr_receive_buffer(fdr, len);
 	if (!buf) {
 		error("ERROR: Unable to allocate memory for FDR receive buffer\n");
 		return -1;
 	}
 
-	device_error = idevice_connection_receive(fdr->connection, buf, len, &bytes);
-	if (device_error != IDEVICE_E_SUCCESS) {
-		error("ERROR: Unable to receive data from FDR\n");
-		free(buf);
-		return -1;
+	uint32_t done = 0;
+	while (done < len) {
+		bytes = 0;
+		device_error = idevice_connection_receive_timeout(fdr->connection, buf + done, len - done, &bytes, fdr->recv_timeout);
+		if (device_error != IDEVICE_E_SUCCESS || bytes == 0) {
+			error("ERROR: Unable to receive data from FDR\n");
+			return -1;
+		}
+		done += bytes;
 	}
+	bytes = done;
 	plist_from_bin(buf, bytes, data);
-	free(buf);
 
 	debug("FDR Received %d bytes\n", bytes);
 
@@ -230,9 +279,8 @@ static int fdr_receive_plist(fdr_client_t fdr, plist_t* data)
 
 static int fdr_send_plist(fdr_client_t fdr, plist_t data)
 {
-	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	char *buf = NULL;
-	uint32_t len = 0, bytes = 0;
+	uint32_t len = 0;
 
 	if (!data)
 		return -1;
@@ -244,22 +292,19 @@ static int fdr_send_plist(fdr_client_t fdr, plist_t data)
 	debug("FDR sending %d bytes:\n", len);
 	if (idevicerestore_debug)
 		debug_plist(data);
-	device_error = idevice_connection_send(fdr->connection, (char *)&len, sizeof(len), &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != sizeof(len)) {
-		error("ERROR: FDR unable to send data length. (%d) Sent %u of %u bytes.\n",
-		      device_error, bytes, (uint32_t)sizeof(len));
-		free(buf);
-		return -1;
-	}
-	device_error = idevice_connection_send(fdr->connection, buf, len, &bytes);
+	/* length prefix and body go out together */
+	struct conn_iovec iov[2] = {
+		{ &len, sizeof(len) },
+		{ buf, len }
+	};
+	int res = conn_writer_sendv(&fdr->writer, iov, 2);
 	free(buf);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
-		error("ERROR: FDR unable to send data (%d). Sent %u of %u bytes.\n",
-		      device_error, bytes, len);
+	if (res < 0) {
+		error("ERROR: FDR unable to send plist\n");
 		return -1;
 	}
 
-	debug("FDR Sent %d bytes\n", bytes);
+	debug("FDR Sent %d bytes\n", len);
 	return 0;
 }
 
@@ -272,24 +317,22 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 
 	debug("About to do ctrl handshake\n");
 
-	ctrlprotoversion = 2;
+	fdr->ctrlprotoversion = 2;
 
-	device_error = idevice_connection_send(fdr->connection, CTRLCMD, len, &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
+	if (conn_writer_send(&fdr->writer, CTRLCMD, len) < 0) {
 		debug("Hmm... looks like the device doesn't like the newer protocol, using the old one\n");
-		ctrlprotoversion = 1;
+		fdr->ctrlprotoversion = 1;
 		len = sizeof(HELLOCTRLCMD);
-		device_error = idevice_connection_send(fdr->connection, HELLOCTRLCMD, len, &bytes);
-		if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
-			error("ERROR: FDR unable to send BeginCtrl. Sent %u of %u bytes.\n", bytes, len);
+		if (conn_writer_send(&fdr->writer, HELLOCTRLCMD, len) < 0) {
+			error("ERROR: FDR unable to send BeginCtrl.\n");
 			return -1;
 		}
 	}
 
-	if (ctrlprotoversion == 2) {
+	if (fdr->ctrlprotoversion == 2) {
 		dict = plist_new_dict();
 		plist_dict_set_item(dict, "Command", plist_new_string(CTRLCMD));
-		plist_dict_set_item(dict, "CtrlProtoVersion", plist_new_uint(ctrlprotoversion));
+		plist_dict_set_item(dict, "CtrlProtoVersion", plist_new_uint(fdr->ctrlprotoversion));
 		res = fdr_send_plist(fdr, dict);
 		plist_free(dict);
 		if (res) {
@@ -305,7 +348,9 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 			debug_plist(dict);
 		node = plist_dict_get_item(dict, "ConnPort");
 		if (node && plist_get_node_type(node) == PLIST_UINT) {
+			uint64_t conn_port = 0;
 			plist_get_uint_val(node, &conn_port);
+			fdr->conn_port = (uint16_t)conn_port;
 		} else {
 			error("ERROR: Could not get FDR ConnPort value\n");
 			return -1;
@@ -337,10 +382,10 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 			return -1;
 		}
 
-		conn_port = le16toh(cport);
+		fdr->conn_port = le16toh(cport);
 	}
 
-	debug("Ctrl handshake done (ConnPort = %" PRIu64 ")\n", (uint64_t)conn_port);
+	debug("Ctrl handshake done (ConnPort = %u)\n", fdr->conn_port);
 
 	return 0;
 }
@@ -351,13 +396,12 @@ static int fdr_sync_handshake(fdr_client_t fdr)
 	uint32_t bytes = 0, len = sizeof(HELLOCMD);
 	plist_t reply;
 
-	device_error = idevice_connection_send(fdr->connection, HELLOCMD, len, &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
-		error("ERROR: FDR unable to send Hello. Sent %u of %u bytes.\n", bytes, len);
+	if (conn_writer_send(&fdr->writer, HELLOCMD, len) < 0) {
+		error("ERROR: FDR unable to send Hello.\n");
 		return -1;
 	}
 
-	if (ctrlprotoversion == 2) {
+	if (fdr->ctrlprotoversion == 2) {
 		if (fdr_receive_plist(fdr, &reply)) {
 			error("ERROR: FDR did not get HelloConn reply.\n");
 			return -1;
@@ -420,16 +464,23 @@ static int fdr_handle_sync_cmd(fdr_client_t fdr_ctrl)
 	uint32_t bytes = 0;
 	char buf[4096];
 
-	device_error = idevice_connection_receive(fdr_ctrl->connection, buf, sizeof(buf), &bytes);
+	device_error = idevice_connection_receive_timeout(fdr_ctrl->connection, buf, sizeof(buf), &bytes, fdr_ctrl->recv_timeout);
 	if (device_error != IDEVICE_E_SUCCESS || bytes != 2) {
 		error("ERROR: Unexpected data from FDR\n");
 		return -1;
 	}
 	/* Open a new connection and wait for messages on it */
-	if (fdr_connect(fdr_ctrl->device, FDR_CONN, &fdr)) {
+	if (fdr_connect_port(fdr_ctrl->device, FDR_CONN, fdr_ctrl->conn_port, fdr_ctrl->ctrlprotoversion, &fdr)) {
 		error("ERROR: Failed to connect to FDR port\n");
 		return -1;
 	}
+#ifndef WIN32
+	/* all connections share one relay, a thread of their own is only the fallback */
+	if (fdr_relay_add(fdr) == 0) {
+		debug("FDR %p connected in reply to sync message, handed to relay\n", fdr);
+		return 0;
+	}
+#endif
 	debug("FDR connected in reply to sync message, starting command thread\n");
 	res = thread_new(&fdr_thread, fdr_listener_thread, fdr);
 	if(res) {
@@ -488,20 +539,18 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 {
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	char *buf = NULL;
-	size_t bufsize = 1048576;
-	uint32_t sent = 0, bytes = 0;
+	uint32_t bufsize = (fdr->recv_buf) ? fdr->recv_bufsize : FDR_PROXY_BUFSIZE;
+	uint32_t bytes = 0;
 	char *host = NULL;
 	uint16_t port = 0;
 
-	buf = malloc(bufsize);
+	buf = fdr_receive_buffer(fdr, bufsize);
 	if (!buf) {
-		error("ERROR: %s: malloc failed\n", __func__);
 		return -1;
 	}
 
-	device_error = idevice_connection_receive(fdr->connection, buf, bufsize, &bytes);
+	device_error = idevice_connection_receive_timeout(fdr->connection, buf, bufsize, &bytes, fdr->recv_timeout);
 	if (device_error != IDEVICE_E_SUCCESS) {
-		free(buf);
 		error("ERROR: FDR %p failed to read data for proxy command\n", fdr);
 		return -1;
 	}
@@ -510,25 +559,22 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 	/* Just return success here unconditionally because we don't know
 	 * anything else and we will eventually abort on failure anyway */
 	uint16_t ack = 5;
-	device_error = idevice_connection_send(fdr->connection, (char *)&ack, sizeof(ack), &sent);
-	if (device_error != IDEVICE_E_SUCCESS || sent != sizeof(ack)) {
-		free(buf);
-		error("ERROR: FDR %p unable to send ack. Sent %u of %u bytes.\n",
-		      fdr, sent, (uint32_t)sizeof(ack));
-		return -1;
-	}
-
 	if (bytes < 3) {
-		debug("FDR %p proxy command data too short, retrying\n", fdr);
-		return fdr_poll_and_handle_message(fdr);
+		if (conn_writer_send(&fdr->writer, &ack, sizeof(ack)) < 0) {
+			error("ERROR: FDR %p unable to send ack.\n", fdr);
+			return -1;
+		}
+		debug("FDR %p proxy command data too short, waiting for the next command\n", fdr);
+		return 0;
 	}
 
-	/* ack command data too */
-	device_error = idevice_connection_send(fdr->connection, buf, bytes, &sent);
-	if (device_error != IDEVICE_E_SUCCESS || sent != bytes) {
-		free(buf);
-		error("ERROR: FDR %p unable to send data. Sent %u of %u bytes.\n",
-		      fdr, sent, bytes);
+	/* ack command data too, in the same send */
+	struct conn_iovec iov[2] = {
+		{ &ack, sizeof(ack) },
+		{ buf, bytes }
+	};
+	if (conn_writer_sendv(&fdr->writer, iov, 2) < 0) {
+		error("ERROR: FDR %p unable to send ack.\n", fdr);
 		return -1;
 	}
 
@@ -544,18 +590,41 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 
 	if (!host || !buf[2]) {
 		/* missing or zero length host name */
-		free(buf);
+		free(host);
 		return 0;
 	}
 
-	/* else wait for messages and forward them */
+	if (fdr->defer_connect) {
+		/* the relay connects without holding up the other connections */
+		free(fdr->proxy_host);
+		fdr->proxy_host = host;
+		fdr->proxy_port = port;
+		return 0;
+	}
+
+	/* the data is forwarded by whoever polls this connection */
 	int sockfd = socket_connect(host, port);
 	free(host);
 	if (sockfd < 0) {
-		free(buf);
 		error("ERROR: Failed to connect socket: %s\n", strerror(errno));
 		return -1;
 	}
+	fdr->proxy_fd = sockfd;
+	return 0;
+}
+
+/* forwards in both directions until one side closes, for connections that have a thread of their own */
+static int fdr_proxy_relay(fdr_client_t fdr)
+{
+	idevice_error_t device_error = IDEVICE_E_SUCCESS;
+	uint32_t bufsize = FDR_PROXY_BUFSIZE;
+	uint32_t sent = 0, bytes = 0;
+	int sockfd = fdr->proxy_fd;
+
+	char *buf = conn_writer_scratch(&fdr->writer, bufsize);
+	if (!buf) {
+		return -1;
+	}
 
 	int res = 0, bytes_ret;
 	while (1) {
@@ -587,7 +656,6 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 			}
 			if (sent != bytes) {
 				error("ERROR: Sending proxy payload failed: %s. Sent %u of %u bytes. \n", strerror(errno), sent, bytes);
-				socket_close(sockfd);
 				res = -1;
 				break;
 			}
@@ -609,23 +677,427 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 			debug("FDR %p Received %u bytes reply data,%s sending to device\n",
 			      fdr, bytes, (bytes ? "" : " not"));
 
-			sent = 0;
-			while (sent < bytes) {
-				uint32_t s;
-				device_error = idevice_connection_send(fdr->connection, buf + sent, bytes - sent, &s);
-				if (device_error != IDEVICE_E_SUCCESS) {
-					break;
-				}
-				sent += s;
-			}
-			if (device_error != IDEVICE_E_SUCCESS || bytes != sent) {
-				error("ERROR: FDR %p unable to send data (%d). Sent %u of %u bytes.\n", fdr, device_error, sent, bytes);
+			if (conn_writer_send(&fdr->writer, buf, bytes) < 0) {
+				error("ERROR: FDR %p unable to relay proxy reply to device\n", fdr);
 				res = -1;
 				break;
 			}
-		} else serial++;
+		} else fdr->serial++;
 	}
 	socket_close(sockfd);
-	free(buf);
+	fdr->proxy_fd = -1;
 	return res;
 }
+
+#ifndef WIN32
+/* FDR data connections of all devices are served by a single thread that
+ * polls them together with the sockets they proxy to. It runs while there
+ * are connections and is started again by the next one. */
+
+#define FDR_RELAY_BUFSIZE 0x10000
+#define FDR_RELAY_POOL_SIZE 32
+/* commands are only received once poll() saw them arrive */
+#define FDR_RELAY_RECV_TIMEOUT 1000
+/* fdr_relay_service() result for a session that has to connect its proxy socket */
+#define FDR_RELAY_CONNECT 2
+
+struct fdr_relay_session {
+	fdr_client_t fdr;
+	int dev_fd;
+	/* payload from the device the socket didn't take yet */
+	char* pending;
+	uint32_t pending_len;
+	uint32_t pending_off;
+	/* reply data the device didn't take yet */
+	char* out;
+	uint32_t out_len;
+	uint32_t out_off;
+	/* the device hung up, what it sent before is still delivered */
+	int dev_closed;
+	int connect_failed;
+	struct fdr_relay_session* next;
+};
+
+struct fdr_relay {
+	mutex_t mutex;
+	int wakeup[2];
+	int running;
+	/* added by fdr_relay_queue(), picked up by the relay thread */
+	struct fdr_relay_session* incoming;
+	/* everything below is only used by the relay thread */
+	struct fdr_relay_session* sessions;
+	char* pool[FDR_RELAY_POOL_SIZE];
+	int pool_count;
+	struct pollfd* pfds;
+	int max_pfds;
+};
+
+static struct fdr_relay fdr_relay;
+static thread_once_t fdr_relay_once = THREAD_ONCE_INIT;
+static int fdr_relay_available = 0;
+
+static void fdr_relay_init(void)
+{
+	memset(&fdr_relay, 0, sizeof(fdr_relay));
+	mutex_init(&fdr_relay.mutex);
+	if (pipe(fdr_relay.wakeup) != 0) {
+		error("ERROR: FDR relay: Unable to create pipe: %s\n", strerror(errno));
+		return;
+	}
+	fcntl(fdr_relay.wakeup[0], F_SETFL, fcntl(fdr_relay.wakeup[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fdr_relay.wakeup[1], F_SETFL, fcntl(fdr_relay.wakeup[1], F_GETFL) | O_NONBLOCK);
+	fdr_relay_available = 1;
+}
+
+/* buffers are only held while data is in flight, they go back to the pool once it is delivered */
+static char* fdr_relay_get_buffer(void)
+{
+	if (fdr_relay.pool_count > 0) {
+		return fdr_relay.pool[--fdr_relay.pool_count];
+	}
+	char* buf = (char*)malloc(FDR_RELAY_BUFSIZE);
+	if (!buf) {
+		error("ERROR: FDR relay: Out of memory\n");
+	}
+	return buf;
+}
+
+static void fdr_relay_put_buffer(char* buf)
+{
+	if (!buf) {
+		return;
+	}
+	if (fdr_relay.pool_count < FDR_RELAY_POOL_SIZE) {
+		fdr_relay.pool[fdr_relay.pool_count++] = buf;
+	} else {
+		free(buf);
+	}
+}
+
+static void fdr_relay_close(struct fdr_relay_session* s)
+{
+	debug("FDR %p terminating...\n", s->fdr);
+	fdr_relay_put_buffer(s->pending);
+	fdr_relay_put_buffer(s->out);
+	fdr_free(s->fdr);
+	free(s);
+}
+
+/* Hands a session to the relay thread, starting it if it isn't running */
+static int fdr_relay_queue(struct fdr_relay_session* s)
+{
+	mutex_lock(&fdr_relay.mutex);
+	if (!fdr_relay.running) {
+		THREAD_T relay_thread = THREAD_T_NULL;
+		if (thread_new(&relay_thread, fdr_relay_thread, NULL) != 0) {
+			mutex_unlock(&fdr_relay.mutex);
+			error("ERROR: Failed to start FDR relay thread\n");
+			return -1;
+		}
+		thread_detach(relay_thread);
+		fdr_relay.running = 1;
+	}
+	s->next = fdr_relay.incoming;
+	fdr_relay.incoming = s;
+	mutex_unlock(&fdr_relay.mutex);
+
+	char c = 0;
+	if (write(fdr_relay.wakeup[1], &c, 1) < 0) {
+		/* the pipe is full, so a wakeup is pending anyway */
+	}
+	return 0;
+}
+
+/* Name resolution and connect can take long, so they happen here while the
+ * relay serves the others. The session comes back through fdr_relay_queue(). */
+static void* fdr_relay_connect_thread(void* arg)
+{
+	struct fdr_relay_session* s = (struct fdr_relay_session*)arg;
+	fdr_client_t fdr = s->fdr;
+
+	idevicerestore_log_set_ecid(fdr->log_ecid);
+	int sockfd = socket_connect(fdr->proxy_host, fdr->proxy_port);
+	if (sockfd < 0) {
+		error("ERROR: Failed to connect socket: %s\n", strerror(errno));
+		s->connect_failed = 1;
+	} else {
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+		fdr->proxy_fd = sockfd;
+	}
+	free(fdr->proxy_host);
+	fdr->proxy_host = NULL;
+
+	if (fdr_relay_queue(s) < 0) {
+		/* a connecting session holds no pooled buffers */
+		fdr_free(fdr);
+		free(s);
+	}
+	return NULL;
+}
+
+static void fdr_relay_connect(struct fdr_relay_session* s)
+{
+	THREAD_T connect_thread = THREAD_T_NULL;
+	if (thread_new(&connect_thread, fdr_relay_connect_thread, s) == 0) {
+		thread_detach(connect_thread);
+		return;
+	}
+	/* no thread, connect right here */
+	fdr_relay_connect_thread(s);
+}
+
+/* returns non-zero when the session is done, FDR_RELAY_CONNECT when it has to connect first */
+static int fdr_relay_service(struct fdr_relay_session* s, short dev_revents, short sock_revents)
+{
+	fdr_client_t fdr = s->fdr;
+
+	if (s->connect_failed) {
+		return -1;
+	}
+
+	if (fdr->proxy_fd < 0) {
+		/* waiting for a command */
+		if (!dev_revents) {
+			return 0;
+		}
+		fdr->recv_buf = fdr_relay_get_buffer();
+		if (!fdr->recv_buf) {
+			return -1;
+		}
+		fdr->recv_bufsize = FDR_RELAY_BUFSIZE;
+		int res = fdr_poll_and_handle_message(fdr);
+		fdr_relay_put_buffer(fdr->recv_buf);
+		fdr->recv_buf = NULL;
+		fdr->recv_bufsize = 0;
+		if (res != 0) {
+			return 1;
+		}
+		return (fdr->proxy_host) ? FDR_RELAY_CONNECT : 0;
+	}
+
+	/* The payload is plain bytes on the device socket, so both sides are
+	 * read and written directly without blocking. Device to socket: the
+	 * next payload is read once the socket took the last one. */
+	if (!s->dev_closed && s->pending_len == 0 && (dev_revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+		if (!s->pending) {
+			s->pending = fdr_relay_get_buffer();
+			if (!s->pending) {
+				return -1;
+			}
+		}
+		ssize_t r = recv(s->dev_fd, s->pending, FDR_RELAY_BUFSIZE, MSG_DONTWAIT);
+		if (r > 0) {
+			debug("FDR %p got payload of %u bytes, now try to proxy it\n", fdr, (uint32_t)r);
+			s->pending_len = (uint32_t)r;
+			s->pending_off = 0;
+		} else if (r == 0 || errno == ECONNRESET) {
+			s->dev_closed = 1;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			error("ERROR: FDR %p Unable to receive proxy payload: %s\n", fdr, strerror(errno));
+			return -1;
+		}
+	}
+	while (s->pending_off < s->pending_len) {
+		ssize_t r = send(fdr->proxy_fd, s->pending + s->pending_off, s->pending_len - s->pending_off, 0);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+			error("ERROR: Sending proxy payload failed: %s. Sent %u of %u bytes. \n", strerror(errno), s->pending_off, s->pending_len);
+			return -1;
+		}
+		s->pending_off += (uint32_t)r;
+	}
+	if (s->pending && s->pending_off == s->pending_len) {
+		s->pending_len = 0;
+		s->pending_off = 0;
+		fdr_relay_put_buffer(s->pending);
+		s->pending = NULL;
+	}
+	if (s->dev_closed && s->pending_len == 0) {
+		return 1;
+	}
+
+	/* socket to device, the next reply is read once the device took the last one */
+	if (s->out_len == 0 && (sock_revents & (POLLIN | POLLHUP | POLLERR))) {
+		if (!s->out) {
+			s->out = fdr_relay_get_buffer();
+			if (!s->out) {
+				return -1;
+			}
+		}
+		ssize_t r = recv(fdr->proxy_fd, s->out, FDR_RELAY_BUFSIZE, 0);
+		if (r == 0) {
+			return 1;
+		}
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return 0;
+			}
+			if (errno == ECONNRESET) {
+				return 1;
+			}
+			error("ERROR: FDR %p receiving proxy payload failed: %d (%s)\n", fdr, errno, strerror(errno));
+			return -1;
+		}
+		debug("FDR %p Received %u bytes reply data, sending to device\n", fdr, (uint32_t)r);
+		s->out_len = (uint32_t)r;
+		s->out_off = 0;
+	}
+	while (s->out_off < s->out_len) {
+		ssize_t r = send(s->dev_fd, s->out + s->out_off, s->out_len - s->out_off, MSG_DONTWAIT);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+			error("ERROR: FDR %p unable to relay proxy reply to device: %s\n", fdr, strerror(errno));
+			return -1;
+		}
+		s->out_off += (uint32_t)r;
+	}
+	if (s->out && s->out_off == s->out_len) {
+		s->out_len = 0;
+		s->out_off = 0;
+		fdr_relay_put_buffer(s->out);
+		s->out = NULL;
+	}
+	return 0;
+}
+
+static void* fdr_relay_thread(void* arg)
+{
+	struct fdr_relay_session* s;
+	struct fdr_relay_session** link;
+
+	while (1) {
+		mutex_lock(&fdr_relay.mutex);
+		while (fdr_relay.incoming) {
+			s = fdr_relay.incoming;
+			fdr_relay.incoming = s->next;
+			s->next = fdr_relay.sessions;
+			fdr_relay.sessions = s;
+		}
+		if (!fdr_relay.sessions) {
+			/* stop with the lock held, so fdr_relay_queue() starts a new thread only after this one cleaned up */
+			break;
+		}
+		mutex_unlock(&fdr_relay.mutex);
+
+		/* the wakeup pipe, then the device connection and the proxy socket of every session */
+		int num = 1;
+		for (s = fdr_relay.sessions; s; s = s->next) {
+			num += 2;
+		}
+		if (num > fdr_relay.max_pfds) {
+			struct pollfd* pfds = (struct pollfd*)realloc(fdr_relay.pfds, num * sizeof(struct pollfd));
+			if (!pfds) {
+				error("ERROR: FDR relay: Out of memory\n");
+				mutex_lock(&fdr_relay.mutex);
+				break;
+			}
+			fdr_relay.pfds = pfds;
+			fdr_relay.max_pfds = num;
+		}
+		struct pollfd* pfd = fdr_relay.pfds;
+		pfd->fd = fdr_relay.wakeup[0];
+		pfd->events = POLLIN;
+		pfd->revents = 0;
+		pfd++;
+		for (s = fdr_relay.sessions; s; s = s->next) {
+			/* only what can be acted on is polled, poll() skips negative fds */
+			pfd->events = ((s->pending_len == 0) ? POLLIN : 0) | ((s->out_len > 0) ? POLLOUT : 0);
+			pfd->fd = (s->dev_closed || !pfd->events) ? -1 : s->dev_fd;
+			pfd->revents = 0;
+			pfd++;
+			pfd->events = ((s->out_len == 0) ? POLLIN : 0) | ((s->pending_len > 0) ? POLLOUT : 0);
+			pfd->fd = (s->fdr->proxy_fd < 0 || !pfd->events) ? -1 : s->fdr->proxy_fd;
+			pfd->revents = 0;
+			pfd++;
+		}
+
+		if (poll(fdr_relay.pfds, num, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error("ERROR: FDR relay: poll failed: %s\n", strerror(errno));
+			mutex_lock(&fdr_relay.mutex);
+			break;
+		}
+		if (fdr_relay.pfds[0].revents) {
+			char drain[64];
+			while (read(fdr_relay.wakeup[0], drain, sizeof(drain)) > 0);
+		}
+
+		pfd = fdr_relay.pfds + 1;
+		link = &fdr_relay.sessions;
+		while ((s = *link)) {
+			short dev_revents = (pfd[0].fd >= 0) ? pfd[0].revents : 0;
+			short sock_revents = (pfd[1].fd >= 0) ? pfd[1].revents : 0;
+			/* the relay serves every device, so the tag follows the session */
+			idevicerestore_log_set_ecid(s->fdr->log_ecid);
+			int res = fdr_relay_service(s, dev_revents, sock_revents);
+			if (res == FDR_RELAY_CONNECT) {
+				/* the connect thread owns the session until it is queued again */
+				*link = s->next;
+				fdr_relay_connect(s);
+			} else if (res != 0) {
+				*link = s->next;
+				fdr_relay_close(s);
+			} else {
+				link = &s->next;
+			}
+			pfd += 2;
+		}
+		idevicerestore_log_set_ecid(0);
+	}
+
+	/* sessions are only left over if poll failed or memory ran out */
+	while (fdr_relay.incoming) {
+		s = fdr_relay.incoming;
+		fdr_relay.incoming = s->next;
+		s->next = fdr_relay.sessions;
+		fdr_relay.sessions = s;
+	}
+	while ((s = fdr_relay.sessions)) {
+		fdr_relay.sessions = s->next;
+		fdr_relay_close(s);
+	}
+	while (fdr_relay.pool_count > 0) {
+		free(fdr_relay.pool[--fdr_relay.pool_count]);
+	}
+	free(fdr_relay.pfds);
+	fdr_relay.pfds = NULL;
+	fdr_relay.max_pfds = 0;
+	fdr_relay.running = 0;
+	mutex_unlock(&fdr_relay.mutex);
+	return NULL;
+}
+
+static int fdr_relay_add(fdr_client_t fdr)
+{
+	thread_once(&fdr_relay_once, fdr_relay_init);
+	if (!fdr_relay_available) {
+		return -1;
+	}
+
+	struct fdr_relay_session* s = (struct fdr_relay_session*)calloc(1, sizeof(struct fdr_relay_session));
+	if (!s) {
+		return -1;
+	}
+	if (idevice_connection_get_fd(fdr->connection, &s->dev_fd) != IDEVICE_E_SUCCESS || s->dev_fd < 0) {
+		free(s);
+		return -1;
+	}
+	s->fdr = fdr;
+	fdr->recv_timeout = FDR_RELAY_RECV_TIMEOUT;
+	fdr->defer_connect = 1;
+
+	if (fdr_relay_queue(s) < 0) {
+		fdr->recv_timeout = FDR_RECV_TIMEOUT;
+		fdr->defer_connect = 0;
+		free(s);
+		return -1;
+	}
+	return 0;
+}
+#endif
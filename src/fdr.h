@@ -28,6 +28,8 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 
+#include "conn_writer.h"
+
 typedef enum {
 	FDR_CTRL,
 	FDR_CONN
@@ -37,6 +39,25 @@ struct fdr_client {
 	idevice_connection_t connection;
 	idevice_t device;
 	fdr_type_t type;
+	/* negotiated by the control channel and inherited by its connections */
+	uint16_t conn_port;
+	int ctrlprotoversion;
+	int serial;
+	/* socket of the proxy connection being relayed, -1 if there is none */
+	int proxy_fd;
+	/* how long a message may take to arrive once it started */
+	unsigned int recv_timeout;
+	/* commands are received here if set, into the writer's scratch buffer otherwise */
+	char* recv_buf;
+	uint32_t recv_bufsize;
+	/* connect requests only record the target, whoever serves the
+	 * connection opens the socket */
+	int defer_connect;
+	char* proxy_host;
+	uint16_t proxy_port;
+	/* log tag of the thread that connected, for the threads serving it */
+	uint64_t log_ecid;
+	struct conn_writer writer;
 };
 typedef struct fdr_client *fdr_client_t;
 
@@ -0,0 +1,405 @@
+/*
+ * fs_cache.c
+ * Shared cache of extracted root filesystems
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_CLONEFILE
+#include <sys/clonefile.h>
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "fs_cache.h"
+#include "locking.h"
+#include "common.h"
+
+/* how often a reader checks for more data of an extraction in progress */
+#define FS_CACHE_POLL_INTERVAL 100000
+/* how long a reader waits for an extraction to create its file */
+#define FS_CACHE_OPEN_TRIES 100
+
+/* fcntl() locks are per process, the extractions of this process are
+ * tracked here so other threads do not take or release their locks */
+struct fs_cache_extraction {
+	char* path;
+	struct fs_cache_extraction* next;
+};
+
+static thread_once_t fs_cache_once = THREAD_ONCE_INIT;
+static mutex_t fs_cache_mutex;
+static struct fs_cache_extraction* fs_cache_extractions = NULL;
+
+static void fs_cache_init(void)
+{
+	mutex_init(&fs_cache_mutex);
+}
+
+/* must be called with fs_cache_mutex held */
+static struct fs_cache_extraction** fs_cache_find_extraction(const char* path)
+{
+	struct fs_cache_extraction** pe = &fs_cache_extractions;
+	while (*pe && strcmp((*pe)->path, path) != 0) {
+		pe = &(*pe)->next;
+	}
+	return pe;
+}
+
+/* takes the extraction lock for path, fails if somebody else holds it */
+static int fs_cache_claim(const char* path, const char* lock_path, lock_info_t* li)
+{
+	int res = -1;
+	thread_once(&fs_cache_once, fs_cache_init);
+	mutex_lock(&fs_cache_mutex);
+	if (*fs_cache_find_extraction(path) == NULL && try_lock_file(lock_path, li) == 0) {
+		struct fs_cache_extraction* e = (struct fs_cache_extraction*)calloc(1, sizeof(struct fs_cache_extraction));
+		if (e) {
+			e->path = strdup(path);
+		}
+		if (e && e->path) {
+			e->next = fs_cache_extractions;
+			fs_cache_extractions = e;
+			res = 0;
+		} else {
+			free(e);
+			unlock_file(li);
+		}
+	}
+	mutex_unlock(&fs_cache_mutex);
+	return res;
+}
+
+static void fs_cache_release(const char* path, lock_info_t* li)
+{
+	mutex_lock(&fs_cache_mutex);
+	struct fs_cache_extraction** pe = fs_cache_find_extraction(path);
+	if (*pe) {
+		struct fs_cache_extraction* e = *pe;
+		*pe = e->next;
+		free(e->path);
+		free(e);
+	}
+	unlock_file(li);
+	mutex_unlock(&fs_cache_mutex);
+}
+
+static int fs_cache_busy(const char* path, const char* lock_path)
+{
+	int busy = 1;
+	thread_once(&fs_cache_once, fs_cache_init);
+	mutex_lock(&fs_cache_mutex);
+	if (*fs_cache_find_extraction(path) == NULL) {
+		lock_info_t li;
+		if (try_lock_file(lock_path, &li) == 0) {
+			unlock_file(&li);
+			busy = 0;
+		}
+	}
+	mutex_unlock(&fs_cache_mutex);
+	return busy;
+}
+
+static int fs_cache_complete(const char* path, uint64_t size)
+{
+	struct stat fst;
+	return (stat(path, &fst) == 0 && (uint64_t)fst.st_size == size);
+}
+
+/* Makes dst the same file as src without copying the data */
+static int fs_cache_share(const char* src, const char* dst)
+{
+#ifdef WIN32
+	if (CreateHardLinkA(dst, src, NULL)) {
+		return 0;
+	}
+#else
+	if (link(src, dst) == 0) {
+		return 0;
+	}
+#endif
+#if defined(__linux__) && defined(FICLONE)
+	int in = open(src, O_RDONLY);
+	if (in >= 0) {
+		int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (out >= 0) {
+			int res = ioctl(out, FICLONE, in);
+			close(out);
+			if (res == 0) {
+				close(in);
+				return 0;
+			}
+			unlink(dst);
+		}
+		close(in);
+	}
+#elif defined(HAVE_CLONEFILE)
+	if (clonefile(src, dst, 0) == 0) {
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+static char* fs_cache_name(ipsw_archive_t ipsw, plist_t build_identity, const char* fsname, uint64_t size)
+{
+	char key[128];
+	plist_t node = plist_access_path(build_identity, 3, "Manifest", "OS", "Digest");
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
+		char* digest = NULL;
+		uint64_t len = 0;
+		plist_get_data_val(node, &digest, &len);
+		if (!digest || len == 0 || len > 48) {
+			free(digest);
+			return NULL;
+		}
+		uint64_t i;
+		for (i = 0; i < len; i++) {
+			sprintf(key + i*2, "%02x", (unsigned char)digest[i]);
+		}
+		free(digest);
+	} else {
+		uint32_t crc = 0;
+		if (ipsw_get_file_crc(ipsw, fsname, &crc) < 0) {
+			return NULL;
+		}
+		snprintf(key, sizeof(key), "crc32-%08x", crc);
+	}
+
+	const char* ext = strrchr(fsname, '.');
+	if (!ext || strchr(ext, '/') || strlen(ext) > 8) {
+		ext = "";
+	}
+	char* name = (char*)malloc(strlen(key) + 22 + strlen(ext) + 1);
+	if (name) {
+		sprintf(name, "%s-%" PRIu64 "%s", key, size, ext);
+	}
+	return name;
+}
+
+static char* fs_cache_path_with_suffix(const char* path, const char* suffix)
+{
+	char* res = (char*)malloc(strlen(path) + strlen(suffix) + 1);
+	if (res) {
+		strcpy(res, path);
+		strcat(res, suffix);
+	}
+	return res;
+}
+
+int fs_cache_get(const char* cache_dir, ipsw_archive_t ipsw, plist_t build_identity, const char* fsname, const char* link_path, char** path)
+{
+	if (!cache_dir || !ipsw || !fsname || !path) {
+		return -1;
+	}
+	*path = NULL;
+
+	uint64_t fssize = 0;
+	if (ipsw_get_file_size(ipsw, fsname, &fssize) < 0 || fssize == 0) {
+		return -1;
+	}
+	char* name = fs_cache_name(ipsw, build_identity, fsname, fssize);
+	if (!name) {
+		debug("DEBUG: %s: no key for %s, not caching it\n", __func__, fsname);
+		return -1;
+	}
+	char* cached = (char*)malloc(strlen(cache_dir) + 13 + strlen(name) + 1);
+	if (!cached) {
+		free(name);
+		return -1;
+	}
+	sprintf(cached, "%s/filesystems", cache_dir);
+	mkdir_with_parents(cached, 0755);
+	strcat(cached, "/");
+	strcat(cached, name);
+	free(name);
+	char* lock_path = fs_cache_path_with_suffix(cached, ".lock");
+	char* extract_path = fs_cache_path_with_suffix(cached, ".extract");
+	if (!lock_path || !extract_path) {
+		free(lock_path);
+		free(extract_path);
+		free(cached);
+		return -1;
+	}
+
+	int res = -1;
+	if (fs_cache_complete(cached, fssize)) {
+		info("Using cached filesystem from '%s'\n", cached);
+		res = 0;
+	} else if (link_path && fs_cache_complete(link_path, fssize)) {
+		/* extracted for this IPSW before, move it where other builds find it */
+		remove(cached);
+		if (fs_cache_share(link_path, cached) == 0 || rename(link_path, cached) == 0) {
+			info("Using cached filesystem from '%s'\n", cached);
+			res = 0;
+		}
+	}
+
+	if (res < 0) {
+		ipsw_file_handle_t fsfile = ipsw_file_open(ipsw, fsname);
+		int seekable = ipsw_file_is_seekable(fsfile);
+		ipsw_file_close(fsfile);
+		if (fsfile && !seekable) {
+			lock_info_t li;
+			if (fs_cache_claim(cached, lock_path, &li) == 0) {
+				if (fs_cache_complete(cached, fssize)) {
+					/* somebody finished it in the meantime */
+					res = 0;
+				} else {
+					info("Extracting filesystem from IPSW: %s\n", fsname);
+					if (ipsw_extract_to_file_with_progress(ipsw, fsname, extract_path, 1) == 0 && fs_cache_complete(extract_path, fssize)) {
+						remove(cached);
+						if (rename(extract_path, cached) == 0) {
+							res = 0;
+						}
+					}
+					if (res < 0) {
+						error("ERROR: Unable to extract filesystem from IPSW\n");
+						remove(extract_path);
+						res = -2;
+					}
+				}
+				fs_cache_release(cached, &li);
+			} else {
+				info("Filesystem %s is being extracted by another process, it will be read while it is written\n", fsname);
+				res = 0;
+			}
+		}
+	}
+
+	if (res == 0 && link_path && !fs_cache_complete(link_path, fssize) && fs_cache_complete(cached, fssize)) {
+		remove(link_path);
+		if (fs_cache_share(cached, link_path) < 0) {
+			debug("DEBUG: %s: unable to link %s to %s\n", __func__, link_path, cached);
+		}
+	}
+
+	free(lock_path);
+	free(extract_path);
+	if (res == 0) {
+		*path = cached;
+	} else {
+		free(cached);
+	}
+	return res;
+}
+
+struct fs_cache_reader {
+	char* path;
+	char* lock_path;
+	int stalls;
+};
+
+static void fs_cache_reader_free(void* userdata)
+{
+	struct fs_cache_reader* reader = (struct fs_cache_reader*)userdata;
+	if (!reader) {
+		return;
+	}
+	free(reader->path);
+	free(reader->lock_path);
+	free(reader);
+}
+
+static int fs_cache_reader_wait(void* userdata)
+{
+	struct fs_cache_reader* reader = (struct fs_cache_reader*)userdata;
+	struct stat fst;
+	if (stat(reader->path, &fst) == 0) {
+		/* renamed, so all of the data has been written */
+		return (reader->stalls++ < 1) ? 0 : -1;
+	}
+	if (!fs_cache_busy(reader->path, reader->lock_path)) {
+		/* the extraction might have finished right now, otherwise it failed */
+		return (stat(reader->path, &fst) == 0) ? 0 : -1;
+	}
+	__usleep(FS_CACHE_POLL_INTERVAL);
+	return 0;
+}
+
+ipsw_file_handle_t fs_cache_open(const char* path, uint64_t size)
+{
+	if (!path) {
+		return NULL;
+	}
+
+	struct stat fst;
+	if (stat(path, &fst) == 0) {
+		return ipsw_file_open(NULL, path);
+	}
+
+	struct fs_cache_reader* reader = (struct fs_cache_reader*)calloc(1, sizeof(struct fs_cache_reader));
+	if (!reader) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	reader->path = strdup(path);
+	reader->lock_path = fs_cache_path_with_suffix(path, ".lock");
+	char* extract_path = fs_cache_path_with_suffix(path, ".extract");
+	if (!reader->path || !reader->lock_path || !extract_path) {
+		free(extract_path);
+		fs_cache_reader_free(reader);
+		return NULL;
+	}
+
+	ipsw_file_handle_t handle = NULL;
+	int tries;
+	for (tries = 0; tries < FS_CACHE_OPEN_TRIES; tries++) {
+		int busy = fs_cache_busy(path, reader->lock_path);
+		if (stat(path, &fst) == 0) {
+			handle = ipsw_file_open(NULL, path);
+			break;
+		}
+		if (!busy) {
+			break;
+		}
+		if (stat(extract_path, &fst) == 0) {
+			debug("DEBUG: %s: reading %s while it is extracted\n", __func__, extract_path);
+			handle = ipsw_file_open_growing(extract_path, size, fs_cache_reader_wait, reader, fs_cache_reader_free);
+			if (handle) {
+				reader = NULL;
+			}
+			break;
+		}
+		__usleep(FS_CACHE_POLL_INTERVAL);
+	}
+	if (!handle) {
+		error("ERROR: Unable to open filesystem %s\n", path);
+	}
+
+	free(extract_path);
+	fs_cache_reader_free(reader);
+	return handle;
+}
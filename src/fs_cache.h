@@ -0,0 +1,52 @@
+/*
+ * fs_cache.h
+ * Shared cache of extracted root filesystems (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef IDEVICERESTORE_FS_CACHE_H
+#define IDEVICERESTORE_FS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+#include "ipsw.h"
+
+/* Extracted filesystems are kept in <cache_dir>/filesystems, named after the
+ * Digest of the OS component (or the CRC of the zip entry), so builds with
+ * the same DMG share one file. link_path, the per-IPSW location used so far,
+ * is adopted if it holds a complete copy and is shared with the cached file
+ * otherwise. Returns 0 with *path set to the cached file, which is either
+ * complete or still being extracted by another process, see fs_cache_open().
+ * Returns -1 if the filesystem is not cached and should not be extracted,
+ * e.g. because it can be streamed directly from the IPSW, and -2 if the
+ * extraction failed. */
+int fs_cache_get(const char* cache_dir, ipsw_archive_t ipsw, plist_t build_identity, const char* fsname, const char* link_path, char** path);
+
+/* Opens a filesystem returned by fs_cache_get() (or any other file), reads
+ * wait for the data of an extraction that is still in progress. */
+ipsw_file_handle_t fs_cache_open(const char* path, uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
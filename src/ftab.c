@@ -45,8 +45,18 @@ int ftab_parse(unsigned char *data, unsigned int data_size, ftab_t *ftab, uint32
 		return -1;
 	}
 
+	uint32_t num_entries = le32toh(hdr_ptr->num_entries);
+	if (num_entries > (data_size - sizeof(struct ftab_header)) / sizeof(struct ftab_entry)) {
+		error("ERROR: %s: Buffer too small for %u ftab entries\n", __func__, num_entries);
+		return -1;
+	}
+
 	/* copy header */
 	ftab_t ftab_new = (ftab_t)calloc(1, sizeof(struct ftab_fmt));
+	if (!ftab_new) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		return -1;
+	}
 	memcpy(&ftab_new->header, data, sizeof(struct ftab_header));
 
 	ftab_new->header.always_01 = le32toh(ftab_new->header.always_01);
@@ -56,24 +66,29 @@ int ftab_parse(unsigned char *data, unsigned int data_size, ftab_t *ftab, uint32
 		*tag = ftab_new->header.tag;
 	}
 	ftab_new->header.magic = be32toh(ftab_new->header.magic);
-	ftab_new->header.num_entries = le32toh(ftab_new->header.num_entries);
-
-	/* copy entries */
-	ftab_new->entries = (struct ftab_entry*)malloc(sizeof(struct ftab_entry) * ftab_new->header.num_entries);
-	memcpy(ftab_new->entries, data + sizeof(struct ftab_header), sizeof(struct ftab_entry) * ftab_new->header.num_entries);
+	ftab_new->header.num_entries = num_entries;
 
-	/* create data storage */
-	ftab_new->storage = (unsigned char**)calloc(ftab_new->header.num_entries, sizeof(unsigned char*));
+	/* entries and data pointers in one allocation */
+	ftab_new->entries = (struct ftab_entry*)malloc((sizeof(struct ftab_entry) + sizeof(unsigned char*)) * (num_entries + 1));
+	if (!ftab_new->entries) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		free(ftab_new);
+		return -1;
+	}
+	memcpy(ftab_new->entries, data + sizeof(struct ftab_header), sizeof(struct ftab_entry) * num_entries);
+	ftab_new->storage = (unsigned char**)(ftab_new->entries + num_entries + 1);
 
-	/* fill data storage */
 	uint32_t i = 0;
-	for (i = 0; i < ftab_new->header.num_entries; i++) {
+	for (i = 0; i < num_entries; i++) {
 		ftab_new->entries[i].tag = be32toh(ftab_new->entries[i].tag);
 		ftab_new->entries[i].offset = le32toh(ftab_new->entries[i].offset);
 		ftab_new->entries[i].size = le32toh(ftab_new->entries[i].size);
-
-		ftab_new->storage[i] = malloc(ftab_new->entries[i].size);
-		memcpy(ftab_new->storage[i], data + ftab_new->entries[i].offset, ftab_new->entries[i].size);
+		if (ftab_new->entries[i].offset > data_size || ftab_new->entries[i].size > data_size - ftab_new->entries[i].offset) {
+			error("ERROR: %s: ftab entry %u is out of bounds\n", __func__, i);
+			ftab_free(ftab_new);
+			return -1;
+		}
+		ftab_new->storage[i] = data + ftab_new->entries[i].offset;
 	}
 
 	*ftab = ftab_new;
@@ -105,29 +120,23 @@ int ftab_add_entry(ftab_t ftab, uint32_t tag, unsigned char *data, unsigned int
 		return -1;
 	}
 
-	uint32_t new_index = ftab->header.num_entries;
-	struct ftab_entry *new_entries = realloc(ftab->entries, sizeof(struct ftab_entry) * (ftab->header.num_entries + 1));
+	uint32_t num_entries = ftab->header.num_entries;
+	struct ftab_entry *new_entries = (struct ftab_entry*)malloc((sizeof(struct ftab_entry) + sizeof(unsigned char*)) * (num_entries + 2));
 	if (!new_entries) {
-		error("ERROR: %s: realloc failed!\n", __func__);
+		error("ERROR: %s: Out of memory\n", __func__);
 		return -1;
 	}
+	unsigned char **new_storage = (unsigned char**)(new_entries + num_entries + 2);
+	memcpy(new_entries, ftab->entries, sizeof(struct ftab_entry) * num_entries);
+	memcpy(new_storage, ftab->storage, sizeof(unsigned char*) * num_entries);
+	free(ftab->entries);
 	ftab->entries = new_entries;
-	unsigned char **new_storage = realloc(ftab->storage, sizeof(unsigned char*) * (ftab->header.num_entries + 1));
-	if (!new_storage) {
-		error("ERROR: %s: realloc failed!\n", __func__);
-		return -1;
-	}
 	ftab->storage = new_storage;
 
-	unsigned char *data_copy = (unsigned char*)malloc(data_size);
-	if (!data_copy) {
-		return -1;
-	}
-	memcpy(data_copy, data, data_size);
-
-	ftab->storage[new_index] = data_copy;
-	ftab->entries[new_index].tag = tag;
-	ftab->entries[new_index].size = data_size;
+	ftab->storage[num_entries] = data;
+	ftab->entries[num_entries].tag = tag;
+	ftab->entries[num_entries].size = data_size;
+	ftab->entries[num_entries].pad_0x0C = 0;
 	ftab->header.num_entries++;
 
 	uint32_t off = sizeof(struct ftab_header) + sizeof(struct ftab_entry) * ftab->header.num_entries;
@@ -163,18 +172,34 @@ int ftab_write(ftab_t ftab, unsigned char **data, unsigned int *data_size)
 	ftab_header->magic = htobe32(ftab->header.magic);
 	ftab_header->num_entries = htole32(ftab->header.num_entries);
 
+	unsigned int off = sizeof(struct ftab_header) + (sizeof(struct ftab_entry) * ftab->header.num_entries);
 	for (i = 0; i < ftab->header.num_entries; i++) {
 		struct ftab_entry* entry = (struct ftab_entry*)(data_out + sizeof(struct ftab_header) + (sizeof(struct ftab_entry) * i));
 		entry->tag = htobe32(ftab->entries[i].tag);
-		entry->offset = htole32(ftab->entries[i].offset);
+		entry->offset = htole32(off);
 		entry->size = htole32(ftab->entries[i].size);
 		entry->pad_0x0C = 0;
+		off += ftab->entries[i].size;
 	}
 
+	/* entries that follow each other in their source are copied together */
 	unsigned char *p = data_out + sizeof(struct ftab_header) + (sizeof(struct ftab_entry) * ftab->header.num_entries);
+	const unsigned char *run = NULL;
+	unsigned int run_size = 0;
 	for (i = 0; i < ftab->header.num_entries; i++) {
-		memcpy(p, ftab->storage[i], ftab->entries[i].size);
-		p += ftab->entries[i].size;
+		if (run && run + run_size == ftab->storage[i]) {
+			run_size += ftab->entries[i].size;
+			continue;
+		}
+		if (run_size > 0) {
+			memcpy(p, run, run_size);
+			p += run_size;
+		}
+		run = ftab->storage[i];
+		run_size = ftab->entries[i].size;
+	}
+	if (run_size > 0) {
+		memcpy(p, run, run_size);
 	}
 
 	*data = data_out;
@@ -186,11 +211,7 @@ int ftab_write(ftab_t ftab, unsigned char **data, unsigned int *data_size)
 int ftab_free(ftab_t ftab)
 {
 	if (!ftab) return -1;
-	uint32_t i = 0;
-	for (i = 0; i < ftab->header.num_entries; i++) {
-		free(ftab->storage[i]);
-	}
-	free(ftab->storage);
+	/* storage is part of the entries allocation */
 	free(ftab->entries);
 	free(ftab);
 	return 0;
@@ -50,6 +50,8 @@ struct ftab_entry {
 	uint32_t pad_0x0C;
 };
 
+/* storage points into the parsed data and the buffers of added entries,
+ * nothing is copied until ftab_write() */
 struct ftab_fmt {
 	struct ftab_header header;
 	struct ftab_entry *entries;
@@ -58,9 +60,12 @@ struct ftab_fmt {
 
 typedef struct ftab_fmt *ftab_t;
 
+/* data must stay valid until the ftab is freed */
 int ftab_parse(unsigned char *data, unsigned int data_size, ftab_t *ftab, uint32_t *tag);
 int ftab_get_entry_ptr(ftab_t ftab, uint32_t tag, unsigned char **data, unsigned int *data_size);
+/* data is referenced, not copied, it must stay valid until the ftab is freed */
 int ftab_add_entry(ftab_t ftab, uint32_t tag, unsigned char *data, unsigned int data_size);
+/* Writes the ftab into an allocation of the exact size in one pass */
 int ftab_write(ftab_t ftab, unsigned char **data, unsigned int *data_size);
 int ftab_free(ftab_t ftab);
 
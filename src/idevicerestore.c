@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
 #include <getopt.h>
 #include <plist/plist.h>
 #include <zlib.h>
@@ -49,13 +50,24 @@
 #include "tss.h"
 #include "img3.h"
 #include "img4.h"
+#include "component_buffer.h"
+#include "mem_budget.h"
+#include "component_registry.h"
+#include "component_verify.h"
 #include "ipsw.h"
+#include "ipsw_remote.h"
+#include "catalog.h"
+#include "cache.h"
 #include "common.h"
 #include "normal.h"
 #include "restore.h"
 #include "download.h"
 #include "recovery.h"
 #include "idevicerestore.h"
+#include "supervisor.h"
+#include "transition.h"
+#include "shsh_batch.h"
+#include "fs_cache.h"
 
 #include "limera1n.h"
 
@@ -63,6 +75,8 @@
 
 #define VERSION_XML "version.xml"
 
+static plist_t recoveryos_root_ticket_tss_request_new(struct idevicerestore_client_t* client, plist_t build_identity);
+
 #ifndef IDEVICERESTORE_NOMAIN
 static struct option longopts[] = {
 	{ "ecid",           required_argument, NULL, 'i' },
@@ -87,6 +101,12 @@ static struct option longopts[] = {
 	{ "version",        no_argument,       NULL, 'v' },
 	{ "ipsw-info",      no_argument,       NULL, 'I' },
 	{ "ignore-errors",  no_argument,       NULL,  1  },
+	{ "supervise",      no_argument,       NULL,  2  },
+	{ "metrics",        required_argument, NULL,  3  },
+	{ "shsh-batch",     required_argument, NULL,  4  },
+	{ "shsh-jobs",      required_argument, NULL,  5  },
+	{ "memory-budget",  required_argument, NULL,  6  },
+	{ "verify",         no_argument,       NULL,  7  },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -99,7 +119,8 @@ static void usage(int argc, char* argv[], int err)
 	"Restore IPSW firmware at PATH to an iOS device.\n" \
 	"\n" \
 	"PATH can be a compressed .ipsw file or a directory containing all files\n" \
-	"extracted from an IPSW.\n" \
+	"extracted from an IPSW. It can also be a http(s) URL of an .ipsw file, in\n" \
+	"which case only the parts that are needed are downloaded.\n" \
 	"\n" \
 	"OPTIONS:\n" \
 	"  -i, --ecid ECID       Target specific device by its ECID\n" \
@@ -144,6 +165,27 @@ static void usage(int argc, char* argv[], int err)
 	"                        errors (like a failed baseband update)\n" \
 	"                        WARNING: This might render the device unable to boot\n" \
 	"                        or only partially functioning. Use with caution.\n" \
+	"  --supervise           Keep running and restore every device that is connected\n" \
+	"                        with the firmware at PATH, several at the same time.\n" \
+	"                        Implies -y. Stop with Ctrl+C.\n" \
+	"  --metrics PATH        Write time spent and bytes moved per restore phase to\n" \
+	"                        PATH, as JSON if it ends in .json, otherwise in the\n" \
+	"                        OpenMetrics text format. With --supervise the ECID of\n" \
+	"                        each device is added to the file name.\n" \
+	"  --shsh-batch FILE     Save SHSH blobs for every device listed in FILE and\n" \
+	"                        every BuildManifest given as PATH (more than one can\n" \
+	"                        be given), then exit. The devices don't need to be\n" \
+	"                        connected. FILE has one device per line:\n" \
+	"                        ECID PRODUCT_TYPE BOARD_CONFIG [GENERATOR [APNONCE]]\n" \
+	"  --shsh-jobs NUM       Number of TSS requests --shsh-batch sends at the same\n" \
+	"                        time (default: 8)\n" \
+	"  --memory-budget MB    Limit the memory large firmware components occupy at\n" \
+	"                        the same time, restores wait for or spill to disk\n" \
+	"                        beyond it (default: half of the RAM with --supervise,\n" \
+	"                        0 for no limit)\n" \
+	"  --verify              Check every component against its digest in the\n" \
+	"                        BuildManifest before the restore starts. With\n" \
+	"                        --cache-path the result is kept for the IPSW.\n" \
 	"\n" \
 	"Homepage:    <" PACKAGE_URL ">\n" \
 	"Bug Reports: <" PACKAGE_BUGREPORT ">\n",
@@ -158,7 +200,15 @@ const uint8_t lpol_file[22] = {
 };
 const uint32_t lpol_file_length = 22;
 
-static int idevicerestore_keep_pers = 0;
+static plist_t version_data_parse(const char* data, uint32_t size, void* userdata)
+{
+	plist_t version_data = NULL;
+	plist_from_xml(data, size, &version_data);
+	if (!version_data) {
+		error("ERROR: Cannot parse plist data from %s.\n", (const char*)userdata);
+	}
+	return version_data;
+}
 
 static int load_version_data(struct idevicerestore_client_t* client)
 {
@@ -166,62 +216,30 @@ static int load_version_data(struct idevicerestore_client_t* client)
 		return -1;
 	}
 
+	const char* url = "http://itunes.apple.com/check/version";
 	struct stat fst;
-	int cached = 0;
-
-	char version_xml[1024];
+	char version_catalog[1024];
 
+	/* the parsed version data is cached in binary form, which loads a lot faster */
 	if (client->cache_dir) {
 		if (stat(client->cache_dir, &fst) < 0) {
 			mkdir_with_parents(client->cache_dir, 0755);
 		}
-		strcpy(version_xml, client->cache_dir);
-		strcat(version_xml, "/");
-		strcat(version_xml, VERSION_XML);
-	} else {
-		strcpy(version_xml, VERSION_XML);
-	}
-
-	if ((stat(version_xml, &fst) < 0) || ((time(NULL)-86400) > fst.st_mtime)) {
-		char version_xml_tmp[1024];
-		strcpy(version_xml_tmp, version_xml);
-		strcat(version_xml_tmp, ".tmp");
-
-		if (download_to_file("http://itunes.apple.com/check/version",  version_xml_tmp, 0) == 0) {
-			remove(version_xml);
-			if (rename(version_xml_tmp, version_xml) < 0) {
-				error("ERROR: Could not update '%s'\n", version_xml);
-			} else {
-				info("NOTE: Updated version data.\n");
-			}
-		}
+		strcpy(version_catalog, client->cache_dir);
+		strcat(version_catalog, "/");
+		strcat(version_catalog, VERSION_XML);
 	} else {
-		cached = 1;
-	}
-
-	char *verbuf = NULL;
-	size_t verlen = 0;
-	read_file(version_xml, (void**)&verbuf, &verlen);
-
-	if (!verbuf) {
-		error("ERROR: Could not load '%s'\n", version_xml);
-		return -1;
+		strcpy(version_catalog, VERSION_XML);
 	}
+	strcat(version_catalog, ".catalog");
 
+	plist_free(client->version_data);
 	client->version_data = NULL;
-	plist_from_xml(verbuf, verlen, &client->version_data);
-	free(verbuf);
-
-	if (!client->version_data) {
-		remove(version_xml);
-		error("ERROR: Cannot parse plist data from '%s'.\n", version_xml);
+	if (catalog_get(url, version_catalog, 86400, version_data_parse, (void*)url, &client->version_data) < 0) {
+		error("ERROR: Could not load version data\n");
 		return -1;
 	}
 
-	if (cached) {
-		info("NOTE: using cached version data\n");
-	}
-
 	return 0;
 }
 
@@ -317,6 +335,161 @@ static void irecv_event_cb(const irecv_device_event_t* event, void *userdata)
 	}
 }
 
+/* libimobiledevice only allows a single device event subscriber per process,
+ * so its events are dispatched from here to every client (or a supervisor)
+ * that runs concurrently. Subscribers that come later get the devices that
+ * are already connected replayed as add events. libirecovery handles
+ * multiple subscribers itself. */
+struct device_event_subscriber {
+	irecv_device_event_context_t irecv_ctx;
+	idevice_event_cb_t idevice_cb;
+	void* userdata;
+};
+
+static thread_once_t device_events_once = THREAD_ONCE_INIT;
+static mutex_t device_events_mutex;
+/* serializes (un)subscribing, device_events_mutex can't be held for that
+ * since it is taken by the event thread that gets joined on unsubscribe */
+static mutex_t device_events_subscribe_mutex;
+static struct device_event_subscriber* device_event_subscribers = NULL;
+static int num_device_event_subscribers = 0;
+/* set while callbacks run without device_events_mutex held, unsubscribing
+ * waits for it so the callbacks never see freed userdata */
+static int device_events_dispatching = 0;
+static cond_t device_events_dispatch_cond;
+
+static void device_events_init(void)
+{
+	mutex_init(&device_events_mutex);
+	mutex_init(&device_events_subscribe_mutex);
+	cond_init(&device_events_dispatch_cond);
+}
+
+static void device_events_idevice_cb(const idevice_event_t *event, void *userdata)
+{
+	int i;
+	int count = 0;
+	struct device_event_subscriber* subscribers = NULL;
+
+	/* the callbacks can take a while (normal_check_mode talks to lockdownd),
+	 * so they are run on a copy of the list without holding the lock */
+	mutex_lock(&device_events_mutex);
+	if (num_device_event_subscribers > 0) {
+		subscribers = (struct device_event_subscriber*)malloc(sizeof(struct device_event_subscriber) * num_device_event_subscribers);
+		if (subscribers) {
+			memcpy(subscribers, device_event_subscribers, sizeof(struct device_event_subscriber) * num_device_event_subscribers);
+			count = num_device_event_subscribers;
+		}
+	}
+	device_events_dispatching++;
+	mutex_unlock(&device_events_mutex);
+
+	for (i = 0; i < count; i++) {
+		if (subscribers[i].idevice_cb) {
+			subscribers[i].idevice_cb(event, subscribers[i].userdata);
+		}
+	}
+	free(subscribers);
+
+	mutex_lock(&device_events_mutex);
+	device_events_dispatching--;
+	cond_signal(&device_events_dispatch_cond);
+	mutex_unlock(&device_events_mutex);
+}
+
+static void device_events_replay(idevice_event_cb_t idevice_cb, void* userdata)
+{
+	idevice_info_t* devices = NULL;
+	int count = 0;
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		return;
+	}
+	int i;
+	for (i = 0; i < count; i++) {
+		idevice_event_t event;
+		memset(&event, 0, sizeof(event));
+		event.event = IDEVICE_DEVICE_ADD;
+		event.udid = devices[i]->udid;
+#ifdef HAVE_ENUM_IDEVICE_CONNECTION_TYPE
+		event.conn_type = devices[i]->conn_type;
+#endif
+		idevice_cb(&event, userdata);
+	}
+	idevice_device_list_extended_free(devices);
+}
+
+int device_events_subscribe(irecv_device_event_cb_t irecv_cb, idevice_event_cb_t idevice_cb, void* userdata)
+{
+	thread_once(&device_events_once, device_events_init);
+
+	struct device_event_subscriber subscriber;
+	memset(&subscriber, 0, sizeof(subscriber));
+	subscriber.idevice_cb = idevice_cb;
+	subscriber.userdata = userdata;
+	if (irecv_cb) {
+		irecv_device_event_subscribe(&subscriber.irecv_ctx, irecv_cb, userdata);
+	}
+
+	mutex_lock(&device_events_subscribe_mutex);
+	mutex_lock(&device_events_mutex);
+	struct device_event_subscriber* subscribers = (struct device_event_subscriber*)realloc(device_event_subscribers, sizeof(struct device_event_subscriber) * (num_device_event_subscribers + 1));
+	if (!subscribers) {
+		mutex_unlock(&device_events_mutex);
+		mutex_unlock(&device_events_subscribe_mutex);
+		if (subscriber.irecv_ctx) {
+			irecv_device_event_unsubscribe(subscriber.irecv_ctx);
+		}
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	device_event_subscribers = subscribers;
+	device_event_subscribers[num_device_event_subscribers++] = subscriber;
+	int first = (num_device_event_subscribers == 1);
+	mutex_unlock(&device_events_mutex);
+
+	if (first) {
+		idevice_event_subscribe(device_events_idevice_cb, NULL);
+	} else if (idevice_cb) {
+		device_events_replay(idevice_cb, userdata);
+	}
+	mutex_unlock(&device_events_subscribe_mutex);
+
+	return 0;
+}
+
+void device_events_unsubscribe(void* userdata)
+{
+	thread_once(&device_events_once, device_events_init);
+
+	irecv_device_event_context_t irecv_ctx = NULL;
+	int last = 0;
+	mutex_lock(&device_events_subscribe_mutex);
+	mutex_lock(&device_events_mutex);
+	int i;
+	for (i = 0; i < num_device_event_subscribers; i++) {
+		if (device_event_subscribers[i].userdata == userdata) {
+			irecv_ctx = device_event_subscribers[i].irecv_ctx;
+			memmove(&device_event_subscribers[i], &device_event_subscribers[i+1], sizeof(struct device_event_subscriber) * (num_device_event_subscribers - i - 1));
+			num_device_event_subscribers--;
+			last = (num_device_event_subscribers == 0);
+			break;
+		}
+	}
+	while (device_events_dispatching > 0) {
+		cond_wait(&device_events_dispatch_cond, &device_events_mutex);
+	}
+	mutex_unlock(&device_events_mutex);
+
+	if (last) {
+		idevice_event_unsubscribe();
+	}
+	mutex_unlock(&device_events_subscribe_mutex);
+
+	if (irecv_ctx) {
+		irecv_device_event_unsubscribe(irecv_ctx);
+	}
+}
+
 int idevicerestore_start(struct idevicerestore_client_t* client)
 {
 	int tss_enabled = 0;
@@ -344,16 +517,25 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 
 	idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.0);
 
-	irecv_device_event_subscribe(&client->irecv_e_ctx, irecv_event_cb, client);
+	if (!client->device_events_subscribed) {
+		device_events_subscribe(irecv_event_cb, idevice_event_cb, client);
+		client->device_events_subscribed = 1;
+	}
 
-	idevice_event_subscribe(idevice_event_cb, client);
-	client->idevice_e_ctx = idevice_event_cb;
+	if (client->cache_dir) {
+		char* latency_file = (char*)malloc(strlen(client->cache_dir) + 26);
+		if (latency_file) {
+			mkdir_with_parents(client->cache_dir, 0755);
+			sprintf(latency_file, "%s/transition_latency.plist", client->cache_dir);
+			transition_set_latency_file(latency_file);
+			free(latency_file);
+		}
+	}
 
 	// check which mode the device is currently in so we know where to start
 	mutex_lock(&client->device_event_mutex);
 	if (client->mode == MODE_UNKNOWN) {
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-		if (client->mode == MODE_UNKNOWN || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "discover", TRANSITION_ANY_MODE, 10000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			error("ERROR: Unable to discover device mode. Please make sure a device is attached.\n");
 			return -1;
@@ -421,7 +603,11 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 				download_to_file(s_wtfurl, wtfipsw, 0);
 			}
 
-			ipsw_extract_to_memory(wtfipsw, wtfname, &wtftmp, &wtfsize);
+			ipsw_archive_t wtf_ipsw = ipsw_open(wtfipsw);
+			if (wtf_ipsw) {
+				ipsw_extract_to_memory(wtf_ipsw, wtfname, &wtftmp, &wtfsize);
+				ipsw_close(wtf_ipsw);
+			}
 			if (!wtftmp) {
 				error("ERROR: Could not extract WTF\n");
 			}
@@ -437,8 +623,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 
 		free(wtftmp);
 
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 10000);
-		if (client->mode != MODE_DFU || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "wtf-dfu", TRANSITION_MODE(MODE_DFU), 10000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			/* TODO: verify if it actually goes from 0x1222 -> 0x1227 */
 			error("ERROR: Failed to put device into DFU from WTF mode\n");
@@ -491,7 +676,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		unsigned char fwsha1[20];
 		unsigned char *p_fwsha1 = NULL;
 		plist_t signed_fws = NULL;
-		int res = ipsw_get_signed_firmwares(client->device->product_type, &signed_fws);
+		int res = ipsw_get_signed_firmwares(client->device->product_type, client->cache_dir, &signed_fws);
 		if (res < 0) {
 			error("ERROR: Could not fetch list of signed firmwares.\n");
 			return res;
@@ -582,15 +767,29 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			return -1;
 		}
 
-		char* ipsw = NULL;
-		res = ipsw_download_fw(fwurl, p_fwsha1, client->cache_dir, &ipsw);
-		if (res != 0) {
-			if (ipsw) {
-				free(ipsw);
+		if (client->flags & FLAG_SHSHONLY) {
+			/* the filesystem is never read, so only fetch the parts that are
+			 * actually needed instead of the whole firmware */
+			client->ipsw = ipsw_open_remote(fwurl, client->cache_dir);
+			if (!client->ipsw) {
+				error("ERROR: Unable to open remote firmware file %s\n", fwurl);
+				return -1;
 			}
-			return res;
 		} else {
-			client->ipsw = ipsw;
+			char* ipsw = NULL;
+			res = ipsw_download_fw(fwurl, p_fwsha1, client->cache_dir, &ipsw);
+			if (res != 0) {
+				if (ipsw) {
+					free(ipsw);
+				}
+				return res;
+			}
+			client->ipsw = ipsw_open(ipsw);
+			free(ipsw);
+			if (!client->ipsw) {
+				error("ERROR: Unable to open downloaded firmware file\n");
+				return -1;
+			}
 		}
 	}
 	idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.6);
@@ -614,8 +813,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 
 			// we need to refresh the current mode again
 			mutex_lock(&client->device_event_mutex);
-			cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 60000);
-			if (client->mode == MODE_UNKNOWN || (client->flags & FLAG_QUIT)) {
+			if (transition_wait(client, "restore-reboot-connect", TRANSITION_ANY_MODE, 60000) < 0) {
 				mutex_unlock(&client->device_event_mutex);
 				error("ERROR: Unable to discover device mode. Please make sure a device is attached.\n");
 				return -1;
@@ -626,27 +824,52 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	// verify if ipsw file exists
-	if (access(client->ipsw, F_OK) < 0) {
-		error("ERROR: Firmware file %s does not exist.\n", client->ipsw);
+	if (!ipsw_is_remote(client->ipsw) && access(ipsw_get_path(client->ipsw), F_OK) < 0) {
+		error("ERROR: Firmware file %s does not exist.\n", ipsw_get_path(client->ipsw));
 		return -1;
 	}
 
 	// extract buildmanifest
 	if (client->flags & FLAG_CUSTOM) {
 		info("Extracting Restore.plist from IPSW\n");
-		if (ipsw_extract_restore_plist(client->ipsw, &client->build_manifest) < 0) {
-			error("ERROR: Unable to extract Restore.plist from %s. Firmware file might be corrupt.\n", client->ipsw);
+		plist_t restore_plist = NULL;
+		if (ipsw_extract_restore_plist(client->ipsw, &restore_plist) < 0) {
+			error("ERROR: Unable to extract Restore.plist from %s. Firmware file might be corrupt.\n", ipsw_get_path(client->ipsw));
 			return -1;
 		}
+		client->manifest = build_manifest_new(restore_plist, 0);
 	} else {
 		info("Extracting BuildManifest from IPSW\n");
-		if (ipsw_extract_build_manifest(client->ipsw, &client->build_manifest, &tss_enabled) < 0) {
-			error("ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
+		/* parsed only once for all clients restoring from the same archive */
+		if (ipsw_get_build_manifest(client->ipsw, &client->manifest) < 0) {
+			error("ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", ipsw_get_path(client->ipsw));
 			return -1;
 		}
+		tss_enabled = build_manifest_is_tss_enabled(client->manifest);
+	}
+	client->build_manifest = build_manifest_get_plist(client->manifest);
+	if (!client->build_manifest) {
+		error("ERROR: Unable to parse the build manifest of %s\n", ipsw_get_path(client->ipsw));
+		return -1;
 	}
 	idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.8);
 
+	if (client->cache_dir && !client->component_cache) {
+		client->component_cache = cache_open(client->cache_dir, "components", CACHE_DEFAULT_MAX_SIZE);
+	}
+	if (client->cache_dir && !client->fwupdater_cache) {
+		client->fwupdater_cache = cache_open(client->cache_dir, "fwupdater", FWUPDATER_CACHE_MAX_SIZE);
+	}
+	if (client->cache_dir) {
+		char* health_file = (char*)malloc(strlen(client->cache_dir) + 18);
+		if (health_file) {
+			mkdir_with_parents(client->cache_dir, 0755);
+			sprintf(health_file, "%s/tss_health.plist", client->cache_dir);
+			tss_set_health_file(health_file);
+			free(health_file);
+		}
+	}
+
 	/* check if device type is supported by the given build manifest */
 	if (build_manifest_check_compatibility(client->build_manifest, client->device->product_type) < 0) {
 		error("ERROR: Could not make sure this firmware is suitable for the current device. Refusing to continue.\n");
@@ -826,19 +1049,19 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			plist_dict_set_item(build_identity, "Manifest", manifest);
 		}
 	} else if (client->flags & FLAG_ERASE) {
-		build_identity = build_manifest_get_build_identity_for_model_with_variant(client->build_manifest, client->device->hardware_model, RESTORE_VARIANT_ERASE_INSTALL);
+		build_identity = build_manifest_find_identity(client->manifest, client->device->hardware_model, RESTORE_VARIANT_ERASE_INSTALL);
 		if (build_identity == NULL) {
 			error("ERROR: Unable to find any build identities\n");
 			return -1;
 		}
 	} else {
-		build_identity = build_manifest_get_build_identity_for_model_with_variant(client->build_manifest, client->device->hardware_model, RESTORE_VARIANT_UPGRADE_INSTALL);
+		build_identity = build_manifest_find_identity(client->manifest, client->device->hardware_model, RESTORE_VARIANT_UPGRADE_INSTALL);
 		if (!build_identity) {
-			build_identity = build_manifest_get_build_identity_for_model(client->build_manifest, client->device->hardware_model);
+			build_identity = build_manifest_find_identity(client->manifest, client->device->hardware_model, NULL);
 		}
 	}
 
-	client->macos_variant = build_manifest_get_build_identity_for_model_with_variant(client->build_manifest, client->device->hardware_model, RESTORE_VARIANT_MACOS_RECOVERY_OS);
+	client->macos_variant = build_manifest_find_identity(client->manifest, client->device->hardware_model, RESTORE_VARIANT_MACOS_RECOVERY_OS);
 
 	/* print information about current build identity */
 	build_identity_print_information(build_identity);
@@ -923,11 +1146,19 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	/* check if all components we need are actually there */
 	info("Checking IPSW for required components...\n");
 	if (build_identity_check_components_in_ipsw(build_identity, client->ipsw) < 0) {
-		error("ERROR: Could not find all required components in IPSW %s\n", client->ipsw);
+		error("ERROR: Could not find all required components in IPSW %s\n", ipsw_get_path(client->ipsw));
 		return -1;
 	}
 	info("All required components found in IPSW\n");
 
+	if (client->flags & FLAG_VERIFY) {
+		if (component_verify_build_identity(client->ipsw, build_identity, client->cache_dir) < 0) {
+			error("ERROR: Components in IPSW %s are damaged\n", ipsw_get_path(client->ipsw));
+			return -1;
+		}
+		info("All components match the BuildManifest\n");
+	}
+
 	// Get filesystem name from build identity
 	char* fsname = NULL;
 	if (build_identity_get_component_path(build_identity, "OS", &fsname) < 0) {
@@ -936,7 +1167,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	// check if we already have an extracted filesystem
-	int delete_fs = 0;
 	char* filesystem = NULL;
 	struct stat st;
 	memset(&st, '\0', sizeof(struct stat));
@@ -947,14 +1177,19 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		}
 		strcpy(tmpf, client->cache_dir);
 		strcat(tmpf, "/");
-		char *ipswtmp = strdup(client->ipsw);
+		char *ipswtmp = strdup(ipsw_get_path(client->ipsw));
 		strcat(tmpf, basename(ipswtmp));
 		free(ipswtmp);
+	} else if (ipsw_is_remote(client->ipsw)) {
+		// keep the filesystem of a remote IPSW in the current directory
+		char *ipswtmp = strdup(ipsw_get_path(client->ipsw));
+		strcpy(tmpf, basename(ipswtmp));
+		free(ipswtmp);
 	} else {
-		strcpy(tmpf, client->ipsw);
+		strcpy(tmpf, ipsw_get_path(client->ipsw));
 	}
 
-	if (!ipsw_is_directory(client->ipsw)) {
+	if (!ipsw_is_directory(ipsw_get_path(client->ipsw))) {
 		// strip off file extension if given ipsw is not a directory
 		char* s = tmpf + strlen(tmpf) - 1;
 		char* p = s;
@@ -972,8 +1207,17 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	strcat(tmpf, "/");
 	strcat(tmpf, fsname);
 
+	if (client->cache_dir && !(client->flags & FLAG_SHSHONLY)) {
+		/* shared between the builds with the same filesystem */
+		if (fs_cache_get(client->cache_dir, client->ipsw, build_identity, fsname, tmpf, &filesystem) == -2) {
+			if (client->tss)
+				plist_free(client->tss);
+			return -1;
+		}
+	}
+
 	memset(&st, '\0', sizeof(struct stat));
-	if (stat(tmpf, &st) == 0) {
+	if (!filesystem && stat(tmpf, &st) == 0) {
 		uint64_t fssize = 0;
 		ipsw_get_file_size(client->ipsw, fsname, &fssize);
 		if ((fssize > 0) && ((uint64_t)st.st_size == fssize)) {
@@ -983,52 +1227,59 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	if (!filesystem && !(client->flags & FLAG_SHSHONLY)) {
-		char extfn[1024];
-		strcpy(extfn, tmpf);
-		strcat(extfn, ".extract");
-		char lockfn[1024];
-		strcpy(lockfn, tmpf);
-		strcat(lockfn, ".lock");
-		lock_info_t li;
-
-		lock_file(lockfn, &li);
-		FILE* extf = NULL;
-		if (access(extfn, F_OK) != 0) {
-			extf = fopen(extfn, "wb");
-		}
-		unlock_file(&li);
-		if (!extf) {
-			// use temp filename
-			filesystem = get_temp_filename("ipsw_");
-			if (!filesystem) {
-				error("WARNING: Could not get temporary filename, using '%s' in current directory\n", fsname);
-				filesystem = strdup(fsname);
-			}
-			delete_fs = 1;
-		} else {
-			// use <fsname>.extract as filename
-			filesystem = strdup(extfn);
-			fclose(extf);
-		}
-		remove(lockfn);
-
-		// Extract filesystem from IPSW
-		info("Extracting filesystem from IPSW: %s\n", fsname);
-		if (ipsw_extract_to_file_with_progress(client->ipsw, fsname, filesystem, 1) < 0) {
-			error("ERROR: Unable to extract filesystem from IPSW\n");
-			if (client->tss)
-				plist_free(client->tss);
-			info("Removing %s\n", filesystem);
-			unlink(filesystem);
+		ipsw_file_handle_t fsfile = ipsw_file_open(client->ipsw, fsname);
+		if (!fsfile) {
+			error("ERROR: Unable to open filesystem %s in IPSW\n", fsname);
 			return -1;
 		}
+		/* uncompressed entries can be read at any offset, no need to extract them */
+		int stream_fs = ipsw_file_is_seekable(fsfile);
+		ipsw_file_close(fsfile);
 
-		if (strstr(filesystem, ".extract")) {
-			// rename <fsname>.extract to <fsname>
-			remove(tmpf);
-			rename(filesystem, tmpf);
-			free(filesystem);
-			filesystem = strdup(tmpf);
+		if (stream_fs) {
+			info("Filesystem %s will be streamed directly from IPSW\n", fsname);
+		} else {
+			char extfn[1024];
+			strcpy(extfn, tmpf);
+			strcat(extfn, ".extract");
+			char lockfn[1024];
+			strcpy(lockfn, tmpf);
+			strcat(lockfn, ".lock");
+			lock_info_t li;
+
+			lock_file(lockfn, &li);
+			FILE* extf = NULL;
+			if (access(extfn, F_OK) != 0) {
+				extf = fopen(extfn, "wb");
+			}
+			unlock_file(&li);
+			remove(lockfn);
+
+			if (!extf) {
+				// somebody else is extracting already, stream it instead of extracting another copy
+				info("Filesystem %s will be streamed from IPSW\n", fsname);
+			} else {
+				// use <fsname>.extract as filename
+				filesystem = strdup(extfn);
+				fclose(extf);
+
+				// Extract filesystem from IPSW
+				info("Extracting filesystem from IPSW: %s\n", fsname);
+				if (ipsw_extract_to_file_with_progress(client->ipsw, fsname, filesystem, 1) < 0) {
+					error("ERROR: Unable to extract filesystem from IPSW\n");
+					if (client->tss)
+						plist_free(client->tss);
+					info("Removing %s\n", filesystem);
+					unlink(filesystem);
+					return -1;
+				}
+
+				// rename <fsname>.extract to <fsname>
+				remove(tmpf);
+				rename(filesystem, tmpf);
+				free(filesystem);
+				filesystem = strdup(tmpf);
+			}
 		}
 	}
 
@@ -1045,6 +1296,13 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		}
 		info("Found ECID %" PRIu64 "\n", client->ecid);
 
+		if (client->cache_dir && !client->tss_cache) {
+			/* responses of an earlier attempt on this device are reused if the request is the same */
+			char tss_cache_name[32];
+			snprintf(tss_cache_name, sizeof(tss_cache_name), "tss/%" PRIu64, client->ecid);
+			client->tss_cache = cache_open(client->cache_dir, tss_cache_name, TSS_CACHE_MAX_SIZE);
+		}
+
 		if (client->mode == MODE_NORMAL && !(client->flags & FLAG_ERASE) && !(client->flags & FLAG_SHSHONLY)) {
 			plist_t node = normal_get_lockdown_value(client, NULL, "HasSiDP");
 			uint8_t needs_preboard = 0;
@@ -1097,18 +1355,36 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			return -1;
 		}
 		
+		/* the recovery OS root ticket doesn't depend on the AP ticket, so both
+		 * requests are in flight at the same time. Only the local policy needs
+		 * to wait for the AP ticket. */
+		tss_async_request_t root_ticket_request = NULL;
+		if (client->macos_variant) {
+			plist_t request = recoveryos_root_ticket_tss_request_new(client, build_identity);
+			if (!request) {
+				error("ERROR: Unable to get SHSH blobs for this device (recovery OS Root Ticket)\n");
+				return -1;
+			}
+			root_ticket_request = tss_request_send_async_for_client(client, request);
+			plist_free(request);
+		}
+
 		if (get_tss_response(client, build_identity, &client->tss) < 0) {
 			error("ERROR: Unable to get SHSH blobs for this device\n");
+			plist_free(tss_request_wait(root_ticket_request));
 			return -1;
 		}
 		if (client->macos_variant) {
-			if (get_local_policy_tss_response(client, build_identity, &client->tss_localpolicy) < 0) {
-				error("ERROR: Unable to get SHSH blobs for this device (local policy)\n");
+			uint64_t wait_begin = telemetry_begin();
+			client->tss_recoveryos_root_ticket = tss_request_wait(root_ticket_request);
+			telemetry_end(client->telemetry, "tss_wait", wait_begin, 0);
+			if (!client->tss_recoveryos_root_ticket) {
+				error("ERROR: Unable to get SHSH blobs for this device (recovery OS Root Ticket)\n");
 				return -1;
 			}
-			if (get_recoveryos_root_ticket_tss_response(client, build_identity, &client->tss_recoveryos_root_ticket) <
-				0) {
-				error("ERROR: Unable to get SHSH blobs for this device (recovery OS Root Ticket)\n");
+			info("Received SHSH blobs\n");
+			if (get_local_policy_tss_response(client, build_identity, &client->tss_localpolicy) < 0) {
+				error("ERROR: Unable to get SHSH blobs for this device (local policy)\n");
 				return -1;
 			}
 		}
@@ -1129,8 +1405,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	if (client->flags & FLAG_QUIT) {
-		if (delete_fs && filesystem)
-			unlink(filesystem);
 		return -1;
 	}
 	if (client->flags & FLAG_SHSHONLY) {
@@ -1182,11 +1456,13 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if ((tss_enabled) && client->tss) {
 		/* fix empty dicts */
 		fixup_tss(client->tss);
+		/* get the boot chain ready while the device changes modes */
+		if (client->image4supported && !(client->flags & FLAG_CUSTOM)) {
+			client->prefetch = prefetch_start(client, build_identity, client->tss);
+		}
 	}
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.25);
 	if (client->flags & FLAG_QUIT) {
-		if (delete_fs && filesystem)
-			unlink(filesystem);
 		return -1;
 	}
 
@@ -1203,8 +1479,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.3);
 	if (client->flags & FLAG_QUIT) {
-		if (delete_fs && filesystem)
-			unlink(filesystem);
 		return -1;
 	}
 
@@ -1215,8 +1489,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		if ((client->flags & FLAG_CUSTOM) && limera1n_is_supported(client->device)) {
 			info("connecting to DFU\n");
 			if (dfu_client_new(client) < 0) {
-				if (delete_fs && filesystem)
-					unlink(filesystem);
 				return -1;
 			}
 			info("exploiting with limera1n\n");
@@ -1224,8 +1496,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			if (limera1n_exploit(client->device, &client->dfu->client) != 0) {
 				error("ERROR: limera1n exploit failed\n");
 				dfu_client_free(client);
-				if (delete_fs && filesystem)
-					unlink(filesystem);
 				return -1;
 			}
 			dfu_client_free(client);
@@ -1235,8 +1505,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			error("ERROR: Unable to place device into recovery mode from DFU mode\n");
 			if (client->tss)
 				plist_free(client->tss);
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -2;
 		}
 	} else if (client->mode == MODE_RECOVERY) {
@@ -1246,8 +1514,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 				/* send ApTicket */
 				if (recovery_send_ticket(client) < 0) {
 					error("ERROR: Unable to send APTicket\n");
-					if (delete_fs && filesystem)
-						unlink(filesystem);
 					return -2;
 				}
 			}
@@ -1259,41 +1525,31 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		if (recovery_send_ibec(client, build_identity) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			error("ERROR: Unable to send iBEC\n");
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -2;
 		}
 		recovery_client_free(client);
 
 		debug("Waiting for device to disconnect...\n");
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 60000);
-		if (client->mode != MODE_UNKNOWN || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "ibec-disconnect", TRANSITION_MODE(MODE_UNKNOWN), 60000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 
 			if (!(client->flags & FLAG_QUIT)) {
 				error("ERROR: Device did not disconnect. Possibly invalid iBEC. Reset device and try again.\n");
 			}
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -2;
 		}
 		debug("Waiting for device to reconnect in recovery mode...\n");
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 60000);
-		if (client->mode != MODE_RECOVERY || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "ibec-recovery", TRANSITION_MODE(MODE_RECOVERY), 60000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			if (!(client->flags & FLAG_QUIT)) {
 				error("ERROR: Device did not reconnect in recovery mode. Possibly invalid iBEC. Reset device and try again.\n");
 			}
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -2;
 		}
 		mutex_unlock(&client->device_event_mutex);
 	}
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.5);
 	if (client->flags & FLAG_QUIT) {
-		if (delete_fs && filesystem)
-			unlink(filesystem);
 		return -1;
 	}
 
@@ -1305,8 +1561,6 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		if (get_ap_nonce(client, &nonce, &nonce_size) < 0) {
 			error("ERROR: Unable to get nonce from device!\n");
 			recovery_send_reset(client);
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -2;
 		}
 
@@ -1326,23 +1580,18 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			plist_free(client->tss);
 			if (get_tss_response(client, build_identity, &client->tss) < 0) {
 				error("ERROR: Unable to get SHSH blobs for this device\n");
-				if (delete_fs && filesystem)
-					unlink(filesystem);
 				return -1;
 			}
 			if (!client->tss) {
 				error("ERROR: can't continue without TSS\n");
-				if (delete_fs && filesystem)
-					unlink(filesystem);
 				return -1;
 			}
 			fixup_tss(client->tss);
+			prefetch_update_tss(client->prefetch, client->tss);
 		}
 	}
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.7);
 	if (client->flags & FLAG_QUIT) {
-		if (delete_fs && filesystem)
-			unlink(filesystem);
 		return -1;
 	}
 
@@ -1350,16 +1599,12 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if (client->mode == MODE_RECOVERY) {
 		if (client->srnm == NULL) {
 			error("ERROR: could not retrieve device serial number. Can't continue.\n");
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -1;
 		}
 		if (recovery_enter_restore(client, build_identity) < 0) {
 			error("ERROR: Unable to place device into restore mode\n");
 			if (client->tss)
 				plist_free(client->tss);
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -2;
 		}
 		recovery_client_free(client);
@@ -1369,13 +1614,10 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if (client->mode != MODE_RESTORE) {
 		mutex_lock(&client->device_event_mutex);
 		info("Waiting for device to enter restore mode...\n");
-		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 180000);
-		if (client->mode != MODE_RESTORE || (client->flags & FLAG_QUIT)) {
+		if (transition_wait(client, "restore", TRANSITION_MODE(MODE_RESTORE), 180000) < 0) {
 			mutex_unlock(&client->device_event_mutex);
 			error("ERROR: Device failed to enter restore mode.\n");
 			error("Please make sure that usbmuxd is running.\n");
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return -1;
 		}
 		mutex_unlock(&client->device_event_mutex);
@@ -1392,15 +1634,11 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		result = restore_device(client, build_identity, filesystem);
 		if (result < 0) {
 			error("ERROR: Unable to restore device\n");
-			if (delete_fs && filesystem)
-				unlink(filesystem);
 			return result;
 		}
 	}
 
 	info("Cleaning up...\n");
-	if (delete_fs && filesystem)
-		unlink(filesystem);
 
 	/* special handling of older AppleTVs as they enter Recovery mode on boot when plugged in to USB */
 	if ((strncmp(client->device->product_type, "AppleTV", 7) == 0) && (client->device->product_type[7] < '5')) {
@@ -1438,6 +1676,7 @@ struct idevicerestore_client_t* idevicerestore_client_new(void)
 	client->mode = MODE_UNKNOWN;
 	mutex_init(&client->device_event_mutex);
 	cond_init(&client->device_event_cond);
+	client->telemetry = telemetry_new();
 	return client;
 }
 
@@ -1447,11 +1686,11 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
 		return;
 	}
 
-	if (client->irecv_e_ctx) {
-		irecv_device_event_unsubscribe(client->irecv_e_ctx);
+	if (client->prefetch) {
+		prefetch_free(client->prefetch);
 	}
-	if (client->idevice_e_ctx) {
-		idevice_event_unsubscribe();
+	if (client->device_events_subscribed) {
+		device_events_unsubscribe(client);
 	}
 	cond_destroy(&client->device_event_cond);
 	mutex_destroy(&client->device_event_mutex);
@@ -1472,8 +1711,19 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
 		free(client->srnm);
 	}
 	if (client->ipsw) {
-		free(client->ipsw);
+		ipsw_close(client->ipsw);
+	}
+	if (client->component_cache) {
+		cache_close(client->component_cache);
 	}
+	if (client->fwupdater_cache) {
+		cache_close(client->fwupdater_cache);
+	}
+	if (client->tss_cache) {
+		cache_close(client->tss_cache);
+	}
+	telemetry_free(client->telemetry);
+	free(client->metrics_path);
 	if (client->version) {
 		free(client->version);
 	}
@@ -1489,8 +1739,8 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
 	if (client->root_ticket) {
 		free(client->root_ticket);
 	}
-	if (client->build_manifest) {
-		plist_free(client->build_manifest);
+	if (client->manifest) {
+		build_manifest_free(client->manifest);
 	}
 	if (client->preflight_info) {
 		plist_free(client->preflight_info);
@@ -1530,11 +1780,11 @@ void idevicerestore_set_ipsw(struct idevicerestore_client_t* client, const char*
 	if (!client)
 		return;
 	if (client->ipsw) {
-		free(client->ipsw);
+		ipsw_close(client->ipsw);
 		client->ipsw = NULL;
 	}
 	if (path) {
-		client->ipsw = strdup(path);
+		client->ipsw = ipsw_open(path);
 	}
 }
 
@@ -1551,6 +1801,27 @@ void idevicerestore_set_cache_path(struct idevicerestore_client_t* client, const
 	}
 }
 
+void idevicerestore_set_metrics_path(struct idevicerestore_client_t* client, const char* path)
+{
+	if (!client)
+		return;
+	if (client->metrics_path) {
+		free(client->metrics_path);
+		client->metrics_path = NULL;
+	}
+	if (path) {
+		client->metrics_path = strdup(path);
+	}
+}
+
+void idevicerestore_write_metrics(struct idevicerestore_client_t* client, int result)
+{
+	if (!client || !client->metrics_path) {
+		return;
+	}
+	telemetry_write(client->telemetry, client->metrics_path, client->ecid, (client->device) ? client->device->product_type : NULL, result);
+}
+
 void idevicerestore_set_progress_callback(struct idevicerestore_client_t* client, idevicerestore_progress_cb_t cbfunc, void* userdata)
 {
 	if (!client)
@@ -1566,7 +1837,7 @@ static void handle_signal(int sig)
 {
 	if (idevicerestore_client) {
 		idevicerestore_client->flags |= FLAG_QUIT;
-		ipsw_cancel();
+		ipsw_cancel(idevicerestore_client->ipsw);
 	}
 }
 
@@ -1581,6 +1852,10 @@ int main(int argc, char* argv[]) {
 	int optindex = 0;
 	char* ipsw = NULL;
 	int ipsw_info = 0;
+	int supervise = 0;
+	const char* shsh_batch = NULL;
+	int shsh_jobs = 0;
+	long long memory_budget = -1;
 	int result = 0;
 
 	struct idevicerestore_client_t* client = idevicerestore_client_new();
@@ -1670,7 +1945,7 @@ int main(int argc, char* argv[]) {
 			break;
 
 		case 'k':
-			idevicerestore_keep_pers = 1;
+			client->flags |= FLAG_KEEP_PERS;
 			break;
 
 		case 'p':
@@ -1725,6 +2000,38 @@ int main(int argc, char* argv[]) {
 			client->flags |= FLAG_IGNORE_ERRORS;
 			break;
 
+		case 2:
+			supervise = 1;
+			break;
+
+		case 3:
+			idevicerestore_set_metrics_path(client, optarg);
+			break;
+
+		case 4:
+			shsh_batch = optarg;
+			break;
+
+		case 5:
+			shsh_jobs = (int)strtol(optarg, NULL, 0);
+			if (shsh_jobs <= 0) {
+				error("ERROR: Invalid --shsh-jobs value '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 6:
+			memory_budget = strtoll(optarg, NULL, 0);
+			if (memory_budget < 0) {
+				error("ERROR: Invalid --memory-budget value '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 7:
+			client->flags |= FLAG_VERIFY;
+			break;
+
 		default:
 			usage(argc, argv, 1);
 			return EXIT_FAILURE;
@@ -1740,6 +2047,20 @@ int main(int argc, char* argv[]) {
 		return (ipsw_print_info(*(argv + optind)) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
+	if (shsh_batch) {
+		if (argc-optind < 1) {
+			error("ERROR: --shsh-batch requires at least one BuildManifest path.\n");
+			usage(argc, argv, 1);
+			return EXIT_FAILURE;
+		}
+		curl_global_init(CURL_GLOBAL_ALL);
+		result = shsh_batch_run(shsh_batch, argv + optind, argc - optind, client->cache_dir, client->tss_url, shsh_jobs);
+		idevicerestore_client_free(client);
+		tss_cleanup();
+		curl_global_cleanup();
+		return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	if (((argc-optind) == 1) || (client->flags & FLAG_PWN) || (client->flags & FLAG_LATEST)) {
 		argc -= optind;
 		argv += optind;
@@ -1755,18 +2076,62 @@ int main(int argc, char* argv[]) {
 		return EXIT_FAILURE;
 	}
 
+	if (supervise && (client->flags & (FLAG_LATEST | FLAG_PWN))) {
+		error("ERROR: --supervise can't be used with --latest or --pwn.\n");
+		return EXIT_FAILURE;
+	}
+
 	info("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
 
-	if (ipsw) {
-		client->ipsw = strdup(ipsw);
+	if (memory_budget < 0) {
+		memory_budget = (supervise) ? (long long)(get_physical_memory() / 2 / (1024 * 1024)) : 0;
+	}
+	if (memory_budget > 0) {
+		const char* spill_dir = client->cache_dir;
+		if (!spill_dir) {
+			spill_dir = getenv("TMPDIR");
+		}
+#ifndef WIN32
+		if (!spill_dir) {
+			spill_dir = "/tmp";
+		}
+#endif
+		debug("DEBUG: memory budget %lld MB, spilling to %s\n", memory_budget, (spill_dir) ? spill_dir : "(none)");
+		mem_budget_set_limit((uint64_t)memory_budget * 1024 * 1024);
+		mem_budget_set_spill_dir(spill_dir);
 	}
 
 	curl_global_init(CURL_GLOBAL_ALL);
 
-	result = idevicerestore_start(client);
+	if (ipsw) {
+		if (ipsw_remote_is_url(ipsw)) {
+			/* only the parts that are actually needed get downloaded */
+			client->ipsw = ipsw_open_remote(ipsw, client->cache_dir);
+		} else {
+			client->ipsw = ipsw_open(ipsw);
+		}
+		if (!client->ipsw) {
+			error("ERROR: Firmware file %s cannot be opened.\n", ipsw);
+			idevicerestore_client_free(client);
+			curl_global_cleanup();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (supervise) {
+		if (client->cache_dir) {
+			client->component_cache = cache_open(client->cache_dir, "components", CACHE_DEFAULT_MAX_SIZE);
+			client->fwupdater_cache = cache_open(client->cache_dir, "fwupdater", FWUPDATER_CACHE_MAX_SIZE);
+		}
+		result = idevicerestore_supervise(client);
+	} else {
+		result = idevicerestore_start(client);
+		idevicerestore_write_metrics(client, result);
+	}
 
 	idevicerestore_client_free(client);
 
+	tss_cleanup();
 	curl_global_cleanup();
 
 	return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -2173,48 +2538,67 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
 		plist_dict_set_item(parameters, "ApSupportsImg4", plist_new_bool(0));
 	}
 
-	tss_parameters_add_from_manifest(parameters, build_identity);
-
-	/* create basic request */
-	request = tss_request_new(NULL);
-	if (request == NULL) {
-		error("ERROR: Unable to create TSS request\n");
-		plist_free(parameters);
-		return -1;
-	}
-
-	/* add common tags from manifest */
-	if (tss_request_add_common_tags(request, parameters, NULL) < 0) {
-		error("ERROR: Unable to add common tags to TSS request\n");
-		plist_free(request);
-		plist_free(parameters);
-		return -1;
+	/* the AP part only depends on the build identity, patch in the device values */
+	unsigned int template_flags = TSS_TEMPLATE_PRODUCTION_MODE;
+	if (client->image4supported) {
+		template_flags |= TSS_TEMPLATE_IMG4 | TSS_TEMPLATE_SECURITY_MODE;
 	}
+	tss_request_template_t tmpl = tss_request_template_get(build_identity, template_flags);
+	if (tmpl) {
+		request = tss_request_template_new_request(tmpl, parameters);
+		if (request == NULL) {
+			error("ERROR: Unable to create TSS request\n");
+			plist_free(parameters);
+			return -1;
+		}
+		if (client->mode == MODE_NORMAL) {
+			/* the baseband tags need the manifest */
+			tss_parameters_add_from_manifest(parameters, build_identity);
+		}
+	} else {
+		tss_parameters_add_from_manifest(parameters, build_identity);
 
-	/* add tags from manifest */
-	if (tss_request_add_ap_tags(request, parameters, NULL) < 0) {
-		error("ERROR: Unable to add common tags to TSS request\n");
-		plist_free(request);
-		plist_free(parameters);
-		return -1;
-	}
+		/* create basic request */
+		request = tss_request_new(NULL);
+		if (request == NULL) {
+			error("ERROR: Unable to create TSS request\n");
+			plist_free(parameters);
+			return -1;
+		}
 
-	if (client->image4supported) {
-		/* add personalized parameters */
-		if (tss_request_add_ap_img4_tags(request, parameters) < 0) {
-			error("ERROR: Unable to add img4 tags to TSS request\n");
+		/* add common tags from manifest */
+		if (tss_request_add_common_tags(request, parameters, NULL) < 0) {
+			error("ERROR: Unable to add common tags to TSS request\n");
 			plist_free(request);
 			plist_free(parameters);
 			return -1;
 		}
-	} else {
-		/* add personalized parameters */
-		if (tss_request_add_ap_img3_tags(request, parameters) < 0) {
-			error("ERROR: Unable to add img3 tags to TSS request\n");
+
+		/* add tags from manifest */
+		if (tss_request_add_ap_tags(request, parameters, NULL) < 0) {
+			error("ERROR: Unable to add common tags to TSS request\n");
 			plist_free(request);
 			plist_free(parameters);
 			return -1;
 		}
+
+		if (client->image4supported) {
+			/* add personalized parameters */
+			if (tss_request_add_ap_img4_tags(request, parameters) < 0) {
+				error("ERROR: Unable to add img4 tags to TSS request\n");
+				plist_free(request);
+				plist_free(parameters);
+				return -1;
+			}
+		} else {
+			/* add personalized parameters */
+			if (tss_request_add_ap_img3_tags(request, parameters) < 0) {
+				error("ERROR: Unable to add img3 tags to TSS request\n");
+				plist_free(request);
+				plist_free(parameters);
+				return -1;
+			}
+		}
 	}
 
 	if (client->mode == MODE_NORMAL) {
@@ -2245,7 +2629,7 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
 	}
 
 	/* send request and grab response */
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	if (response == NULL) {
 		info("ERROR: Unable to send TSS request\n");
 		plist_free(request);
@@ -2263,11 +2647,9 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
 	return 0;
 }
 
-int get_recoveryos_root_ticket_tss_response(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss)
+static plist_t recoveryos_root_ticket_tss_request_new(struct idevicerestore_client_t* client, plist_t build_identity)
 {
 	plist_t request = NULL;
-	plist_t response = NULL;
-	*tss = NULL;
 
 	/* populate parameters */
 	plist_t parameters = plist_new_dict();
@@ -2309,7 +2691,7 @@ int get_recoveryos_root_ticket_tss_response(struct idevicerestore_client_t* clie
 	if (request == NULL) {
 		error("ERROR: Unable to create TSS request\n");
 		plist_free(parameters);
-		return -1;
+		return NULL;
 	}
 
 	/* add common tags from manifest */
@@ -2318,7 +2700,7 @@ int get_recoveryos_root_ticket_tss_response(struct idevicerestore_client_t* clie
 		error("ERROR: Unable to add AP IMG4 tags to TSS request\n");
 		plist_free(request);
 		plist_free(parameters);
-		return -1;
+		return NULL;
 	}
 
 	/* add AP tags from manifest */
@@ -2326,7 +2708,7 @@ int get_recoveryos_root_ticket_tss_response(struct idevicerestore_client_t* clie
 		error("ERROR: Unable to add common tags to TSS request\n");
 		plist_free(request);
 		plist_free(parameters);
-		return -1;
+		return NULL;
 	}
 
 	/* add AP tags from manifest */
@@ -2335,23 +2717,35 @@ int get_recoveryos_root_ticket_tss_response(struct idevicerestore_client_t* clie
 		error("ERROR: Unable to add common tags to TSS request\n");
 		plist_free(request);
 		plist_free(parameters);
+		return NULL;
+	}
+
+	plist_free(parameters);
+
+	return request;
+}
+
+int get_recoveryos_root_ticket_tss_response(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss)
+{
+	plist_t response = NULL;
+	*tss = NULL;
+
+	plist_t request = recoveryos_root_ticket_tss_request_new(client, build_identity);
+	if (request == NULL) {
 		return -1;
 	}
 
 	/* send request and grab response */
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	if (response == NULL) {
 		info("ERROR: Unable to send TSS request\n");
 		plist_free(request);
-		plist_free(parameters);
 		return -1;
 	}
-	// request_add_ap_tags
 
 	info("Received SHSH blobs\n");
 
 	plist_free(request);
-	plist_free(parameters);
 
 	*tss = response;
 
@@ -2428,7 +2822,7 @@ int get_recovery_os_local_policy_tss_response(
 	}
 
 	/* send request and grab response */
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	if (response == NULL) {
 		info("ERROR: Unable to send TSS request\n");
 		plist_free(request);
@@ -2513,7 +2907,7 @@ int get_local_policy_tss_response(struct idevicerestore_client_t* client, plist_
 	}
 
 	/* send request and grab response */
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	if (response == NULL) {
 		info("ERROR: Unable to send TSS request\n");
 		plist_free(request);
@@ -2572,10 +2966,53 @@ int build_manifest_get_identity_count(plist_t build_manifest)
 	return plist_array_get_size(build_identities_array);
 }
 
-int extract_component(const char* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size)
+int extract_component(struct idevicerestore_client_t* client, const char* path, unsigned char** component_data, unsigned int* component_size)
+{
+	if (client && client->prefetch && path && component_data && component_size) {
+		if (prefetch_take_component(client->prefetch, path, component_data, component_size) == 0) {
+			debug("DEBUG: Using prefetched %s\n", path);
+			return 0;
+		}
+	}
+	return _extract_component(client, path, component_data, component_size);
+}
+
+static int extract_component_to_buffer(ipsw_archive_t ipsw, const char* path, unsigned int headroom, unsigned int size, struct component_buffer* cb)
+{
+	unsigned char* data = component_buffer_reserve(cb, headroom, size);
+	if (!data) {
+		return -1;
+	}
+	ipsw_file_handle_t file = ipsw_file_open(ipsw, path);
+	if (!file) {
+		component_buffer_free(cb);
+		return -1;
+	}
+	unsigned int done = 0;
+	while (done < size) {
+		int64_t r = ipsw_file_read(file, data + done, size - done);
+		if (r <= 0) {
+			break;
+		}
+		done += (unsigned int)r;
+	}
+	ipsw_file_close(file);
+	if (done != size) {
+		error("ERROR: %s: read %u of %u bytes of %s\n", __func__, done, size, path);
+		component_buffer_free(cb);
+		return -1;
+	}
+	return 0;
+}
+
+static int extract_component_with_headroom(struct idevicerestore_client_t* client, const char* path, unsigned int headroom, struct component_buffer* cb)
 {
 	char* component_name = NULL;
-	if (!ipsw || !path || !component_data || !component_size) {
+	unsigned char key[CACHE_KEY_SIZE];
+	int have_key = 0;
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+	if (!client || !client->ipsw || !path || !cb) {
 		return -1;
 	}
 
@@ -2585,54 +3022,213 @@ int extract_component(const char* ipsw, const char* path, unsigned char** compon
 	else
 		component_name = (char*) path;
 
+	unsigned char* map_base = NULL;
+	size_t map_size = 0;
+	unsigned int map_head = 0;
+	if (headroom > 0 && ipsw_map_file(client->ipsw, path, headroom, COMPONENT_BUFFER_TAILROOM, &map_base, &map_size, &map_head, &size) == 0) {
+		/* unpacked firmware is read straight from the page cache, there is
+		 * nothing to gain from the component cache */
+		debug("DEBUG: Mapped %s (%s)\n", component_name, path);
+		component_buffer_attach_mapping(cb, map_base, map_size, map_head, size);
+		/* only its personalized output goes to the cache */
+		if (client->component_cache && ipsw_get_file_key(client->ipsw, path, cb->key) == 0) {
+			cb->have_key = 1;
+		}
+		return 0;
+	}
+
+	if (client->component_cache && ipsw_get_file_key(client->ipsw, path, key) == 0) {
+		have_key = 1;
+		if (cache_get(client->component_cache, key, &data, &size) == 0) {
+			info("Using cached %s (%s)\n", component_name, path);
+			component_buffer_attach(cb, data, size);
+			memcpy(cb->key, key, CACHE_KEY_SIZE);
+			cb->have_key = 1;
+			return 0;
+		}
+	}
+
 	info("Extracting %s (%s)...\n", component_name, path);
-	if (ipsw_extract_to_memory(ipsw, path, component_data, component_size) < 0) {
-		error("ERROR: Unable to extract %s from %s\n", component_name, ipsw);
+	uint64_t begin = telemetry_begin();
+	uint64_t fsize = 0;
+	if (headroom > 0 && ipsw_get_file_size(client->ipsw, path, &fsize) == 0 && fsize >= MEM_BUDGET_MIN_SIZE && fsize <= UINT_MAX - headroom) {
+		/* large components are accounted against the memory budget */
+		if (extract_component_to_buffer(client->ipsw, path, headroom, (unsigned int)fsize, cb) < 0) {
+			error("ERROR: Unable to extract %s from %s\n", component_name, ipsw_get_path(client->ipsw));
+			return -1;
+		}
+		size = cb->size;
+	} else {
+		if (ipsw_extract_to_memory_with_headroom(client->ipsw, path, headroom, &data, &size) < 0) {
+			error("ERROR: Unable to extract %s from %s\n", component_name, ipsw_get_path(client->ipsw));
+			return -1;
+		}
+		component_buffer_attach_base(cb, data, headroom, size, headroom + size + 1);
+	}
+	telemetry_end(client->telemetry, "ipsw_extract", begin, size);
+
+	if (have_key) {
+		cache_put(client->component_cache, key, component_buffer_data(cb), cb->size);
+		memcpy(cb->key, key, CACHE_KEY_SIZE);
+		cb->have_key = 1;
+	}
+
+	return 0;
+}
+
+int _extract_component(struct idevicerestore_client_t* client, const char* path, unsigned char** component_data, unsigned int* component_size)
+{
+	struct component_buffer cb;
+	if (!component_data || !component_size) {
 		return -1;
 	}
+	component_buffer_init(&cb);
+	if (extract_component_with_headroom(client, path, 0, &cb) < 0) {
+		return -1;
+	}
+	*component_data = component_buffer_detach(&cb, component_size);
+	return 0;
+}
+
+int extract_component_buffer(struct idevicerestore_client_t* client, const char* path, struct component_buffer* cb)
+{
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+	if (client && client->prefetch && path && cb) {
+		if (prefetch_take_component(client->prefetch, path, &data, &size) == 0) {
+			debug("DEBUG: Using prefetched %s\n", path);
+			component_buffer_attach(cb, data, size);
+			return 0;
+		}
+	}
+	/* leave room for the IMG4 headers so personalizing doesn't copy it */
+	return extract_component_with_headroom(client, path, COMPONENT_BUFFER_HEADROOM, cb);
+}
 
+/* The raw component's key and a digest of the ticket, which is small, so no
+ * lookup has to hash the payload */
+static void personalized_component_key(unsigned char* key, const unsigned char* component_key, const unsigned char* blob, unsigned int blob_size)
+{
+	unsigned char buf[1 + CACHE_KEY_SIZE * 2];
+	/* personalized and unpersonalized entries share the cache */
+	buf[0] = 'P';
+	memcpy(buf + 1, component_key, CACHE_KEY_SIZE);
+	cache_key_from_data(buf + 1 + CACHE_KEY_SIZE, blob, blob_size);
+	cache_key_from_data(key, buf, sizeof(buf));
+}
+
+static int personalize_component_prefetched(struct idevicerestore_client_t* client, const char *component_name, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, struct component_buffer* cb)
+{
+	unsigned char* ticket = NULL;
+	unsigned int ticket_size = 0;
+	int res = -1;
+	if (client && client->prefetch && tss_response && tss_response_get_ap_img4_ticket(tss_response, &ticket, &ticket_size) == 0) {
+		res = prefetch_take_personalized(client->prefetch, component_name, component_data, component_size, ticket, ticket_size, cb);
+		free(ticket);
+		if (res == 0) {
+			debug("DEBUG: Using prefetched personalized %s\n", component_name);
+		}
+	}
+	return res;
+}
+
+int personalize_component(struct idevicerestore_client_t* client, const char *component_name, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size)
+{
+	struct component_buffer cb;
+	component_buffer_init(&cb);
+	if (personalize_component_prefetched(client, component_name, component_data, component_size, tss_response, &cb) < 0) {
+		if (component_buffer_copy(&cb, component_data, component_size) < 0) {
+			return -1;
+		}
+		if (_personalize_component(client, component_name, &cb, tss_response) < 0) {
+			component_buffer_free(&cb);
+			return -1;
+		}
+	}
+	*personalized_component = component_buffer_detach(&cb, personalized_component_size);
 	return 0;
 }
 
-int personalize_component(const char *component_name, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size)
+int personalize_component_buffer(struct idevicerestore_client_t* client, const char *component_name, struct component_buffer* cb, plist_t tss_response)
+{
+	struct component_buffer prefetched;
+	component_buffer_init(&prefetched);
+	if (personalize_component_prefetched(client, component_name, component_buffer_data(cb), cb->size, tss_response, &prefetched) == 0) {
+		component_buffer_free(cb);
+		*cb = prefetched;
+		return 0;
+	}
+	return _personalize_component(client, component_name, cb, tss_response);
+}
+
+int _personalize_component(struct idevicerestore_client_t* client, const char *component_name, struct component_buffer* cb, plist_t tss_response)
 {
 	unsigned char* component_blob = NULL;
 	unsigned int component_blob_size = 0;
 	unsigned char* stitched_component = NULL;
 	unsigned int stitched_component_size = 0;
+	unsigned char key[CACHE_KEY_SIZE];
+	cache_t cache = (client && cb->have_key) ? client->component_cache : NULL;
+	unsigned char component_key[CACHE_KEY_SIZE];
+
+	/* whatever comes out, it is no longer the extracted component */
+	memcpy(component_key, cb->key, CACHE_KEY_SIZE);
+	cb->have_key = 0;
 
 	if (tss_response && tss_response_get_ap_img4_ticket(tss_response, &component_blob, &component_blob_size) == 0) {
-		/* stitch ApImg4Ticket into IMG4 file */
-		img4_stitch_component(component_name, component_data, component_size, component_blob, component_blob_size, &stitched_component, &stitched_component_size);
+		if (cache) {
+			personalized_component_key(key, component_key, component_blob, component_blob_size);
+			if (cache_get(cache, key, &stitched_component, &stitched_component_size) == 0) {
+				debug("DEBUG: Using cached personalized %s\n", component_name);
+				component_buffer_attach(cb, stitched_component, stitched_component_size);
+			}
+		}
+		if (!stitched_component) {
+			/* stitch ApImg4Ticket into IMG4 file */
+			if (img4_stitch_component_buffer(component_name, cb, component_blob, component_blob_size) < 0) {
+				error("ERROR: Unable to stitch ApImg4Ticket into %s\n", component_name);
+				free(component_blob);
+				return -1;
+			}
+			if (cache) {
+				cache_put(cache, key, component_buffer_data(cb), cb->size);
+			}
+		}
 	} else {
 		/* try to get blob for current component from tss response */
-		if (tss_response && tss_response_get_blob_by_entry(tss_response, component_name, &component_blob) < 0) {
+		if (tss_response && tss_response_get_blob_by_entry(tss_response, component_name, &component_blob, &component_blob_size) < 0) {
 			debug("NOTE: No SHSH blob found for component %s\n", component_name);
 		}
 
 		if (component_blob != NULL) {
-			if (img3_stitch_component(component_name, component_data, component_size, component_blob, 64, &stitched_component, &stitched_component_size) < 0) {
-				error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
-				free(component_blob);
-				return -1;
+			if (cache) {
+				personalized_component_key(key, component_key, component_blob, component_blob_size);
+				if (cache_get(cache, key, &stitched_component, &stitched_component_size) == 0) {
+					debug("DEBUG: Using cached personalized %s\n", component_name);
+				}
 			}
+			if (!stitched_component) {
+				if (img3_stitch_component(component_name, component_buffer_data(cb), cb->size, component_blob, component_blob_size, &stitched_component, &stitched_component_size) < 0) {
+					error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
+					free(component_blob);
+					return -1;
+				}
+				if (cache) {
+					cache_put(cache, key, stitched_component, stitched_component_size);
+				}
+			}
+			component_buffer_attach(cb, stitched_component, stitched_component_size);
 		} else {
+			/* the component is used as it is */
 			info("Not personalizing component %s...\n", component_name);
-			stitched_component = (unsigned char*)malloc(component_size);
-			if (stitched_component) {
-				stitched_component_size = component_size;
-				memcpy(stitched_component, component_data, component_size);
-			}
 		}
 	}
 	free(component_blob);
 
-	if (idevicerestore_keep_pers) {
-		write_file(component_name, stitched_component, stitched_component_size);
+	if (client && (client->flags & FLAG_KEEP_PERS)) {
+		write_file(component_name, component_buffer_data(cb), cb->size);
 	}
 
-	*personalized_component = stitched_component;
-	*personalized_component_size = stitched_component_size;
 	return 0;
 }
 
@@ -2727,7 +3323,7 @@ void build_identity_print_information(plist_t build_identity)
 	node = NULL;
 }
 
-int build_identity_check_components_in_ipsw(plist_t build_identity, const char *ipsw)
+int build_identity_check_components_in_ipsw(plist_t build_identity, ipsw_archive_t ipsw)
 {
 	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
 	if (!manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
@@ -2763,6 +3359,12 @@ int build_identity_check_components_in_ipsw(plist_t build_identity, const char *
 
 int build_identity_has_component(plist_t build_identity, const char* component)
 {
+	const struct build_manifest_component* comp = NULL;
+	int res = build_manifest_get_component(build_identity, component, &comp);
+	if (res != -2) {
+		return (res == 0);
+	}
+
 	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
 	if (!manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
 		return 0;
@@ -2780,6 +3382,22 @@ int build_identity_get_component_path(plist_t build_identity, const char* compon
 {
 	char* filename = NULL;
 
+	const struct build_manifest_component* comp = NULL;
+	int res = build_manifest_get_component(build_identity, component, &comp);
+	if (res == -1) {
+		error("ERROR: Unable to find component node for %s\n", component);
+		return -1;
+	} else if (res == 0) {
+		if (!comp->path) {
+			error("ERROR: Unable to find component info path node for %s\n", component);
+			return -1;
+		}
+		*path = strdup(comp->path);
+		return 0;
+	}
+
+	/* not part of an indexed build manifest, e.g. the identity built for custom firmware */
+
 	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
 	if (!manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
 		error("ERROR: Unable to find manifest node\n");
@@ -2819,42 +3437,10 @@ int build_identity_get_component_path(plist_t build_identity, const char* compon
 
 const char* get_component_name(const char* filename)
 {
-	if (!strncmp(filename, "LLB", 3)) {
-		return "LLB";
-	} else if (!strncmp(filename, "iBoot", 5)) {
-		return "iBoot";
-	} else if (!strncmp(filename, "DeviceTree", 10)) {
-		return "DeviceTree";
-	} else if (!strncmp(filename, "applelogo", 9)) {
-		return "AppleLogo";
-	} else if (!strncmp(filename, "liquiddetect", 12)) {
-		return "Liquid";
-	} else if (!strncmp(filename, "lowpowermode", 12)) {
-		return "LowPowerWallet0";
-	} else if (!strncmp(filename, "recoverymode", 12)) {
-		return "RecoveryMode";
-	} else if (!strncmp(filename, "batterylow0", 11)) {
-		return "BatteryLow0";
-	} else if (!strncmp(filename, "batterylow1", 11)) {
-		return "BatteryLow1";
-	} else if (!strncmp(filename, "glyphcharging", 13)) {
-		return "BatteryCharging";
-	} else if (!strncmp(filename, "glyphplugin", 11)) {
-		return "BatteryPlugin";
-	} else if (!strncmp(filename, "batterycharging0", 16)) {
-		return "BatteryCharging0";
-	} else if (!strncmp(filename, "batterycharging1", 16)) {
-		return "BatteryCharging1";
-	} else if (!strncmp(filename, "batteryfull", 11)) {
-		return "BatteryFull";
-	} else if (!strncmp(filename, "needservice", 11)) {
-		return "NeedService";
-	} else if (!strncmp(filename, "SCAB", 4)) {
-		return "SCAB";
-	} else if (!strncmp(filename, "sep-firmware", 12)) {
-		return "RestoreSEP";
-	} else {
+	const struct component_info* info = component_registry_lookup_file(filename);
+	if (!info) {
 		error("WARNING: Unhandled component '%s'", filename);
 		return NULL;
 	}
+	return info->name;
 }
@@ -33,6 +33,9 @@ extern "C" {
 #include <plist/plist.h>
 #include <libirecovery.h>
 
+#include "ipsw.h"
+#include "component_buffer.h"
+
 // the flag with value 1 is reserved for internal use only. don't use it.
 #define FLAG_DEBUG           (1 << 1)
 #define FLAG_ERASE           (1 << 2)
@@ -46,6 +49,8 @@ extern "C" {
 #define FLAG_ALLOW_RESTORE_MODE (1 << 10)
 #define FLAG_NO_RESTORE      (1 << 11)
 #define FLAG_IGNORE_ERRORS   (1 << 12)
+#define FLAG_KEEP_PERS       (1 << 13)
+#define FLAG_VERIFY          (1 << 14)
 
 #define RESTORE_VARIANT_ERASE_INSTALL      "Erase Install (IPSW)"
 #define RESTORE_VARIANT_UPGRADE_INSTALL    "Upgrade Install (IPSW)"
@@ -79,6 +84,9 @@ void idevicerestore_set_udid(struct idevicerestore_client_t* client, const char*
 void idevicerestore_set_flags(struct idevicerestore_client_t* client, int flags);
 void idevicerestore_set_ipsw(struct idevicerestore_client_t* client, const char* path);
 void idevicerestore_set_cache_path(struct idevicerestore_client_t* client, const char* path);
+void idevicerestore_set_metrics_path(struct idevicerestore_client_t* client, const char* path);
+/* writes the timing summary of the last restore if a metrics path is set */
+void idevicerestore_write_metrics(struct idevicerestore_client_t* client, int result);
 void idevicerestore_set_progress_callback(struct idevicerestore_client_t* client, idevicerestore_progress_cb_t cbfunc, void* userdata);
 void idevicerestore_set_info_stream(FILE* strm);
 void idevicerestore_set_error_stream(FILE* strm);
@@ -108,12 +116,18 @@ plist_t build_manifest_get_build_identity_for_model(plist_t build_manifest, cons
 plist_t build_manifest_get_build_identity_for_model_with_variant(plist_t build_manifest, const char *hardware_model, const char *variant);
 int build_manifest_get_build_count(plist_t build_manifest);
 void build_identity_print_information(plist_t build_identity);
-int build_identity_check_components_in_ipsw(plist_t build_identity, const char* ipsw);
+int build_identity_check_components_in_ipsw(plist_t build_identity, ipsw_archive_t ipsw);
 int build_identity_has_component(plist_t build_identity, const char* component);
 int build_identity_get_component_path(plist_t build_identity, const char* component, char** path);
 int ipsw_extract_filesystem(const char* ipsw, plist_t build_identity, char** filesystem);
-int extract_component(const char* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size);
-int personalize_component(const char *component, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size);
+int extract_component(struct idevicerestore_client_t* client, const char* path, unsigned char** component_data, unsigned int* component_size);
+int personalize_component(struct idevicerestore_client_t* client, const char *component, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size);
+/* the component is extracted with headroom and personalized in place */
+int extract_component_buffer(struct idevicerestore_client_t* client, const char* path, struct component_buffer* cb);
+int personalize_component_buffer(struct idevicerestore_client_t* client, const char *component, struct component_buffer* cb, plist_t tss_response);
+/* same as above without looking at prefetched components */
+int _extract_component(struct idevicerestore_client_t* client, const char* path, unsigned char** component_data, unsigned int* component_size);
+int _personalize_component(struct idevicerestore_client_t* client, const char *component, struct component_buffer* cb, plist_t tss_response);
 int get_preboard_manifest(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* manifest);
 
 const char* get_component_name(const char* filename);
@@ -29,342 +29,175 @@
 #include "common.h"
 #include "idevicerestore.h"
 
-static void img3_free(img3_file* image);
-static img3_element* img3_parse_element(const unsigned char* data);
-static void img3_free_element(img3_element* element);
+static int img3_is_known_element(unsigned int type)
+{
+	switch (type) {
+	case kTypeElement:
+	case kDataElement:
+	case kVersElement:
+	case kSepoElement:
+	case kBordElement:
+	case kChipElement:
+	case kKbagElement:
+	case kEcidElement:
+	case kShshElement:
+	case kCertElement:
+	case kUnknElement:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-static img3_file* img3_parse_file(const unsigned char* data, unsigned int size) {
-	unsigned int data_offset = 0;
-	img3_element* element;
-	img3_header* header = (img3_header*) data;
-	if (header->signature != kImg3Container) {
-		error("ERROR: Invalid IMG3 file\n");
-		return NULL;
+int img3_next_element(const unsigned char* data, unsigned int size, unsigned int* offset, img3_element_view* element)
+{
+	if (*offset >= size) {
+		return 0;
+	}
+	if (size - *offset < sizeof(img3_element_header)) {
+		error("ERROR: Truncated IMG3 element at offset %u\n", *offset);
+		return -1;
 	}
+	const img3_element_header* header = (const img3_element_header*)(data + *offset);
+	if (header->full_size < sizeof(img3_element_header) || header->full_size > size - *offset) {
+		error("ERROR: Invalid size %u of IMG3 element at offset %u\n", header->full_size, *offset);
+		return -1;
+	}
+	element->data = data + *offset;
+	element->size = header->full_size;
+	element->type = (img3_element_type)header->signature;
+	*offset += header->full_size;
+	return 1;
+}
 
-	img3_file* image = (img3_file*) malloc(sizeof(img3_file));
-	if (image == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 file\n");
-		return NULL;
+/* The elements point into data, nothing is copied */
+static int img3_parse_view(const unsigned char* data, unsigned int size, img3_view* image)
+{
+	const img3_header* header = (const img3_header*)data;
+	if (size < sizeof(img3_header) || header->signature != kImg3Container) {
+		error("ERROR: Invalid IMG3 file\n");
+		return -1;
 	}
-	memset(image, '\0', sizeof(img3_file));
+
+	memset(image, '\0', sizeof(img3_view));
+	image->data = data;
+	image->size = size;
+	image->header = header;
 	image->idx_ecid_element = -1;
 	image->idx_shsh_element = -1;
 	image->idx_cert_element = -1;
 
-	image->header = (img3_header*) malloc(sizeof(img3_header));
-	if (image->header == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 header\n");
-		img3_free(image);
-		return NULL;
-	}
-	memcpy(image->header, data, sizeof(img3_header));
-	data_offset += sizeof(img3_header);
-
-	img3_element_header* current = NULL;
-	while (data_offset < size) {
-		current = (img3_element_header*) &data[data_offset];
-		switch (current->signature) {
-		case kTypeElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse TYPE element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed TYPE element\n");
-			break;
-
-		case kDataElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse DATA element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed DATA element\n");
-			break;
-
-		case kVersElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse VERS element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed VERS element\n");
-			break;
-
-		case kSepoElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse SEPO element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed SEPO element\n");
-			break;
-
-		case kBordElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse BORD element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed BORD element\n");
-			break;
-
-		case kChipElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse CHIP element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed CHIP element\n");
-			break;
-
-		case kKbagElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse first KBAG element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed KBAG element\n");
-			break;
-
+	unsigned int offset = sizeof(img3_header);
+	img3_element_view element;
+	int res;
+	while ((res = img3_next_element(data, size, &offset, &element)) > 0) {
+		if (!img3_is_known_element(element.type)) {
+			error("ERROR: Unknown IMG3 element type %08x\n", element.type);
+			return -1;
+		}
+		if (image->num_elements >= IMG3_MAX_ELEMENTS - 3) {
+			/* room must be left for the signature elements */
+			error("ERROR: Too many IMG3 elements\n");
+			return -1;
+		}
+		switch (element.type) {
 		case kEcidElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse ECID element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_ecid_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed ECID element\n");
 			break;
-
 		case kShshElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse SHSH element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_shsh_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed SHSH element\n");
 			break;
-
 		case kCertElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse CERT element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_cert_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed CERT element\n");
 			break;
-
-		case kUnknElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse UNKN element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed UNKN element\n");
-			break;
-
 		default:
-			error("ERROR: Unknown IMG3 element type %08x\n", current->signature);
-			img3_free(image);
-			return NULL;
-		}
-		data_offset += current->full_size;
-	}
-
-	return image;
-}
-
-static img3_element* img3_parse_element(const unsigned char* data) {
-	img3_element_header* element_header = (img3_element_header*) data;
-	img3_element* element = (img3_element*) malloc(sizeof(img3_element));
-	if (element == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 element\n");
-		return NULL;
-	}
-	memset(element, '\0', sizeof(img3_element));
-
-	element->data = (unsigned char*) malloc(element_header->full_size);
-	if (element->data == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 element data\n");
-		free(element);
-		return NULL;
-	}
-	memcpy(element->data, data, element_header->full_size);
-	element->header = (img3_element_header*) element->data;
-	element->type = (img3_element_type) element->header->signature;
-
-	return element;
-}
-
-static void img3_free(img3_file* image) {
-	if (image != NULL) {
-		if (image->header != NULL) {
-			free(image->header);
-		}
-
-		int i;
-		for (i = 0; i < image->num_elements; i++) {
-			img3_free_element(image->elements[i]);
-			image->elements[i] = NULL;
+			break;
 		}
-		free(image);
-		image = NULL;
+		image->elements[image->num_elements++] = element;
 	}
+	return res;
 }
 
-static void img3_free_element(img3_element* element) {
-	if (element != NULL) {
-		if (element->data != NULL) {
-			free(element->data);
-			element->data = NULL;
-		}
-		free(element);
-		element = NULL;
+static void img3_insert_element(img3_view* image, int idx, const img3_element_view* element)
+{
+	memmove(&image->elements[idx+1], &image->elements[idx], (image->num_elements - idx) * sizeof(img3_element_view));
+	image->elements[idx] = *element;
+	image->num_elements++;
+	if (image->idx_ecid_element >= idx) image->idx_ecid_element++;
+	if (image->idx_shsh_element >= idx) image->idx_shsh_element++;
+	if (image->idx_cert_element >= idx) image->idx_cert_element++;
+	switch (element->type) {
+	case kEcidElement:
+		image->idx_ecid_element = idx;
+		break;
+	case kShshElement:
+		image->idx_shsh_element = idx;
+		break;
+	case kCertElement:
+		image->idx_cert_element = idx;
+		break;
+	default:
+		break;
 	}
 }
 
-static int img3_replace_signature(img3_file* image, const unsigned char* signature) {
-	int i, oldidx;
-	int offset = 0;
-	img3_element* ecid = img3_parse_element(&signature[offset]);
-	if (ecid == NULL || ecid->type != kEcidElement) {
+/* Makes the ECID, SHSH and CERT elements of the view point into signature */
+static int img3_replace_signature(img3_view* image, const unsigned char* signature, unsigned int signature_size) {
+	unsigned int offset = 0;
+	img3_element_view ecid, shsh, cert;
+	if (img3_next_element(signature, signature_size, &offset, &ecid) <= 0 || ecid.type != kEcidElement) {
 		error("ERROR: Unable to find ECID element in signature\n");
 		return -1;
 	}
-	offset += ecid->header->full_size;
-
-	img3_element* shsh = img3_parse_element(&signature[offset]);
-	if (shsh == NULL || shsh->type != kShshElement) {
+	if (img3_next_element(signature, signature_size, &offset, &shsh) <= 0 || shsh.type != kShshElement) {
 		error("ERROR: Unable to find SHSH element in signature\n");
 		return -1;
 	}
-	offset += shsh->header->full_size;
-
-	img3_element* cert = img3_parse_element(&signature[offset]);
-	if (cert == NULL || cert->type != kCertElement) {
+	if (img3_next_element(signature, signature_size, &offset, &cert) <= 0 || cert.type != kCertElement) {
 		error("ERROR: Unable to find CERT element in signature\n");
 		return -1;
 	}
-	offset += cert->header->full_size;
 
 	if (image->idx_ecid_element >= 0) {
-		img3_free_element(image->elements[image->idx_ecid_element]);
 		image->elements[image->idx_ecid_element] = ecid;
+	} else if (image->idx_shsh_element >= 0) {
+		img3_insert_element(image, image->idx_shsh_element, &ecid);
 	} else {
-		if (image->idx_shsh_element >= 0) {
-			// move elements by 1
-			oldidx = image->idx_shsh_element;
-			for (i = image->num_elements-1; i >= oldidx; i--) {
-				image->elements[i+1] = image->elements[i];
-				switch (image->elements[i+1]->type) {
-				case kShshElement:
-					image->idx_shsh_element = i+1;
-					break;
-				case kCertElement:
-					image->idx_cert_element = i+1;
-					break;
-				case kEcidElement:
-					image->idx_ecid_element = i+1;
-					break;
-				default:
-					break;
-				}
-			}
-			image->elements[oldidx] = ecid;
-			image->idx_ecid_element = oldidx;
-			image->num_elements++;
-		} else {
-			// append if not found
-			image->elements[image->num_elements] = ecid;
-			image->idx_ecid_element = image->num_elements;
-			image->num_elements++;
-		}
+		// append if not found
+		img3_insert_element(image, image->num_elements, &ecid);
 	}
 
 	if (image->idx_shsh_element >= 0) {
-		img3_free_element(image->elements[image->idx_shsh_element]);
 		image->elements[image->idx_shsh_element] = shsh;
+	} else if (image->idx_cert_element >= 0) {
+		img3_insert_element(image, image->idx_cert_element, &shsh);
 	} else {
-		if (image->idx_cert_element >= 0) {
-			// move elements by 1
-			oldidx = image->idx_cert_element;
-			for (i = image->num_elements-1; i >= oldidx; i--) {
-				image->elements[i+1] = image->elements[i];
-				switch (image->elements[i+1]->type) {
-				case kShshElement:
-					image->idx_shsh_element = i+1;
-					break;
-				case kCertElement:
-					image->idx_cert_element = i+1;
-					break;
-				case kEcidElement:
-					image->idx_ecid_element = i+1;
-					break;
-				default:
-					break;
-				}
-			}
-			image->elements[oldidx] = shsh;
-			image->idx_shsh_element = oldidx;
-			image->num_elements++;
-		} else {
-			// append if not found
-			image->elements[image->num_elements] = shsh;
-			image->idx_shsh_element = image->num_elements;
-			image->num_elements++;
-		}
+		// append if not found
+		img3_insert_element(image, image->num_elements, &shsh);
 	}
 
 	if (image->idx_cert_element >= 0) {
-		img3_free_element(image->elements[image->idx_cert_element]);
 		image->elements[image->idx_cert_element] = cert;
 	} else {
 		// append if not found
-		image->elements[image->num_elements] = cert;
-		image->idx_cert_element = image->num_elements;
-		image->num_elements++;
+		img3_insert_element(image, image->num_elements, &cert);
 	}
 
 	return 0;
 }
 
-static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int* psize) {
+/* Writes the image in one pass into an allocation of the exact size,
+ * elements that were adjacent in their source are copied together */
+static int img3_get_data(img3_view* image, unsigned char** pdata, unsigned int* psize) {
 	int i;
-	int offset = 0;
-	int size = sizeof(img3_header);
+	unsigned int offset = 0;
+	unsigned int size = sizeof(img3_header);
 
-	// Add up the size of the image first so we can allocate our memory
 	for (i = 0; i < image->num_elements; i++) {
-		size += image->elements[i]->header->full_size;
+		size += image->elements[i].size;
 	}
 
-	info("reconstructed size: %d\n", size);
+	debug("DEBUG: %s: reconstructed size: %u\n", __func__, size);
 
 	unsigned char* data = (unsigned char*) malloc(size);
 	if (data == NULL) {
@@ -372,21 +205,35 @@ static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int*
 		return -1;
 	}
 
-	// Add data to our new header (except shsh_offset)
 	img3_header* header = (img3_header*) data;
 	header->full_size = size;
 	header->signature = image->header->signature;
 	header->data_size = size - sizeof(img3_header);
+	header->shsh_offset = 0;
 	header->image_type = image->header->image_type;
 	offset += sizeof(img3_header);
 
-	// Copy each section over to the new buffer
+	const unsigned char* run = NULL;
+	unsigned int run_size = 0;
 	for (i = 0; i < image->num_elements; i++) {
-		memcpy(&data[offset], image->elements[i]->data, image->elements[i]->header->full_size);
-		if (image->elements[i]->type == kShshElement) {
-			header->shsh_offset = offset - sizeof(img3_header);
+		const img3_element_view* element = &image->elements[i];
+		if (element->type == kShshElement) {
+			header->shsh_offset = offset + run_size - sizeof(img3_header);
 		}
-		offset += image->elements[i]->header->full_size;
+		if (run && run + run_size == element->data) {
+			run_size += element->size;
+			continue;
+		}
+		if (run) {
+			memcpy(data + offset, run, run_size);
+			offset += run_size;
+		}
+		run = element->data;
+		run_size = element->size;
+	}
+	if (run) {
+		memcpy(data + offset, run, run_size);
+		offset += run_size;
 	}
 
 	if (offset != size) {
@@ -404,46 +251,40 @@ static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int*
 
 int img3_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img3_data, unsigned int *img3_size)
 {
-	img3_file *img3 = NULL;
+	img3_view img3;
 	unsigned char* outbuf = NULL;
 	unsigned int outsize = 0;
 
-	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !img3_data || !img3_size) {
+	if (!component_name || !component_data || component_size == 0 || !blob || blob_size < sizeof(img3_element_header) || !img3_data || !img3_size) {
 		return -1;
 	}
 
 	info("Personalizing IMG3 component %s...\n", component_name);
 
 	/* parse current component as img3 */
-	img3 = img3_parse_file(component_data, component_size);
-	if (img3 == NULL) {
+	if (img3_parse_view(component_data, component_size, &img3) < 0) {
 		error("ERROR: Unable to parse %s IMG3 file\n", component_name);
 		return -1;
 	}
 
-	if (((img3_element_header*)blob)->full_size != blob_size) {
-		error("ERROR: Invalid blob passed for %s IMG3: The size %d embedded in the blob does not match the passed size of %d\n", component_name, ((img3_element_header*)blob)->full_size, blob_size);
-		img3_free(img3);
+	if (((const img3_element_header*)blob)->full_size > blob_size) {
+		error("ERROR: Invalid blob passed for %s IMG3: The size %d embedded in the blob exceeds the passed size of %d\n", component_name, ((const img3_element_header*)blob)->full_size, blob_size);
 		return -1;
 	}
 
-	/* personalize the component using the blob */
-	if (img3_replace_signature(img3, blob) < 0) {
+	/* personalize the component using the blob, its ECID, SHSH and CERT
+	 * elements must all lie within blob_size */
+	if (img3_replace_signature(&img3, blob, blob_size) < 0) {
 		error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
-		img3_free(img3);
 		return -1;
 	}
 
 	/* get the img3 file as data */
-	if (img3_get_data(img3, &outbuf, &outsize) < 0) {
+	if (img3_get_data(&img3, &outbuf, &outsize) < 0) {
 		error("ERROR: Unable to reconstruct %s IMG3\n", component_name);
-		img3_free(img3);
 		return -1;
 	}
 
-	/* cleanup */
-	img3_free(img3);
-
 	*img3_data = outbuf;
 	*img3_size = outsize;
 
@@ -65,35 +65,31 @@ typedef struct {
 	unsigned int data_size;
 } img3_element_header;
 
+#define IMG3_MAX_ELEMENTS 19
+
+/* An element of an image in memory, data points at its header */
 typedef struct {
-	img3_element_header* header;
+	const unsigned char* data;
+	unsigned int size;
 	img3_element_type type;
-	unsigned char* data;
-} img3_element;
+} img3_element_view;
 
+/* Read-only view of an image, the elements point into the image or into
+ * the signature that replaced some of them */
 typedef struct {
-	unsigned char* data;
-	img3_header* header;
+	const unsigned char* data;
+	unsigned int size;
+	const img3_header* header;
 	int num_elements;
-	img3_element* elements[16];
+	img3_element_view elements[IMG3_MAX_ELEMENTS];
 	int idx_ecid_element;
 	int idx_shsh_element;
 	int idx_cert_element;
-/*	img3_element* type_element;
-	img3_element* data_element;
-	img3_element* vers_element;
-	img3_element* sepo_element;
-	img3_element* bord_element;
-	img3_element* sepo2_element;
-	img3_element* chip_element;
-	img3_element* bord2_element;
-	img3_element* kbag1_element;
-	img3_element* kbag2_element;
-	img3_element* ecid_element;
-	img3_element* shsh_element;
-	img3_element* cert_element;
-	img3_element* unkn_element;*/
-} img3_file;
+} img3_view;
+
+/* Decodes the element at *offset and advances *offset past it. Returns 1
+ * for an element, 0 at the end of data and -1 if it is malformed. */
+int img3_next_element(const unsigned char* data, unsigned int size, unsigned int* offset, img3_element_view* element);
 
 int img3_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img3_data, unsigned int *img3_size);
 
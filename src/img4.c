@@ -24,6 +24,8 @@
 
 #include "common.h"
 #include "img4.h"
+#include "component_buffer.h"
+#include "component_registry.h"
 
 #define ASN1_PRIVATE 0xc0
 #define ASN1_PRIMITIVE_TAG 0x1f
@@ -57,153 +59,257 @@ static void asn1_write_int_value(unsigned char **p, uint64_t value, int size)
 	*p += value_size;
 }
 
-static void asn1_write_size(unsigned int size, unsigned char** data, unsigned int *data_size)
+static unsigned int asn1_size_length(unsigned int size)
 {
-	unsigned int off = 0;
-
-	// first, calculate the size
 	if (size >= 0x1000000) {
-		// 1+4 bytes length
-		(*data)[off++] = 0x84;
-		(*data)[off++] = (size >> 24) & 0xFF;
-		(*data)[off++] = (size >> 16) & 0xFF;
-		(*data)[off++] = (size >> 8) & 0xFF;
-		(*data)[off++] = size & 0xFF;
+		return 5;
 	} else if (size >= 0x10000) {
-		// 1+3 bytes length
-		(*data)[off++] = 0x83;
-		(*data)[off++] = (size >> 16) & 0xFF;
-		(*data)[off++] = (size >> 8) & 0xFF;
-		(*data)[off++] = size & 0xFF;
+		return 4;
 	} else if (size >= 0x100) {
-		// 1+2 bytes length
-		(*data)[off++] = 0x82;
-		(*data)[off++] = (size >> 8) & 0xFF;
-		(*data)[off++] = (size & 0xFF);
+		return 3;
 	} else if (size >= 0x80) {
-		// 1+1 byte length
-		(*data)[off++] = 0x81;
-		(*data)[off++] = (size & 0xFF);
-	} else {
-		// 1 byte length
-		(*data)[off++] = size & 0xFF;
+		return 2;
 	}
+	return 1;
+}
+
+static void asn1_write_size(unsigned int size, unsigned char** data)
+{
+	unsigned char* p = *data;
+	unsigned int n = asn1_size_length(size);
 
-	*data += off;
-	*data_size += off;
+	if (n > 1) {
+		*p++ = 0x80 | (n - 1);
+	}
+	while (--n > 0) {
+		*p++ = (size >> (8 * (n - 1))) & 0xFF;
+	}
+	if (p == *data) {
+		*p++ = size & 0xFF;
+	}
+	*data = p;
 }
 
-static void asn1_write_element_header(unsigned char type, unsigned int size, unsigned char** data, unsigned int *data_size)
+/* Empty elements don't get a header at all, the device expects it that way */
+static unsigned int asn1_header_length(unsigned int size)
 {
-	unsigned int off = 0;
+	return (size == 0) ? 0 : 1 + asn1_size_length(size);
+}
 
-	if (!type || size == 0 || !data || !data_size) {
+static void asn1_write_header(unsigned char type, unsigned int size, unsigned char** data)
+{
+	if (size == 0) {
 		return;
 	}
+	*(*data)++ = type;
+	asn1_write_size(size, data);
+}
 
-	(*data)[off++] = type;
-	*data += off;
+static unsigned int asn1_priv_tag_length(uint32_t tag)
+{
+	unsigned int n = 0;
+	while (tag > 0) {
+		tag >>= 7;
+		n++;
+	}
+	return 1 + n;
+}
 
-	asn1_write_size(size, data, &off);
+static void asn1_write_priv_tag(uint32_t tag, unsigned char** data)
+{
+	unsigned int n = asn1_priv_tag_length(tag) - 1;
+	unsigned int i;
 
-	*data_size += off;
+	*(*data)++ = ASN1_PRIVATE | ASN1_CONSTRUCTED | ASN1_PRIMITIVE_TAG;
+	for (i = n; i > 0; i--) {
+		(*data)[i-1] = (tag & 0x7f) | ((i != n) ? 0x80 : 0);
+		tag >>= 7;
+	}
+	*data += n;
 }
 
-static unsigned char* asn1_create_element_header(unsigned char type, unsigned int size, unsigned char** data, unsigned int *data_size)
+/* Two-phase DER encoder. Elements are recorded in document order, then the
+ * lengths are summed up from the innermost element outwards and everything
+ * is written into one buffer of the exact size. Data is referenced, not
+ * copied, so it has to stay valid until der_finish(). */
+enum der_kind {
+	DER_CONSTRUCTED,
+	DER_PRIVATE,
+	DER_DATA,
+	DER_INTEGER,
+	DER_BOOLEAN
+};
+
+struct der_node {
+	enum der_kind kind;
+	unsigned char type;
+	int parent;
+	uint32_t tag;
+	const void* data;
+	uint64_t value;
+	unsigned int content_length;
+};
+
+struct der_encoder {
+	struct der_node* nodes;
+	int count;
+	int capacity;
+	int current;
+	int failed;
+};
+
+static void der_init(struct der_encoder* der)
 {
-	unsigned char buf[6];
-	unsigned int off = 0;
+	memset(der, 0, sizeof(struct der_encoder));
+	der->current = -1;
+}
 
-	if (!type || size == 0 || !data || !data_size) {
+static struct der_node* der_add(struct der_encoder* der, enum der_kind kind, unsigned char type)
+{
+	if (der->failed) {
 		return NULL;
 	}
+	if (der->count == der->capacity) {
+		int capacity = (der->capacity > 0) ? der->capacity * 2 : 64;
+		struct der_node* nodes = (struct der_node*)realloc(der->nodes, capacity * sizeof(struct der_node));
+		if (!nodes) {
+			der->failed = 1;
+			return NULL;
+		}
+		der->nodes = nodes;
+		der->capacity = capacity;
+	}
+	struct der_node* node = &der->nodes[der->count++];
+	memset(node, 0, sizeof(struct der_node));
+	node->kind = kind;
+	node->type = type;
+	node->parent = der->current;
+	return node;
+}
 
-	buf[off++] = type;
+static void der_begin(struct der_encoder* der, unsigned char type)
+{
+	if (der_add(der, DER_CONSTRUCTED, type)) {
+		der->current = der->count - 1;
+	}
+}
 
-	unsigned char* p = &buf[off];
-	asn1_write_size(size, &p, &off);
+/* private tagged element of a 4 character tag like "BORD" */
+static void der_begin_private(struct der_encoder* der, const char* tag)
+{
+	struct der_node* node = der_add(der, DER_PRIVATE, 0);
+	if (node) {
+		node->tag = ((uint32_t)(unsigned char)tag[0] << 24) | ((uint32_t)(unsigned char)tag[1] << 16) | ((uint32_t)(unsigned char)tag[2] << 8) | (unsigned char)tag[3];
+		der->current = der->count - 1;
+	}
+}
 
-	*data = malloc(off);
-	memcpy(*data, buf, off);
-	*data_size = off;
+static void der_end(struct der_encoder* der)
+{
+	if (!der->failed && der->current >= 0) {
+		der->current = der->nodes[der->current].parent;
+	}
+}
+
+static void der_add_data(struct der_encoder* der, unsigned char type, const void* data, unsigned int length)
+{
+	struct der_node* node = der_add(der, DER_DATA, type);
+	if (node) {
+		node->data = data;
+		node->content_length = length;
+	}
+}
 
-	return *data;
+static void der_add_string(struct der_encoder* der, const char* str)
+{
+	der_add_data(der, ASN1_IA5_STRING, str, strlen(str));
 }
 
-static void asn1_write_priv_element(unsigned char **p, unsigned int *length, unsigned int value)
+static void der_add_integer(struct der_encoder* der, uint64_t value)
 {
-	int i = 0;
-	int ttag = 0;
-	int tag = value;
-
-	i = ASN1_CONSTRUCTED;
-	i |= (0xFF & ASN1_PRIVATE);
-
-	(*p)[0] = i | ASN1_PRIMITIVE_TAG;
-	*p += 1;
-	*length += 1;
-
-	for (i = 0, ttag = tag; ttag > 0; i++)
-            ttag >>= 7;
-        ttag = i;
-        while (i-- > 0) {
-            (*p)[i] = tag & 0x7f;
-            if (i != (ttag - 1))
-                (*p)[i] |= 0x80;
-            tag >>= 7;
-        }
-        *p += ttag;
-	*length += ttag;
+	struct der_node* node = der_add(der, DER_INTEGER, ASN1_INTEGER);
+	if (node) {
+		node->value = value;
+		node->content_length = asn1_calc_int_size(value);
+	}
+}
+
+static void der_add_boolean(struct der_encoder* der, int value)
+{
+	struct der_node* node = der_add(der, DER_BOOLEAN, ASN1_BOOLEAN);
+	if (node) {
+		node->value = (value) ? 0xFF : 0x00;
+		node->content_length = 1;
+	}
 }
 
-static void asn1_write_element(unsigned char **p, unsigned int *length, unsigned char type, void *data, int data_len)
+static unsigned int der_node_length(struct der_node* node)
 {
-	unsigned int this_len = 0;
-	switch (type) {
-	case ASN1_IA5_STRING: {
-		char *str = (char*)data;
-		size_t len = (data_len < 0) ? strlen(str) : data_len;
-		asn1_write_element_header(type, len, p, &this_len);
-		*length += this_len;
-		memcpy(*p, str, len);
-		*p += len;
-		*length += len;
-	}	break;
-	case ASN1_OCTET_STRING: {
-		asn1_write_element_header(type, data_len, p, &this_len);
-		*length += this_len;
-		memcpy(*p, data, data_len);
-		*p += data_len;
-		*length += data_len;
-	}	break;
-	case ASN1_INTEGER: {
-		uint64_t value = *(uint64_t*)data;
-		int value_size = asn1_calc_int_size(value);
-		asn1_write_element_header(type, value_size, p, &this_len);
-		*length += this_len;
-		asn1_write_int_value(p, value, value_size);
-		*length += value_size;
-	}	break;
-	case ASN1_BOOLEAN: {
-		unsigned int value = *(unsigned int*)data;
-		asn1_write_element_header(type, 1, p, &this_len);
-		*length += this_len;
-		asn1_write_int_value(p, value ? 0xFF : 0x00, 1);
-		*length += 1;
-	}	break;
-	case (ASN1_SET | ASN1_CONSTRUCTED): {
-		asn1_write_element_header(type, data_len, p, &this_len);
-		*length += this_len;
-		if (data && data_len > 0) {
-			memcpy(*p, data, data_len);
-			*p += data_len;
-			*length += data_len;
+	if (node->kind == DER_PRIVATE) {
+		return asn1_priv_tag_length(node->tag) + asn1_size_length(node->content_length) + node->content_length;
+	}
+	return asn1_header_length(node->content_length) + node->content_length;
+}
+
+static int der_finish(struct der_encoder* der, unsigned char** data, unsigned int* size)
+{
+	int i;
+	unsigned int total = 0;
+
+	if (der->failed || der->current != -1) {
+		free(der->nodes);
+		der_init(der);
+		return -1;
+	}
+
+	/* children always come after their parent */
+	for (i = der->count - 1; i >= 0; i--) {
+		struct der_node* node = &der->nodes[i];
+		unsigned int length = der_node_length(node);
+		if (node->parent >= 0) {
+			der->nodes[node->parent].content_length += length;
+		} else {
+			total += length;
 		}
-	}	break;
-	default:
-		fprintf(stderr, "ERROR: %s: type %02x is not implemented", __func__, type);
-		return;
 	}
+
+	unsigned char* buf = (unsigned char*)malloc((total > 0) ? total : 1);
+	if (!buf) {
+		free(der->nodes);
+		der_init(der);
+		return -1;
+	}
+	unsigned char* p = buf;
+	for (i = 0; i < der->count; i++) {
+		struct der_node* node = &der->nodes[i];
+		switch (node->kind) {
+		case DER_PRIVATE:
+			asn1_write_priv_tag(node->tag, &p);
+			asn1_write_size(node->content_length, &p);
+			break;
+		case DER_CONSTRUCTED:
+			asn1_write_header(node->type, node->content_length, &p);
+			break;
+		case DER_DATA:
+			asn1_write_header(node->type, node->content_length, &p);
+			if (node->content_length > 0) {
+				memcpy(p, node->data, node->content_length);
+				p += node->content_length;
+			}
+			break;
+		case DER_INTEGER:
+		case DER_BOOLEAN:
+			asn1_write_header(node->type, node->content_length, &p);
+			asn1_write_int_value(&p, node->value, node->content_length);
+			break;
+		}
+	}
+
+	free(der->nodes);
+	der_init(der);
+	*data = buf;
+	*size = total;
+	return 0;
 }
 
 static unsigned int asn1_get_element(const unsigned char* data, unsigned char* type, unsigned char* size)
@@ -267,317 +373,150 @@ static const unsigned char *asn1_find_element(unsigned int index, unsigned char
 
 static const char *_img4_get_component_tag(const char *compname)
 {
-	struct comp_tags {
-		const char *comp;
-		const char *tag;
-	};
-	const struct comp_tags component_tags[] = {
-		{ "ACIBT", "acib" },
-		{ "ACIBTLPEM", "lpbt" },
-		{ "ACIWIFI", "aciw" },
-		{ "Alamo", "almo" },
-		{ "ANE", "anef" },
-		{ "ANS", "ansf" },
-		{ "AOP", "aopf" },
-		{ "Ap,AudioAccessibilityBootChime", "auac" },
-		{ "Ap,AudioBootChime", "aubt" },
-		{ "Ap,AudioPowerAttachChime", "aupr" },
-		{ "Ap,CIO", "ciof" },
-		{ "Ap,HapticAssets", "hpas" },
-		{ "Ap,LocalBoot", "lobo" },
-		{ "Ap,LocalPolicy", "lpol" },
-		{ "Ap,NextStageIM4MHash", "nsih" },
-		{ "Ap,RecoveryOSPolicyNonceHash", "ronh" },
-		{ "Ap,RestoreCIO", "rcio" },
-		{ "Ap,RestoreTMU", "rtmu" },
-		{ "Ap,Scorpius", "scpf" },
-		{ "Ap,SystemVolumeCanonicalMetadata", "msys" },
-		{ "Ap,TMU", "tmuf" },
-		{ "Ap,VolumeUUID", "vuid" },
-		{ "AppleLogo", "logo" },
-		{ "AudioCodecFirmware", "acfw" },
-		{ "AVE", "avef" },
-		{ "BatteryCharging", "glyC" },
-		{ "BatteryCharging0", "chg0" },
-		{ "BatteryCharging1", "chg1" },
-		{ "BatteryFull", "batF" },
-		{ "BatteryLow0", "bat0" },
-		{ "BatteryLow1", "bat1" },
-		{ "BatteryPlugin", "glyP" },
-		{ "CFELoader", "cfel" },
-		{ "Dali", "dali" },
-		{ "DCP", "dcpf" },
-		{ "DeviceTree", "dtre" },
-		{ "Diags", "diag" },
-		{ "EngineeringTrustCache", "dtrs" },
-		{ "ExtDCP", "edcp" },
-		{ "ftap", "ftap" },
-		{ "ftsp", "ftsp" },
-		{ "GFX", "gfxf" },
-		{ "Hamm", "hamf" },
-		{ "Homer", "homr" },
-		{ "iBEC", "ibec" },
-		{ "iBoot", "ibot" },
-		{ "iBootData", "ibdt" },
-		{ "iBootTest", "itst" },
-		{ "iBSS", "ibss" },
-		{ "InputDevice", "ipdf" },
-		{ "ISP", "ispf" },
-		{ "KernelCache", "krnl" },
-		{ "LeapHaptics", "lphp" },
-		{ "Liquid", "liqd" },
-		{ "LLB", "illb" },
-		{ "LoadableTrustCache", "ltrs" },
-		{ "LowPowerWallet0", "lpw0" },
-		{ "LowPowerWallet1", "lpw1" },
-		{ "LowPowerWallet2", "lpw2" },
-		{ "MacEFI", "mefi" },
-		{ "MtpFirmware", "mtpf" },
-		{ "Multitouch", "mtfw" },
-		{ "NeedService", "nsrv" },
-		{ "OS", "OS\0\0" },
-		{ "OSRamdisk", "osrd" },
-		{ "PersonalizedDMG", "pdmg" },
-		{ "PEHammer", "hmmr" },
-		{ "PERTOS", "pert" },
-		{ "PHLEET", "phlt" },
-		{ "PMP", "pmpf" },
-		{ "RBM", "rmbt" },
-		{ "Rap,SoftwareBinaryDsp1", "sbd1" },
-		{ "Rap,RTKitOS", "rkos" },
-		{ "Rap,RestoreRTKitOS", "rrko" },
-		{ "RecoveryMode", "recm" },
-		{ "RestoreANS", "rans" },
-		{ "RestoreDCP", "rdcp" },
-		{ "RestoreDeviceTree", "rdtr" },
-		{ "RestoreExtDCP", "recp" },
-		{ "RestoreKernelCache", "rkrn" },
-		{ "RestoreLogo", "rlgo" },
-		{ "RestoreRamDisk", "rdsk" },
-		{ "RestoreSEP", "rsep" },
-		{ "RestoreTrustCache", "rtsc" },
-		{ "rfta", "rfta" },
-		{ "rfts", "rfts" },
-		{ "RTP", "rtpf" },
-		{ "SCE", "scef" },
-		{ "SCE1Firmware", "sc1f" },
-		{ "SEP", "sepi" },
-		{ "SIO", "siof" },
-		{ "StaticTrustCache", "trst" },
-		{ "SystemLocker", "lckr" },
-		{ "SystemVolume", "isys" },
-		{ "WCHFirmwareUpdater", "wchf" },
-		{ NULL, NULL }
-	};
-	int i = 0;
-
-	while (component_tags[i].comp) {
-		if (!strcmp(component_tags[i].comp, compname)) {
-			return component_tags[i].tag;
-		}
-		i++;
-	}
-
-	return NULL;
+	const struct component_info* info = component_registry_lookup(compname);
+	return (info) ? info->tag : NULL;
 }
 
-int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size)
+int img4_stitch_component_buffer(const char* component_name, struct component_buffer* cb, const unsigned char* blob, unsigned int blob_size)
 {
-	unsigned char* magic_header = NULL;
-	unsigned int magic_header_size = 0;
-	unsigned char* blob_header = NULL;
-	unsigned int blob_header_size = 0;
-	unsigned char* img4header = NULL;
-	unsigned int img4header_size = 0;
 	unsigned int content_size;
-	unsigned char* outbuf;
 	unsigned char* p;
 
-	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !img4_data || !img4_size) {
+	if (!component_name || !cb || cb->size == 0 || !blob || blob_size == 0) {
 		return -1;
 	}
 
 	info("Personalizing IMG4 component %s...\n", component_name);
 	/* first we need check if we have to change the tag for the given component */
-	const void *tag = asn1_find_element(1, ASN1_IA5_STRING, component_data);
+	void *tag = (void*)asn1_find_element(1, ASN1_IA5_STRING, component_buffer_data(cb));
 	if (tag) {
 		debug("Tag found\n");
-		if (strcmp(component_name, "RestoreKernelCache") == 0) {
-			memcpy((void*)tag, "rkrn", 4);
-		} else if (strcmp(component_name, "RestoreDeviceTree") == 0) {
-			memcpy((void*)tag, "rdtr", 4);
-		} else if (strcmp(component_name, "RestoreSEP") == 0) {
-			memcpy((void*)tag, "rsep", 4);
-		} else if (strcmp(component_name, "RestoreLogo") == 0) {
-			memcpy((void*)tag, "rlgo", 4);
-		} else if (strcmp(component_name, "RestoreTrustCache") == 0) {
-			memcpy((void*)tag, "rtsc", 4);
-		} else if (strcmp(component_name, "RestoreDCP") == 0) {
-			memcpy((void*)tag, "rdcp", 4);
-		} else if (strcmp(component_name, "Ap,RestoreTMU") == 0) {
-			memcpy((void*)tag, "rtmu", 4);
-		} else if (strcmp(component_name, "Ap,RestoreCIO") == 0) {
-			memcpy((void*)tag, "rcio", 4);
-		} else if (strcmp(component_name, "Ap,DCP2") == 0) {
-			memcpy((void*)tag, "dcp2", 4);
+		const struct component_info* info = component_registry_lookup(component_name);
+		if (info && (info->flags & COMPONENT_FLAG_RETAG)) {
+			memcpy(tag, info->tag, 4);
 		}
 	}
 
-	// create element header for the "IMG4" magic
-	asn1_create_element_header(ASN1_IA5_STRING, IMG4_MAGIC_SIZE, &magic_header, &magic_header_size);
-	// create element header for the blob (ApImg4Ticket)
-	asn1_create_element_header(ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED, blob_size, &blob_header, &blob_header_size);
-
-	// calculate the size for the final IMG4 file (asn1 sequence)
-	content_size = magic_header_size + IMG4_MAGIC_SIZE + component_size + blob_header_size + blob_size;
+	/* SEQUENCE { IA5String "IMG4", IM4P, [0] { ApImg4Ticket } } */
+	content_size = asn1_header_length(IMG4_MAGIC_SIZE) + IMG4_MAGIC_SIZE + cb->size + asn1_header_length(blob_size) + blob_size;
 
-	// create element header for the final IMG4 asn1 blob
-	asn1_create_element_header(ASN1_SEQUENCE|ASN1_CONSTRUCTED, content_size, &img4header, &img4header_size);
+	// the headers go in front of the component and the ticket after it
+	p = component_buffer_push(cb, asn1_header_length(content_size) + asn1_header_length(IMG4_MAGIC_SIZE) + IMG4_MAGIC_SIZE);
+	if (p) {
+		asn1_write_header(ASN1_SEQUENCE|ASN1_CONSTRUCTED, content_size, &p);
+		asn1_write_header(ASN1_IA5_STRING, IMG4_MAGIC_SIZE, &p);
+		memcpy(p, IMG4_MAGIC, IMG4_MAGIC_SIZE);
 
-	outbuf = (unsigned char*)malloc(img4header_size + content_size);
-	if (!outbuf) {
-		if (magic_header) {
-			free(magic_header);
-		}
-		if (blob_header) {
-			free(blob_header);
-		}
-		if (img4header) {
-			free(img4header);
-		}
+		p = component_buffer_put(cb, asn1_header_length(blob_size) + blob_size);
+	}
+	if (!p) {
 		error("ERROR: out of memory when personalizing IMG4 component %s\n", component_name);
 		return -1;
 	}
-	p = outbuf;
-
-	// now put everything together
-	memcpy(p, img4header, img4header_size);
-	p += img4header_size;
-	memcpy(p, magic_header, magic_header_size);
-	p += magic_header_size;
-	memcpy(p, IMG4_MAGIC, IMG4_MAGIC_SIZE);
-	p += IMG4_MAGIC_SIZE;
-	memcpy(p, component_data, component_size);
-	p += component_size;
-	memcpy(p, blob_header, blob_header_size);
-	p += blob_header_size;
+	asn1_write_header(ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED, blob_size, &p);
 	memcpy(p, blob, blob_size);
-	p += blob_size;
 
-	*img4_data = outbuf;
-	*img4_size = (p - outbuf);
+	return 0;
+}
 
-	if (magic_header) {
-		free(magic_header);
+int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size)
+{
+	struct component_buffer cb;
+
+	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !img4_data || !img4_size) {
+		return -1;
 	}
-	if (blob_header) {
-		free(blob_header);
+
+	component_buffer_init(&cb);
+	if (component_buffer_copy(&cb, component_data, component_size) < 0) {
+		return -1;
 	}
-	if (img4header) {
-		free(img4header);
+	if (img4_stitch_component_buffer(component_name, &cb, blob, blob_size) < 0) {
+		component_buffer_free(&cb);
+		return -1;
 	}
+	*img4_data = component_buffer_detach(&cb, img4_size);
 
 	return 0;
 }
 
-#ifndef __bswap_32
-#define __bswap_32(x) ((((x) & 0xFF000000) >> 24) \
-                    | (((x) & 0x00FF0000) >> 8) \
-                    | (((x) & 0x0000FF00) << 8) \
-                    | (((x) & 0x000000FF) << 24))
-#endif
+/* [PRIVATE tag] { SEQUENCE { IA5String tag, value } } */
+static void _manifest_begin_key(struct der_encoder* der, const char* tag)
+{
+	der_begin_private(der, tag);
+	der_begin(der, ASN1_SEQUENCE | ASN1_CONSTRUCTED);
+	der_add_string(der, tag);
+}
 
-static void _manifest_write_key_value(unsigned char **p, unsigned int *length, const char *tag, int type, void *value, int size)
+static void _manifest_end_key(struct der_encoder* der)
 {
-	uint32_t utag = __bswap_32(*(uint32_t*)tag);
-	asn1_write_priv_element(p, length, utag);
-
-	unsigned char *start = *p;
-	unsigned char *outer_start = *p + 5;
-	unsigned char *inner_start = *p + 5 + 6;
-	unsigned int inner_length = 0;
-	asn1_write_element(&inner_start, &inner_length, ASN1_IA5_STRING, (void*)tag, -1);
-	asn1_write_element(&inner_start, &inner_length, type, value, size);
-
-	unsigned int outer_length = 0;
-	unsigned int this_length = 0;
-	if (!value && size > 0) {
-		asn1_write_element_header(ASN1_SEQUENCE | ASN1_CONSTRUCTED, inner_length + size, &outer_start, &outer_length);
-		asn1_write_size(outer_length + inner_length + size, &start, &this_length);
-	} else {
-		asn1_write_element_header(ASN1_SEQUENCE | ASN1_CONSTRUCTED, inner_length, &outer_start, &outer_length);
-		asn1_write_size(outer_length + inner_length, &start, &this_length);
-	}
-
-	memmove(start, outer_start - outer_length, outer_length);
-	outer_start = start + outer_length;
-	*length += this_length;
-	*length += outer_length;
-
-	memmove(outer_start, inner_start - inner_length, inner_length);
-	*length += inner_length;
-
-	*p += this_length + outer_length + inner_length;
+	der_end(der);
+	der_end(der);
 }
 
-static void _manifest_write_component(unsigned char **p, unsigned int *length, const char *tag, plist_t comp)
+static void _manifest_add_integer(struct der_encoder* der, const char* tag, uint64_t value)
 {
-	uint32_t utag = __bswap_32(*(uint32_t*)tag);
-	asn1_write_priv_element(p, length, utag);
+	_manifest_begin_key(der, tag);
+	der_add_integer(der, value);
+	_manifest_end_key(der);
+}
 
-	unsigned char *start = *p;
-	unsigned char *outer_start = *p + 5;
-	unsigned char *inner_start = *p + 5 + 6;
-	unsigned int inner_length = 0;
-	asn1_write_element(&inner_start, &inner_length, ASN1_IA5_STRING, (void*)tag, -1);
+static void _manifest_add_boolean(struct der_encoder* der, const char* tag, int value)
+{
+	_manifest_begin_key(der, tag);
+	der_add_boolean(der, value);
+	_manifest_end_key(der);
+}
 
-	unsigned char tmp_[512] = { 0, };
-	unsigned int tmp_len = 0;
-	unsigned char *tmp = &tmp_[0];
+static void _manifest_add_data(struct der_encoder* der, const char* tag, const void* data, unsigned int size)
+{
+	_manifest_begin_key(der, tag);
+	der_add_data(der, ASN1_OCTET_STRING, data, size);
+	_manifest_end_key(der);
+}
 
+static void _manifest_add_component(struct der_encoder* der, const char *tag, plist_t comp)
+{
 	plist_t node = NULL;
 	uint8_t boolval = 0;
 
+	_manifest_begin_key(der, tag);
+	der_begin(der, ASN1_SET | ASN1_CONSTRUCTED);
+
 	node = plist_dict_get_item(comp, "Digest");
-	if (node) {
-		char *digest = NULL;
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
 		uint64_t digest_len = 0;
-		plist_get_data_val(node, &digest, &digest_len);
+		const char *digest = plist_get_data_ptr(node, &digest_len);
 		if (digest_len > 0) {
-			_manifest_write_key_value(&tmp, &tmp_len, "DGST", ASN1_OCTET_STRING, digest, digest_len);
+			_manifest_add_data(der, "DGST", digest, digest_len);
 		}
-		free(digest);
 	}
 
 	node = plist_dict_get_item(comp, "Trusted");
 	if (node) {
 		boolval = 0;
 		plist_get_bool_val(node, &boolval);
-		unsigned int int_bool_val = boolval;
-		_manifest_write_key_value(&tmp, &tmp_len, "EKEY", ASN1_BOOLEAN, &int_bool_val, -1);
+		_manifest_add_boolean(der, "EKEY", boolval);
 	}
 
 	node = plist_dict_get_item(comp, "EPRO");
 	if (node) {
 		boolval = 0;
 		plist_get_bool_val(node, &boolval);
-		unsigned int int_bool_val = boolval;
-		_manifest_write_key_value(&tmp, &tmp_len, "EPRO", ASN1_BOOLEAN, &int_bool_val, -1);
+		_manifest_add_boolean(der, "EPRO", boolval);
 	}
 
 	node = plist_dict_get_item(comp, "ESEC");
 	if (node) {
 		boolval = 0;
 		plist_get_bool_val(node, &boolval);
-		unsigned int int_bool_val = boolval;
-		_manifest_write_key_value(&tmp, &tmp_len, "ESEC", ASN1_BOOLEAN, &int_bool_val, -1);
+		_manifest_add_boolean(der, "ESEC", boolval);
 	}
 
 	node = plist_dict_get_item(comp, "TBMDigests");
-	if (node) {
-		char *data = NULL;
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
 		uint64_t datalen = 0;
-		plist_get_data_val(node, &data, &datalen);
+		const char *data = plist_get_data_ptr(node, &datalen);
 		const char *tbmtag = NULL;
 		if (!strcmp(tag, "sepi")) {
 			tbmtag = "tbms";
@@ -587,79 +526,52 @@ static void _manifest_write_component(unsigned char **p, unsigned int *length, c
 		if (!tbmtag) {
 			error("ERROR: Unexpected TMBDigests for comp '%s'\n", tag);
 		} else {
-			_manifest_write_key_value(&tmp, &tmp_len, tbmtag, ASN1_OCTET_STRING, data, datalen);
+			_manifest_add_data(der, tbmtag, data, datalen);
 		}
-		free(data);
 	}
 
-	asn1_write_element_header(ASN1_SET | ASN1_CONSTRUCTED, tmp_len, &inner_start, &inner_length);
-	memcpy(inner_start, tmp_, tmp_len);
-	inner_start += tmp_len;
-	inner_length += tmp_len;
-
-	unsigned int outer_length = 0;
-	asn1_write_element_header(ASN1_SEQUENCE | ASN1_CONSTRUCTED, inner_length, &outer_start, &outer_length);
-
-	unsigned int this_length = 0;
-	asn1_write_size(outer_length + inner_length, &start, &this_length);
-
-	memmove(start, outer_start - outer_length, outer_length);
-
-	outer_start = start + outer_length;
-	*length += this_length;
-	*length += outer_length;
-
-	memmove(outer_start, inner_start - inner_length, inner_length);
-
-	*length += inner_length;
-
-	*p += this_length + outer_length + inner_length;
+	der_end(der);
+	_manifest_end_key(der);
 }
 
 int img4_create_local_manifest(plist_t request, plist_t build_identity, plist_t* manifest)
 {
+	struct der_encoder der;
+	unsigned char *buf = NULL;
+	unsigned int length = 0;
+
 	if (!request || !manifest) {
 		return -1;
 	}
 
-	unsigned char *buf = calloc(1, 65536);
-	unsigned char *p = buf;
-	unsigned int length = 0;
-	uint64_t uintval = 0;
-	unsigned int boolval = 0;
-
-	unsigned char tmp_[1024];
-	unsigned char *tmp = &tmp_[0];
-	unsigned int tmp_len = 0;
-
-	/* write manifest properties */
-	uintval = _plist_dict_get_uint(request, "ApBoardID");
-	_manifest_write_key_value(&tmp, &tmp_len, "BORD", ASN1_INTEGER, &uintval, -1);
-
-	uintval = 0;
-	_manifest_write_key_value(&tmp, &tmp_len, "CEPO", ASN1_INTEGER, &uintval, -1);
-
-	uintval = _plist_dict_get_uint(request, "ApChipID");
-	_manifest_write_key_value(&tmp, &tmp_len, "CHIP", ASN1_INTEGER, &uintval, -1);
-
-	boolval = _plist_dict_get_bool(request, "ApProductionMode");
-	_manifest_write_key_value(&tmp, &tmp_len, "CPRO", ASN1_BOOLEAN, &boolval, -1);
-
-	boolval = 0;
-	_manifest_write_key_value(&tmp, &tmp_len, "CSEC", ASN1_BOOLEAN, &boolval, -1);
-
-	uintval = _plist_dict_get_uint(request, "ApSecurityDomain");
-	_manifest_write_key_value(&tmp, &tmp_len, "SDOM", ASN1_INTEGER, &uintval, -1);
-
-	/* create manifest properties set */
-	_manifest_write_key_value(&p, &length, "MANP", ASN1_SET | ASN1_CONSTRUCTED, tmp_, tmp_len);
+	der_init(&der);
+
+	/* SEQUENCE { IA5String "IM4M", INTEGER 0, SET { MANB { SET { MANP, components } } } } */
+	der_begin(&der, ASN1_SEQUENCE | ASN1_CONSTRUCTED);
+	der_add_string(&der, "IM4M");
+	der_add_integer(&der, 0);
+	der_begin(&der, ASN1_SET | ASN1_CONSTRUCTED);
+	_manifest_begin_key(&der, "MANB");
+	der_begin(&der, ASN1_SET | ASN1_CONSTRUCTED);
+
+	/* manifest properties */
+	_manifest_begin_key(&der, "MANP");
+	der_begin(&der, ASN1_SET | ASN1_CONSTRUCTED);
+	_manifest_add_integer(&der, "BORD", _plist_dict_get_uint(request, "ApBoardID"));
+	_manifest_add_integer(&der, "CEPO", 0);
+	_manifest_add_integer(&der, "CHIP", _plist_dict_get_uint(request, "ApChipID"));
+	_manifest_add_boolean(&der, "CPRO", _plist_dict_get_bool(request, "ApProductionMode"));
+	_manifest_add_boolean(&der, "CSEC", 0);
+	_manifest_add_integer(&der, "SDOM", _plist_dict_get_uint(request, "ApSecurityDomain"));
+	der_end(&der);
+	_manifest_end_key(&der);
 
 	plist_t component_manifest = NULL;
 	if (build_identity) {
 		component_manifest = plist_dict_get_item(build_identity, "Manifest");
 	}
 
-	/* now write the components */
+	/* now add the components, the tags and values stay alive until the manifest is written */
 	plist_dict_iter iter = NULL;
 	plist_dict_new_iter(request, &iter);
 	char *key = NULL;
@@ -680,68 +592,28 @@ int img4_create_local_manifest(plist_t request, plist_t build_identity, plist_t*
 			}
 			if (!comp) {
 				error("ERROR: %s: Unhandled component '%s' - can't create manifest\n", __func__, key);
+				free(key);
 				free(iter);
-				free(buf);
+				free(der.nodes);
 				return -1;
 			}
 			debug("DEBUG: found component %s (%s)\n", comp, key);
-			_manifest_write_component(&p, &length, comp, val);
+			_manifest_add_component(&der, comp, val);
 		}
 		free(key);
+		key = NULL;
 	} while (val);
 	free(iter);
 
-	/* write manifest body header */
-	unsigned char manb_[32];
-	unsigned char *manb = &manb_[0];
-	unsigned int manb_len = 0;
-	_manifest_write_key_value(&manb, &manb_len, "MANB", ASN1_SET | ASN1_CONSTRUCTED, NULL, length);
-
-	/* write inner set */
-	unsigned char inner_set_[8];
-	unsigned char *inner_set = &inner_set_[0];
-	unsigned int inner_set_len = 0;
-	asn1_write_element_header(ASN1_SET | ASN1_CONSTRUCTED, length + manb_len, &inner_set, &inner_set_len);
-
-	/* write header values */
-	unsigned char hdrdata_[16];
-	unsigned char *hdrdata = &hdrdata_[0];
-	unsigned int hdrdata_len = 0;
-	asn1_write_element(&hdrdata, &hdrdata_len, ASN1_IA5_STRING, (void*)"IM4M", -1);
-	uint64_t intval = 0;
-	asn1_write_element(&hdrdata, &hdrdata_len, ASN1_INTEGER, &intval, -1);
-
-	/* write outer sequence now that we know the entire size */
-	unsigned char seq_[8];
-	unsigned char *seq = &seq_[0];
-	unsigned int seq_len = 0;
-	asn1_write_element_header(ASN1_SEQUENCE | ASN1_CONSTRUCTED, inner_set_len + length + manb_len + hdrdata_len, &seq, &seq_len);
-
-	unsigned int header_len = seq_len + hdrdata_len + inner_set_len + manb_len;
-
-	/* now put everything together */
-	memmove(buf + header_len, buf, length);
-
-	unsigned char *hdr = buf;
-	unsigned int hdr_len = 0;
-
-	memcpy(hdr, seq_, seq_len);
-	hdr += seq_len;
-	hdr_len += seq_len;
-
-	memcpy(hdr, hdrdata_, hdrdata_len);
-	hdr += hdrdata_len;
-	hdr_len += hdrdata_len;
-
-	memcpy(hdr, inner_set_, inner_set_len);
-	hdr += inner_set_len;
-	hdr_len += inner_set_len;
-
-	memcpy(hdr, manb_, manb_len);
-	hdr += manb_len;
-	hdr_len += manb_len;
-
-	length += hdr_len;
+	der_end(&der);
+	_manifest_end_key(&der);
+	der_end(&der);
+	der_end(&der);
+
+	if (der_finish(&der, &buf, &length) < 0) {
+		error("ERROR: %s: Unable to encode manifest\n", __func__);
+		return -1;
+	}
 
 	*manifest = plist_new_data((char*)buf, length);
 
@@ -26,6 +26,10 @@
 extern "C" {
 #endif
 
+struct component_buffer;
+
+/* Stitches the ticket into the component in place */
+int img4_stitch_component_buffer(const char* component_name, struct component_buffer* cb, const unsigned char* blob, unsigned int blob_size);
 int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size);
 int img4_create_local_manifest(plist_t request, plist_t build_identity, plist_t* manifest);
 
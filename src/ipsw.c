@@ -24,16 +24,32 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* copy_file_range(), fallocate() and O_DIRECT */
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_CLONEFILE
+#include <sys/clonefile.h>
+#endif
 #include <zip.h>
+#include <zlib.h>
 #ifdef HAVE_OPENSSL
 #include <openssl/sha.h>
 #else
@@ -45,25 +61,72 @@
 #endif
 
 #include <libimobiledevice-glue/termcolors.h>
+#include <libimobiledevice-glue/thread.h>
 #include <plist/plist.h>
 
 #include "ipsw.h"
+#include "ipsw_remote.h"
+#include "catalog.h"
 #include "locking.h"
 #include "download.h"
 #include "common.h"
 #include "idevicerestore.h"
 
 #define BUFSIZE 0x100000
-
-typedef struct {
+/* bulk extraction, the buffers are aligned for O_DIRECT */
+#define IPSW_EXTRACT_BUFSIZE (8 * 1024 * 1024)
+#define IPSW_EXTRACT_ALIGN 4096
+/* the progress bar of an extraction is redrawn at most this often */
+#define IPSW_PROGRESS_INTERVAL_US 100000
+
+/* distance between inflate checkpoints in streamed (deflated) zip entries */
+#define IPSW_FILE_CHECKPOINT_SPAN 0x1000000
+#define IPSW_FILE_WINDOW_SIZE 32768
+#define IPSW_FILE_INBUF_SIZE 0x10000
+
+struct ipsw_archive_index_entry {
+	uint32_t hash;
+	zip_int64_t zindex;
+};
+
+/* entry of a directory archive's listing, in the order it was walked */
+struct ipsw_dir_entry {
+	char* name;
+	struct stat st;
+	int depth;
+};
+
+struct ipsw_archive {
 	struct zip* zip;
-	char *path;
-} ipsw_archive;
+	char* path;
+	/* set if path is a URL, entries are fetched on demand */
+	ipsw_remote_t remote;
+	mutex_t mutex;
+	/* open addressing hash table mapping entry names to zip indexes */
+	struct ipsw_archive_index_entry* index;
+	uint32_t index_mask;
+	/* SHA1 of the build manifest, identifies the firmware contents */
+	unsigned char digest[20];
+	int have_digest;
+	/* parsed once and shared by every client restoring this archive */
+	build_manifest_t manifest;
+	/* guards the manifest and the digest */
+	mutex_t manifest_mutex;
+	int refcount;
+	/* set by ipsw_cancel(), aborts running extractions */
+	volatile int cancel;
+	/* listing of a directory archive, made on first use and kept, as
+	 * unpacked firmware is not expected to change while it is in use */
+	struct ipsw_dir_entry* dir_entries;
+	int num_dir_entries;
+	/* spare zip handles of the archive, so entries are read by several
+	 * threads at once instead of one after the other through zip */
+	struct zip* zip_pool[IPSW_ZIP_POOL_SIZE];
+	int zip_pool_count;
+	/* makes the names of temporary clones unique within the process */
+	unsigned int clone_serial;
+};
 
-static int cancel_flag = 0;
-
-ipsw_archive* ipsw_open(const char* ipsw);
-void ipsw_close(ipsw_archive* archive);
 
 static char* build_path(const char* path, const char* file)
 {
@@ -119,10 +182,16 @@ int ipsw_print_info(const char* path)
 
 	if (memcmp(&magic, "PK\x03\x04", 4) == 0) {
 		unsigned int rlen = 0;
-		if (ipsw_extract_to_memory(thepath, "BuildManifest.plist", (unsigned char**)&plist_buf, &rlen) < 0) {
+		ipsw_archive_t ipsw = ipsw_open(thepath);
+		if (!ipsw) {
+			return -1;
+		}
+		if (ipsw_extract_to_memory(ipsw, "BuildManifest.plist", (unsigned char**)&plist_buf, &rlen) < 0) {
 			error("ERROR: Failed to extract BuildManifest.plist from IPSW!\n");
+			ipsw_close(ipsw);
 			return -1;
 		}
+		ipsw_close(ipsw);
 		plist_len = (uint32_t)rlen;
 	} else {
 		size_t rlen = 0;
@@ -302,34 +371,211 @@ int ipsw_print_info(const char* path)
 	return 0;
 }
 
-ipsw_archive* ipsw_open(const char* ipsw)
+static uint32_t ipsw_archive_hash(const char* name)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int ipsw_archive_build_index(ipsw_archive_t archive)
+{
+	zip_int64_t entries = zip_get_num_entries(archive->zip, 0);
+	if (entries < 0) {
+		error("ERROR: zip_get_num_entries failed\n");
+		return -1;
+	}
+
+	uint32_t capacity = 16;
+	while (capacity < (uint64_t)entries * 2) {
+		capacity <<= 1;
+	}
+	archive->index = (struct ipsw_archive_index_entry*)malloc(sizeof(struct ipsw_archive_index_entry) * capacity);
+	if (!archive->index) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	archive->index_mask = capacity - 1;
+
+	uint32_t i;
+	for (i = 0; i < capacity; i++) {
+		archive->index[i].zindex = -1;
+	}
+
+	zip_int64_t zindex;
+	for (zindex = 0; zindex < entries; zindex++) {
+		const char* name = zip_get_name(archive->zip, zindex, 0);
+		if (!name) {
+			continue;
+		}
+		uint32_t hash = ipsw_archive_hash(name);
+		uint32_t slot = hash & archive->index_mask;
+		while (archive->index[slot].zindex >= 0) {
+			slot = (slot + 1) & archive->index_mask;
+		}
+		archive->index[slot].hash = hash;
+		archive->index[slot].zindex = zindex;
+	}
+
+	return 0;
+}
+
+/* must be called with the archive mutex held */
+static zip_int64_t ipsw_archive_locate(ipsw_archive_t archive, const char* name)
+{
+	if (!archive->index) {
+		return zip_name_locate(archive->zip, name, 0);
+	}
+	uint32_t hash = ipsw_archive_hash(name);
+	uint32_t slot = hash & archive->index_mask;
+	while (archive->index[slot].zindex >= 0) {
+		if (archive->index[slot].hash == hash) {
+			const char* zname = zip_get_name(archive->zip, archive->index[slot].zindex, 0);
+			if (zname && strcmp(zname, name) == 0) {
+				return archive->index[slot].zindex;
+			}
+		}
+		slot = (slot + 1) & archive->index_mask;
+	}
+	return -1;
+}
+
+static struct zip* ipsw_archive_zip_open(ipsw_archive_t archive, int* err)
+{
+	if (archive->remote) {
+		return ipsw_remote_zip_open(archive->remote, err);
+	}
+	return zip_open(archive->path, 0, err);
+}
+
+/* A zip handle of the archive for the calling thread alone, the shared one
+ * is only used for lookups. Give it back with ipsw_archive_zip_put(). */
+static struct zip* ipsw_archive_zip_get(ipsw_archive_t archive)
+{
+	struct zip* zip = NULL;
+	mutex_lock(&archive->mutex);
+	if (archive->zip_pool_count > 0) {
+		zip = archive->zip_pool[--archive->zip_pool_count];
+	}
+	mutex_unlock(&archive->mutex);
+	if (!zip) {
+		int err = 0;
+		zip = ipsw_archive_zip_open(archive, &err);
+		if (!zip) {
+			error("ERROR: zip_open: %s: %d\n", archive->path, err);
+		}
+	}
+	return zip;
+}
+
+static void ipsw_archive_zip_put(ipsw_archive_t archive, struct zip* zip)
+{
+	if (!zip) {
+		return;
+	}
+	mutex_lock(&archive->mutex);
+	if (archive->zip_pool_count < IPSW_ZIP_POOL_SIZE) {
+		archive->zip_pool[archive->zip_pool_count++] = zip;
+		zip = NULL;
+	}
+	mutex_unlock(&archive->mutex);
+	if (zip) {
+		zip_close(zip);
+	}
+}
+
+static ipsw_archive_t ipsw_archive_new(const char* path, ipsw_remote_t remote)
 {
 	int err = 0;
-	ipsw_archive* archive = (ipsw_archive*) malloc(sizeof(ipsw_archive));
+	ipsw_archive_t archive = (ipsw_archive_t)calloc(1, sizeof(struct ipsw_archive));
 	if (archive == NULL) {
 		error("ERROR: Out of memory\n");
+		ipsw_remote_close(remote);
+		return NULL;
+	}
+
+	archive->path = strdup(path);
+	archive->remote = remote;
+	archive->zip = ipsw_archive_zip_open(archive, &err);
+	if (archive->zip == NULL) {
+		error("ERROR: zip_open: %s: %d\n", path, err);
+		ipsw_remote_close(archive->remote);
+		free(archive->path);
+		free(archive);
+		return NULL;
+	}
+	if (ipsw_archive_build_index(archive) < 0) {
+		/* lookups fall back to zip_name_locate() */
+		free(archive->index);
+		archive->index = NULL;
+	}
+	mutex_init(&archive->mutex);
+	mutex_init(&archive->manifest_mutex);
+	archive->refcount = 1;
+	return archive;
+}
+
+ipsw_archive_t ipsw_open_remote(const char* url, const char* cache_dir)
+{
+	ipsw_remote_t remote = ipsw_remote_open(url, cache_dir);
+	if (!remote) {
 		return NULL;
 	}
+	return ipsw_archive_new(url, remote);
+}
+
+int ipsw_is_remote(ipsw_archive_t ipsw)
+{
+	return (ipsw && ipsw->remote);
+}
+
+ipsw_archive_t ipsw_open(const char* ipsw)
+{
+	if (ipsw_remote_is_url(ipsw)) {
+		return ipsw_open_remote(ipsw, NULL);
+	}
 
 	struct stat fst;
 	if (stat(ipsw, &fst) != 0) {
 		error("ERROR: ipsw_open %s: %s\n", ipsw, strerror(errno));
 		return NULL;
 	}
-	archive->path = strdup(ipsw);
-	if (S_ISDIR(fst.st_mode)) {
-		archive->zip = NULL;
-	} else {
-		archive->zip = zip_open(ipsw, 0, &err);
-		if (archive->zip == NULL) {
-			error("ERROR: zip_open: %s: %d\n", ipsw, err);
-			free(archive);
-			return NULL;
-		}
+
+	if (!S_ISDIR(fst.st_mode)) {
+		return ipsw_archive_new(ipsw, NULL);
+	}
+
+	ipsw_archive_t archive = (ipsw_archive_t)calloc(1, sizeof(struct ipsw_archive));
+	if (archive == NULL) {
+		error("ERROR: Out of memory\n");
+		return NULL;
 	}
+	archive->path = strdup(ipsw);
+	mutex_init(&archive->mutex);
+	mutex_init(&archive->manifest_mutex);
+	archive->refcount = 1;
 	return archive;
 }
 
+ipsw_archive_t ipsw_ref(ipsw_archive_t ipsw)
+{
+	if (ipsw) {
+		mutex_lock(&ipsw->mutex);
+		ipsw->refcount++;
+		mutex_unlock(&ipsw->mutex);
+	}
+	return ipsw;
+}
+
+const char* ipsw_get_path(ipsw_archive_t ipsw)
+{
+	return (ipsw) ? ipsw->path : NULL;
+}
+
 int ipsw_is_directory(const char* ipsw)
 {
 	struct stat fst;
@@ -340,37 +586,37 @@ int ipsw_is_directory(const char* ipsw)
 	return S_ISDIR(fst.st_mode);
 }
 
-int ipsw_get_file_size(const char* ipsw, const char* infile, uint64_t* size)
+int ipsw_get_file_size(ipsw_archive_t ipsw, const char* infile, uint64_t* size)
 {
-	ipsw_archive* archive = ipsw_open(ipsw);
-	if (archive == NULL) {
+	if (ipsw == NULL) {
 		error("ERROR: Invalid archive\n");
 		return -1;
 	}
 
-	if (archive->zip) {
-		int zindex = zip_name_locate(archive->zip, infile, 0);
+	if (ipsw->zip) {
+		mutex_lock(&ipsw->mutex);
+		zip_int64_t zindex = ipsw_archive_locate(ipsw, infile);
 		if (zindex < 0) {
+			mutex_unlock(&ipsw->mutex);
 			error("ERROR: zip_name_locate: %s\n", infile);
-			ipsw_close(archive);
 			return -1;
 		}
 
 		struct zip_stat zstat;
 		zip_stat_init(&zstat);
-		if (zip_stat_index(archive->zip, zindex, 0, &zstat) != 0) {
+		if (zip_stat_index(ipsw->zip, zindex, 0, &zstat) != 0) {
+			mutex_unlock(&ipsw->mutex);
 			error("ERROR: zip_stat_index: %s\n", infile);
-			ipsw_close(archive);
 			return -1;
 		}
+		mutex_unlock(&ipsw->mutex);
 
 		*size = zstat.size;
 	} else {
-		char *filepath = build_path(archive->path, infile);
+		char *filepath = build_path(ipsw->path, infile);
 		struct stat fst;
 		if (stat(filepath, &fst) != 0) {
 			free(filepath);
-			ipsw_close(archive);
 			return -1;
 		}
 		free(filepath);
@@ -378,257 +624,441 @@ int ipsw_get_file_size(const char* ipsw, const char* infile, uint64_t* size)
 		*size = fst.st_size;
 	}
 
-	ipsw_close(archive);
 	return 0;
 }
 
-int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress)
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+#define IPSW_EXTRACT_DIRECT 1
+#endif
+
+struct ipsw_extract_output {
+	int fd;
+	int direct;
+	/* written through the page cache */
+	uint64_t cached;
+};
+
+static int ipsw_extract_output_open(struct ipsw_extract_output* out, const char* outfile, uint64_t size, int allow_direct)
 {
-	int ret = 0;
-	ipsw_archive* archive = ipsw_open(ipsw);
-	if (archive == NULL) {
-		error("ERROR: Invalid archive\n");
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_BINARY
+	flags |= O_BINARY;
+#endif
+	out->fd = -1;
+	out->direct = 0;
+	out->cached = 0;
+#ifdef IPSW_EXTRACT_DIRECT
+	/* large files bypass the page cache, the restore reads them only once */
+	if (allow_direct && size >= IPSW_EXTRACT_BUFSIZE) {
+		out->fd = open(outfile, flags | O_DIRECT, 0644);
+		out->direct = (out->fd >= 0);
+	}
+#endif
+	if (out->fd < 0) {
+		out->fd = open(outfile, flags, 0644);
+	}
+	if (out->fd < 0) {
+		error("ERROR: Unable to open output file: %s: %s\n", outfile, strerror(errno));
 		return -1;
 	}
 
-	cancel_flag = 0;
+	/* reserve the space without changing the file size, a partly
+	 * extracted file may be read while it is written */
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+	if (size > 0 && fallocate(out->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) < 0 && errno == ENOSPC) {
+		error("ERROR: Not enough space for %s (%" PRIu64 " bytes)\n", outfile, size);
+		close(out->fd);
+		out->fd = -1;
+		return -1;
+	}
+#elif defined(F_PREALLOCATE)
+	if (size > 0) {
+		fstore_t fstore = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)size, 0 };
+		fcntl(out->fd, F_PREALLOCATE, &fstore);
+	}
+#endif
+	return 0;
+}
 
-	if (archive->zip) {
-		int zindex = zip_name_locate(archive->zip, infile, 0);
-		if (zindex < 0) {
-			error("ERROR: zip_name_locate: %s\n", infile);
-			return -1;
-		}
+static void ipsw_extract_output_undirect(struct ipsw_extract_output* out)
+{
+#ifdef IPSW_EXTRACT_DIRECT
+	int flags = fcntl(out->fd, F_GETFL);
+	if (flags != -1 && fcntl(out->fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+		out->direct = 0;
+	}
+#endif
+}
 
-		struct zip_stat zstat;
-		zip_stat_init(&zstat);
-		if (zip_stat_index(archive->zip, zindex, 0, &zstat) != 0) {
-			error("ERROR: zip_stat_index: %s\n", infile);
+static int ipsw_extract_output_write(struct ipsw_extract_output* out, const char* buf, size_t len)
+{
+	if (out->direct && (len % IPSW_EXTRACT_ALIGN) != 0) {
+		/* only the last block has an odd size */
+		ipsw_extract_output_undirect(out);
+	}
+	while (len > 0) {
+		ssize_t w = write(out->fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (out->direct && errno == EINVAL) {
+				/* not supported by this filesystem after all */
+				ipsw_extract_output_undirect(out);
+				if (!out->direct) {
+					continue;
+				}
+			}
+			error("ERROR: write failed: %s\n", strerror(errno));
 			return -1;
 		}
-
-		char* buffer = (char*) malloc(BUFSIZE);
-		if (buffer == NULL) {
-			error("ERROR: Unable to allocate memory\n");
-			return -1;
+		if (!out->direct) {
+			out->cached += w;
 		}
+		buf += w;
+		len -= w;
+	}
+	return 0;
+}
 
-		struct zip_file* zfile = zip_fopen_index(archive->zip, zindex, 0);
-		if (zfile == NULL) {
-			error("ERROR: zip_fopen_index: %s\n", infile);
-			return -1;
-		}
+static int ipsw_extract_output_close(struct ipsw_extract_output* out, int success)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	if (success && out->cached >= IPSW_EXTRACT_BUFSIZE) {
+		/* only clean pages can be dropped */
+		fdatasync(out->fd);
+		posix_fadvise(out->fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+	if (close(out->fd) != 0 && success) {
+		error("ERROR: close failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-		FILE* fd = fopen(outfile, "wb");
-		if (fd == NULL) {
-			error("ERROR: Unable to open output file: %s\n", outfile);
-			zip_fclose(zfile);
-			return -1;
-		}
+static char* ipsw_extract_buffer_new(void)
+{
+	void* buf = NULL;
+#ifdef HAVE_POSIX_MEMALIGN
+	if (posix_memalign(&buf, IPSW_EXTRACT_ALIGN, IPSW_EXTRACT_BUFSIZE) != 0) {
+		buf = NULL;
+	}
+#else
+	buf = malloc(IPSW_EXTRACT_BUFSIZE);
+#endif
+	return (char*)buf;
+}
+
+static void ipsw_extract_progress(uint64_t* last, uint64_t done, uint64_t total)
+{
+	uint64_t now = get_monotonic_time_us();
+	if (done < total && *last != 0 && now - *last < IPSW_PROGRESS_INTERVAL_US) {
+		return;
+	}
+	*last = now;
+	print_progress_bar((total > 0) ? ((double)done / (double)total) * 100.0 : 100.0);
+}
+
+static int ipsw_extract_copy(ipsw_archive_t ipsw, ipsw_file_handle_t in, const char* outfile, int print_progress)
+{
+	uint64_t size = ipsw_file_size(in);
+	uint64_t done = 0;
+	uint64_t last_progress = 0;
+	int in_fd = ipsw_file_get_fd(in);
+	int ret = 0;
+
+	struct ipsw_extract_output out;
+#ifdef HAVE_COPY_FILE_RANGE
+	/* copy_file_range() might not work with O_DIRECT */
+	if (ipsw_extract_output_open(&out, outfile, size, (in_fd < 0)) < 0) {
+#else
+	if (ipsw_extract_output_open(&out, outfile, size, 1) < 0) {
+#endif
+		return -1;
+	}
 
-		uint64_t i, bytes = 0;
-		int count, size = BUFSIZE;
-		double progress;
-		for(i = zstat.size; i > 0; i -= count) {
-			if (cancel_flag) {
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+	if (in_fd >= 0) {
+		posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	if (in_fd >= 0) {
+		/* plain files are copied by the kernel, or shared by the filesystem */
+		while (done < size && !ipsw->cancel) {
+			uint64_t left = size - done;
+			ssize_t r = copy_file_range(in_fd, NULL, out.fd, NULL, (left > IPSW_EXTRACT_BUFSIZE) ? IPSW_EXTRACT_BUFSIZE : (size_t)left, 0);
+			if (r <= 0) {
 				break;
 			}
-			if (i < BUFSIZE)
-				size = i;
-			count = zip_fread(zfile, buffer, size);
-			if (count < 0) {
-				error("ERROR: zip_fread: %s\n", infile);
-				ret = -1;
-				break;
+			done += r;
+			if (print_progress) {
+				ipsw_extract_progress(&last_progress, done, size);
 			}
-			if (fwrite(buffer, 1, count, fd) != count) {
-				error("ERROR: frite: %s\n", outfile);
+		}
+		/* anything left is copied below */
+		if (done > 0 && done < size && ipsw_file_seek(in, done, SEEK_SET) < 0) {
+			ret = -1;
+		}
+	}
+#endif
+
+	char* buffer = NULL;
+	if (ret == 0 && done < size) {
+		buffer = ipsw_extract_buffer_new();
+		if (!buffer) {
+			error("ERROR: Unable to allocate memory\n");
+			ret = -1;
+		}
+	}
+	while (ret == 0 && done < size) {
+		if (ipsw->cancel) {
+			break;
+		}
+		/* full buffers keep the writes aligned */
+		uint64_t left = size - done;
+		size_t want = (left > IPSW_EXTRACT_BUFSIZE) ? IPSW_EXTRACT_BUFSIZE : (size_t)left;
+		size_t fill = 0;
+		while (fill < want) {
+			int64_t r = ipsw_file_read(in, buffer + fill, want - fill);
+			if (r < 0) {
 				ret = -1;
 				break;
 			}
-
-			bytes += size;
-			if (print_progress) {
-				progress = ((double)bytes / (double)zstat.size) * 100.0;
-				print_progress_bar(progress);
+			if (r == 0) {
+				break;
 			}
+			fill += r;
 		}
-		free(buffer);
-		fclose(fd);
-		zip_fclose(zfile);
-	} else {
-		char *filepath = build_path(archive->path, infile);
-		char actual_filepath[PATH_MAX+1];
-		char actual_outfile[PATH_MAX+1];
-		if (!realpath(filepath, actual_filepath)) {
-			error("ERROR: realpath failed on %s: %s\n", filepath, strerror(errno));
+		if (ret == 0 && fill == 0) {
+			error("ERROR: Unexpected end of data after %" PRIu64 " of %" PRIu64 " bytes\n", done, size);
 			ret = -1;
-			goto leave;
-		} else {
-			actual_outfile[0] = '\0';
-			if (realpath(outfile, actual_outfile) && (strcmp(actual_filepath, actual_outfile) == 0)) {
-				/* files are identical */
-				ret = 0;
-			} else {
-				if (actual_outfile[0] == '\0') {
-					strcpy(actual_outfile, outfile);
-				}
-				FILE *fi = fopen(actual_filepath, "rb");
-				if (!fi) {
-					error("ERROR: fopen: %s: %s\n", actual_filepath, strerror(errno));
-					ret = -1;
-					goto leave;
-				}
-				struct stat fst;
-				if (fstat(fileno(fi), &fst) != 0) {
-					fclose(fi);
-					error("ERROR: fstat: %s: %s\n", actual_filepath, strerror(errno));
-					ret = -1;
-					goto leave;
-				}
-				FILE *fo = fopen(actual_outfile, "wb");
-				if (!fo) {
-					fclose(fi);
-					error("ERROR: fopen: %s: %s\n", actual_outfile, strerror(errno));
-					ret = -1;
-					goto leave;
-				}
-				char* buffer = (char*) malloc(BUFSIZE);
-				if (buffer == NULL) {
-					fclose(fi);
-					fclose(fo);
-					error("ERROR: Unable to allocate memory\n");
-					ret = -1;
-					goto leave;;
-				}
-
-				uint64_t bytes = 0;
-				double progress;
-				while (!feof(fi)) {
-					if (cancel_flag) {
-						break;
-					}
-					ssize_t r = fread(buffer, 1, BUFSIZE, fi);
-					if (r < 0) {
-						error("ERROR: fread failed: %s\n", strerror(errno));
-						ret = -1;
-						break;
-					}
-					if (fwrite(buffer, 1, r, fo) != r) {
-						error("ERROR: fwrite failed\n");
-						ret = -1;
-						break;
-					}
-					bytes += r;
-					if (print_progress) {
-						progress = ((double)bytes / (double)fst.st_size) * 100.0;
-						print_progress_bar(progress);
-					}
-				}
-
-				free(buffer);
-				fclose(fi);
-				fclose(fo);
-			}
 		}
-	leave:
-		free(filepath);
+		if (ret < 0) {
+			break;
+		}
+		if (ipsw_extract_output_write(&out, buffer, fill) < 0) {
+			error("ERROR: Unable to write to %s\n", outfile);
+			ret = -1;
+			break;
+		}
+		done += fill;
+		if (print_progress) {
+			ipsw_extract_progress(&last_progress, done, size);
+		}
 	}
-	ipsw_close(archive);
-	if (cancel_flag) {
-		ret = -2;
+	free(buffer);
+
+	if (ipsw_extract_output_close(&out, (ret == 0 && !ipsw->cancel)) < 0) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		/* never leave corrupt or partial data behind */
+		unlink(outfile);
 	}
 	return ret;
 }
 
-int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile)
-{
-	return ipsw_extract_to_file_with_progress(ipsw, infile, outfile, 0);
-}
-
-int ipsw_file_exists(const char* ipsw, const char* infile)
+/* Makes outfile share the blocks of a file of a directory archive, on
+ * filesystems that support it. Fails without touching outfile otherwise. */
+static int ipsw_clone_file(ipsw_archive_t ipsw, const char* src, const char* dst)
 {
-	ipsw_archive* archive = ipsw_open(ipsw);
-	if (archive == NULL) {
-		return 0;
+#if (defined(__linux__) && defined(FICLONE)) || defined(HAVE_CLONEFILE)
+	mutex_lock(&ipsw->mutex);
+	unsigned int serial = ipsw->clone_serial++;
+	mutex_unlock(&ipsw->mutex);
+#endif
+#if defined(__linux__) && defined(FICLONE)
+	int res = -1;
+	int in = open(src, O_RDONLY);
+	if (in < 0) {
+		return -1;
 	}
-
-	if (archive->zip) {
-		int zindex = zip_name_locate(archive->zip, infile, 0);
-		if (zindex < 0) {
-			ipsw_close(archive);
-			return 0;
+	struct stat fst;
+	if (fstat(in, &fst) == 0 && S_ISREG(fst.st_mode)) {
+		char* tmp = (char*)malloc(strlen(dst) + 32);
+		if (tmp) {
+			sprintf(tmp, "%s.%d-%u.clone", dst, (int)getpid(), serial);
+			int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if (out >= 0) {
+				res = ioctl(out, FICLONE, in);
+				close(out);
+				if (res == 0) {
+					res = rename(tmp, dst);
+				}
+				if (res != 0) {
+					unlink(tmp);
+				}
+			}
+			free(tmp);
 		}
-	} else {
-		char *filepath = build_path(archive->path, infile);
-		if (access(filepath, R_OK) != 0) {
-			free(filepath);
-			ipsw_close(archive);
-			return 0;
+	}
+	close(in);
+	return res;
+#elif defined(HAVE_CLONEFILE)
+	char* tmp = (char*)malloc(strlen(dst) + 32);
+	if (!tmp) {
+		return -1;
+	}
+	sprintf(tmp, "%s.%d-%u.clone", dst, (int)getpid(), serial);
+	int res = clonefile(src, tmp, 0);
+	if (res == 0) {
+		res = rename(tmp, dst);
+		if (res != 0) {
+			unlink(tmp);
 		}
-		free(filepath);
 	}
-
-	ipsw_close(archive);
-
-	return 1;
+	free(tmp);
+	return res;
+#else
+	return -1;
+#endif
 }
 
-int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize)
+int ipsw_extract_to_file_with_progress(ipsw_archive_t ipsw, const char* infile, const char* outfile, int print_progress)
 {
-	size_t size = 0;
-	unsigned char* buffer = NULL;
-	ipsw_archive* archive = ipsw_open(ipsw);
-	if (archive == NULL) {
+	int ret = 0;
+	if (ipsw == NULL) {
 		error("ERROR: Invalid archive\n");
 		return -1;
 	}
 
-	if (archive->zip) {
-		int zindex = zip_name_locate(archive->zip, infile, 0);
-		if (zindex < 0) {
-			debug("NOTE: zip_name_locate: '%s' not found in archive.\n", infile);
-			ipsw_close(archive);
+	if (!ipsw->zip) {
+		char *filepath = build_path(ipsw->path, infile);
+		char actual_filepath[PATH_MAX+1];
+		char actual_outfile[PATH_MAX+1];
+		if (!realpath(filepath, actual_filepath)) {
+			error("ERROR: realpath failed on %s: %s\n", filepath, strerror(errno));
+			free(filepath);
+			return -1;
+		}
+		free(filepath);
+		if (realpath(outfile, actual_outfile) && (strcmp(actual_filepath, actual_outfile) == 0)) {
+			/* files are identical */
+			return 0;
+		}
+	}
+
+	if (!ipsw->zip && !ipsw->remote) {
+		char *filepath = build_path(ipsw->path, infile);
+		int cloned = (filepath && ipsw_clone_file(ipsw, filepath, outfile) == 0);
+		free(filepath);
+		if (cloned) {
+			debug("DEBUG: %s: cloned %s\n", __func__, infile);
+			if (print_progress) {
+				print_progress_bar(100.0);
+			}
+			return 0;
+		}
+	}
+
+	ipsw_file_handle_t in = ipsw_file_open(ipsw, infile);
+	if (!in) {
+		return -1;
+	}
+	ret = ipsw_extract_copy(ipsw, in, outfile, print_progress);
+	ipsw_file_close(in);
+
+	if (ipsw->cancel) {
+		ret = -2;
+	}
+	return ret;
+}
+
+int ipsw_extract_to_file(ipsw_archive_t ipsw, const char* infile, const char* outfile)
+{
+	return ipsw_extract_to_file_with_progress(ipsw, infile, outfile, 0);
+}
+
+int ipsw_file_exists(ipsw_archive_t ipsw, const char* infile)
+{
+	if (ipsw == NULL) {
+		return 0;
+	}
+
+	if (ipsw->zip) {
+		mutex_lock(&ipsw->mutex);
+		zip_int64_t zindex = ipsw_archive_locate(ipsw, infile);
+		mutex_unlock(&ipsw->mutex);
+		if (zindex < 0) {
+			return 0;
+		}
+	} else {
+		char *filepath = build_path(ipsw->path, infile);
+		if (access(filepath, R_OK) != 0) {
+			free(filepath);
+			return 0;
+		}
+		free(filepath);
+	}
+
+	return 1;
+}
+
+int ipsw_extract_to_memory_with_headroom(ipsw_archive_t ipsw, const char* infile, unsigned int headroom, unsigned char** pbuffer, unsigned int* psize)
+{
+	size_t size = 0;
+	unsigned char* buffer = NULL;
+	if (ipsw == NULL) {
+		error("ERROR: Invalid archive\n");
+		return -1;
+	}
+
+	if (ipsw->zip) {
+		/* the archive lock is only held for the lookup, the entry is
+		 * inflated through a zip handle of this thread */
+		mutex_lock(&ipsw->mutex);
+		zip_int64_t zindex = ipsw_archive_locate(ipsw, infile);
+		mutex_unlock(&ipsw->mutex);
+		if (zindex < 0) {
+			debug("NOTE: zip_name_locate: '%s' not found in archive.\n", infile);
+			return -1;
+		}
+
+		struct zip* zip = ipsw_archive_zip_get(ipsw);
+		if (!zip) {
 			return -1;
 		}
 
 		struct zip_stat zstat;
 		zip_stat_init(&zstat);
-		if (zip_stat_index(archive->zip, zindex, 0, &zstat) != 0) {
+		if (zip_stat_index(zip, zindex, 0, &zstat) != 0) {
+			ipsw_archive_zip_put(ipsw, zip);
 			error("ERROR: zip_stat_index: %s\n", infile);
-			ipsw_close(archive);
 			return -1;
 		}
 
-		struct zip_file* zfile = zip_fopen_index(archive->zip, zindex, 0);
+		struct zip_file* zfile = zip_fopen_index(zip, zindex, 0);
 		if (zfile == NULL) {
+			ipsw_archive_zip_put(ipsw, zip);
 			error("ERROR: zip_fopen_index: %s\n", infile);
-			ipsw_close(archive);
 			return -1;
 		}
 
 		size = zstat.size;
-		buffer = (unsigned char*) malloc(size+1);
+		buffer = (unsigned char*) malloc(headroom+size+1);
 		if (buffer == NULL) {
-			error("ERROR: Out of memory\n");
 			zip_fclose(zfile);
-			ipsw_close(archive);
+			ipsw_archive_zip_put(ipsw, zip);
+			error("ERROR: Out of memory\n");
 			return -1;
 		}
 
-		if (zip_fread(zfile, buffer, size) != size) {
-			error("ERROR: zip_fread: %s\n", infile);
+		if (zip_fread(zfile, buffer+headroom, size) != size) {
 			zip_fclose(zfile);
+			ipsw_archive_zip_put(ipsw, zip);
+			error("ERROR: zip_fread: %s\n", infile);
 			free(buffer);
-			ipsw_close(archive);
 			return -1;
 		}
 
-		buffer[size] = '\0';
+		buffer[headroom+size] = '\0';
 
 		zip_fclose(zfile);
+		ipsw_archive_zip_put(ipsw, zip);
 	} else {
-		char *filepath = build_path(archive->path, infile);
+		char *filepath = build_path(ipsw->path, infile);
 		struct stat fst;
 #ifdef WIN32
 		if (stat(filepath, &fst) != 0) {
@@ -637,25 +1067,22 @@ int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char**
 #endif
 			error("ERROR: %s: stat failed for %s: %s\n", __func__, filepath, strerror(errno));
 			free(filepath);
-			ipsw_close(archive);
 			return -1;
 		}
 		size = fst.st_size;
-		buffer = (unsigned char*)malloc(size+1);
+		buffer = (unsigned char*)malloc(headroom+size+1);
 		if (buffer == NULL) {
 			error("ERROR: Out of memory\n");
 			free(filepath);
-			ipsw_close(archive);
 			return -1;
 		}
 
 #ifndef WIN32
 		if (S_ISLNK(fst.st_mode)) {
-			if (readlink(filepath, (char*)buffer, size) < 0) {
+			if (readlink(filepath, (char*)buffer+headroom, size) < 0) {
 				error("ERROR: %s: readlink failed for %s: %s\n", __func__, filepath, strerror(errno));
 				free(filepath);
 				free(buffer);
-				ipsw_close(archive);
 				return -1;
 			}
 		} else {
@@ -665,33 +1092,185 @@ int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char**
 				error("ERROR: %s: fopen failed for %s: %s\n", __func__, filepath, strerror(errno));
 				free(filepath);
 				free(buffer);
-				ipsw_close(archive);
 				return -2;
 			}
-			if (fread(buffer, 1, size, f) != size) {
+			if (fread(buffer+headroom, 1, size, f) != size) {
 				fclose(f);
 				error("ERROR: %s: fread failed for %s: %s\n", __func__, filepath, strerror(errno));
 				free(filepath);
 				free(buffer);
-				ipsw_close(archive);
 				return -1;
 			}
 			fclose(f);
 #ifndef WIN32
 		}
 #endif
-		buffer[size] = '\0';
+		buffer[headroom+size] = '\0';
 
 		free(filepath);
 	}
-	ipsw_close(archive);
 
 	*pbuffer = buffer;
 	*psize = size;
 	return 0;
 }
 
-int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *tss_enabled)
+int ipsw_map_file(ipsw_archive_t ipsw, const char* infile, unsigned int headroom, unsigned int tailroom, unsigned char** pbase, size_t* pmap_size, unsigned int* phead, unsigned int* psize)
+{
+#ifdef WIN32
+	return -1;
+#else
+	if (!ipsw || ipsw->zip || ipsw->remote || !infile || !pbase || !pmap_size || !phead || !psize) {
+		return -1;
+	}
+	char *filepath = build_path(ipsw->path, infile);
+	if (!filepath) {
+		return -1;
+	}
+	int fd = open(filepath, O_RDONLY);
+	free(filepath);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat fst;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	if (fstat(fd, &fst) != 0 || !S_ISREG(fst.st_mode) || fst.st_size == 0 || (uint64_t)fst.st_size > UINT_MAX - page - tailroom) {
+		close(fd);
+		return -1;
+	}
+	size_t size = (size_t)fst.st_size;
+	size_t front = (headroom + page - 1) / page * page;
+	size_t body = (size + page - 1) / page * page;
+	size_t total = front + body + (tailroom + page - 1) / page * page;
+
+	/* reserve the whole range, then put the file in the middle of it */
+	unsigned char* base = (unsigned char*)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	void* data = mmap(base + front, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		munmap(base, total);
+		return -1;
+	}
+#ifdef MADV_WILLNEED
+	madvise(data, size, MADV_WILLNEED);
+#endif
+
+	*pbase = base;
+	*pmap_size = total;
+	*phead = (unsigned int)front;
+	*psize = (unsigned int)size;
+	return 0;
+#endif
+}
+
+int ipsw_extract_to_memory(ipsw_archive_t ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize)
+{
+	return ipsw_extract_to_memory_with_headroom(ipsw, infile, 0, pbuffer, psize);
+}
+
+static int ipsw_get_digest(ipsw_archive_t ipsw, unsigned char* digest)
+{
+	mutex_lock(&ipsw->manifest_mutex);
+	if (!ipsw->have_digest) {
+		static const char* manifests[] = { "BuildManifest.plist", "BuildManifesto.plist", "Restore.plist", NULL };
+		unsigned char* data = NULL;
+		unsigned int size = 0;
+		int i;
+		for (i = 0; manifests[i]; i++) {
+			if (ipsw_file_exists(ipsw, manifests[i]) && ipsw_extract_to_memory(ipsw, manifests[i], &data, &size) == 0) {
+				break;
+			}
+		}
+		if (!data) {
+			mutex_unlock(&ipsw->manifest_mutex);
+			return -1;
+		}
+		SHA1(data, size, ipsw->digest);
+		free(data);
+		ipsw->have_digest = 1;
+	}
+	memcpy(digest, ipsw->digest, 20);
+	mutex_unlock(&ipsw->manifest_mutex);
+	return 0;
+}
+
+int ipsw_get_file_key(ipsw_archive_t ipsw, const char* infile, unsigned char* key)
+{
+	unsigned char digest[20];
+	uint64_t size = 0;
+	uint64_t stamp = 0;
+
+	if (!ipsw || !infile || !key) {
+		return -1;
+	}
+	if (ipsw_get_digest(ipsw, digest) < 0) {
+		return -1;
+	}
+
+	if (ipsw->zip) {
+		mutex_lock(&ipsw->mutex);
+		zip_int64_t zindex = ipsw_archive_locate(ipsw, infile);
+		struct zip_stat zstat;
+		zip_stat_init(&zstat);
+		if (zindex < 0 || zip_stat_index(ipsw->zip, zindex, 0, &zstat) != 0) {
+			mutex_unlock(&ipsw->mutex);
+			return -1;
+		}
+		mutex_unlock(&ipsw->mutex);
+		size = zstat.size;
+		stamp = zstat.crc;
+	} else {
+		char *filepath = build_path(ipsw->path, infile);
+		struct stat fst;
+		if (stat(filepath, &fst) != 0) {
+			free(filepath);
+			return -1;
+		}
+		free(filepath);
+		size = fst.st_size;
+		stamp = fst.st_mtime;
+	}
+
+	/* manifest digest + entry path + size + crc (or mtime for directories) */
+	size_t plen = strlen(infile);
+	unsigned char* buf = (unsigned char*)malloc(20 + plen + 16);
+	if (!buf) {
+		return -1;
+	}
+	memcpy(buf, digest, 20);
+	memcpy(buf + 20, infile, plen);
+	memcpy(buf + 20 + plen, &size, 8);
+	memcpy(buf + 20 + plen + 8, &stamp, 8);
+	SHA1(buf, 20 + plen + 16, key);
+	free(buf);
+
+	return 0;
+}
+
+int ipsw_get_file_crc(ipsw_archive_t ipsw, const char* infile, uint32_t* crc)
+{
+	if (!ipsw || !ipsw->zip || !infile || !crc) {
+		return -1;
+	}
+
+	mutex_lock(&ipsw->mutex);
+	zip_int64_t zindex = ipsw_archive_locate(ipsw, infile);
+	struct zip_stat zstat;
+	zip_stat_init(&zstat);
+	int res = (zindex >= 0 && zip_stat_index(ipsw->zip, zindex, 0, &zstat) == 0 && (zstat.valid & ZIP_STAT_CRC)) ? 0 : -1;
+	mutex_unlock(&ipsw->mutex);
+	if (res == 0) {
+		*crc = zstat.crc;
+	}
+
+	return res;
+}
+
+int ipsw_extract_build_manifest(ipsw_archive_t ipsw, plist_t* buildmanifest, int *tss_enabled)
 {
 	unsigned int size = 0;
 	unsigned char* data = NULL;
@@ -717,163 +1296,1047 @@ int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *t
 		free(data);
 		return 0;
 	}
-
-	return -1;
+
+	return -1;
+}
+
+int ipsw_get_build_manifest(ipsw_archive_t ipsw, build_manifest_t* manifest)
+{
+	if (!ipsw || !manifest) {
+		return -1;
+	}
+
+	mutex_lock(&ipsw->manifest_mutex);
+	if (!ipsw->manifest) {
+		plist_t plist = NULL;
+		int tss_enabled = 0;
+		if (ipsw_extract_build_manifest(ipsw, &plist, &tss_enabled) == 0) {
+			ipsw->manifest = build_manifest_new(plist, tss_enabled);
+		}
+	}
+	*manifest = build_manifest_ref(ipsw->manifest);
+	mutex_unlock(&ipsw->manifest_mutex);
+
+	return (*manifest) ? 0 : -1;
+}
+
+int ipsw_extract_restore_plist(ipsw_archive_t ipsw, plist_t* restore_plist)
+{
+	unsigned int size = 0;
+	unsigned char* data = NULL;
+
+	if (ipsw_extract_to_memory(ipsw, "Restore.plist", &data, &size) == 0) {
+		plist_from_xml((char*)data, size, restore_plist);
+		free(data);
+		return 0;
+	}
+
+	return -1;
+}
+
+struct ipsw_dir_listing {
+	struct ipsw_dir_entry* entries;
+	int num_entries;
+	int capacity;
+	int failed;
+};
+
+static void ipsw_dir_listing_free(struct ipsw_dir_entry* entries, int num_entries)
+{
+	int i;
+	for (i = 0; i < num_entries; i++) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
+
+static int ipsw_list_contents_recurse(ipsw_archive_t archive, const char *path, ipsw_list_cb cb, void *ctx)
+{
+	int ret = 0;
+	char *base = build_path(archive->path, path);
+
+	DIR *dirp = opendir(base);
+
+	if (!dirp) {
+		error("ERROR: failed to open directory %s\n", base);
+		free(base);
+		return -1;
+	}
+
+	while (ret >= 0) {
+		struct dirent *dir = readdir(dirp);
+		if (!dir)
+			break;
+
+		if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+			continue;
+
+		char *fpath = build_path(base, dir->d_name);
+		char *subpath;
+		if (*path)
+			subpath = build_path(path, dir->d_name);
+		else
+			subpath = strdup(dir->d_name);
+
+		struct stat st;
+#ifdef WIN32
+		ret = stat(fpath, &st);
+#else
+		ret = lstat(fpath, &st);
+#endif
+		if (ret != 0) {
+			error("ERROR: %s: stat failed for %s: %s\n", __func__, fpath, strerror(errno));
+			free(fpath);
+			free(subpath);
+			break;
+		}
+
+		ret = cb(ctx, archive, subpath, &st);
+
+		if (ret >= 0 && S_ISDIR(st.st_mode))
+			ipsw_list_contents_recurse(archive, subpath, cb, ctx);
+
+		free(fpath);
+		free(subpath);
+	}
+
+	closedir(dirp);
+	free(base);
+	return ret;
+}
+
+static int ipsw_dir_listing_add(void *ctx, ipsw_archive_t archive, const char *name, struct stat *stat)
+{
+	struct ipsw_dir_listing* listing = (struct ipsw_dir_listing*)ctx;
+	if (listing->num_entries == listing->capacity) {
+		int capacity = (listing->capacity > 0) ? listing->capacity * 2 : 256;
+		struct ipsw_dir_entry* entries = (struct ipsw_dir_entry*)realloc(listing->entries, capacity * sizeof(struct ipsw_dir_entry));
+		if (!entries) {
+			listing->failed = 1;
+			return -1;
+		}
+		listing->entries = entries;
+		listing->capacity = capacity;
+	}
+	struct ipsw_dir_entry* entry = &listing->entries[listing->num_entries];
+	entry->name = strdup(name);
+	if (!entry->name) {
+		listing->failed = 1;
+		return -1;
+	}
+	entry->st = *stat;
+	/* the walk passes paths relative to the top, one '/' per level */
+	entry->depth = 0;
+	for (; *name; name++) {
+		if (*name == '/') {
+			entry->depth++;
+		}
+	}
+	listing->num_entries++;
+	return 0;
+}
+
+/* ipsw_list_contents_recurse() for the listing, but a subdirectory that can't
+ * be walked fails it, a listing with holes would be kept for good */
+static int ipsw_dir_listing_walk(ipsw_archive_t archive, const char *path, struct ipsw_dir_listing* listing)
+{
+	int ret = 0;
+	char *base = build_path(archive->path, path);
+
+	DIR *dirp = opendir(base);
+	if (!dirp) {
+		error("ERROR: failed to open directory %s\n", base);
+		free(base);
+		return -1;
+	}
+
+	while (ret >= 0) {
+		struct dirent *dir = readdir(dirp);
+		if (!dir)
+			break;
+
+		if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+			continue;
+
+		char *fpath = build_path(base, dir->d_name);
+		char *subpath = (*path) ? build_path(path, dir->d_name) : strdup(dir->d_name);
+
+		struct stat st;
+#ifdef WIN32
+		ret = stat(fpath, &st);
+#else
+		ret = lstat(fpath, &st);
+#endif
+		if (ret != 0) {
+			error("ERROR: %s: stat failed for %s: %s\n", __func__, fpath, strerror(errno));
+		} else {
+			ret = ipsw_dir_listing_add(listing, archive, subpath, &st);
+			if (ret >= 0 && S_ISDIR(st.st_mode))
+				ret = ipsw_dir_listing_walk(archive, subpath, listing);
+		}
+
+		free(fpath);
+		free(subpath);
+	}
+
+	closedir(dirp);
+	free(base);
+	return (ret < 0) ? -1 : 0;
+}
+
+/* Walks the directory once, later listings are served from memory */
+static int ipsw_dir_listing_get(ipsw_archive_t ipsw, struct ipsw_dir_entry** entries, int* num_entries)
+{
+	mutex_lock(&ipsw->mutex);
+	*entries = ipsw->dir_entries;
+	*num_entries = ipsw->num_dir_entries;
+	mutex_unlock(&ipsw->mutex);
+	if (*entries) {
+		return 0;
+	}
+
+	struct ipsw_dir_listing listing;
+	memset(&listing, 0, sizeof(listing));
+	if (ipsw_dir_listing_walk(ipsw, "", &listing) < 0 || listing.failed || listing.num_entries == 0) {
+		ipsw_dir_listing_free(listing.entries, listing.num_entries);
+		return -1;
+	}
+
+	mutex_lock(&ipsw->mutex);
+	if (ipsw->dir_entries) {
+		/* another thread was faster */
+		ipsw_dir_listing_free(listing.entries, listing.num_entries);
+	} else {
+		ipsw->dir_entries = listing.entries;
+		ipsw->num_dir_entries = listing.num_entries;
+	}
+	*entries = ipsw->dir_entries;
+	*num_entries = ipsw->num_dir_entries;
+	mutex_unlock(&ipsw->mutex);
+	return 0;
+}
+
+/* Calls cb for the entries in the same order and with the same early exits
+ * as ipsw_list_contents_recurse(): a failed callback ends the walk of the
+ * directory it was called for, and the whole walk at the top level. */
+static int ipsw_dir_listing_replay(ipsw_archive_t ipsw, struct ipsw_dir_entry* entries, int num_entries, ipsw_list_cb cb, void *ctx)
+{
+	int ret = 0;
+	int skip_depth = -1;
+	int i;
+	for (i = 0; i < num_entries; i++) {
+		struct ipsw_dir_entry* entry = &entries[i];
+		if (skip_depth >= 0) {
+			if (entry->depth >= skip_depth) {
+				continue;
+			}
+			skip_depth = -1;
+		}
+		/* the callback gets its own copy, as it did with the walk */
+		struct stat st = entry->st;
+		int r = cb(ctx, ipsw, entry->name, &st);
+		if (entry->depth == 0) {
+			ret = r;
+		}
+		if (r < 0) {
+			if (entry->depth == 0) {
+				break;
+			}
+			skip_depth = entry->depth;
+		}
+	}
+	return ret;
+}
+
+static int ipsw_list_directory(ipsw_archive_t ipsw, ipsw_list_cb cb, void *ctx)
+{
+	struct ipsw_dir_entry* entries = NULL;
+	int num_entries = 0;
+	if (ipsw_dir_listing_get(ipsw, &entries, &num_entries) < 0) {
+		return ipsw_list_contents_recurse(ipsw, "", cb, ctx);
+	}
+	return ipsw_dir_listing_replay(ipsw, entries, num_entries, cb, ctx);
+}
+
+/* Name and stat of a zip entry, with the trailing slash of directories removed */
+static int ipsw_zip_entry_stat(struct zip* zip, zip_uint64_t index, char** name, struct stat* st)
+{
+	zip_stat_t stat;
+	zip_stat_init(&stat);
+	if (zip_stat_index(zip, index, 0, &stat) < 0) {
+		error("ERROR: zip_stat_index failed for index %" PRIu64 "\n", (uint64_t)index);
+		return -1;
+	}
+
+	uint8_t opsys;
+	uint32_t attributes;
+	if (zip_file_get_external_attributes(zip, index, 0, &opsys, &attributes) < 0) {
+		error("ERROR: zip_file_get_external_attributes failed for %s\n", stat.name);
+		return -1;
+	}
+	if (opsys != ZIP_OPSYS_UNIX) {
+		error("ERROR: File %s does not have UNIX attributes\n", stat.name);
+		return -1;
+	}
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = 1 + index;
+	st->st_nlink = 1;
+	st->st_mode = attributes >> 16;
+	st->st_size = stat.size;
+
+	*name = strdup(stat.name);
+	size_t len = strlen(*name);
+	if (len > 0 && (*name)[len - 1] == '/')
+		(*name)[len - 1] = '\0';
+
+	return 0;
+}
+
+int ipsw_list_contents(ipsw_archive_t ipsw, ipsw_list_cb cb, void *ctx)
+{
+	int ret = 0;
+
+	if (ipsw == NULL) {
+		error("ERROR: Invalid archive\n");
+		return -1;
+	}
+
+	if (ipsw->zip) {
+		mutex_lock(&ipsw->mutex);
+		int64_t entries = zip_get_num_entries(ipsw->zip, 0);
+		mutex_unlock(&ipsw->mutex);
+		if (entries < 0) {
+			error("ERROR: zip_get_num_entries failed\n");
+			return -1;
+		}
+
+		for (int64_t index = 0; index < entries; index++) {
+			char *name = NULL;
+			struct stat st;
+
+			/* the callback may extract from the archive, so don't hold the lock while calling it */
+			mutex_lock(&ipsw->mutex);
+			int sr = ipsw_zip_entry_stat(ipsw->zip, index, &name, &st);
+			mutex_unlock(&ipsw->mutex);
+			if (sr < 0) {
+				ret = -1;
+				continue;
+			}
+
+			ret = cb(ctx, ipsw, name, &st);
+
+			free(name);
+
+			if (ret < 0)
+				break;
+		}
+	} else {
+		ret = ipsw_list_directory(ipsw, cb, ctx);
+	}
+
+	return ret;
+}
+
+void ipsw_close(ipsw_archive_t ipsw)
+{
+	if (ipsw != NULL) {
+		mutex_lock(&ipsw->mutex);
+		int refcount = --ipsw->refcount;
+		mutex_unlock(&ipsw->mutex);
+		if (refcount > 0) {
+			return;
+		}
+		free(ipsw->path);
+		if (ipsw->zip) {
+			zip_unchange_all(ipsw->zip);
+			zip_close(ipsw->zip);
+		}
+		while (ipsw->zip_pool_count > 0) {
+			zip_close(ipsw->zip_pool[--ipsw->zip_pool_count]);
+		}
+		ipsw_remote_close(ipsw->remote);
+		free(ipsw->index);
+		ipsw_dir_listing_free(ipsw->dir_entries, ipsw->num_dir_entries);
+		build_manifest_free(ipsw->manifest);
+		mutex_destroy(&ipsw->manifest_mutex);
+		mutex_destroy(&ipsw->mutex);
+		free(ipsw);
+	}
+}
+
+struct ipsw_file_checkpoint {
+	uint64_t out;	/* offset in uncompressed data */
+	uint64_t in;	/* offset in raw deflate stream */
+	int bits;	/* bits of the byte at in-1 belonging to the next block */
+	unsigned char window[IPSW_FILE_WINDOW_SIZE];
+};
+
+struct ipsw_file_handle {
+	FILE* file;
+	/* private zip handle, so the entry can be read without holding the archive lock */
+	struct zip* zip;
+	/* set if zip came from the pool of this archive, it goes back on close */
+	ipsw_archive_t archive;
+	zip_uint64_t zindex;
+	struct zip_file* zfile;
+	uint64_t size;
+	uint64_t offset;
+	int seekable;
+	/* CRC32 of the uncompressed zip entry, and of what was inflated of it
+	 * front to back so far */
+	int have_crc;
+	uint32_t crc;
+	uLong crc_done;
+	uint64_t crc_offset;
+	/* symlink target of a directory archive, read from memory */
+	unsigned char* data;
+	/* only used for deflated zip entries */
+	int deflated;
+	z_stream zstrm;
+	int zstrm_init;
+	uint64_t comp_size;
+	uint64_t in_offset;
+	unsigned char* inbuf;
+	unsigned char* history;
+	unsigned int history_pos;
+	uint64_t last_checkpoint;
+	struct ipsw_file_checkpoint* checkpoints;
+	int num_checkpoints;
+	/* only used for files that are still being written */
+	ipsw_file_wait_cb wait_cb;
+	void* wait_userdata;
+	void (*wait_free)(void*);
+};
+
+static int ipsw_file_zip_reopen(ipsw_file_handle_t handle)
+{
+	if (handle->zfile) {
+		zip_fclose(handle->zfile);
+	}
+	handle->zfile = zip_fopen_index(handle->zip, handle->zindex, (handle->deflated) ? ZIP_FL_COMPRESSED : 0);
+	if (!handle->zfile) {
+		error("ERROR: zip_fopen_index failed for index %" PRIu64 "\n", (uint64_t)handle->zindex);
+		return -1;
+	}
+	handle->offset = 0;
+	handle->in_offset = 0;
+	handle->crc_done = crc32(0L, Z_NULL, 0);
+	handle->crc_offset = 0;
+	handle->history_pos = 0;
+	if (handle->deflated) {
+		if (handle->zstrm_init) {
+			inflateEnd(&handle->zstrm);
+		}
+		memset(&handle->zstrm, '\0', sizeof(z_stream));
+		if (inflateInit2(&handle->zstrm, -15) != Z_OK) {
+			error("ERROR: inflateInit2 failed\n");
+			handle->zstrm_init = 0;
+			return -1;
+		}
+		handle->zstrm_init = 1;
+	}
+	return 0;
+}
+
+/* skip the raw (compressed) stream forward to the given offset */
+static int ipsw_file_zip_skip_raw(ipsw_file_handle_t handle, uint64_t target)
+{
+#ifdef HAVE_ZIP_FSEEK
+	if (zip_fseek(handle->zfile, (zip_int64_t)target, SEEK_SET) == 0) {
+		handle->in_offset = target;
+		return 0;
+	}
+	debug("DEBUG: %s: zip_fseek failed, skipping forward instead\n", __func__);
+#endif
+	while (handle->in_offset < target) {
+		uint64_t left = target - handle->in_offset;
+		zip_int64_t r = zip_fread(handle->zfile, handle->inbuf, (left > IPSW_FILE_INBUF_SIZE) ? IPSW_FILE_INBUF_SIZE : left);
+		if (r <= 0) {
+			error("ERROR: %s: zip_fread failed\n", __func__);
+			return -1;
+		}
+		handle->in_offset += r;
+	}
+	return 0;
+}
+
+static void ipsw_file_add_checkpoint(ipsw_file_handle_t handle)
+{
+	struct ipsw_file_checkpoint* cps = realloc(handle->checkpoints, sizeof(struct ipsw_file_checkpoint) * (handle->num_checkpoints + 1));
+	if (!cps) {
+		return;
+	}
+	handle->checkpoints = cps;
+	struct ipsw_file_checkpoint* cp = &cps[handle->num_checkpoints++];
+	cp->out = handle->offset;
+	cp->in = handle->in_offset - handle->zstrm.avail_in;
+	cp->bits = handle->zstrm.data_type & 7;
+	/* history is a ring buffer with history_pos pointing at the oldest byte */
+	memcpy(cp->window, handle->history + handle->history_pos, IPSW_FILE_WINDOW_SIZE - handle->history_pos);
+	memcpy(cp->window + IPSW_FILE_WINDOW_SIZE - handle->history_pos, handle->history, handle->history_pos);
+	handle->last_checkpoint = handle->offset;
+}
+
+static void ipsw_file_update_history(ipsw_file_handle_t handle, const unsigned char* data, size_t size)
+{
+	if (size >= IPSW_FILE_WINDOW_SIZE) {
+		memcpy(handle->history, data + size - IPSW_FILE_WINDOW_SIZE, IPSW_FILE_WINDOW_SIZE);
+		handle->history_pos = 0;
+		return;
+	}
+	size_t first = IPSW_FILE_WINDOW_SIZE - handle->history_pos;
+	if (first > size) {
+		first = size;
+	}
+	memcpy(handle->history + handle->history_pos, data, first);
+	memcpy(handle->history, data + first, size - first);
+	handle->history_pos = (handle->history_pos + size) % IPSW_FILE_WINDOW_SIZE;
+}
+
+static int64_t ipsw_file_inflate(ipsw_file_handle_t handle, unsigned char* buffer, size_t size)
+{
+	size_t done = 0;
+	while (done < size && handle->offset < handle->size) {
+		if (handle->zstrm.avail_in == 0) {
+			uint64_t left = handle->comp_size - handle->in_offset;
+			if (left == 0) {
+				error("ERROR: %s: unexpected end of compressed data\n", __func__);
+				return -1;
+			}
+			zip_int64_t r = zip_fread(handle->zfile, handle->inbuf, (left > IPSW_FILE_INBUF_SIZE) ? IPSW_FILE_INBUF_SIZE : left);
+			if (r <= 0) {
+				error("ERROR: %s: zip_fread failed\n", __func__);
+				return -1;
+			}
+			handle->in_offset += r;
+			handle->zstrm.next_in = handle->inbuf;
+			handle->zstrm.avail_in = (uInt)r;
+		}
+		size_t chunk = size - done;
+		if (chunk > 0x40000000) {
+			chunk = 0x40000000;
+		}
+		handle->zstrm.next_out = buffer + done;
+		handle->zstrm.avail_out = (uInt)chunk;
+		int zr = inflate(&handle->zstrm, Z_BLOCK);
+		if (zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR) {
+			error("ERROR: %s: inflate failed (%d)\n", __func__, zr);
+			return -1;
+		}
+		size_t produced = chunk - handle->zstrm.avail_out;
+		ipsw_file_update_history(handle, buffer + done, produced);
+		done += produced;
+		handle->offset += produced;
+		if (zr == Z_STREAM_END) {
+			break;
+		}
+		/* at a block boundary (but not after the last block) we can place a checkpoint */
+		if ((handle->zstrm.data_type & 128) && !(handle->zstrm.data_type & 64)
+		    && handle->offset >= IPSW_FILE_WINDOW_SIZE
+		    && handle->offset >= handle->last_checkpoint + IPSW_FILE_CHECKPOINT_SPAN) {
+			ipsw_file_add_checkpoint(handle);
+		}
+	}
+	return done;
+}
+
+static int ipsw_file_restore_checkpoint(ipsw_file_handle_t handle, struct ipsw_file_checkpoint* cp)
+{
+	if (ipsw_file_zip_reopen(handle) < 0) {
+		return -1;
+	}
+	if (ipsw_file_zip_skip_raw(handle, cp->in - ((cp->bits) ? 1 : 0)) < 0) {
+		return -1;
+	}
+	if (cp->bits) {
+		unsigned char c = 0;
+		if (zip_fread(handle->zfile, &c, 1) != 1) {
+			error("ERROR: %s: zip_fread failed\n", __func__);
+			return -1;
+		}
+		handle->in_offset++;
+		inflatePrime(&handle->zstrm, cp->bits, c >> (8 - cp->bits));
+	}
+	inflateSetDictionary(&handle->zstrm, cp->window, IPSW_FILE_WINDOW_SIZE);
+	memcpy(handle->history, cp->window, IPSW_FILE_WINDOW_SIZE);
+	handle->history_pos = 0;
+	handle->offset = cp->out;
+	return 0;
+}
+
+/* Opens entry zindex of zip, which has to stay open while the handle is used */
+static ipsw_file_handle_t ipsw_file_open_index(struct zip* zip, zip_uint64_t zindex, const char* path)
+{
+	ipsw_file_handle_t handle = (ipsw_file_handle_t)calloc(1, sizeof(struct ipsw_file_handle));
+	if (!handle) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	handle->zip = zip;
+	struct zip_stat zstat;
+	zip_stat_init(&zstat);
+	if (zip_stat_index(zip, zindex, 0, &zstat) != 0) {
+		error("ERROR: zip_stat_index: %s\n", path);
+		ipsw_file_close(handle);
+		return NULL;
+	}
+	handle->zindex = zindex;
+	handle->size = zstat.size;
+	if (zstat.valid & ZIP_STAT_CRC) {
+		handle->have_crc = 1;
+		handle->crc = zstat.crc;
+	}
+	if (zstat.comp_method == ZIP_CM_DEFLATE && !((zstat.valid & ZIP_STAT_ENCRYPTION_METHOD) && zstat.encryption_method != ZIP_EM_NONE)) {
+		handle->deflated = 1;
+		handle->comp_size = zstat.comp_size;
+		handle->inbuf = (unsigned char*)malloc(IPSW_FILE_INBUF_SIZE);
+		handle->history = (unsigned char*)calloc(1, IPSW_FILE_WINDOW_SIZE);
+		if (!handle->inbuf || !handle->history) {
+			error("ERROR: Out of memory\n");
+			ipsw_file_close(handle);
+			return NULL;
+		}
+	} else if (zstat.comp_method == ZIP_CM_STORE) {
+		handle->seekable = 1;
+	}
+	if (ipsw_file_zip_reopen(handle) < 0) {
+		ipsw_file_close(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+ipsw_file_handle_t ipsw_file_open(ipsw_archive_t ipsw, const char* path)
+{
+	ipsw_file_handle_t handle = NULL;
+
+	if (ipsw && ipsw->zip) {
+		mutex_lock(&ipsw->mutex);
+		zip_int64_t zindex = ipsw_archive_locate(ipsw, path);
+		mutex_unlock(&ipsw->mutex);
+		if (zindex < 0) {
+			error("ERROR: zip_name_locate: %s\n", path);
+			return NULL;
+		}
+		struct zip* zip = ipsw_archive_zip_get(ipsw);
+		if (!zip) {
+			return NULL;
+		}
+		handle = ipsw_file_open_index(zip, (zip_uint64_t)zindex, path);
+		if (!handle) {
+			ipsw_archive_zip_put(ipsw, zip);
+			return NULL;
+		}
+		handle->archive = ipsw_ref(ipsw);
+	} else {
+		handle = (ipsw_file_handle_t)calloc(1, sizeof(struct ipsw_file_handle));
+		if (!handle) {
+			error("ERROR: Out of memory\n");
+			return NULL;
+		}
+		char *filepath = (ipsw) ? build_path(ipsw->path, path) : strdup(path);
+		handle->file = fopen(filepath, "rb");
+		if (!handle->file) {
+			error("ERROR: fopen: %s: %s\n", filepath, strerror(errno));
+			free(filepath);
+			ipsw_file_close(handle);
+			return NULL;
+		}
+		free(filepath);
+		struct stat fst;
+		if (fstat(fileno(handle->file), &fst) != 0) {
+			error("ERROR: fstat failed: %s\n", strerror(errno));
+			ipsw_file_close(handle);
+			return NULL;
+		}
+		handle->size = fst.st_size;
+		handle->seekable = 1;
+	}
+
+	return handle;
+}
+
+ipsw_file_handle_t ipsw_file_open_growing(const char* path, uint64_t size, ipsw_file_wait_cb wait_cb, void* userdata, void (*free_func)(void*))
+{
+	if (!path || !wait_cb) {
+		return NULL;
+	}
+	ipsw_file_handle_t handle = (ipsw_file_handle_t)calloc(1, sizeof(struct ipsw_file_handle));
+	if (!handle) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	handle->file = fopen(path, "rb");
+	if (!handle->file) {
+		error("ERROR: fopen: %s: %s\n", path, strerror(errno));
+		free(handle);
+		return NULL;
+	}
+	handle->size = size;
+	handle->seekable = 1;
+	handle->wait_cb = wait_cb;
+	handle->wait_userdata = userdata;
+	handle->wait_free = free_func;
+	return handle;
+}
+
+void ipsw_file_close(ipsw_file_handle_t handle)
+{
+	if (!handle) {
+		return;
+	}
+	if (handle->file) {
+		fclose(handle->file);
+	}
+	if (handle->zfile) {
+		zip_fclose(handle->zfile);
+	}
+	if (handle->zstrm_init) {
+		inflateEnd(&handle->zstrm);
+	}
+	free(handle->data);
+	free(handle->inbuf);
+	free(handle->history);
+	free(handle->checkpoints);
+	if (handle->wait_free) {
+		handle->wait_free(handle->wait_userdata);
+	}
+	if (handle->zip && handle->archive) {
+		ipsw_archive_zip_put(handle->archive, handle->zip);
+		ipsw_close(handle->archive);
+	}
+	free(handle);
+}
+
+/* Reads the target of a symlink in a directory archive as the entry's data */
+static ipsw_file_handle_t ipsw_file_open_link(ipsw_archive_t ipsw, const char* path, uint64_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	ipsw_file_handle_t handle = (ipsw_file_handle_t)calloc(1, sizeof(struct ipsw_file_handle));
+	if (!handle) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	handle->data = (unsigned char*)malloc(size);
+	if (!handle->data) {
+		error("ERROR: Out of memory\n");
+		free(handle);
+		return NULL;
+	}
+	char *filepath = build_path(ipsw->path, path);
+#ifdef WIN32
+	errno = ENOSYS;
+	ssize_t r = -1;
+#else
+	ssize_t r = readlink(filepath, (char*)handle->data, size);
+#endif
+	if (r < 0 || (uint64_t)r != size) {
+		error("ERROR: %s: readlink failed for %s: %s\n", __func__, filepath, (r < 0) ? strerror(errno) : "size changed");
+		free(filepath);
+		ipsw_file_close(handle);
+		return NULL;
+	}
+	free(filepath);
+	handle->size = size;
+	handle->seekable = 1;
+	return handle;
 }
 
-int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist)
-{
-	unsigned int size = 0;
-	unsigned char* data = NULL;
+struct ipsw_stream_dir_ctx {
+	const char* prefix;
+	ipsw_stream_cb cb;
+	void* ctx;
+};
 
-	if (ipsw_extract_to_memory(ipsw, "Restore.plist", &data, &size) == 0) {
-		plist_from_xml((char*)data, size, restore_plist);
-		free(data);
+static int ipsw_stream_dir_entry(void *ctx, ipsw_archive_t ipsw, const char *name, struct stat *stat)
+{
+	struct ipsw_stream_dir_ctx* sctx = (struct ipsw_stream_dir_ctx*)ctx;
+	if (strncmp(name, sctx->prefix, strlen(sctx->prefix)) != 0) {
 		return 0;
 	}
-
-	return -1;
+	ipsw_file_handle_t file = NULL;
+	if (S_ISLNK(stat->st_mode)) {
+		/* the link itself, not what it points to */
+		file = ipsw_file_open_link(ipsw, name, stat->st_size);
+		if (!file) {
+			return -1;
+		}
+	} else if (S_ISREG(stat->st_mode) && stat->st_size > 0) {
+		file = ipsw_file_open(ipsw, name);
+		if (!file) {
+			return -1;
+		}
+	}
+	int ret = sctx->cb(sctx->ctx, ipsw, name, stat, file);
+	ipsw_file_close(file);
+	return ret;
 }
 
-static int ipsw_list_contents_recurse(ipsw_archive *archive, const char *path, ipsw_list_cb cb, void *ctx)
+int ipsw_stream_contents(ipsw_archive_t ipsw, const char* prefix, ipsw_stream_cb cb, void *ctx)
 {
 	int ret = 0;
-	char *base = build_path(archive->path, path);
-
-	DIR *dirp = opendir(base);
 
-	if (!dirp) {
-		error("ERROR: failed to open directory %s\n", base);
-		free(base);
+	if (ipsw == NULL) {
+		error("ERROR: Invalid archive\n");
 		return -1;
 	}
 
-	while (ret >= 0) {
-		struct dirent *dir = readdir(dirp);
-		if (!dir)
-			break;
-
-		if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
-			continue;
+	if (!ipsw->zip) {
+		struct ipsw_stream_dir_ctx sctx = { prefix, cb, ctx };
+		return ipsw_list_directory(ipsw, ipsw_stream_dir_entry, &sctx);
+	}
 
-		char *fpath = build_path(base, dir->d_name);
-		char *subpath;
-		if (*path)
-			subpath = build_path(path, dir->d_name);
-		else
-			subpath = strdup(dir->d_name);
+	/* one private zip handle for the whole walk */
+	int err = 0;
+	struct zip* zip = ipsw_archive_zip_open(ipsw, &err);
+	if (!zip) {
+		error("ERROR: zip_open: %s: %d\n", ipsw->path, err);
+		return -1;
+	}
+	int64_t entries = zip_get_num_entries(zip, 0);
+	if (entries < 0) {
+		error("ERROR: zip_get_num_entries failed\n");
+		zip_close(zip);
+		return -1;
+	}
 
+	for (int64_t index = 0; index < entries; index++) {
+		const char* zname = zip_get_name(zip, index, 0);
+		if (!zname || strncmp(zname, prefix, strlen(prefix)) != 0) {
+			continue;
+		}
+		char *name = NULL;
 		struct stat st;
-#ifdef WIN32
-		ret = stat(fpath, &st);
-#else
-		ret = lstat(fpath, &st);
-#endif
-		if (ret != 0) {
-			error("ERROR: %s: stat failed for %s: %s\n", __func__, fpath, strerror(errno));
-			free(fpath);
-			free(subpath);
+		if (ipsw_zip_entry_stat(zip, index, &name, &st) < 0) {
+			ret = -1;
+			break;
+		}
+		ipsw_file_handle_t file = NULL;
+		/* the data of a symlink entry is its target */
+		if ((S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) && st.st_size > 0) {
+			file = ipsw_file_open_index(zip, (zip_uint64_t)index, name);
+			if (!file) {
+				free(name);
+				ret = -1;
+				break;
+			}
+		}
+		ret = cb(ctx, ipsw, name, &st, file);
+		ipsw_file_close(file);
+		free(name);
+		if (ret < 0) {
 			break;
 		}
-
-		ret = cb(ctx, archive->path, subpath, &st);
-
-		if (ret >= 0 && S_ISDIR(st.st_mode))
-			ipsw_list_contents_recurse(archive, subpath, cb, ctx);
-
-		free(fpath);
-		free(subpath);
 	}
+	zip_close(zip);
 
-	closedir(dirp);
-	free(base);
 	return ret;
 }
 
-int ipsw_list_contents(const char* ipsw, ipsw_list_cb cb, void *ctx)
+uint64_t ipsw_file_size(ipsw_file_handle_t handle)
 {
-	int ret = 0;
-
-	ipsw_archive* archive = ipsw_open(ipsw);
-	if (archive == NULL) {
-		error("ERROR: Invalid archive\n");
-		return -1;
-	}
+	return (handle) ? handle->size : 0;
+}
 
-	if (archive->zip) {
-        int64_t entries = zip_get_num_entries(archive->zip, 0);
-		if (entries < 0) {
-			error("ERROR: zip_get_num_entries failed\n");
-			ipsw_close(archive);
-			return -1;
-		}
+int ipsw_file_is_seekable(ipsw_file_handle_t handle)
+{
+	return (handle) ? handle->seekable : 0;
+}
 
-		for (int64_t index = 0; index < entries; index++) {
-			zip_stat_t stat;
+int ipsw_file_get_fd(ipsw_file_handle_t handle)
+{
+	return (handle && handle->file) ? fileno(handle->file) : -1;
+}
 
-			zip_stat_init(&stat);
-			if (zip_stat_index(archive->zip, index, 0, &stat) < 0) {
-				error("ERROR: zip_stat_index failed for %s\n", stat.name);
-				ret = -1;
+int64_t ipsw_file_read(ipsw_file_handle_t handle, void* buffer, size_t size)
+{
+	if (!handle) {
+		return -1;
+	}
+	if (handle->file && handle->wait_cb) {
+		/* the writer is not done yet, wait at the end of what is there */
+		size_t done = 0;
+		while (done < size && handle->offset < handle->size) {
+			uint64_t left = handle->size - handle->offset;
+			size_t r = fread((char*)buffer + done, 1, (size - done > left) ? left : size - done, handle->file);
+			if (r > 0) {
+				done += r;
+				handle->offset += r;
 				continue;
 			}
-
-			uint8_t opsys;
-			uint32_t attributes;
-			if (zip_file_get_external_attributes(archive->zip, index, 0, &opsys, &attributes) < 0) {
-				error("ERROR: zip_file_get_external_attributes failed for %s\n", stat.name);
-				ret = -1;
-				continue;
+			if (ferror(handle->file)) {
+				error("ERROR: %s: fread failed: %s\n", __func__, strerror(errno));
+				return -1;
 			}
-			if (opsys != ZIP_OPSYS_UNIX) {
-				error("ERROR: File %s does not have UNIX attributes\n", stat.name);
-				ret = -1;
-				continue;
+			clearerr(handle->file);
+			if (handle->wait_cb(handle->wait_userdata) < 0) {
+				error("ERROR: %s: file ended at %" PRIu64 " of %" PRIu64 " bytes\n", __func__, handle->offset, handle->size);
+				return -1;
+			}
+		}
+		return done;
+	}
+	if (handle->data) {
+		uint64_t left = handle->size - handle->offset;
+		size_t r = (size > left) ? (size_t)left : size;
+		memcpy(buffer, handle->data + handle->offset, r);
+		handle->offset += r;
+		return r;
+	}
+	if (handle->file) {
+		size_t r = fread(buffer, 1, size, handle->file);
+		if (r < size && ferror(handle->file)) {
+			error("ERROR: %s: fread failed: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+		handle->offset += r;
+		return r;
+	}
+	if (handle->deflated) {
+		/* raw deflate streams are inflated here, so libzip doesn't check
+		 * the CRC. Data read again after a seek back is not counted twice. */
+		uint64_t start = handle->offset;
+		int64_t r = ipsw_file_inflate(handle, (unsigned char*)buffer, size);
+		if (r > 0 && handle->have_crc && start <= handle->crc_offset && start + r > handle->crc_offset) {
+			uint64_t skip = handle->crc_offset - start;
+			handle->crc_done = crc32(handle->crc_done, (const Bytef*)buffer + skip, (uInt)(r - skip));
+			handle->crc_offset = start + r;
+			if (handle->crc_offset == handle->size && (uint32_t)handle->crc_done != handle->crc) {
+				error("ERROR: %s: CRC mismatch for zip entry %" PRIu64 " (0x%08x, expected 0x%08x)\n", __func__, (uint64_t)handle->zindex, (uint32_t)handle->crc_done, handle->crc);
+				return -1;
 			}
+		}
+		return r;
+	}
 
-			struct stat st;
-			memset(&st, 0, sizeof(st));
-			st.st_ino = 1 + index;
-			st.st_nlink = 1;
-			st.st_mode = attributes >> 16;
-			st.st_size = stat.size;
+	size_t done = 0;
+	while (done < size && handle->offset < handle->size) {
+		zip_int64_t r = zip_fread(handle->zfile, (char*)buffer + done, size - done);
+		if (r < 0) {
+			error("ERROR: %s: zip_fread failed\n", __func__);
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		done += r;
+		handle->offset += r;
+	}
+	return done;
+}
+
+int ipsw_file_seek(ipsw_file_handle_t handle, int64_t offset, int whence)
+{
+	if (!handle) {
+		return -1;
+	}
+	uint64_t target;
+	switch (whence) {
+	case SEEK_SET:
+		target = offset;
+		break;
+	case SEEK_CUR:
+		target = handle->offset + offset;
+		break;
+	case SEEK_END:
+		target = handle->size + offset;
+		break;
+	default:
+		return -1;
+	}
+	if (target > handle->size) {
+		return -1;
+	}
 
-			char *name = strdup(stat.name);
-			if (name[strlen(name) - 1] == '/')
-				name[strlen(name) - 1] = '\0';
+	if (handle->data) {
+		handle->offset = target;
+		return 0;
+	}
 
-			ret = cb(ctx, ipsw, name, &st);
+	if (handle->file) {
+#ifdef WIN32
+		rewind(handle->file);
+		if (_lseeki64(fileno(handle->file), target, SEEK_SET) < 0) {
+#else
+		if (fseeko(handle->file, target, SEEK_SET) != 0) {
+#endif
+			error("ERROR: %s: seek failed: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+		handle->offset = target;
+		return 0;
+	}
 
-			free(name);
+	if (target == handle->offset) {
+		return 0;
+	}
 
-			if (ret < 0)
+	if (handle->deflated) {
+		/* find the closest checkpoint at or before the target offset */
+		struct ipsw_file_checkpoint* cp = NULL;
+		int i;
+		for (i = handle->num_checkpoints-1; i >= 0; i--) {
+			if (handle->checkpoints[i].out <= target) {
+				cp = &handle->checkpoints[i];
 				break;
+			}
+		}
+		if (target < handle->offset || (cp && cp->out > handle->offset)) {
+			if (cp) {
+				if (ipsw_file_restore_checkpoint(handle, cp) < 0) {
+					return -1;
+				}
+			} else if (ipsw_file_zip_reopen(handle) < 0) {
+				return -1;
+			}
 		}
 	} else {
-		ret = ipsw_list_contents_recurse(archive, "", cb, ctx);
+#ifdef HAVE_ZIP_FSEEK
+		if (handle->seekable && zip_fseek(handle->zfile, (zip_int64_t)target, SEEK_SET) == 0) {
+			handle->offset = target;
+			return 0;
+		}
+#endif
+		if (target < handle->offset) {
+			if (ipsw_file_zip_reopen(handle) < 0) {
+				return -1;
+			}
+		}
 	}
 
-	ipsw_close(archive);
-	return ret;
+	/* read forward until we reach the target offset */
+	if (handle->offset < target) {
+		char* buf = (char*)malloc(BUFSIZE);
+		if (!buf) {
+			error("ERROR: Out of memory\n");
+			return -1;
+		}
+		while (handle->offset < target) {
+			uint64_t left = target - handle->offset;
+			int64_t r = ipsw_file_read(handle, buf, (left > BUFSIZE) ? BUFSIZE : left);
+			if (r <= 0) {
+				free(buf);
+				return -1;
+			}
+		}
+		free(buf);
+	}
+
+	return 0;
 }
 
-void ipsw_close(ipsw_archive* archive)
+int64_t ipsw_file_tell(ipsw_file_handle_t handle)
 {
-	if (archive != NULL) {
-		free(archive->path);
-		if (archive->zip) {
-			zip_unchange_all(archive->zip);
-			zip_close(archive->zip);
-		}
-		free(archive);
-	}
+	return (handle) ? (int64_t)handle->offset : -1;
 }
 
-int ipsw_get_signed_firmwares(const char* product, plist_t* firmwares)
+/* keeps what is needed to pick and download a firmware from the ipsw.me answer */
+static plist_t ipsw_signed_firmwares_parse(const char* jdata, uint32_t jsize, void* userdata)
 {
-	char url[256];
-	char *jdata = NULL;
-	uint32_t jsize = 0;
+	const char* product = (const char*)userdata;
 	plist_t dict = NULL;
 	plist_t node = NULL;
 	plist_t fws = NULL;
@@ -881,45 +2344,34 @@ int ipsw_get_signed_firmwares(const char* product, plist_t* firmwares)
 	uint32_t count = 0;
 	uint32_t i = 0;
 
-	if (!product || !firmwares) {
-		return -1;
-	}
-
-	*firmwares = NULL;
-	snprintf(url, sizeof(url), "https://api.ipsw.me/v4/device/%s", product);
-
-	if (download_to_buffer(url, &jdata, &jsize) < 0) {
-		error("ERROR: Download from %s failed.\n", url);
-		return -1;
-	}
 	plist_from_json(jdata, jsize, &dict);
-	free(jdata);
 	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
 		error("ERROR: Failed to parse json data.\n");
 		plist_free(dict);
-		return -1;
+		return NULL;
 	}
 
 	node = plist_dict_get_item(dict, "identifier");
 	if (!node || plist_get_node_type(node) != PLIST_STRING) {
 		error("ERROR: Unexpected json data returned - missing 'identifier'\n");
 		plist_free(dict);
-		return -1;
+		return NULL;
 	}
 	product_type = plist_get_string_ptr(node, NULL);
 	if (!product_type || strcmp(product_type, product) != 0) {
 		error("ERROR: Unexpected json data returned - failed to read identifier\n");
 		plist_free(dict);
-		return -1;
+		return NULL;
 	}
 	fws = plist_dict_get_item(dict, "firmwares");
 	if (!fws || plist_get_node_type(fws) != PLIST_ARRAY) {
 		error("ERROR: Unexpected json data returned - missing 'firmwares'\n");
 		plist_free(dict);
-		return -1;
+		return NULL;
 	}
 
-	*firmwares = plist_new_array();
+	static const char* keys[] = { "version", "buildid", "url", "sha1sum", "filesize", NULL };
+	plist_t firmwares = plist_new_array();
 	count = plist_array_get_size(fws);
 	for (i = 0; i < count; i++) {
 		plist_t fw = plist_array_get_item(fws, i);
@@ -928,12 +2380,51 @@ int ipsw_get_signed_firmwares(const char* product, plist_t* firmwares)
 			uint8_t bv = 0;
 			plist_get_bool_val(node, &bv);
 			if (bv) {
-				plist_array_append_item(*firmwares, plist_copy(fw));
+				plist_t entry = plist_new_dict();
+				int k;
+				for (k = 0; keys[k]; k++) {
+					_plist_dict_copy_item(entry, fw, keys[k], NULL);
+				}
+				plist_array_append_item(firmwares, entry);
 			}
 		}
 	}
 	plist_free(dict);
 
+	return firmwares;
+}
+
+int ipsw_get_signed_firmwares(const char* product, const char* cache_dir, plist_t* firmwares)
+{
+	char url[256];
+	char* path = NULL;
+
+	if (!product || !firmwares) {
+		return -1;
+	}
+
+	*firmwares = NULL;
+	snprintf(url, sizeof(url), "https://api.ipsw.me/v4/device/%s", product);
+
+	if (cache_dir) {
+		struct stat fst;
+		if (stat(cache_dir, &fst) != 0) {
+			mkdir_with_parents(cache_dir, 0755);
+		}
+		path = (char*)malloc(strlen(cache_dir) + strlen(product) + 24);
+		if (path) {
+			sprintf(path, "%s/signed-%s.catalog", cache_dir, product);
+		}
+	}
+
+	/* signing status changes rarely, but it does change */
+	int res = catalog_get(url, path, 900, ipsw_signed_firmwares_parse, (void*)product, firmwares);
+	free(path);
+	if (res < 0) {
+		error("ERROR: Download from %s failed.\n", url);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1076,6 +2567,96 @@ static int sha1_verify_fp(FILE* f, unsigned char* expected_sha1)
 	return (memcmp(expected_sha1, tsha1, 20) == 0) ? 1 : 0;
 }
 
+static char* ipsw_sha1_sidecar_path(const char* path)
+{
+	char* sidecar = (char*)malloc(strlen(path) + 6);
+	if (sidecar) {
+		sprintf(sidecar, "%s.sha1", path);
+	}
+	return sidecar;
+}
+
+/* returns 1 if the digest recorded next to path is sha1 and path has not changed since */
+static int ipsw_sha1_sidecar_matches(const char* path, const unsigned char* sha1)
+{
+	struct stat fst;
+	if (stat(path, &fst) != 0) {
+		return 0;
+	}
+	char* sidecar = ipsw_sha1_sidecar_path(path);
+	if (!sidecar) {
+		return 0;
+	}
+	char* buf = NULL;
+	size_t len = 0;
+	int res = read_file(sidecar, (void**)&buf, &len);
+	free(sidecar);
+	if (res != 0) {
+		return 0;
+	}
+	plist_t dict = NULL;
+	plist_from_memory(buf, len, &dict);
+	free(buf);
+	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
+		plist_free(dict);
+		return 0;
+	}
+	res = 0;
+	plist_t node = plist_dict_get_item(dict, "SHA1");
+	uint64_t dlen = 0;
+	const char* digest = (node && plist_get_node_type(node) == PLIST_DATA) ? plist_get_data_ptr(node, &dlen) : NULL;
+	if (digest && dlen == 20 && memcmp(digest, sha1, 20) == 0
+	    && _plist_dict_get_uint(dict, "Size") == (uint64_t)fst.st_size
+	    && _plist_dict_get_uint(dict, "MTime") == (uint64_t)fst.st_mtime) {
+		res = 1;
+	}
+	plist_free(dict);
+	return res;
+}
+
+static void ipsw_sha1_sidecar_write(const char* path, const unsigned char* sha1)
+{
+	struct stat fst;
+	char* sidecar = ipsw_sha1_sidecar_path(path);
+	if (!sidecar) {
+		return;
+	}
+	if (stat(path, &fst) != 0) {
+		free(sidecar);
+		return;
+	}
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "SHA1", plist_new_data((const char*)sha1, 20));
+	plist_dict_set_item(dict, "Size", plist_new_uint((uint64_t)fst.st_size));
+	plist_dict_set_item(dict, "MTime", plist_new_uint((uint64_t)fst.st_mtime));
+	char* xml = NULL;
+	uint32_t xlen = 0;
+	plist_to_xml(dict, &xml, &xlen);
+	plist_free(dict);
+	if (xml) {
+		/* a torn sidecar must not vouch for the file */
+		char* tmp = (char*)malloc(strlen(sidecar) + 16);
+		if (tmp) {
+			sprintf(tmp, "%s.%d.tmp", sidecar, (int)getpid());
+			if (write_file(tmp, xml, xlen) != (int)xlen || rename(tmp, sidecar) != 0) {
+				remove(tmp);
+			}
+			free(tmp);
+		}
+		free(xml);
+	}
+	free(sidecar);
+}
+
+static void ipsw_sha1_sidecar_remove(const char* path)
+{
+	char* sidecar = ipsw_sha1_sidecar_path(path);
+	if (sidecar) {
+		remove(sidecar);
+		free(sidecar);
+	}
+}
+
 int ipsw_download_fw(const char *fwurl, unsigned char* isha1, const char* todir, char** ipswfile)
 {
 	char* fwfn = strrchr(fwurl, '/');
@@ -1103,15 +2684,20 @@ int ipsw_download_fw(const char *fwurl, unsigned char* isha1, const char* todir,
 
 	int need_dl = 0;
 	unsigned char zsha1[20] = {0, };
-	FILE* f = fopen(fwlfn, "rb");
+	FILE* f = (download_is_incomplete(fwlfn)) ? NULL : fopen(fwlfn, "rb");
 	if (f) {
 		if (memcmp(zsha1, isha1, 20) != 0) {
-			info("Verifying '%s'...\n", fwlfn);
-			if (sha1_verify_fp(f, isha1)) {
-				info("Checksum matches.\n");
+			if (ipsw_sha1_sidecar_matches(fwlfn, isha1)) {
+				info("Checksum of '%s' already verified.\n", fwlfn);
 			} else {
-				info("Checksum does not match.\n");
-				need_dl = 1;
+				info("Verifying '%s'...\n", fwlfn);
+				if (sha1_verify_fp(f, isha1)) {
+					info("Checksum matches.\n");
+					ipsw_sha1_sidecar_write(fwlfn, isha1);
+				} else {
+					info("Checksum does not match.\n");
+					need_dl = 1;
+				}
 			}
 		}
 		fclose(f);
@@ -1125,27 +2711,22 @@ int ipsw_download_fw(const char *fwurl, unsigned char* isha1, const char* todir,
 			error("ERROR: Can't download '%s' because it needs a purchase.\n", fwfn);
 			res = -3;
 		} else {
-			remove(fwlfn);
+			unsigned char dsha1[20];
+			ipsw_sha1_sidecar_remove(fwlfn);
 			info("Downloading firmware (%s)\n", fwurl);
-			download_to_file(fwurl, fwlfn, 1);
-			if (memcmp(isha1, zsha1, 20) != 0) {
-				info("\nVerifying '%s'...\n", fwlfn);
-				FILE* f = fopen(fwlfn, "rb");
-				if (f) {
-					if (sha1_verify_fp(f, isha1)) {
-						info("Checksum matches.\n");
-					} else {
-						error("ERROR: File download failed (checksum mismatch).\n");
-						res = -4;
-					}
-					fclose(f);
-
-					// make sure to remove invalid files
-					if (res < 0)
-						remove(fwlfn);
+			if (download_to_file_resumable(fwurl, fwlfn, 1, dsha1) < 0) {
+				error("ERROR: Unable to download '%s'\n", fwurl);
+				res = -6;
+			} else if (memcmp(isha1, zsha1, 20) != 0) {
+				/* the digest was computed while downloading */
+				if (memcmp(dsha1, isha1, 20) == 0) {
+					info("Checksum matches.\n");
+					ipsw_sha1_sidecar_write(fwlfn, isha1);
 				} else {
-					error("ERROR: Can't open '%s' for checksum verification\n", fwlfn);
-					res = -5;
+					error("ERROR: File download failed (checksum mismatch).\n");
+					res = -4;
+					// make sure to remove invalid files
+					remove(fwlfn);
 				}
 			}
 		}
@@ -1188,7 +2769,9 @@ int ipsw_download_latest_fw(plist_t version_data, const char* product, const cha
 	return res;
 }
 
-void ipsw_cancel(void)
+void ipsw_cancel(ipsw_archive_t ipsw)
 {
-	cancel_flag++;
+	if (ipsw) {
+		ipsw->cancel = 1;
+	}
 }
@@ -28,31 +28,86 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <plist/plist.h>
 #include <sys/stat.h>
 
+#include "build_manifest.h"
+
 int ipsw_print_info(const char* ipsw);
 
-typedef int (*ipsw_list_cb)(void *ctx, const char* ipsw, const char *name, struct stat *stat);
+typedef struct ipsw_archive* ipsw_archive_t;
+typedef struct ipsw_file_handle* ipsw_file_handle_t;
+
+/* zip handles kept open per archive, readers beyond it open their own */
+#define IPSW_ZIP_POOL_SIZE 8
+
+typedef int (*ipsw_list_cb)(void *ctx, ipsw_archive_t ipsw, const char *name, struct stat *stat);
+/* file reads the entry's data, it is NULL for directories and empty files */
+typedef int (*ipsw_stream_cb)(void *ctx, ipsw_archive_t ipsw, const char *name, struct stat *stat, ipsw_file_handle_t file);
+
+/* The archive stays open (with an index of its entries) until the last
+ * reference is dropped with ipsw_close() */
+ipsw_archive_t ipsw_open(const char* ipsw);
+/* Reads the IPSW at url on demand, fetched ranges are kept in cache_dir */
+ipsw_archive_t ipsw_open_remote(const char* url, const char* cache_dir);
+int ipsw_is_remote(ipsw_archive_t ipsw);
+ipsw_archive_t ipsw_ref(ipsw_archive_t ipsw);
+void ipsw_close(ipsw_archive_t ipsw);
+const char* ipsw_get_path(ipsw_archive_t ipsw);
 
 int ipsw_is_directory(const char* ipsw);
-int ipsw_file_exists(const char* ipsw, const char* infile);
-int ipsw_get_file_size(const char* ipsw, const char* infile, uint64_t* size);
-int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile);
-int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress);
-int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize);
-int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *tss_enabled);
-int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist);
-int ipsw_list_contents(const char* ipsw, ipsw_list_cb cb, void *ctx);
-
-int ipsw_get_signed_firmwares(const char* product, plist_t* firmwares);
+int ipsw_file_exists(ipsw_archive_t ipsw, const char* infile);
+int ipsw_get_file_size(ipsw_archive_t ipsw, const char* infile, uint64_t* size);
+int ipsw_extract_to_file(ipsw_archive_t ipsw, const char* infile, const char* outfile);
+int ipsw_extract_to_file_with_progress(ipsw_archive_t ipsw, const char* infile, const char* outfile, int print_progress);
+int ipsw_extract_to_memory(ipsw_archive_t ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize);
+/* The returned buffer starts with headroom unused bytes before the file data */
+int ipsw_extract_to_memory_with_headroom(ipsw_archive_t ipsw, const char* infile, unsigned int headroom, unsigned char** pbuffer, unsigned int* psize);
+/* Maps a file of a directory archive privately, with at least headroom
+ * writable bytes in front of its data and tailroom after it. The data is
+ * at *pbase + *phead, writes to it are not carried through to the file.
+ * Release it with munmap(*pbase, *pmap_size). Fails for zip archives. */
+int ipsw_map_file(ipsw_archive_t ipsw, const char* infile, unsigned int headroom, unsigned int tailroom, unsigned char** pbase, size_t* pmap_size, unsigned int* phead, unsigned int* psize);
+int ipsw_extract_build_manifest(ipsw_archive_t ipsw, plist_t* buildmanifest, int *tss_enabled);
+int ipsw_extract_restore_plist(ipsw_archive_t ipsw, plist_t* restore_plist);
+/* Returns a new reference to the archive's BuildManifest, parsed on first use */
+int ipsw_get_build_manifest(ipsw_archive_t ipsw, build_manifest_t* manifest);
+int ipsw_list_contents(ipsw_archive_t ipsw, ipsw_list_cb cb, void *ctx);
+/* Walks the entries starting with prefix in a single pass over the archive,
+ * the data of all of them is read through one private zip handle */
+int ipsw_stream_contents(ipsw_archive_t ipsw, const char* prefix, ipsw_stream_cb cb, void *ctx);
+
+/* Stable 20 byte key for an entry, derived from the build manifest digest and the entry itself */
+int ipsw_get_file_key(ipsw_archive_t ipsw, const char* infile, unsigned char* key);
+/* CRC32 of a zip entry as recorded in the archive */
+int ipsw_get_file_crc(ipsw_archive_t ipsw, const char* infile, uint32_t* crc);
+
+/* If ipsw is NULL, path is opened as a regular file */
+ipsw_file_handle_t ipsw_file_open(ipsw_archive_t ipsw, const char* path);
+/* Opens path while it is still being written, reads past the written part
+ * call wait_cb until more is there. wait_cb returns < 0 if the file will not
+ * grow to size anymore, userdata is released with free_func on close. */
+typedef int (*ipsw_file_wait_cb)(void* userdata);
+ipsw_file_handle_t ipsw_file_open_growing(const char* path, uint64_t size, ipsw_file_wait_cb wait_cb, void* userdata, void (*free_func)(void*));
+void ipsw_file_close(ipsw_file_handle_t handle);
+uint64_t ipsw_file_size(ipsw_file_handle_t handle);
+int ipsw_file_is_seekable(ipsw_file_handle_t handle);
+/* Descriptor of a file opened from the filesystem, -1 for zip entries */
+int ipsw_file_get_fd(ipsw_file_handle_t handle);
+int64_t ipsw_file_read(ipsw_file_handle_t handle, void* buffer, size_t size);
+int ipsw_file_seek(ipsw_file_handle_t handle, int64_t offset, int whence);
+int64_t ipsw_file_tell(ipsw_file_handle_t handle);
+
+/* The list is cached in cache_dir if given */
+int ipsw_get_signed_firmwares(const char* product, const char* cache_dir, plist_t* firmwares);
 int ipsw_download_fw(const char *fwurl, unsigned char* isha1, const char* todir, char** ipswfile);
 
 int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl, unsigned char* sha1buf);
 int ipsw_download_latest_fw(plist_t version_data, const char* product, const char* todir, char** ipswfile);
 
-void ipsw_cancel(void);
+void ipsw_cancel(ipsw_archive_t ipsw);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,523 @@
+/*
+ * ipsw_remote.c
+ * Lazily fetched remote IPSW archives
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zip.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "ipsw_remote.h"
+#include "download.h"
+#include "common.h"
+#include "locking.h"
+
+/* fetch granularity of the sparse file */
+#define IPSW_REMOTE_BLOCK_SIZE (256 * 1024)
+/* sequential reads fetch ahead, doubling up to this */
+#define IPSW_REMOTE_READAHEAD_MIN (1024 * 1024)
+#define IPSW_REMOTE_READAHEAD_MAX (16 * 1024 * 1024)
+
+/* states of a block of the sparse file */
+#define IPSW_REMOTE_BLOCK_MISSING 0
+#define IPSW_REMOTE_BLOCK_PRESENT 1
+#define IPSW_REMOTE_BLOCK_FETCHING 2
+
+int ipsw_remote_is_url(const char* path)
+{
+	return (path && (strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0));
+}
+
+#if defined(HAVE_ZIP_SOURCE_FUNCTION_CREATE) && !defined(WIN32)
+struct ipsw_remote {
+	char* url;
+	char* effective_url;
+	char* validator;
+	uint64_t length;
+	char* cache_path;
+	char* map_path;
+	int fd;
+	int temporary;
+	/* held on <cache_path>.lock while the sparse file and its map are in use */
+	lock_info_t lock;
+	int locked;
+	/* one IPSW_REMOTE_BLOCK_* state per block */
+	unsigned char* blocks;
+	uint32_t num_blocks;
+	int dirty;
+	uint64_t fetched;
+	/* guards the block states, fetches and reads from the sparse file run
+	 * without it */
+	mutex_t mutex;
+	/* signaled for each of the waiters whenever a fetch is done */
+	cond_t cond;
+	int waiters;
+	int refcount;
+};
+
+struct ipsw_remote_source {
+	ipsw_remote_t remote;
+	zip_error_t error;
+	uint64_t pos;
+	uint64_t last_end;
+	uint64_t readahead;
+};
+
+static int ipsw_remote_map_load(ipsw_remote_t remote)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	if (read_file(remote->map_path, (void**)&buf, &len) != 0) {
+		return -1;
+	}
+	plist_t dict = NULL;
+	plist_from_memory(buf, len, &dict);
+	free(buf);
+	if (!dict || plist_get_node_type(dict) != PLIST_DICT) {
+		plist_free(dict);
+		return -1;
+	}
+	int res = -1;
+	plist_t node = plist_dict_get_item(dict, "URL");
+	const char* url = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+	node = plist_dict_get_item(dict, "Validator");
+	const char* validator = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : "";
+	node = plist_dict_get_item(dict, "Blocks");
+	uint64_t blocks_len = 0;
+	const char* blocks = (node && plist_get_node_type(node) == PLIST_DATA) ? plist_get_data_ptr(node, &blocks_len) : NULL;
+	if (url && !strcmp(url, remote->url)
+	    && _plist_dict_get_uint(dict, "Length") == remote->length
+	    && _plist_dict_get_uint(dict, "BlockSize") == IPSW_REMOTE_BLOCK_SIZE
+	    && !strcmp(validator, (remote->validator) ? remote->validator : "")
+	    && blocks && blocks_len == remote->num_blocks) {
+		uint32_t i;
+		for (i = 0; i < remote->num_blocks; i++) {
+			remote->blocks[i] = (blocks[i] == IPSW_REMOTE_BLOCK_PRESENT) ? IPSW_REMOTE_BLOCK_PRESENT : IPSW_REMOTE_BLOCK_MISSING;
+		}
+		res = 0;
+	}
+	plist_free(dict);
+	return res;
+}
+
+static void ipsw_remote_map_save(ipsw_remote_t remote)
+{
+	if (remote->temporary || !remote->dirty) {
+		return;
+	}
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "URL", plist_new_string(remote->url));
+	plist_dict_set_item(dict, "Length", plist_new_uint(remote->length));
+	plist_dict_set_item(dict, "BlockSize", plist_new_uint(IPSW_REMOTE_BLOCK_SIZE));
+	plist_dict_set_item(dict, "Validator", plist_new_string((remote->validator) ? remote->validator : ""));
+	plist_dict_set_item(dict, "Blocks", plist_new_data((const char*)remote->blocks, remote->num_blocks));
+	char* bin = NULL;
+	uint32_t blen = 0;
+	plist_to_bin(dict, &bin, &blen);
+	plist_free(dict);
+	if (bin) {
+		/* the blocks are on disk already, the map may only lag behind */
+		char* tmp = (char*)malloc(strlen(remote->map_path) + 16);
+		if (tmp && fsync(remote->fd) == 0) {
+			sprintf(tmp, "%s.%d.tmp", remote->map_path, (int)getpid());
+			if (write_file(tmp, bin, blen) == (int)blen && rename(tmp, remote->map_path) == 0) {
+				remote->dirty = 0;
+			} else {
+				remove(tmp);
+			}
+		}
+		free(tmp);
+		free(bin);
+	}
+}
+
+ipsw_remote_t ipsw_remote_open(const char* url, const char* cache_dir)
+{
+	if (!ipsw_remote_is_url(url)) {
+		return NULL;
+	}
+
+	ipsw_remote_t remote = (ipsw_remote_t)calloc(1, sizeof(struct ipsw_remote));
+	if (!remote) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	remote->fd = -1;
+	remote->refcount = 1;
+	mutex_init(&remote->mutex);
+	cond_init(&remote->cond);
+	remote->url = strdup(url);
+
+	if (download_get_range_info(url, &remote->length, &remote->validator, &remote->effective_url) < 0) {
+		error("ERROR: %s does not support range requests\n", url);
+		ipsw_remote_close(remote);
+		return NULL;
+	}
+	remote->num_blocks = (uint32_t)((remote->length + IPSW_REMOTE_BLOCK_SIZE - 1) / IPSW_REMOTE_BLOCK_SIZE);
+	remote->blocks = (unsigned char*)calloc(1, remote->num_blocks);
+	if (!remote->blocks) {
+		error("ERROR: Out of memory\n");
+		ipsw_remote_close(remote);
+		return NULL;
+	}
+
+	if (cache_dir) {
+		const char* name = strrchr(url, '/');
+		name = (name && name[1]) ? name + 1 : "remote.ipsw";
+		struct stat fst;
+		if (stat(cache_dir, &fst) != 0) {
+			mkdir_with_parents(cache_dir, 0755);
+		}
+		remote->cache_path = (char*)malloc(strlen(cache_dir) + 1 + strlen(name) + 9);
+		remote->map_path = (char*)malloc(strlen(cache_dir) + 1 + strlen(name) + 13);
+		char* lock_path = (char*)malloc(strlen(cache_dir) + 1 + strlen(name) + 14);
+		if (remote->cache_path && remote->map_path && lock_path) {
+			sprintf(remote->cache_path, "%s/%s.partial", cache_dir, name);
+			sprintf(remote->map_path, "%s.map", remote->cache_path);
+			sprintf(lock_path, "%s.lock", remote->cache_path);
+			/* another process that fetches into the same sparse file would
+			 * overwrite its map, this one uses a file of its own then */
+			if (try_lock_file(lock_path, &remote->lock) == 0) {
+				remote->locked = 1;
+			} else {
+				info("'%s' is in use by another process, using a temporary file\n", remote->cache_path);
+			}
+		}
+		free(lock_path);
+	}
+	if (!remote->locked) {
+		free(remote->cache_path);
+		free(remote->map_path);
+		remote->map_path = NULL;
+		remote->cache_path = get_temp_filename("ipsw_remote_");
+		remote->temporary = 1;
+	}
+	if (!remote->cache_path) {
+		error("ERROR: Out of memory\n");
+		ipsw_remote_close(remote);
+		return NULL;
+	}
+
+	remote->fd = open(remote->cache_path, O_RDWR | O_CREAT, 0644);
+	if (remote->fd < 0) {
+		error("ERROR: Unable to open '%s': %s\n", remote->cache_path, strerror(errno));
+		ipsw_remote_close(remote);
+		return NULL;
+	}
+	struct stat fst;
+	if (remote->temporary || ipsw_remote_map_load(remote) < 0 || fstat(remote->fd, &fst) != 0 || (uint64_t)fst.st_size != remote->length) {
+		memset(remote->blocks, 0, remote->num_blocks);
+		if (ftruncate(remote->fd, 0) != 0 || ftruncate(remote->fd, (off_t)remote->length) != 0) {
+			error("ERROR: Unable to allocate '%s': %s\n", remote->cache_path, strerror(errno));
+			ipsw_remote_close(remote);
+			return NULL;
+		}
+		if (remote->map_path) {
+			remove(remote->map_path);
+		}
+	}
+
+	return remote;
+}
+
+ipsw_remote_t ipsw_remote_ref(ipsw_remote_t remote)
+{
+	if (remote) {
+		mutex_lock(&remote->mutex);
+		remote->refcount++;
+		mutex_unlock(&remote->mutex);
+	}
+	return remote;
+}
+
+void ipsw_remote_close(ipsw_remote_t remote)
+{
+	if (!remote) {
+		return;
+	}
+	mutex_lock(&remote->mutex);
+	int refcount = --remote->refcount;
+	mutex_unlock(&remote->mutex);
+	if (refcount > 0) {
+		return;
+	}
+
+	if (remote->fd >= 0) {
+		ipsw_remote_map_save(remote);
+		close(remote->fd);
+		if (remote->temporary) {
+			remove(remote->cache_path);
+		}
+	}
+	if (remote->locked) {
+		unlock_file(&remote->lock);
+	}
+	if (remote->fetched > 0) {
+		debug("DEBUG: %s: fetched %" PRIu64 " of %" PRIu64 " bytes from %s\n", __func__, remote->fetched, remote->length, remote->url);
+	}
+	free(remote->url);
+	free(remote->effective_url);
+	free(remote->validator);
+	free(remote->cache_path);
+	free(remote->map_path);
+	free(remote->blocks);
+	cond_destroy(&remote->cond);
+	mutex_destroy(&remote->mutex);
+	free(remote);
+}
+
+uint64_t ipsw_remote_get_fetched(ipsw_remote_t remote)
+{
+	return (remote) ? remote->fetched : 0;
+}
+
+/* there is no broadcast, but every waiter is blocked while the mutex is
+ * held, so each signal wakes one of them */
+static void ipsw_remote_wake_waiters(ipsw_remote_t remote)
+{
+	int i;
+	for (i = 0; i < remote->waiters; i++) {
+		cond_signal(&remote->cond);
+	}
+}
+
+/* makes sure [offset, offset + len) is in the sparse file, must be called
+ * with the mutex held. It is released while fetching, so readers of other
+ * ranges go on, and blocks another thread is fetching are waited for. */
+static int ipsw_remote_fill(ipsw_remote_t remote, uint64_t offset, uint64_t len)
+{
+	if (offset >= remote->length || len == 0) {
+		return 0;
+	}
+	if (len > remote->length - offset) {
+		len = remote->length - offset;
+	}
+	uint32_t b = (uint32_t)(offset / IPSW_REMOTE_BLOCK_SIZE);
+	uint32_t last = (uint32_t)((offset + len - 1) / IPSW_REMOTE_BLOCK_SIZE);
+	while (b <= last) {
+		if (remote->blocks[b] == IPSW_REMOTE_BLOCK_PRESENT) {
+			b++;
+			continue;
+		}
+		if (remote->blocks[b] == IPSW_REMOTE_BLOCK_FETCHING) {
+			/* if that fetch fails the block is missing again and fetched here */
+			remote->waiters++;
+			cond_wait(&remote->cond, &remote->mutex);
+			remote->waiters--;
+			continue;
+		}
+		/* one request per run of missing blocks */
+		uint32_t e = b;
+		while (e < last && remote->blocks[e+1] == IPSW_REMOTE_BLOCK_MISSING) {
+			e++;
+		}
+		uint64_t start = (uint64_t)b * IPSW_REMOTE_BLOCK_SIZE;
+		uint64_t end = (uint64_t)(e + 1) * IPSW_REMOTE_BLOCK_SIZE;
+		if (end > remote->length) {
+			end = remote->length;
+		}
+		memset(remote->blocks + b, IPSW_REMOTE_BLOCK_FETCHING, e - b + 1);
+		mutex_unlock(&remote->mutex);
+		int res = download_range_to_fd(remote->effective_url, start, end - start, remote->fd);
+		mutex_lock(&remote->mutex);
+		if (res < 0) {
+			memset(remote->blocks + b, IPSW_REMOTE_BLOCK_MISSING, e - b + 1);
+			ipsw_remote_wake_waiters(remote);
+			error("ERROR: Unable to fetch bytes %" PRIu64 "-%" PRIu64 " of %s\n", start, end - 1, remote->url);
+			return -1;
+		}
+		memset(remote->blocks + b, IPSW_REMOTE_BLOCK_PRESENT, e - b + 1);
+		remote->dirty = 1;
+		remote->fetched += end - start;
+		ipsw_remote_wake_waiters(remote);
+		b = e + 1;
+	}
+	return 0;
+}
+
+static int ipsw_remote_read(struct ipsw_remote_source* src, void* data, uint64_t len)
+{
+	ipsw_remote_t remote = src->remote;
+
+	/* zip entries are read front to back, fetch more the longer that goes on */
+	if (src->pos == src->last_end && src->readahead > 0) {
+		src->readahead *= 2;
+		if (src->readahead > IPSW_REMOTE_READAHEAD_MAX) {
+			src->readahead = IPSW_REMOTE_READAHEAD_MAX;
+		}
+	} else {
+		src->readahead = (src->pos == src->last_end) ? IPSW_REMOTE_READAHEAD_MIN : 0;
+	}
+
+	mutex_lock(&remote->mutex);
+	int res = ipsw_remote_fill(remote, src->pos, len);
+	if (res == 0 && src->readahead > 0) {
+		/* a failed readahead is not an error, the next read tries again */
+		ipsw_remote_fill(remote, src->pos + len, src->readahead);
+	}
+	mutex_unlock(&remote->mutex);
+	if (res < 0) {
+		return -1;
+	}
+
+	uint64_t done = 0;
+	while (done < len) {
+		ssize_t r = pread(remote->fd, (char*)data + done, len - done, (off_t)(src->pos + done));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return -1;
+		}
+		done += r;
+	}
+	src->last_end = src->pos + len;
+	return 0;
+}
+
+static zip_int64_t ipsw_remote_source_cb(void* userdata, void* data, zip_uint64_t len, zip_source_cmd_t cmd)
+{
+	struct ipsw_remote_source* src = (struct ipsw_remote_source*)userdata;
+	uint64_t length = src->remote->length;
+
+	switch (cmd) {
+	case ZIP_SOURCE_OPEN:
+		src->pos = 0;
+		return 0;
+	case ZIP_SOURCE_READ:
+		if (src->pos >= length) {
+			return 0;
+		}
+		if (len > length - src->pos) {
+			len = length - src->pos;
+		}
+		if (ipsw_remote_read(src, data, len) < 0) {
+			zip_error_set(&src->error, ZIP_ER_READ, EIO);
+			return -1;
+		}
+		src->pos += len;
+		return (zip_int64_t)len;
+	case ZIP_SOURCE_CLOSE:
+		return 0;
+	case ZIP_SOURCE_STAT: {
+		if (len < sizeof(zip_stat_t)) {
+			zip_error_set(&src->error, ZIP_ER_INVAL, 0);
+			return -1;
+		}
+		zip_stat_t* st = (zip_stat_t*)data;
+		zip_stat_init(st);
+		st->size = length;
+		st->valid |= ZIP_STAT_SIZE;
+		return sizeof(zip_stat_t);
+	}
+	case ZIP_SOURCE_ERROR:
+		return zip_error_to_data(&src->error, data, len);
+	case ZIP_SOURCE_SEEK: {
+		zip_int64_t pos = zip_source_seek_compute_offset(src->pos, length, data, len, &src->error);
+		if (pos < 0) {
+			return -1;
+		}
+		src->pos = (uint64_t)pos;
+		return 0;
+	}
+	case ZIP_SOURCE_TELL:
+		return (zip_int64_t)src->pos;
+	case ZIP_SOURCE_FREE:
+		zip_error_fini(&src->error);
+		ipsw_remote_close(src->remote);
+		free(src);
+		return 0;
+	case ZIP_SOURCE_SUPPORTS:
+		return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ, ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT, ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE, ZIP_SOURCE_SEEK, ZIP_SOURCE_TELL, ZIP_SOURCE_SUPPORTS, -1);
+	default:
+		zip_error_set(&src->error, ZIP_ER_OPNOTSUPP, 0);
+		return -1;
+	}
+}
+
+struct zip* ipsw_remote_zip_open(ipsw_remote_t remote, int* err)
+{
+	if (!remote) {
+		return NULL;
+	}
+	struct ipsw_remote_source* src = (struct ipsw_remote_source*)calloc(1, sizeof(struct ipsw_remote_source));
+	if (!src) {
+		if (err) *err = ZIP_ER_MEMORY;
+		return NULL;
+	}
+	src->remote = ipsw_remote_ref(remote);
+	zip_error_init(&src->error);
+
+	zip_error_t zerr;
+	zip_error_init(&zerr);
+	zip_source_t* zsrc = zip_source_function_create(ipsw_remote_source_cb, src, &zerr);
+	if (!zsrc) {
+		if (err) *err = zip_error_code_zip(&zerr);
+		zip_error_fini(&zerr);
+		zip_error_fini(&src->error);
+		ipsw_remote_close(src->remote);
+		free(src);
+		return NULL;
+	}
+	struct zip* zip = zip_open_from_source(zsrc, 0, &zerr);
+	if (!zip) {
+		if (err) *err = zip_error_code_zip(&zerr);
+		/* frees src through ZIP_SOURCE_FREE */
+		zip_source_free(zsrc);
+	}
+	zip_error_fini(&zerr);
+	return zip;
+}
+#else
+ipsw_remote_t ipsw_remote_open(const char* url, const char* cache_dir)
+{
+	error("ERROR: Reading IPSWs from a URL is not supported in this build\n");
+	return NULL;
+}
+
+ipsw_remote_t ipsw_remote_ref(ipsw_remote_t remote)
+{
+	return remote;
+}
+
+void ipsw_remote_close(ipsw_remote_t remote)
+{
+}
+
+struct zip* ipsw_remote_zip_open(ipsw_remote_t remote, int* err)
+{
+	return NULL;
+}
+
+uint64_t ipsw_remote_get_fetched(ipsw_remote_t remote)
+{
+	return 0;
+}
+#endif
@@ -0,0 +1,53 @@
+/*
+ * ipsw_remote.h
+ * Lazily fetched remote IPSW archives (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_IPSW_REMOTE_H
+#define IDEVICERESTORE_IPSW_REMOTE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <zip.h>
+
+typedef struct ipsw_remote* ipsw_remote_t;
+
+/* Returns 1 if path is a http:// or https:// URL */
+int ipsw_remote_is_url(const char* path);
+
+/* Byte ranges of url are fetched on demand into a sparse file in cache_dir,
+ * which is kept for later runs. Without a cache_dir a temporary file is used. */
+ipsw_remote_t ipsw_remote_open(const char* url, const char* cache_dir);
+ipsw_remote_t ipsw_remote_ref(ipsw_remote_t remote);
+void ipsw_remote_close(ipsw_remote_t remote);
+
+/* Opens the remote file as a zip archive, every call reads through its own
+ * zip source so the returned archives can be used from different threads. */
+struct zip* ipsw_remote_zip_open(ipsw_remote_t remote, int* err);
+
+uint64_t ipsw_remote_get_fetched(ipsw_remote_t remote);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,7 +27,7 @@
 #include "locking.h"
 #include "common.h"
 
-int lock_file(const char* filename, lock_info_t* lockinfo)
+static int lock_file_internal(const char* filename, lock_info_t* lockinfo, int wait)
 {
 	if (!lockinfo) {
 		return -1;
@@ -42,7 +42,7 @@ int lock_file(const char* filename, lock_info_t* lockinfo)
 	lockinfo->ldata.Offset = 0;
 	lockinfo->ldata.OffsetHigh = 0;
 
-	if (!LockFileEx(lockinfo->fp, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &lockinfo->ldata)) {
+	if (!LockFileEx(lockinfo->fp, LOCKFILE_EXCLUSIVE_LOCK | ((wait) ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, 1, 0, &lockinfo->ldata)) {
 		debug("ERROR: can't lock file, error %d\n", GetLastError());
 		CloseHandle(lockinfo->fp);
 		lockinfo->fp = INVALID_HANDLE_VALUE;
@@ -61,7 +61,7 @@ int lock_file(const char* filename, lock_info_t* lockinfo)
 	lockinfo->ldata.l_start = 0;
 	lockinfo->ldata.l_len = 0;
 
-	if (fcntl(fileno(lockinfo->fp), F_SETLKW, &lockinfo->ldata) < 0) {
+	if (fcntl(fileno(lockinfo->fp), (wait) ? F_SETLKW : F_SETLK, &lockinfo->ldata) < 0) {
 		debug("ERROR: can't lock file, error %d\n", errno);
 		fclose(lockinfo->fp);
 		lockinfo->fp = NULL;
@@ -71,6 +71,16 @@ int lock_file(const char* filename, lock_info_t* lockinfo)
 	return 0;
 }
 
+int lock_file(const char* filename, lock_info_t* lockinfo)
+{
+	return lock_file_internal(filename, lockinfo, 1);
+}
+
+int try_lock_file(const char* filename, lock_info_t* lockinfo)
+{
+	return lock_file_internal(filename, lockinfo, 0);
+}
+
 int unlock_file(lock_info_t* lockinfo)
 {
 	if (!lockinfo) {
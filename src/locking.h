@@ -38,6 +38,8 @@ typedef struct {
 } lock_info_t;
 
 int lock_file(const char* filename, lock_info_t* lockp);
+/* fails right away if somebody else holds the lock */
+int try_lock_file(const char* filename, lock_info_t* lockp);
 int unlock_file(lock_info_t* lockp);
 
 #endif
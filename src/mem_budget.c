@@ -0,0 +1,298 @@
+/*
+ * mem_budget.c
+ * Process wide accounting of large buffers
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+#include <libimobiledevice-glue/thread.h>
+
+#include "mem_budget.h"
+#include "common.h"
+
+#define MEM_BUFFER_MAGIC 0x4d454d42
+/* keeps the data 64 byte aligned */
+#define MEM_BUFFER_HEADER_SIZE 64
+#ifdef __linux__
+#define MEM_TMPFS_MAGIC 0x01021994
+#define MEM_RAMFS_MAGIC 0x858458f6
+#endif
+
+struct mem_buffer_header {
+	uint64_t size;
+	/* bytes charged to the budget */
+	uint64_t accounted;
+	uint32_t magic;
+	int mapped;
+};
+
+static thread_once_t mem_budget_once = THREAD_ONCE_INIT;
+static mutex_t mem_budget_mutex;
+static cond_t mem_budget_cond;
+static uint64_t mem_budget_limit = 0;
+static uint64_t mem_budget_used = 0;
+static char* mem_budget_spill_dir = NULL;
+
+static void mem_budget_init(void)
+{
+	mutex_init(&mem_budget_mutex);
+	cond_init(&mem_budget_cond);
+}
+
+void mem_budget_set_limit(uint64_t limit)
+{
+	thread_once(&mem_budget_once, mem_budget_init);
+	mutex_lock(&mem_budget_mutex);
+	mem_budget_limit = limit;
+	cond_signal(&mem_budget_cond);
+	mutex_unlock(&mem_budget_mutex);
+}
+
+uint64_t mem_budget_get_limit(void)
+{
+	thread_once(&mem_budget_once, mem_budget_init);
+	mutex_lock(&mem_budget_mutex);
+	uint64_t limit = mem_budget_limit;
+	mutex_unlock(&mem_budget_mutex);
+	return limit;
+}
+
+void mem_budget_set_spill_dir(const char* dir)
+{
+	thread_once(&mem_budget_once, mem_budget_init);
+#ifdef __linux__
+	/* files there are memory themselves, spilling would only add copies */
+	struct statfs sfs;
+	if (dir && statfs(dir, &sfs) == 0 && (sfs.f_type == MEM_TMPFS_MAGIC || sfs.f_type == MEM_RAMFS_MAGIC)) {
+		debug("DEBUG: %s: %s is memory backed, not spilling there\n", __func__, dir);
+		dir = NULL;
+	}
+#endif
+	mutex_lock(&mem_budget_mutex);
+	free(mem_budget_spill_dir);
+	mem_budget_spill_dir = (dir) ? strdup(dir) : NULL;
+	mutex_unlock(&mem_budget_mutex);
+}
+
+/* Charges size bytes, returns 0 if they did not fit into the budget in time
+ * and are charged anyway. Waiting for buffers the caller holds itself could
+ * never end, so the wait is limited. */
+static int mem_budget_acquire(uint64_t size)
+{
+	int res = 1;
+	uint64_t deadline = 0;
+	thread_once(&mem_budget_once, mem_budget_init);
+	mutex_lock(&mem_budget_mutex);
+	while (mem_budget_limit > 0 && mem_budget_used > 0 && mem_budget_used + size > mem_budget_limit) {
+		uint64_t now = get_monotonic_time_us();
+		if (deadline == 0) {
+			debug("DEBUG: %s: waiting for %" PRIu64 " bytes, %" PRIu64 " of %" PRIu64 " in use\n", __func__, size, mem_budget_used, mem_budget_limit);
+			deadline = now + (uint64_t)MEM_BUDGET_WAIT_MS * 1000;
+		} else if (now >= deadline) {
+			res = 0;
+			break;
+		}
+		/* woken up by releases, the timeout also lets smaller requests behind
+		 * a waiter that still doesn't fit make progress */
+		cond_wait_timeout(&mem_budget_cond, &mem_budget_mutex, 100);
+	}
+	mem_budget_used += size;
+	if (mem_budget_limit == 0 || mem_budget_used < mem_budget_limit) {
+		/* there might be room for another waiter */
+		cond_signal(&mem_budget_cond);
+	}
+	mutex_unlock(&mem_budget_mutex);
+	return res;
+}
+
+static void mem_budget_release(uint64_t size)
+{
+	if (size == 0) {
+		return;
+	}
+	mutex_lock(&mem_budget_mutex);
+	mem_budget_used = (mem_budget_used > size) ? mem_budget_used - size : 0;
+	cond_signal(&mem_budget_cond);
+	mutex_unlock(&mem_budget_mutex);
+}
+
+/* Maps an unlinked file of total bytes in the spill directory */
+static void* mem_buffer_map(size_t total)
+{
+#ifdef WIN32
+	return NULL;
+#else
+	mutex_lock(&mem_budget_mutex);
+	char* path = (mem_budget_spill_dir) ? (char*)malloc(strlen(mem_budget_spill_dir) + 16) : NULL;
+	if (path) {
+		sprintf(path, "%s/.spill-XXXXXX", mem_budget_spill_dir);
+	}
+	mutex_unlock(&mem_budget_mutex);
+	if (!path) {
+		return NULL;
+	}
+
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		debug("DEBUG: %s: unable to create %s: %s\n", __func__, path, strerror(errno));
+		free(path);
+		return NULL;
+	}
+	unlink(path);
+	free(path);
+
+	/* the blocks are allocated now, a full disk would fault on first write otherwise */
+#ifdef HAVE_POSIX_FALLOCATE
+	int res = posix_fallocate(fd, 0, (off_t)total);
+#else
+	int res = ftruncate(fd, (off_t)total);
+#endif
+	if (res != 0) {
+		close(fd);
+		return NULL;
+	}
+	void* addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return (addr == MAP_FAILED) ? NULL : addr;
+#endif
+}
+
+static struct mem_buffer_header* mem_buffer_header(void* ptr)
+{
+	struct mem_buffer_header* hdr = (struct mem_buffer_header*)((unsigned char*)ptr - MEM_BUFFER_HEADER_SIZE);
+	if (hdr->magic != MEM_BUFFER_MAGIC) {
+		error("ERROR: %s: %p is not a mem_buffer\n", __func__, ptr);
+		abort();
+	}
+	return hdr;
+}
+
+/* charged bytes are already accounted to the caller and handed over */
+static void* mem_buffer_alloc_charged(size_t size, uint64_t charged)
+{
+	size_t total = MEM_BUFFER_HEADER_SIZE + size;
+	uint64_t accounted = (size >= MEM_BUDGET_MIN_SIZE) ? size : 0;
+	int within_budget = 1;
+	if (accounted > charged) {
+		within_budget = mem_budget_acquire(accounted - charged);
+	} else if (charged > accounted) {
+		mem_budget_release(charged - accounted);
+	}
+
+	struct mem_buffer_header* hdr = NULL;
+	int mapped = 0;
+	if (!within_budget && accounted > 0) {
+		hdr = (struct mem_buffer_header*)mem_buffer_map(total);
+		mapped = (hdr != NULL);
+		debug("DEBUG: %s: over budget, %s %zu bytes\n", __func__, (mapped) ? "spilling" : "allocating", size);
+	}
+	if (!hdr) {
+		hdr = (struct mem_buffer_header*)malloc(total);
+	}
+	if (!hdr) {
+		mem_budget_release(accounted);
+		return NULL;
+	}
+	hdr->size = size;
+	hdr->accounted = accounted;
+	hdr->magic = MEM_BUFFER_MAGIC;
+	hdr->mapped = mapped;
+	return (unsigned char*)hdr + MEM_BUFFER_HEADER_SIZE;
+}
+
+void* mem_buffer_alloc(size_t size)
+{
+	return mem_buffer_alloc_charged(size, 0);
+}
+
+void* mem_buffer_realloc(void* ptr, size_t size)
+{
+	if (!ptr) {
+		return mem_buffer_alloc(size);
+	}
+	struct mem_buffer_header* hdr = mem_buffer_header(ptr);
+	if (!hdr->mapped) {
+		uint64_t accounted = (size >= MEM_BUDGET_MIN_SIZE) ? size : 0;
+		if (accounted > hdr->accounted) {
+			mem_budget_acquire(accounted - hdr->accounted);
+		}
+		struct mem_buffer_header* newhdr = (struct mem_buffer_header*)realloc(hdr, MEM_BUFFER_HEADER_SIZE + size);
+		if (!newhdr) {
+			if (accounted > hdr->accounted) {
+				mem_budget_release(accounted - hdr->accounted);
+			}
+			return NULL;
+		}
+		if (accounted < newhdr->accounted) {
+			mem_budget_release(newhdr->accounted - accounted);
+		}
+		newhdr->size = size;
+		newhdr->accounted = accounted;
+		return (unsigned char*)newhdr + MEM_BUFFER_HEADER_SIZE;
+	}
+
+	/* the old buffer's share is handed over, so growing it only waits for
+	 * the difference and not for the buffer itself to be released */
+	void* newptr = mem_buffer_alloc_charged(size, hdr->accounted);
+	if (!newptr) {
+		/* the share was released, ptr is still valid but not accounted */
+		hdr->accounted = 0;
+		return NULL;
+	}
+	hdr->accounted = 0;
+	memcpy(newptr, ptr, (hdr->size < size) ? hdr->size : size);
+	mem_buffer_free(ptr);
+	return newptr;
+}
+
+void mem_buffer_free(void* ptr)
+{
+	if (!ptr) {
+		return;
+	}
+	struct mem_buffer_header* hdr = mem_buffer_header(ptr);
+	uint64_t accounted = hdr->accounted;
+	hdr->magic = 0;
+#ifndef WIN32
+	if (hdr->mapped) {
+		munmap(hdr, MEM_BUFFER_HEADER_SIZE + hdr->size);
+	} else
+#endif
+	free(hdr);
+	mem_budget_release(accounted);
+}
+
+size_t mem_buffer_size(void* ptr)
+{
+	return (ptr) ? (size_t)mem_buffer_header(ptr)->size : 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * mem_budget.h
+ * Process wide accounting of large buffers (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef IDEVICERESTORE_MEM_BUDGET_H
+#define IDEVICERESTORE_MEM_BUDGET_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* smaller buffers are plain malloc() allocations and not accounted */
+#define MEM_BUDGET_MIN_SIZE (1024 * 1024)
+/* how long an allocation waits for budget before it is spilled */
+#define MEM_BUDGET_WAIT_MS 30000
+
+/* Bytes all buffers of the process may hold at once, 0 for no limit */
+void mem_budget_set_limit(uint64_t limit);
+uint64_t mem_budget_get_limit(void);
+/* Buffers that don't fit into the budget are backed by unlinked files in
+ * dir, so the kernel can write them out under memory pressure. NULL, or a
+ * memory backed dir like tmpfs, keeps them in memory. */
+void mem_budget_set_spill_dir(const char* dir);
+
+/* Allocations of MEM_BUDGET_MIN_SIZE and more wait while the budget is used
+ * up by other buffers. They must be released with mem_buffer_free(), not
+ * free(). */
+void* mem_buffer_alloc(size_t size);
+void* mem_buffer_realloc(void* ptr, size_t size);
+void mem_buffer_free(void* ptr);
+size_t mem_buffer_size(void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
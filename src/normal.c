@@ -33,6 +33,7 @@
 #include "common.h"
 #include "normal.h"
 #include "recovery.h"
+#include "transition.h"
 
 static int normal_idevice_new(struct idevicerestore_client_t* client, idevice_t* device)
 {
@@ -259,16 +260,14 @@ int normal_enter_recovery(struct idevicerestore_client_t* client)
 
 	mutex_lock(&client->device_event_mutex);
 	debug("DEBUG: Waiting for device to disconnect...\n");
-	cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 60000);
-	if (client->mode == MODE_NORMAL || (client->flags & FLAG_QUIT)) {
+	if (transition_wait(client, "normal-disconnect", TRANSITION_ANY_MODE_BUT(MODE_NORMAL), 60000) < 0) {
 		mutex_unlock(&client->device_event_mutex);
 		error("ERROR: Failed to place device in recovery mode\n");
 		return -1;
 	}
 
 	debug("DEBUG: Waiting for device to connect in recovery mode...\n");
-	cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 60000);
-	if (client->mode != MODE_RECOVERY || (client->flags & FLAG_QUIT)) {
+	if (transition_wait(client, "normal-recovery", TRANSITION_MODE(MODE_RECOVERY), 60000) < 0) {
 		mutex_unlock(&client->device_event_mutex);
 		error("ERROR: Failed to enter recovery mode\n");
 		return -1;
@@ -0,0 +1,403 @@
+/*
+ * prefetch.c
+ * Background extraction and personalization of boot components
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "tss.h"
+#include "common.h"
+#include "prefetch.h"
+#include "idevicerestore.h"
+
+enum prefetch_state {
+	PREFETCH_PENDING = 0,
+	PREFETCH_BUSY,
+	PREFETCH_READY,
+	/* the extracted data has been handed out */
+	PREFETCH_TAKEN,
+	/* nothing left to hand out */
+	PREFETCH_DONE
+};
+
+struct prefetch_entry {
+	char* name;
+	char* path;
+	enum prefetch_state state;
+	unsigned char* data;
+	unsigned int size;
+	/* what prefetch_take_component() handed out, only compared, never dereferenced */
+	const unsigned char* taken;
+	struct component_buffer personalized;
+	/* the ticket the component was stitched with */
+	unsigned char* ticket;
+	unsigned int ticket_size;
+	unsigned int generation;
+};
+
+struct prefetch {
+	struct idevicerestore_client_t* client;
+	THREAD_T thread;
+	int have_thread;
+	mutex_t mutex;
+	/* the worker waits on work_cond, the restore thread on done_cond */
+	cond_t work_cond;
+	cond_t done_cond;
+	int stop;
+	plist_t tss;
+	unsigned int generation;
+	struct prefetch_entry* entries;
+	unsigned int num_entries;
+	uint64_t log_ecid;
+};
+
+/* boot chain in the order it is sent to the device */
+static const char* prefetch_boot_components[] = {
+	"iBSS",
+	"iBEC",
+	"RestoreLogo",
+	"RestoreRamDisk",
+	"RestoreDeviceTree",
+	"RestoreSEP",
+	"RestoreKernelCache",
+	"LLB",
+	"SEP",
+	NULL
+};
+
+static void prefetch_add_component(prefetch_t prefetch, plist_t build_identity, plist_t tss, const char* name)
+{
+	unsigned int i;
+	for (i = 0; i < prefetch->num_entries; i++) {
+		if (!strcmp(prefetch->entries[i].name, name)) {
+			return;
+		}
+	}
+	if (!build_identity_has_component(build_identity, name)) {
+		return;
+	}
+
+	/* same lookup order as the senders use */
+	char* path = NULL;
+	if (tss_response_get_path_by_entry(tss, name, &path) < 0) {
+		path = NULL;
+	}
+	if (!path && build_identity_get_component_path(build_identity, name, &path) < 0) {
+		free(path);
+		return;
+	}
+
+	struct prefetch_entry* entries = (struct prefetch_entry*)realloc(prefetch->entries, sizeof(struct prefetch_entry) * (prefetch->num_entries + 1));
+	if (!entries) {
+		free(path);
+		return;
+	}
+	prefetch->entries = entries;
+	struct prefetch_entry* entry = &prefetch->entries[prefetch->num_entries++];
+	memset(entry, 0, sizeof(struct prefetch_entry));
+	entry->name = strdup(name);
+	entry->path = path;
+}
+
+static void prefetch_add_manifest_components(prefetch_t prefetch, plist_t build_identity, plist_t tss)
+{
+	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
+	if (!manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
+		return;
+	}
+
+	/* components sent by recovery_send_loaded_by_iboot() and restore_send_nor() */
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(manifest_node, &iter);
+	while (iter) {
+		char* key = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(manifest_node, iter, &key, &node);
+		if (!key) {
+			break;
+		}
+		uint8_t is_fw = 0;
+		uint8_t is_secondary_fw = 0;
+		uint8_t loaded_by_iboot = 0;
+		uint8_t is_stg1 = 0;
+		plist_t fw_node = plist_access_path(node, 2, "Info", "IsFirmwarePayload");
+		if (fw_node && plist_get_node_type(fw_node) == PLIST_BOOLEAN) {
+			plist_get_bool_val(fw_node, &is_fw);
+		}
+		fw_node = plist_access_path(node, 2, "Info", "IsSecondaryFirmwarePayload");
+		if (fw_node && plist_get_node_type(fw_node) == PLIST_BOOLEAN) {
+			plist_get_bool_val(fw_node, &is_secondary_fw);
+		}
+		fw_node = plist_access_path(node, 2, "Info", "IsLoadedByiBoot");
+		if (fw_node && plist_get_node_type(fw_node) == PLIST_BOOLEAN) {
+			plist_get_bool_val(fw_node, &loaded_by_iboot);
+		}
+		fw_node = plist_access_path(node, 2, "Info", "IsLoadedByiBootStage1");
+		if (fw_node && plist_get_node_type(fw_node) == PLIST_BOOLEAN) {
+			plist_get_bool_val(fw_node, &is_stg1);
+		}
+		if ((loaded_by_iboot && !is_stg1) || is_fw || (is_secondary_fw && loaded_by_iboot)) {
+			prefetch_add_component(prefetch, build_identity, tss, key);
+		}
+		free(key);
+	}
+	free(iter);
+}
+
+/* must be called with the prefetch mutex held */
+static struct prefetch_entry* prefetch_next_job(prefetch_t prefetch)
+{
+	unsigned int i;
+	for (i = 0; i < prefetch->num_entries; i++) {
+		struct prefetch_entry* entry = &prefetch->entries[i];
+		if (entry->state == PREFETCH_PENDING) {
+			return entry;
+		}
+		if (entry->state == PREFETCH_READY && entry->generation != prefetch->generation) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void* prefetch_thread(void* arg)
+{
+	prefetch_t prefetch = (prefetch_t)arg;
+	struct idevicerestore_client_t* client = prefetch->client;
+
+	idevicerestore_log_set_ecid(prefetch->log_ecid);
+	mutex_lock(&prefetch->mutex);
+	while (!prefetch->stop) {
+		if (client->flags & FLAG_QUIT) {
+			break;
+		}
+		struct prefetch_entry* entry = prefetch_next_job(prefetch);
+		if (!entry) {
+			cond_wait_timeout(&prefetch->work_cond, &prefetch->mutex, 1000);
+			continue;
+		}
+		entry->state = PREFETCH_BUSY;
+		unsigned int generation = prefetch->generation;
+		plist_t tss = plist_copy(prefetch->tss);
+		/* the entry stays where it is while it is busy and nobody else touches these */
+		unsigned char* data = entry->data;
+		unsigned int size = entry->size;
+		struct component_buffer personalized = entry->personalized;
+		unsigned char* ticket = entry->ticket;
+		component_buffer_init(&entry->personalized);
+		entry->ticket = NULL;
+		mutex_unlock(&prefetch->mutex);
+
+		component_buffer_free(&personalized);
+		free(ticket);
+		ticket = NULL;
+		unsigned int ticket_size = 0;
+
+		int res = 0;
+		if (!data) {
+			res = _extract_component(client, entry->path, &data, &size);
+		}
+		if (res == 0 && tss_response_get_ap_img4_ticket(tss, &ticket, &ticket_size) < 0) {
+			res = -1;
+		}
+		/* the sender hands the extracted data back untouched, so it is personalized as a copy */
+		if (res == 0) {
+			res = component_buffer_copy(&personalized, data, size);
+		}
+		if (res == 0) {
+			res = _personalize_component(client, entry->name, &personalized, tss);
+		}
+		plist_free(tss);
+
+		mutex_lock(&prefetch->mutex);
+		if (res == 0) {
+			debug("DEBUG: %s: %s is ready\n", __func__, entry->name);
+			entry->data = data;
+			entry->size = size;
+			entry->personalized = personalized;
+			entry->ticket = ticket;
+			entry->ticket_size = ticket_size;
+			entry->generation = generation;
+			entry->state = PREFETCH_READY;
+		} else {
+			/* the sender will run into the same error and report it */
+			free(data);
+			component_buffer_free(&personalized);
+			free(ticket);
+			entry->data = NULL;
+			entry->state = PREFETCH_DONE;
+		}
+		cond_signal(&prefetch->done_cond);
+	}
+	mutex_unlock(&prefetch->mutex);
+
+	return NULL;
+}
+
+prefetch_t prefetch_start(struct idevicerestore_client_t* client, plist_t build_identity, plist_t tss)
+{
+	if (!client || !build_identity || !tss) {
+		return NULL;
+	}
+
+	prefetch_t prefetch = (prefetch_t)calloc(1, sizeof(struct prefetch));
+	if (!prefetch) {
+		return NULL;
+	}
+	prefetch->client = client;
+	prefetch->tss = plist_copy(tss);
+	mutex_init(&prefetch->mutex);
+	cond_init(&prefetch->work_cond);
+	cond_init(&prefetch->done_cond);
+
+	int i;
+	for (i = 0; prefetch_boot_components[i]; i++) {
+		prefetch_add_component(prefetch, build_identity, tss, prefetch_boot_components[i]);
+	}
+	prefetch_add_manifest_components(prefetch, build_identity, tss);
+
+	prefetch->log_ecid = idevicerestore_log_get_ecid();
+	if (prefetch->num_entries == 0 || thread_new(&prefetch->thread, prefetch_thread, prefetch) != 0) {
+		prefetch_free(prefetch);
+		return NULL;
+	}
+	prefetch->have_thread = 1;
+	debug("DEBUG: %s: prefetching %u components\n", __func__, prefetch->num_entries);
+
+	return prefetch;
+}
+
+void prefetch_update_tss(prefetch_t prefetch, plist_t tss)
+{
+	if (!prefetch || !tss) {
+		return;
+	}
+	mutex_lock(&prefetch->mutex);
+	plist_free(prefetch->tss);
+	prefetch->tss = plist_copy(tss);
+	prefetch->generation++;
+	cond_signal(&prefetch->work_cond);
+	mutex_unlock(&prefetch->mutex);
+}
+
+int prefetch_take_component(prefetch_t prefetch, const char* path, unsigned char** data, unsigned int* size)
+{
+	if (!prefetch || !path || !data || !size) {
+		return -1;
+	}
+
+	int res = -1;
+	mutex_lock(&prefetch->mutex);
+	unsigned int i;
+	for (i = 0; i < prefetch->num_entries; i++) {
+		struct prefetch_entry* entry = &prefetch->entries[i];
+		if (strcmp(entry->path, path) != 0) {
+			continue;
+		}
+		if (entry->state == PREFETCH_PENDING) {
+			/* not started yet, don't let the worker do it twice */
+			entry->state = PREFETCH_DONE;
+			break;
+		}
+		while (entry->state == PREFETCH_BUSY && prefetch->have_thread) {
+			cond_wait_timeout(&prefetch->done_cond, &prefetch->mutex, 1000);
+		}
+		if (entry->state == PREFETCH_READY) {
+			*data = entry->data;
+			*size = entry->size;
+			entry->taken = entry->data;
+			entry->data = NULL;
+			entry->state = PREFETCH_TAKEN;
+			res = 0;
+			break;
+		}
+	}
+	mutex_unlock(&prefetch->mutex);
+
+	return res;
+}
+
+int prefetch_take_personalized(prefetch_t prefetch, const char* component, const unsigned char* data, unsigned int size, const unsigned char* ticket, unsigned int ticket_size, struct component_buffer* personalized)
+{
+	if (!prefetch || !component || !data || !ticket || !personalized) {
+		return -1;
+	}
+
+	int res = -1;
+	mutex_lock(&prefetch->mutex);
+	unsigned int i;
+	for (i = 0; i < prefetch->num_entries; i++) {
+		struct prefetch_entry* entry = &prefetch->entries[i];
+		if (entry->state != PREFETCH_TAKEN || entry->taken != data || entry->size != size || strcmp(entry->name, component) != 0) {
+			continue;
+		}
+		/* the sender passes the untouched buffer it got from prefetch_take_component() */
+		if (entry->personalized.base && entry->ticket_size == ticket_size && memcmp(entry->ticket, ticket, ticket_size) == 0) {
+			*personalized = entry->personalized;
+			component_buffer_init(&entry->personalized);
+			res = 0;
+		}
+		component_buffer_free(&entry->personalized);
+		free(entry->ticket);
+		entry->ticket = NULL;
+		entry->taken = NULL;
+		entry->state = PREFETCH_DONE;
+		break;
+	}
+	mutex_unlock(&prefetch->mutex);
+
+	return res;
+}
+
+void prefetch_free(prefetch_t prefetch)
+{
+	if (!prefetch) {
+		return;
+	}
+	if (prefetch->have_thread) {
+		mutex_lock(&prefetch->mutex);
+		prefetch->stop = 1;
+		cond_signal(&prefetch->work_cond);
+		mutex_unlock(&prefetch->mutex);
+		thread_join(prefetch->thread);
+		thread_free(prefetch->thread);
+	}
+
+	unsigned int i;
+	for (i = 0; i < prefetch->num_entries; i++) {
+		free(prefetch->entries[i].name);
+		free(prefetch->entries[i].path);
+		free(prefetch->entries[i].data);
+		component_buffer_free(&prefetch->entries[i].personalized);
+		free(prefetch->entries[i].ticket);
+	}
+	free(prefetch->entries);
+	plist_free(prefetch->tss);
+	cond_destroy(&prefetch->done_cond);
+	cond_destroy(&prefetch->work_cond);
+	mutex_destroy(&prefetch->mutex);
+	free(prefetch);
+}
@@ -0,0 +1,62 @@
+/*
+ * prefetch.h
+ * Background extraction and personalization of boot components (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_PREFETCH_H
+#define IDEVICERESTORE_PREFETCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+struct idevicerestore_client_t;
+struct component_buffer;
+
+typedef struct prefetch* prefetch_t;
+
+/* Starts extracting and personalizing the components of build_identity the
+ * device will ask for in DFU, recovery and restore mode, in that order.
+ * Component paths are resolved right away, tss is copied. */
+prefetch_t prefetch_start(struct idevicerestore_client_t* client, plist_t build_identity, plist_t tss);
+
+/* Components personalized with an older TSS response are personalized again
+ * with this one. Components that have been handed out already are not. */
+void prefetch_update_tss(prefetch_t prefetch, plist_t tss);
+
+/* Hands out the extracted data of path, waiting for it if it is being worked
+ * on right now. Returns 0 and transfers ownership of data on success, -1 if
+ * the caller has to extract the component itself. */
+int prefetch_take_component(prefetch_t prefetch, const char* path, unsigned char** data, unsigned int* size);
+
+/* Hands out the personalized component if it was made from the very buffer
+ * prefetch_take_component() handed out and stitched with the same ticket.
+ * Returns 0 and transfers ownership on success, -1 otherwise. */
+int prefetch_take_personalized(prefetch_t prefetch, const char* component, const unsigned char* data, unsigned int size, const unsigned char* ticket, unsigned int ticket_size, struct component_buffer* personalized);
+
+/* Stops the background thread and frees everything not handed out */
+void prefetch_free(prefetch_t prefetch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
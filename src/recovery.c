@@ -34,6 +34,7 @@
 #include "img3.h"
 #include "restore.h"
 #include "recovery.h"
+#include "transition.h"
 
 static int recovery_progress_callback(irecv_client_t client, const irecv_event_t* event)
 {
@@ -47,6 +48,8 @@ void recovery_client_free(struct idevicerestore_client_t* client)
 {
 	if(client) {
 		if (client->recovery) {
+			component_pipeline_free(client->recovery->pipeline);
+			client->recovery->pipeline = NULL;
 			if(client->recovery->client) {
 				irecv_close(client->recovery->client);
 				client->recovery->client = NULL;
@@ -59,8 +62,8 @@ void recovery_client_free(struct idevicerestore_client_t* client)
 
 int recovery_client_new(struct idevicerestore_client_t* client)
 {
-	int i = 0;
-	int attempts = 20;
+	unsigned int i = 0;
+	unsigned int budget = 80000;
 	irecv_client_t recovery = NULL;
 	irecv_error_t recovery_error = IRECV_E_UNKNOWN_ERROR;
 
@@ -73,18 +76,17 @@ int recovery_client_new(struct idevicerestore_client_t* client)
 		memset(client->recovery, 0, sizeof(struct recovery_client_t));
 	}
 
-	for (i = 1; i <= attempts; i++) {
+	/* the device may not be ready to be opened right after it showed up */
+	for (i = 0; ; i++) {
 		recovery_error = irecv_open_with_ecid(&recovery, client->ecid);
 		if (recovery_error == IRECV_E_SUCCESS) {
 			break;
 		}
 
-		if (i >= attempts) {
+		if (transition_backoff(i, &budget) < 0) {
 			error("ERROR: Unable to connect to device in recovery mode\n");
 			return -1;
 		}
-
-		sleep(4);
 		debug("Retrying connection...\n");
 	}
 
@@ -120,7 +122,7 @@ int recovery_set_autoboot(struct idevicerestore_client_t* client, int enable)
 	return 0;
 }
 
-int recovery_enter_restore(struct idevicerestore_client_t* client, plist_t build_identity)
+static int recovery_boot_restore(struct idevicerestore_client_t* client, plist_t build_identity)
 {
 	if (client->build_major >= 8) {
 		client->restore_boot_args = strdup("rd=md0 nand-enable-reformat=1 -progress");
@@ -219,8 +221,7 @@ int recovery_enter_restore(struct idevicerestore_client_t* client, plist_t build
 	}
 
 	debug("DEBUG: Waiting for device to disconnect...\n");
-	cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 30000);
-	if (client->mode == MODE_RECOVERY || (client->flags & FLAG_QUIT)) {
+	if (transition_wait(client, "recovery-disconnect", TRANSITION_ANY_MODE_BUT(MODE_RECOVERY), 30000) < 0) {
 		mutex_unlock(&client->device_event_mutex);
 		error("ERROR: Failed to place device in restore mode\n");
 		return -1;
@@ -245,7 +246,9 @@ int recovery_send_ticket(struct idevicerestore_client_t* client)
 	}
 
 	info("Sending APTicket (%d bytes)\n", size);
+	uint64_t begin = telemetry_begin();
 	irecv_error_t err = irecv_send_buffer(client->recovery->client, data, size, 0);
+	telemetry_end(client->telemetry, "recovery_send", begin, size);
 	free(data);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send APTicket: %s\n", irecv_strerror(err));
@@ -261,12 +264,9 @@ int recovery_send_ticket(struct idevicerestore_client_t* client)
 	return 0;
 }
 
-int recovery_send_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component)
+static int recovery_prepare_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component, struct component_buffer* cb)
 {
-	unsigned int size = 0;
-	unsigned char* data = NULL;
 	char* path = NULL;
-	irecv_error_t err = 0;
 
 	if (client->tss) {
 		if (tss_response_get_path_by_entry(client->tss, component, &path) < 0) {
@@ -281,27 +281,42 @@ int recovery_send_component(struct idevicerestore_client_t* client, plist_t buil
 		}
 	}
 
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, path, &component_data, &component_size);
+	int ret = extract_component_buffer(client, path, cb);
 	free(path);
 	if (ret < 0) {
 		error("ERROR: Unable to extract component: %s\n", component);
 		return -1;
 	}
 
-	ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-	free(component_data);
+	ret = personalize_component_buffer(client, component, cb, client->tss);
 	if (ret < 0) {
 		error("ERROR: Unable to get personalized component: %s\n", component);
+		component_buffer_free(cb);
 		return -1;
 	}
 
-	info("Sending %s (%d bytes)...\n", component, size);
+	return 0;
+}
+
+int recovery_send_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component)
+{
+	irecv_error_t err = 0;
+
+	struct component_buffer cb;
+	component_buffer_init(&cb);
+	if (component_pipeline_take(client->recovery->pipeline, component, &cb) < 0) {
+		if (recovery_prepare_component(client, build_identity, component, &cb) < 0) {
+			return -1;
+		}
+	}
+
+	info("Sending %s (%d bytes)...\n", component, cb.size);
 
 	// FIXME: Did I do this right????
-	err = irecv_send_buffer(client->recovery->client, data, size, 0);
-	free(data);
+	uint64_t begin = telemetry_begin();
+	err = irecv_send_buffer(client->recovery->client, component_buffer_data(&cb), cb.size, 0);
+	telemetry_end(client->telemetry, "recovery_send", begin, cb.size);
+	component_buffer_free(&cb);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send %s component: %s\n", component, irecv_strerror(err));
 		return -1;
@@ -328,6 +343,81 @@ int recovery_send_component_and_command(struct idevicerestore_client_t* client,
 	return 0;
 }
 
+static int recovery_is_loaded_by_iboot(plist_t node)
+{
+	plist_t iboot_node = plist_access_path(node, 2, "Info", "IsLoadedByiBoot");
+	plist_t iboot_stg1_node = plist_access_path(node, 2, "Info", "IsLoadedByiBootStage1");
+	uint8_t is_stg1 = 0;
+	uint8_t b = 0;
+	if (iboot_stg1_node && plist_get_node_type(iboot_stg1_node) == PLIST_BOOLEAN) {
+		plist_get_bool_val(iboot_stg1_node, &is_stg1);
+	}
+	if (iboot_node && plist_get_node_type(iboot_node) == PLIST_BOOLEAN && !is_stg1) {
+		plist_get_bool_val(iboot_node, &b);
+	}
+	return b;
+}
+
+/* queues what recovery_boot_restore() sends, in the same order */
+static void recovery_start_pipeline(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	component_pipeline_t pipeline = component_pipeline_new(client, build_identity, recovery_prepare_component);
+	if (!pipeline) {
+		return;
+	}
+
+	if (build_identity_has_component(build_identity, "RestoreLogo")) {
+		component_pipeline_add(pipeline, "RestoreLogo");
+	}
+	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
+	if (manifest_node && plist_get_node_type(manifest_node) == PLIST_DICT) {
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(manifest_node, &iter);
+		while (iter) {
+			char *key = NULL;
+			plist_t node = NULL;
+			plist_dict_next_item(manifest_node, iter, &key, &node);
+			if (key == NULL)
+				break;
+			if (recovery_is_loaded_by_iboot(node)) {
+				component_pipeline_add(pipeline, key);
+			}
+			free(key);
+		}
+		free(iter);
+	}
+	component_pipeline_add(pipeline, "RestoreRamDisk");
+	component_pipeline_add(pipeline, "RestoreDeviceTree");
+	if (build_identity_has_component(build_identity, "RestoreSEP")) {
+		component_pipeline_add(pipeline, "RestoreSEP");
+	}
+	component_pipeline_add(pipeline, "RestoreKernelCache");
+
+	if (component_pipeline_start(pipeline) < 0) {
+		component_pipeline_free(pipeline);
+		return;
+	}
+	client->recovery->pipeline = pipeline;
+}
+
+int recovery_enter_restore(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	if (client->recovery == NULL) {
+		if (recovery_client_new(client) < 0) {
+			return -1;
+		}
+	}
+
+	/* the next component is extracted and personalized while the previous one is uploaded */
+	recovery_start_pipeline(client, build_identity);
+	int res = recovery_boot_restore(client, build_identity);
+	if (client->recovery) {
+		component_pipeline_free(client->recovery->pipeline);
+		client->recovery->pipeline = NULL;
+	}
+	return res;
+}
+
 int recovery_send_ibec(struct idevicerestore_client_t* client, plist_t build_identity)
 {
 	const char* component = "iBEC";
@@ -414,21 +504,11 @@ int recovery_send_loaded_by_iboot(struct idevicerestore_client_t* client, plist_
 		if (key == NULL)
 			break;
 
-		plist_t iboot_node = plist_access_path(node, 2, "Info", "IsLoadedByiBoot");
-		plist_t iboot_stg1_node = plist_access_path(node, 2, "Info", "IsLoadedByiBootStage1");
-		uint8_t is_stg1 = 0;
-		if (iboot_stg1_node && plist_get_node_type(iboot_stg1_node) == PLIST_BOOLEAN) {
-			plist_get_bool_val(iboot_stg1_node, &is_stg1);
-		}
-		if (iboot_node && plist_get_node_type(iboot_node) == PLIST_BOOLEAN && !is_stg1) {
-			uint8_t b = 0;
-			plist_get_bool_val(iboot_node, &b);
-			if (b) {
-				debug("DEBUG: %s is loaded by iBoot.\n", key);
-				if (recovery_send_component_and_command(client, build_identity, key, "firmware") < 0) {
-					error("ERROR: Unable to send component '%s' to device.\n", key);
-					err++;
-				}
+		if (recovery_is_loaded_by_iboot(node)) {
+			debug("DEBUG: %s is loaded by iBoot.\n", key);
+			if (recovery_send_component_and_command(client, build_identity, key, "firmware") < 0) {
+				error("ERROR: Unable to send component '%s' to device.\n", key);
+				err++;
 			}
 		}
 		free(key);
@@ -33,11 +33,14 @@ extern "C" {
 #include <libirecovery.h>
 
 #include "common.h"
+#include "component_pipeline.h"
 
 struct recovery_client_t {
 	irecv_client_t client;
 	const char* ipsw;
 	plist_t tss;
+	/* components of the boot sequence prepared ahead of their upload */
+	component_pipeline_t pipeline;
 };
 
 int recovery_client_new(struct idevicerestore_client_t* client);
@@ -37,6 +37,7 @@
 #endif
 #include <zip.h>
 #include <libirecovery.h>
+#include <libimobiledevice-glue/thread.h>
 
 #include "idevicerestore.h"
 #include "asr.h"
@@ -49,6 +50,12 @@
 #include "restore.h"
 #include "common.h"
 #include "endianness.h"
+#include "conn_writer.h"
+#include "zip_writer.h"
+#include "transition.h"
+#include "bootability.h"
+#include "prefetch.h"
+#include "fs_cache.h"
 
 #define CREATE_PARTITION_MAP          11
 #define CREATE_FILESYSTEM             12
@@ -114,10 +121,6 @@
 #define SEALING_SYSTEM_VOLUME         77
 #define UPDATING_APPLETCON            81
 
-static int restore_finished = 0;
-
-static int restore_device_connected = 0;
-
 int restore_client_new(struct idevicerestore_client_t* client)
 {
 	struct restore_client_t* restore = (struct restore_client_t*) malloc(sizeof(struct restore_client_t));
@@ -150,11 +153,25 @@ void restore_client_free(struct idevicerestore_client_t* client)
 			plist_free(client->restore->bbtss);
 			client->restore->bbtss = NULL;
 		}
+		if (client->restore->nor_thread != THREAD_T_NULL) {
+			thread_join(client->restore->nor_thread);
+			thread_free(client->restore->nor_thread);
+		}
+		plist_free(client->restore->nor_data);
+		mutex_destroy(&client->restore->send_mutex);
 		free(client->restore);
 		client->restore = NULL;
 	}
 }
 
+static restored_error_t restore_send_message(struct idevicerestore_client_t* client, restored_client_t restore, plist_t dict)
+{
+	mutex_lock(&client->restore->send_mutex);
+	restored_error_t restore_error = restored_send(restore, dict);
+	mutex_unlock(&client->restore->send_mutex);
+	return restore_error;
+}
+
 static int restore_idevice_new(struct idevicerestore_client_t* client, idevice_t* device)
 {
 	int num_devices = 0;
@@ -364,8 +381,7 @@ int restore_reboot(struct idevicerestore_client_t* client)
 
 	restored_client_free(client->restore->client);
 
-	cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, 30000);
-	if (client->mode == MODE_RESTORE) {
+	if (transition_wait(client, "restore-reboot", TRANSITION_ANY_MODE_BUT(MODE_RESTORE), 30000) < 0 && client->mode == MODE_RESTORE) {
 		mutex_unlock(&client->device_event_mutex);
 		return -1;
 	}
@@ -467,10 +483,9 @@ int restore_open_with_timeout(struct idevicerestore_client_t* client)
 			return -1;
 		}
 		memset(client->restore, '\0', sizeof(struct restore_client_t));
+		mutex_init(&client->restore->send_mutex);
 	}
 
-	restore_device_connected = 0;
-
 	if (!restore_is_current_device(client, client->udid)) {
 		error("ERROR: Unable to connect to device in restore mode\n");
 		return -1;
@@ -638,8 +653,6 @@ const char* restore_progress_string(unsigned int operation)
 	}
 }
 
-static int lastop = 0;
-
 static int restore_handle_previous_restore_log_msg(restored_client_t client, plist_t msg)
 {
 	plist_t node = NULL;
@@ -687,7 +700,7 @@ int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t
 	}
 
 	if ((progress > 0) && (progress <= 100)) {
-		if ((int)operation != lastop) {
+		if (!client->restore || (unsigned int)operation != client->restore->operation) {
 			info("%s (%d)\n", restore_progress_string(adapted_operation), (int)operation);
 		}
 		switch (adapted_operation) {
@@ -715,12 +728,14 @@ int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t
 	} else {
 		info("%s (%d)\n", restore_progress_string(adapted_operation), (int)operation);
 	}
-	lastop = (int)operation;
+	if (client->restore) {
+		client->restore->operation = (unsigned int)operation;
+	}
 
 	return 0;
 }
 
-int restore_handle_status_msg(restored_client_t client, plist_t msg)
+int restore_handle_status_msg(struct idevicerestore_client_t* client, plist_t msg)
 {
 	int result = 0;
 	uint64_t value = 0;
@@ -734,7 +749,7 @@ int restore_handle_status_msg(restored_client_t client, plist_t msg)
 	switch(value) {
 		case 0:
 			info("Status: Restore Finished\n");
-			restore_finished = 1;
+			client->restore->finished = 1;
 			break;
 		case 0xFFFFFFFFFFFFFFFFLL:
 			info("Status: Verification Error\n");
@@ -902,14 +917,41 @@ static void restore_asr_progress_cb(double progress, void* userdata)
 	}
 }
 
-int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, const char* filesystem)
+int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, plist_t build_identity, const char* filesystem)
 {
 	asr_client_t asr = NULL;
+	ipsw_file_handle_t file = NULL;
 
 	info("About to send filesystem...\n");
 
+	if (filesystem) {
+		/* a cached filesystem might still be extracted by another process */
+		uint64_t fssize = 0;
+		char* fsname = NULL;
+		if (build_identity_get_component_path(build_identity, "OS", &fsname) == 0) {
+			ipsw_get_file_size(client->ipsw, fsname, &fssize);
+			free(fsname);
+		}
+		file = fs_cache_open(filesystem, fssize);
+	} else {
+		/* no extracted filesystem available, stream it directly from the IPSW */
+		char* fsname = NULL;
+		if (build_identity_get_component_path(build_identity, "OS", &fsname) < 0) {
+			error("ERROR: Unable to get path for filesystem component\n");
+			return -1;
+		}
+		info("Streaming filesystem %s from IPSW\n", fsname);
+		file = ipsw_file_open(client->ipsw, fsname);
+		free(fsname);
+	}
+	if (!file) {
+		error("ERROR: Unable to open filesystem image\n");
+		return -1;
+	}
+
 	if (asr_open_with_timeout(device, &asr) < 0) {
 		error("ERROR: Unable to connect to ASR\n");
+		ipsw_file_close(file);
 		return -1;
 	}
 	info("Connected to ASR\n");
@@ -919,9 +961,10 @@ int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t de
 	// this step sends requested chunks of data from various offsets to asr so
 	// it can validate the filesystem before installing it
 	info("Validating the filesystem\n");
-	if (asr_perform_validation(asr, filesystem) < 0) {
+	if (asr_perform_validation(asr, file) < 0) {
 		error("ERROR: ASR was unable to validate the filesystem\n");
 		asr_free(asr);
+		ipsw_file_close(file);
 		return -1;
 	}
 	info("Filesystem validated\n");
@@ -929,14 +972,18 @@ int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t de
 	// once the target filesystem has been validated, ASR then requests the
 	// entire filesystem to be sent.
 	info("Sending filesystem now...\n");
-	if (asr_send_payload(asr, filesystem) < 0) {
+	uint64_t begin = telemetry_begin();
+	if (asr_send_payload(asr, file) < 0) {
 		error("ERROR: Unable to send payload to ASR\n");
 		asr_free(asr);
+		ipsw_file_close(file);
 		return -1;
 	}
+	telemetry_end(client->telemetry, "asr_payload", begin, ipsw_file_size(file));
 	info("Done sending filesystem\n");
 
 	asr_free(asr);
+	ipsw_file_close(file);
 	return 0;
 }
 
@@ -981,7 +1028,7 @@ int restore_send_recovery_os_root_ticket(restored_client_t restore, struct idevi
 	}
 
 	info("Sending RecoveryOSRootTicket now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send RootTicket (%d)\n", restore_error);
@@ -1034,7 +1081,7 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 	}
 
 	info("Sending RootTicket now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send RootTicket (%d)\n", restore_error);
@@ -1047,8 +1094,6 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 
 int restore_send_component(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, const char* component, const char* component_name)
 {
-	unsigned int size = 0;
-	unsigned char* data = NULL;
 	char* path = NULL;
 	plist_t blob = NULL;
 	plist_t dict = NULL;
@@ -1072,9 +1117,9 @@ int restore_send_component(restored_client_t restore, struct idevicerestore_clie
 		}
 	}
 
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, path, &component_data, &component_size);
+	struct component_buffer cb;
+	component_buffer_init(&cb);
+	int ret = extract_component_buffer(client, path, &cb);
 	free(path);
 	path = NULL;
 	if (ret < 0) {
@@ -1082,23 +1127,22 @@ int restore_send_component(restored_client_t restore, struct idevicerestore_clie
 		return -1;
 	}
 
-	ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-	free(component_data);
-	component_data = NULL;
+	ret = personalize_component_buffer(client, component, &cb, client->tss);
 	if (ret < 0) {
 		error("ERROR: Unable to get personalized component %s\n", component);
+		component_buffer_free(&cb);
 		return -1;
 	}
 
 	dict = plist_new_dict();
-	blob = plist_new_data((char*)data, size);
+	blob = plist_new_data((char*)component_buffer_data(&cb), cb.size);
 	char compkeyname[256];
 	sprintf(compkeyname, "%sFile", component_name);
 	plist_dict_set_item(dict, compkeyname, blob);
-	free(data);
+	component_buffer_free(&cb);
 
 	info("Sending %s now...\n", component_name);
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send component %s data\n", component_name);
@@ -1109,7 +1153,174 @@ int restore_send_component(restored_client_t restore, struct idevicerestore_clie
 	return 0;
 }
 
-int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message)
+/* upper bound for the components being extracted and personalized at the same time */
+#define NOR_PREP_MEMORY_BUDGET (256ULL*1024*1024)
+
+struct nor_prep_job {
+	char* component;
+	char* path;
+	uint64_t cost;
+	plist_t data;
+};
+
+struct nor_prep_ctx {
+	struct idevicerestore_client_t* client;
+	struct nor_prep_job* jobs;
+	int num_jobs;
+	int next_job;
+	uint64_t in_use;
+	int failed;
+	mutex_t mutex;
+	cond_t cond;
+};
+
+static int restore_nor_prep_add_job(struct nor_prep_ctx* ctx, const char* component, const char* path)
+{
+	struct nor_prep_job* jobs = (struct nor_prep_job*)realloc(ctx->jobs, (ctx->num_jobs + 1) * sizeof(struct nor_prep_job));
+	if (!jobs) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	ctx->jobs = jobs;
+	struct nor_prep_job* job = &ctx->jobs[ctx->num_jobs];
+	memset(job, '\0', sizeof(struct nor_prep_job));
+	job->component = strdup(component);
+	job->path = strdup(path);
+	if (!job->component || !job->path) {
+		free(job->component);
+		free(job->path);
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	/* the extracted data plus the data node it ends up in */
+	uint64_t size = 0;
+	ipsw_get_file_size(ctx->client->ipsw, path, &size);
+	job->cost = size * 2 + COMPONENT_BUFFER_HEADROOM;
+	ctx->num_jobs++;
+	return 0;
+}
+
+static int restore_nor_prep_component(struct idevicerestore_client_t* client, struct nor_prep_job* job)
+{
+	struct component_buffer cb;
+	component_buffer_init(&cb);
+	if (extract_component_buffer(client, job->path, &cb) < 0) {
+		error("ERROR: Unable to extract component: %s\n", job->component);
+		return -1;
+	}
+	if (personalize_component_buffer(client, job->component, &cb, client->tss) < 0) {
+		component_buffer_free(&cb);
+		error("ERROR: Unable to get personalized component: %s\n", job->component);
+		return -1;
+	}
+	job->data = plist_new_data((char*)component_buffer_data(&cb), (uint64_t)cb.size);
+	component_buffer_free(&cb);
+	return 0;
+}
+
+static void* restore_nor_prep_worker(void* arg)
+{
+	struct nor_prep_ctx* ctx = (struct nor_prep_ctx*)arg;
+
+	while (1) {
+		mutex_lock(&ctx->mutex);
+		if (ctx->failed || ctx->next_job >= ctx->num_jobs) {
+			/* pass it on to the next worker waiting for budget */
+			cond_signal(&ctx->cond);
+			mutex_unlock(&ctx->mutex);
+			break;
+		}
+		struct nor_prep_job* job = &ctx->jobs[ctx->next_job++];
+		/* one job always gets to run, even if it's bigger than the budget */
+		while (!ctx->failed && ctx->in_use > 0 && ctx->in_use + job->cost > NOR_PREP_MEMORY_BUDGET) {
+			cond_wait(&ctx->cond, &ctx->mutex);
+		}
+		if (ctx->failed) {
+			cond_signal(&ctx->cond);
+			mutex_unlock(&ctx->mutex);
+			break;
+		}
+		ctx->in_use += job->cost;
+		mutex_unlock(&ctx->mutex);
+
+		int res = restore_nor_prep_component(ctx->client, job);
+
+		mutex_lock(&ctx->mutex);
+		ctx->in_use -= job->cost;
+		if (res < 0) {
+			ctx->failed = 1;
+		}
+		cond_signal(&ctx->cond);
+		mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+/* The components are independent of each other, so they get extracted and
+ * personalized by a pool of workers. The data nodes are made by the workers
+ * too and handed to the NORData dictionary as they are. */
+static int restore_nor_prep_run(struct nor_prep_ctx* ctx)
+{
+	int i;
+	int num_workers = get_cpu_count();
+	if (num_workers > ctx->num_jobs) {
+		num_workers = ctx->num_jobs;
+	}
+	/* each worker inflates through a zip handle of its own, more than the
+	 * archive keeps open would reopen the zip for every component */
+	if (num_workers > IPSW_ZIP_POOL_SIZE) {
+		num_workers = IPSW_ZIP_POOL_SIZE;
+	}
+	if (num_workers > 1) {
+		THREAD_T* workers = (THREAD_T*)calloc(num_workers, sizeof(THREAD_T));
+		int started = 0;
+		while (workers && started < num_workers && thread_new(&workers[started], restore_nor_prep_worker, ctx) == 0) {
+			started++;
+		}
+		if (started == 0) {
+			restore_nor_prep_worker(ctx);
+		}
+		for (i = 0; i < started; i++) {
+			thread_join(workers[i]);
+			thread_free(workers[i]);
+		}
+		free(workers);
+	} else if (ctx->num_jobs > 0) {
+		restore_nor_prep_worker(ctx);
+	}
+	return (ctx->failed) ? -1 : 0;
+}
+
+static void restore_nor_prep_free(struct nor_prep_ctx* ctx)
+{
+	int i;
+	for (i = 0; i < ctx->num_jobs; i++) {
+		free(ctx->jobs[i].component);
+		free(ctx->jobs[i].path);
+		plist_free(ctx->jobs[i].data);
+	}
+	free(ctx->jobs);
+	ctx->jobs = NULL;
+	ctx->num_jobs = 0;
+	cond_destroy(&ctx->cond);
+	mutex_destroy(&ctx->mutex);
+}
+
+static plist_t restore_nor_prep_take(struct nor_prep_ctx* ctx, const char* component)
+{
+	int i;
+	for (i = 0; i < ctx->num_jobs; i++) {
+		if (ctx->jobs[i].data && !strcmp(ctx->jobs[i].component, component)) {
+			plist_t data = ctx->jobs[i].data;
+			ctx->jobs[i].data = NULL;
+			return data;
+		}
+	}
+	return NULL;
+}
+
+/* NorImageData is a dictionary here, restore_nor_data_for_request() turns it into what restored asked for */
+static plist_t restore_build_nor_data(struct idevicerestore_client_t* client, plist_t build_identity)
 {
 	char* llb_path = NULL;
 	char* llb_filename = NULL;
@@ -1120,21 +1331,9 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	unsigned int manifest_size = 0;
 	unsigned char* manifest_data = NULL;
 	char firmware_filename[PATH_MAX];
-	unsigned int llb_size = 0;
-	unsigned char* llb_data = NULL;
 	plist_t dict = NULL;
-	unsigned int nor_size = 0;
-	unsigned char* nor_data = NULL;
 	plist_t norimage = NULL;
 	plist_t firmware_files = NULL;
-	int flash_version_1 = 0;
-
-	info("About to send NORData...\n");
-
-	plist_t arguments = plist_dict_get_item(message, "Arguments");
-	if (arguments && plist_get_node_type(arguments) == PLIST_DICT) {
-		flash_version_1 = plist_dict_get_item(arguments, "FlashVersion1") ? 1 : 0;
-	}
 
 	if (client->tss) {
 		if (tss_response_get_path_by_entry(client->tss, "LLB", &llb_path) < 0) {
@@ -1144,7 +1343,7 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	if (llb_path == NULL) {
 		if (build_identity_get_component_path(build_identity, "LLB", &llb_path) < 0) {
 			error("ERROR: Unable to get component path for LLB\n");
-			return -1;
+			return NULL;
 		}
 	}
 
@@ -1152,7 +1351,7 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	if (llb_filename == NULL) {
 		error("ERROR: Unable to extract firmware path from LLB filename\n");
 		free(llb_path);
-		return -1;
+		return NULL;
 	}
 
 	memset(firmware_path, '\0', sizeof(firmware_path));
@@ -1229,39 +1428,59 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 
 	if (plist_dict_get_size(firmware_files) == 0) {
 		error("ERROR: Unable to get list of firmware files.\n");
-		return -1;
+		return NULL;
 	}
 
-	const char* component = "LLB";
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, llb_path, &component_data, &component_size);
+	struct nor_prep_ctx ctx;
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.client = client;
+	mutex_init(&ctx.mutex);
+	cond_init(&ctx.cond);
+
+	int ret = restore_nor_prep_add_job(&ctx, "LLB", llb_path);
 	free(llb_path);
-	if (ret < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
-		return -1;
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(firmware_files, &iter);
+	while (iter && ret == 0) {
+		char *comp = NULL;
+		plist_t pcomp = NULL;
+		plist_dict_next_item(firmware_files, iter, &comp, &pcomp);
+		if (!comp) {
+			break;
+		}
+		const char *comppath = plist_get_string_ptr(pcomp, NULL);
+		// skip LLB, it's already passed in LlbImageData
+		// skip RestoreSEP, it's passed in RestoreSEPImageData
+		if (comppath && strcmp(comp, "LLB") && strcmp(comp, "RestoreSEP")) {
+			ret = restore_nor_prep_add_job(&ctx, comp, comppath);
+		}
+		free(comp);
 	}
+	free(iter);
 
-	ret = personalize_component(component, component_data, component_size, client->tss, &llb_data, &llb_size);
-	free(component_data);
-	component_data = NULL;
-	component_size = 0;
-	if (ret < 0) {
-		error("ERROR: Unable to get personalized component: %s\n", component);
-		return -1;
+	if (ret == 0 && build_identity_has_component(build_identity, "RestoreSEP") &&
+	    build_identity_get_component_path(build_identity, "RestoreSEP", &restore_sep_path) == 0) {
+		ret = restore_nor_prep_add_job(&ctx, "RestoreSEP", restore_sep_path);
+		free(restore_sep_path);
 	}
 
-	dict = plist_new_dict();
-	plist_dict_set_item(dict, "LlbImageData", plist_new_data((char*)llb_data, (uint64_t) llb_size));
-	free(llb_data);
+	if (ret == 0 && build_identity_has_component(build_identity, "SEP") &&
+	    build_identity_get_component_path(build_identity, "SEP", &sep_path) == 0) {
+		ret = restore_nor_prep_add_job(&ctx, "SEP", sep_path);
+		free(sep_path);
+	}
 
-	if (flash_version_1) {
-		norimage = plist_new_dict();
-	} else {
-		norimage = plist_new_array();
+	if (ret < 0 || restore_nor_prep_run(&ctx) < 0) {
+		restore_nor_prep_free(&ctx);
+		plist_free(firmware_files);
+		return NULL;
 	}
 
-	plist_dict_iter iter = NULL;
+	dict = plist_new_dict();
+	plist_dict_set_item(dict, "LlbImageData", restore_nor_prep_take(&ctx, "LLB"));
+
+	norimage = plist_new_dict();
 	plist_dict_new_iter(firmware_files, &iter);
 	while (iter) {
 		char *comp = NULL;
@@ -1270,126 +1489,132 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 		if (!comp) {
 			break;
 		}
-		char *comppath = NULL;
-		plist_get_string_val(pcomp, &comppath);
-		if (!comppath) {
-			free(comp);
-			continue;
-		}
-
-		component = (const char*)comp;
-		if (!strcmp(component, "LLB") || !strcmp(component, "RestoreSEP")) {
-			// skip LLB, it's already passed in LlbImageData
-			// skip RestoreSEP, it's passed in RestoreSEPImageData
-			free(comp);
-			free(comppath);
-			continue;
+		if (strcmp(comp, "LLB") && strcmp(comp, "RestoreSEP")) {
+			plist_t data = restore_nor_prep_take(&ctx, comp);
+			if (data) {
+				plist_dict_set_item(norimage, comp, data);
+			}
 		}
+		free(comp);
+	}
+	free(iter);
+	plist_free(firmware_files);
+	plist_dict_set_item(dict, "NorImageData", norimage);
 
-		component_data = NULL;
-		unsigned int component_size = 0;
+	plist_t data = restore_nor_prep_take(&ctx, "RestoreSEP");
+	if (data) {
+		plist_dict_set_item(dict, "RestoreSEPImageData", data);
+	}
+	data = restore_nor_prep_take(&ctx, "SEP");
+	if (data) {
+		plist_dict_set_item(dict, "SEPImageData", data);
+	}
+	restore_nor_prep_free(&ctx);
 
-		if (extract_component(client->ipsw, comppath, &component_data, &component_size) < 0) {
-			free(iter);
-			free(comp);
-			free(comppath);
-			plist_free(firmware_files);
-			error("ERROR: Unable to extract component: %s\n", component);
-			return -1;
-		}
+	return dict;
+}
 
-		if (personalize_component(component, component_data, component_size, client->tss, &nor_data, &nor_size) < 0) {
-			free(iter);
-			free(comp);
-			free(comppath);
-			free(component_data);
-			plist_free(firmware_files);
-			error("ERROR: Unable to get personalized component: %s\n", component);
-			return -1;
+static plist_t restore_nor_data_for_request(plist_t dict, int flash_version_1)
+{
+	if (flash_version_1) {
+		return dict;
+	}
+	plist_t images = plist_dict_get_item(dict, "NorImageData");
+	plist_t norimage = plist_new_array();
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(images, &iter);
+	while (iter) {
+		char* comp = NULL;
+		plist_t data = NULL;
+		plist_dict_next_item(images, iter, &comp, &data);
+		if (!comp) {
+			break;
 		}
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
-
-		if (flash_version_1) {
-			plist_dict_set_item(norimage, component, plist_new_data((char*)nor_data, (uint64_t)nor_size));
+		/* make sure iBoot is the first entry in the array */
+		if (!strncmp("iBoot", comp, 5)) {
+			plist_array_insert_item(norimage, plist_copy(data), 0);
 		} else {
-			/* make sure iBoot is the first entry in the array */
-			if (!strncmp("iBoot", component, 5)) {
-				plist_array_insert_item(norimage, plist_new_data((char*)nor_data, (uint64_t)nor_size), 0);
-			} else {
-				plist_array_append_item(norimage, plist_new_data((char*)nor_data, (uint64_t)nor_size));
-			}
+			plist_array_append_item(norimage, plist_copy(data));
 		}
-
 		free(comp);
-		free(comppath);
-		free(nor_data);
-		nor_data = NULL;
-		nor_size = 0;
 	}
 	free(iter);
-	plist_free(firmware_files);
 	plist_dict_set_item(dict, "NorImageData", norimage);
+	return dict;
+}
 
-	unsigned char* personalized_data = NULL;
-	unsigned int personalized_size = 0;
+struct restore_nor_data_job {
+	struct idevicerestore_client_t* client;
+	plist_t build_identity;
+};
 
-	if (build_identity_has_component(build_identity, "RestoreSEP") &&
-	    build_identity_get_component_path(build_identity, "RestoreSEP", &restore_sep_path) == 0) {
-		component = "RestoreSEP";
-		ret = extract_component(client->ipsw, restore_sep_path, &component_data, &component_size);
-		free(restore_sep_path);
-		if (ret < 0) {
-			error("ERROR: Unable to extract component: %s\n", component);
-			return -1;
-		}
+static void* restore_nor_data_thread(void* arg)
+{
+	struct restore_nor_data_job* job = (struct restore_nor_data_job*)arg;
+	job->client->restore->nor_data = restore_build_nor_data(job->client, job->build_identity);
+	free(job);
+	return NULL;
+}
 
-		ret = personalize_component(component, component_data, component_size, client->tss, &personalized_data, &personalized_size);
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
-		if (ret < 0) {
-			error("ERROR: Unable to get personalized component: %s\n", component);
-			return -1;
-		}
+/* restored asks for NORData once the filesystem is in place, so it can be
+ * put together while the filesystem is still being sent */
+static void restore_predict_nor_data(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	if (client->restore->nor_predicted || (client->flags & FLAG_EXCLUDE) || !build_identity_has_component(build_identity, "LLB")) {
+		return;
+	}
+	client->restore->nor_predicted = 1;
+	struct restore_nor_data_job* job = (struct restore_nor_data_job*)malloc(sizeof(struct restore_nor_data_job));
+	if (!job) {
+		return;
+	}
+	job->client = client;
+	job->build_identity = build_identity;
+	if (thread_new(&client->restore->nor_thread, restore_nor_data_thread, job) != 0) {
+		client->restore->nor_thread = THREAD_T_NULL;
+		free(job);
+	}
+}
 
-		plist_dict_set_item(dict, "RestoreSEPImageData", plist_new_data((char*)personalized_data, (uint64_t) personalized_size));
-		free(personalized_data);
-		personalized_data = NULL;
-		personalized_size = 0;
+static plist_t restore_take_predicted_nor_data(struct idevicerestore_client_t* client)
+{
+	if (client->restore->nor_thread != THREAD_T_NULL) {
+		thread_join(client->restore->nor_thread);
+		thread_free(client->restore->nor_thread);
+		client->restore->nor_thread = THREAD_T_NULL;
 	}
+	plist_t dict = client->restore->nor_data;
+	client->restore->nor_data = NULL;
+	return dict;
+}
 
-	if (build_identity_has_component(build_identity, "SEP") &&
-	    build_identity_get_component_path(build_identity, "SEP", &sep_path) == 0) {
-		component = "SEP";
-		ret = extract_component(client->ipsw, sep_path, &component_data, &component_size);
-		free(sep_path);
-		if (ret < 0) {
-			error("ERROR: Unable to extract component: %s\n", component);
-			return -1;
-		}
+int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message)
+{
+	int flash_version_1 = 0;
 
-		ret = personalize_component(component, component_data, component_size, client->tss, &personalized_data, &personalized_size);
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
-		if (ret < 0) {
-			error("ERROR: Unable to get personalized component: %s\n", component);
+	info("About to send NORData...\n");
+
+	plist_t arguments = plist_dict_get_item(message, "Arguments");
+	if (arguments && plist_get_node_type(arguments) == PLIST_DICT) {
+		flash_version_1 = plist_dict_get_item(arguments, "FlashVersion1") ? 1 : 0;
+	}
+
+	plist_t dict = restore_take_predicted_nor_data(client);
+	if (dict) {
+		debug("DEBUG: %s: Using NORData prepared while the filesystem was sent\n", __func__);
+	} else {
+		dict = restore_build_nor_data(client, build_identity);
+		if (!dict) {
 			return -1;
 		}
-
-		plist_dict_set_item(dict, "SEPImageData", plist_new_data((char*)personalized_data, (uint64_t) personalized_size));
-		free(personalized_data);
-		personalized_data = NULL;
-		personalized_size = 0;
 	}
+	restore_nor_data_for_request(dict, flash_version_1);
 
 	if (idevicerestore_debug)
 		debug_plist(dict);
 
 	info("Sending NORData now...\n");
-	if (restored_send(restore, dict) != RESTORE_E_SUCCESS) {
+	if (restore_send_message(client, restore, dict) != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send NORData\n");
 		plist_free(dict);
 		return -1;
@@ -1440,338 +1665,404 @@ static const char* restore_get_bbfw_fn_for_element(const char* elem)
 	return NULL;
 }
 
-static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned char* bb_nonce)
+struct bbfw_sign_job {
+	const char* signfn;
+	zip_uint64_t zindex;
+	int is_fls;
+	/* the *-Blob signature, NULL if only the ticket goes in */
+	const unsigned char* blob;
+	uint64_t blob_size;
+	/* BBTicket to insert into ebl.fls */
+	const unsigned char* ticket;
+	uint64_t ticket_size;
+	struct zip_writer_blob output;
+};
+
+struct bbfw_sign_ctx {
+	const char* bbfwtmp;
+	struct bbfw_sign_job* jobs;
+	int num_jobs;
+	int next_job;
+	int failed;
+	mutex_t mutex;
+};
+
+static int restore_bbfw_sign_file(struct zip* za, struct bbfw_sign_job* job)
 {
-	int res = -1;
+	struct zip_stat zstat;
+	zip_stat_init(&zstat);
+	if (zip_stat_index(za, job->zindex, 0, &zstat) != 0) {
+		error("ERROR: zip_stat_index failed for index %d\n", (int)job->zindex);
+		return -1;
+	}
 
-	// check for BBTicket in result
-	plist_t bbticket = plist_dict_get_item(bbtss, "BBTicket");
-	if (!bbticket || plist_get_node_type(bbticket) != PLIST_DATA) {
-		error("ERROR: Could not find BBTicket in Baseband TSS response\n");
+	struct zip_file* zfile = zip_fopen_index(za, job->zindex, 0);
+	if (zfile == NULL) {
+		error("ERROR: zip_fopen_index failed for index %d\n", (int)job->zindex);
 		return -1;
 	}
 
-	plist_t bbfw_dict = plist_dict_get_item(bbtss, "BasebandFirmware");
-	if (!bbfw_dict || plist_get_node_type(bbfw_dict) != PLIST_DICT) {
-		error("ERROR: Could not find BasebandFirmware Dictionary node in Baseband TSS response\n");
+	unsigned char* buffer = (unsigned char*)malloc(zstat.size + 1);
+	if (buffer == NULL) {
+		error("ERROR: Out of memory\n");
+		zip_fclose(zfile);
 		return -1;
 	}
 
-	unsigned char* buffer = NULL;
-	unsigned char* blob = NULL;
-	unsigned char* fdata = NULL;
-	uint64_t fsize = 0;
-	uint64_t blob_size = 0;
-	int zerr = 0;
-	int zindex = -1;
-	struct zip_stat zstat;
-	struct zip_file* zfile = NULL;
-	struct zip* za = NULL;
-	struct zip_source* zs = NULL;
+	if (zip_fread(zfile, buffer, zstat.size) != (zip_int64_t)zstat.size) {
+		error("ERROR: zip_fread: failed\n");
+		zip_fclose(zfile);
+		free(buffer);
+		return -1;
+	}
+	buffer[zstat.size] = '\0';
+	zip_fclose(zfile);
+
+	int res = -1;
 	mbn_file* mbn = NULL;
 	fls_file* fls = NULL;
-
-	za = zip_open(bbfwtmp, 0, &zerr);
-	if (!za) {
-		error("ERROR: Could not open ZIP archive '%s': %d\n", bbfwtmp, zerr);
-		goto leave;
+	if (job->is_fls) {
+		fls = fls_parse(buffer, zstat.size);
+		if (!fls) {
+			error("ERROR: could not parse fls file\n");
+		}
+	} else {
+		mbn = mbn_parse(buffer, zstat.size);
+		if (!mbn) {
+			error("ERROR: could not parse mbn file\n");
+		}
 	}
-
-	plist_dict_iter iter = NULL;
-	plist_dict_new_iter(bbfw_dict, &iter);
-	if (!iter) {
-		error("ERROR: Could not create dict iter for BasebandFirmware Dictionary\n");
+	free(buffer);
+	if (!fls && !mbn) {
 		return -1;
 	}
 
-	int is_fls = 0;
-	int signed_file_idxs[16];
-	int signed_file_count = 0;
+	if (job->blob) {
+		if (job->is_fls) {
+			res = fls_update_sig_blob(fls, job->blob, (unsigned int)job->blob_size);
+		} else {
+			res = mbn_update_sig_blob(mbn, job->blob, (unsigned int)job->blob_size);
+		}
+		if (res != 0) {
+			error("ERROR: could not sign %s\n", job->signfn);
+			res = -1;
+			goto leave;
+		}
+	}
+
+	if (job->ticket) {
+		if (fls_insert_ticket(fls, job->ticket, (unsigned int)job->ticket_size) != 0) {
+			error("ERROR: could not insert BBTicket to %s\n", job->signfn);
+			res = -1;
+			goto leave;
+		}
+	}
+
+	if (job->is_fls) {
+		res = zip_writer_compress((const unsigned char*)fls->data, fls->size, &job->output);
+	} else {
+		res = zip_writer_compress((const unsigned char*)mbn->data, mbn->size, &job->output);
+	}
+
+leave:
+	mbn_free(mbn);
+	fls_free(fls);
+	return res;
+}
+
+static void* restore_bbfw_sign_worker(void* arg)
+{
+	struct bbfw_sign_ctx* ctx = (struct bbfw_sign_ctx*)arg;
+
+	/* libzip handles can't be shared between threads */
+	int zerr = 0;
+	struct zip* za = zip_open(ctx->bbfwtmp, 0, &zerr);
+	if (!za) {
+		error("ERROR: Could not open ZIP archive '%s': %d\n", ctx->bbfwtmp, zerr);
+	}
+
+	while (1) {
+		mutex_lock(&ctx->mutex);
+		if (!za) {
+			ctx->failed = 1;
+		}
+		if (ctx->failed || ctx->next_job >= ctx->num_jobs) {
+			mutex_unlock(&ctx->mutex);
+			break;
+		}
+		struct bbfw_sign_job* job = &ctx->jobs[ctx->next_job++];
+		mutex_unlock(&ctx->mutex);
+
+		if (restore_bbfw_sign_file(za, job) < 0) {
+			mutex_lock(&ctx->mutex);
+			ctx->failed = 1;
+			mutex_unlock(&ctx->mutex);
+		}
+	}
+
+	if (za) {
+		zip_close(za);
+	}
+	return NULL;
+}
+
+static struct bbfw_sign_job* restore_bbfw_find_job(struct bbfw_sign_job* jobs, int num_jobs, zip_uint64_t zindex)
+{
+	int i;
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].zindex == zindex) {
+			return &jobs[i];
+		}
+	}
+	return NULL;
+}
+
+static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned char* bb_nonce)
+{
+	int res = -1;
+
+	// check for BBTicket in result
+	plist_t bbticket = plist_dict_get_item(bbtss, "BBTicket");
+	if (!bbticket || plist_get_node_type(bbticket) != PLIST_DATA) {
+		error("ERROR: Could not find BBTicket in Baseband TSS response\n");
+		return -1;
+	}
+
+	plist_t bbfw_dict = plist_dict_get_item(bbtss, "BasebandFirmware");
+	if (!bbfw_dict || plist_get_node_type(bbfw_dict) != PLIST_DICT) {
+		error("ERROR: Could not find BasebandFirmware Dictionary node in Baseband TSS response\n");
+		return -1;
+	}
+
+	int zerr = 0;
+	int zindex = -1;
+	struct zip* za = NULL;
+	struct zip_writer* zw = NULL;
+	struct zip_writer_blob ticket_der;
+	struct bbfw_sign_ctx ctx;
+	char* newtmp = NULL;
 	char* key = NULL;
+	int i;
+
+	memset(&ticket_der, 0, sizeof(ticket_der));
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bbfwtmp = bbfwtmp;
+	mutex_init(&ctx.mutex);
+
+	uint64_t ticket_size = 0;
+	const unsigned char* ticket = (const unsigned char*)plist_get_data_ptr(bbticket, &ticket_size);
+
+	za = zip_open(bbfwtmp, 0, &zerr);
+	if (!za) {
+		error("ERROR: Could not open ZIP archive '%s': %d\n", bbfwtmp, zerr);
+		goto leave;
+	}
+
+	int max_jobs = plist_dict_get_size(bbfw_dict) + 1;
+	ctx.jobs = (struct bbfw_sign_job*)calloc(max_jobs, sizeof(struct bbfw_sign_job));
+	if (!ctx.jobs) {
+		error("ERROR: Out of memory\n");
+		goto leave;
+	}
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(bbfw_dict, &iter);
+	if (!iter) {
+		error("ERROR: Could not create dict iter for BasebandFirmware Dictionary\n");
+		goto leave;
+	}
+
+	/* collect what needs to be signed, the work itself is done by the workers */
+	int is_fls = 0;
 	plist_t node = NULL;
 	while (1) {
 		plist_dict_next_item(bbfw_dict, iter, &key, &node);
 		if (key == NULL)
 			break;
-		if (node && (strcmp(key + (strlen(key) - 5), "-Blob") == 0) && (plist_get_node_type(node) == PLIST_DATA)) {
+		if (node && (strlen(key) > 5) && (strcmp(key + (strlen(key) - 5), "-Blob") == 0) && (plist_get_node_type(node) == PLIST_DATA)) {
 			char *ptr = strchr(key, '-');
 			*ptr = '\0';
 			const char* signfn = restore_get_bbfw_fn_for_element(key);
 			if (!signfn) {
 				error("ERROR: can't match element name '%s' to baseband firmware file name.\n", key);
+				free(iter);
 				goto leave;
 			}
 			char* ext = strrchr(signfn, '.');
-			if (!strcmp(ext, ".fls")) {
+			int file_is_fls = !strcmp(ext, ".fls");
+			if (file_is_fls) {
 				is_fls = 1;
 			}
 
+			// without a nonce only the signed RamPSI goes into a fls archive
+			if (file_is_fls && !bb_nonce && strcmp(key, "RamPSI") != 0) {
+				free(key);
+				key = NULL;
+				continue;
+			}
+
 			zindex = zip_name_locate(za, signfn, 0);
 			if (zindex < 0) {
 				error("ERROR: can't locate '%s' in '%s'\n", signfn, bbfwtmp);
+				free(iter);
 				goto leave;
 			}
-
-			zip_stat_init(&zstat);
-			if (zip_stat_index(za, zindex, 0, &zstat) != 0) {
-				error("ERROR: zip_stat_index failed for index %d\n", zindex);
+			if (restore_bbfw_find_job(ctx.jobs, ctx.num_jobs, zindex)) {
+				error("ERROR: %s is signed more than once\n", signfn);
+				free(iter);
 				goto leave;
 			}
 
-			zfile = zip_fopen_index(za, zindex, 0);
-			if (zfile == NULL) {
-				error("ERROR: zip_fopen_index failed for index %d\n", zindex);
-				goto leave;
-			}
-
-			buffer = (unsigned char*) malloc(zstat.size + 1);
-			if (buffer == NULL) {
-				error("ERROR: Out of memory\n");
-				goto leave;
-			}
-
-			if (zip_fread(zfile, buffer, zstat.size) != zstat.size) {
-				error("ERROR: zip_fread: failed\n");
-				goto leave;
-			}
-			buffer[zstat.size] = '\0';
-
-			zip_fclose(zfile);
-			zfile = NULL;
-
-			if (is_fls) {
-				fls = fls_parse(buffer, zstat.size);
-				if (!fls) {
-					error("ERROR: could not parse fls file\n");
-					goto leave;
-				}
-			} else {
-				mbn = mbn_parse(buffer, zstat.size);
-				if (!mbn) {
-					error("ERROR: could not parse mbn file\n");
-					goto leave;
-				}
-			}
-			free(buffer);
-			buffer = NULL;
-
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(node, (char**)&blob, &blob_size);
-			if (!blob) {
+			struct bbfw_sign_job* job = &ctx.jobs[ctx.num_jobs];
+			job->signfn = signfn;
+			job->zindex = zindex;
+			job->is_fls = file_is_fls;
+			job->blob = (const unsigned char*)plist_get_data_ptr(node, &job->blob_size);
+			if (!job->blob) {
 				error("ERROR: could not get %s-Blob data\n", key);
+				free(iter);
 				goto leave;
 			}
-
-			if (is_fls) {
-				if (fls_update_sig_blob(fls, blob, (unsigned int)blob_size) != 0) {
-					error("ERROR: could not sign %s\n", signfn);
-					goto leave;
-				}
-			} else {
-				if (mbn_update_sig_blob(mbn, blob, (unsigned int)blob_size) != 0) {
-					error("ERROR: could not sign %s\n", signfn);
-					goto leave;
-				}
-			}
-			free(blob);
-			blob = NULL;
-
-			fsize = (is_fls ? fls->size : mbn->size);
-			fdata = (unsigned char*)malloc(fsize);
-			if (fdata == NULL)  {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			if (is_fls) {
-				memcpy(fdata, fls->data, fsize);
-				fls_free(fls);
-				fls = NULL;
-			} else {
-				memcpy(fdata, mbn->data, fsize);
-				mbn_free(mbn);
-				mbn = NULL;
-			}
-
-			zs = zip_source_buffer(za, fdata, fsize, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				free(fdata);
-				goto leave;
-			}
-
-			if (zip_replace(za, zindex, zs) == -1) {
-				error("ERROR: could not update signed '%s' in archive\n", signfn);
-				goto leave;
-			}
-
-			if (is_fls && !bb_nonce) {
-				if (strcmp(key, "RamPSI") == 0) {
-					signed_file_idxs[signed_file_count++] = zindex;
-				}
-			} else {
-				signed_file_idxs[signed_file_count++] = zindex;
-			}
+			ctx.num_jobs++;
 		}
 		free(key);
+		key = NULL;
 	}
 	free(iter);
 
-	// remove everything but required files
-	int i, j, keep, numf = zip_get_num_files(za);
-	for (i = 0; i < numf; i++) {
-		keep = 0;
-		// check for signed file index
-		for (j = 0; j < signed_file_count; j++) {
-			if (i == signed_file_idxs[j]) {
-				keep = 1;
-				break;
-			}
+	if (bb_nonce && is_fls) {
+		if (!ticket) {
+			error("ERROR: could not get BBTicket data\n");
+			goto leave;
 		}
-		// check for anything but .mbn and .fls if bb_nonce is set
-		if (bb_nonce && !keep) {
-			const char* fn = zip_get_name(za, i, 0);
-			if (fn) {
-				char* ext = strrchr(fn, '.');
-				if (ext && (!strcmp(ext, ".fls") || !strcmp(ext, ".mbn") || !strcmp(ext, ".elf") || !strcmp(ext, ".bin"))) {
-					keep = 1;
-				}
-			}
+		// add BBTicket to file ebl.fls
+		zindex = zip_name_locate(za, "ebl.fls", 0);
+		if (zindex < 0) {
+			error("ERROR: can't locate 'ebl.fls' in '%s'\n", bbfwtmp);
+			goto leave;
 		}
-		if (!keep) {
-			zip_delete(za, i);
+		struct bbfw_sign_job* job = restore_bbfw_find_job(ctx.jobs, ctx.num_jobs, zindex);
+		if (!job) {
+			job = &ctx.jobs[ctx.num_jobs++];
+			job->signfn = "ebl.fls";
+			job->zindex = zindex;
+			job->is_fls = 1;
 		}
+		job->ticket = ticket;
+		job->ticket_size = ticket_size;
 	}
 
-	if (bb_nonce) {
-		if (is_fls) {
-			// add BBTicket to file ebl.fls
-			zindex = zip_name_locate(za, "ebl.fls", 0);
-			if (zindex < 0) {
-				error("ERROR: can't locate 'ebl.fls' in '%s'\n", bbfwtmp);
-				goto leave;
-			}
-
-			zip_stat_init(&zstat);
-			if (zip_stat_index(za, zindex, 0, &zstat) != 0) {
-				error("ERROR: zip_stat_index failed for index %d\n", zindex);
-				goto leave;
-			}
-
-			zfile = zip_fopen_index(za, zindex, 0);
-			if (zfile == NULL) {
-				error("ERROR: zip_fopen_index failed for index %d\n", zindex);
-				goto leave;
-			}
-
-			buffer = (unsigned char*) malloc(zstat.size + 1);
-			if (buffer == NULL) {
-				error("ERROR: Out of memory\n");
-				goto leave;
-			}
-
-			if (zip_fread(zfile, buffer, zstat.size) != zstat.size) {
-				error("ERROR: zip_fread: failed\n");
-				goto leave;
-			}
-			buffer[zstat.size] = '\0';
-
-			zip_fclose(zfile);
-			zfile = NULL;
-
-			fls = fls_parse(buffer, zstat.size);
-			free(buffer);
-			buffer = NULL;
-			if (!fls) {
-				error("ERROR: could not parse fls file\n");
-				goto leave;
-			}
-
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(bbticket, (char**)&blob, &blob_size);
-			if (!blob) {
-				error("ERROR: could not get BBTicket data\n");
-				goto leave;
-			}
+	/* parsing, signing and compressing are independent for every file */
+	int num_workers = get_cpu_count();
+	if (num_workers > ctx.num_jobs) {
+		num_workers = ctx.num_jobs;
+	}
+	if (num_workers > 1) {
+		THREAD_T* workers = (THREAD_T*)calloc(num_workers, sizeof(THREAD_T));
+		int started = 0;
+		while (workers && started < num_workers && thread_new(&workers[started], restore_bbfw_sign_worker, &ctx) == 0) {
+			started++;
+		}
+		if (started == 0) {
+			restore_bbfw_sign_worker(&ctx);
+		}
+		for (i = 0; i < started; i++) {
+			thread_join(workers[i]);
+			thread_free(workers[i]);
+		}
+		free(workers);
+	} else if (ctx.num_jobs > 0) {
+		restore_bbfw_sign_worker(&ctx);
+	}
+	if (ctx.failed) {
+		goto leave;
+	}
 
-			if (fls_insert_ticket(fls, blob, (unsigned int)blob_size) != 0) {
-				error("ERROR: could not insert BBTicket to ebl.fls\n");
-				goto leave;
-			}
-			free(blob);
-			blob = NULL;
+	if (bb_nonce && !is_fls) {
+		// add BBTicket as bbticket.der
+		if (!ticket) {
+			error("ERROR: could not get BBTicket data\n");
+			goto leave;
+		}
+		if (zip_writer_compress(ticket, ticket_size, &ticket_der) < 0) {
+			goto leave;
+		}
+	}
 
-			fsize = fls->size;
-			fdata = (unsigned char*)malloc(fsize);
-			if (!fdata) {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			memcpy(fdata, fls->data, fsize);
-			fls_free(fls);
-			fls = NULL;
-
-			zs = zip_source_buffer(za, fdata, fsize, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				free(fdata);
-				goto leave;
-			}
+	/* write the new archive in one pass, files that stay as they are get copied without recompressing */
+	newtmp = (char*)malloc(strlen(bbfwtmp) + 5);
+	if (!newtmp) {
+		error("ERROR: Out of memory\n");
+		goto leave;
+	}
+	sprintf(newtmp, "%s.new", bbfwtmp);
+	zw = zip_writer_open(newtmp);
+	if (!zw) {
+		goto leave;
+	}
 
-			if (zip_replace(za, zindex, zs) == -1) {
-				error("ERROR: could not update archive with ticketed ebl.fls\n");
+	time_t now = time(NULL);
+	int numf = zip_get_num_files(za);
+	for (i = 0; i < numf; i++) {
+		const char* fn = zip_get_name(za, i, 0);
+		if (!fn) {
+			continue;
+		}
+		struct bbfw_sign_job* job = restore_bbfw_find_job(ctx.jobs, ctx.num_jobs, i);
+		if (job) {
+			if (zip_writer_add_blob(zw, fn, now, &job->output) < 0) {
+				error("ERROR: could not update signed '%s' in archive\n", fn);
 				goto leave;
 			}
-		} else {
-			// add BBTicket as bbticket.der
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(bbticket, (char**)&blob, &blob_size);
-			if (!blob) {
-				error("ERROR: could not get BBTicket data\n");
-				goto leave;
+			continue;
+		}
+		// keep anything but .mbn and .fls if bb_nonce is set
+		int keep = 0;
+		if (bb_nonce) {
+			char* ext = strrchr(fn, '.');
+			if (ext && (!strcmp(ext, ".fls") || !strcmp(ext, ".mbn") || !strcmp(ext, ".elf") || !strcmp(ext, ".bin"))) {
+				keep = 1;
 			}
+		}
+		if (keep && zip_writer_copy_entry(zw, za, i) < 0) {
+			goto leave;
+		}
+	}
 
-			zs = zip_source_buffer(za, blob, blob_size, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			blob = NULL;
+	if (ticket_der.data && zip_writer_add_blob(zw, "bbticket.der", now, &ticket_der) < 0) {
+		error("ERROR: could not add bbticket.der to archive\n");
+		goto leave;
+	}
 
-			if (zip_add(za, "bbticket.der", zs) == -1) {
-				error("ERROR: could not add bbticket.der to archive\n");
-				goto leave;
-			}
-		}
+	res = zip_writer_close(zw);
+	zw = NULL;
+	if (res < 0) {
+		error("ERROR: could not close and write modified archive\n");
+		goto leave;
 	}
+	zip_close(za);
+	za = NULL;
 
-	// this will write out the modified zip
-	if (zip_close(za) == -1) {
-		error("ERROR: could not close and write modified archive: %s\n", zip_strerror(za));
+	remove(bbfwtmp);
+	if (rename(newtmp, bbfwtmp) != 0) {
+		error("ERROR: could not replace %s with the signed archive\n", bbfwtmp);
+		remove(newtmp);
 		res = -1;
-	} else {
-		res = 0;
 	}
-	za = NULL;
-	zs = NULL;
 
 leave:
-	if (zfile) {
-		zip_fclose(zfile);
-	}
-	if (zs) {
-		zip_source_free(zs);
-	}
+	free(key);
+	zip_writer_discard(zw);
 	if (za) {
-		zip_unchange_all(za);
 		zip_close(za);
 	}
-	mbn_free(mbn);
-	fls_free(fls);
-	free(buffer);
-	free(blob);
+	for (i = 0; ctx.jobs && i < ctx.num_jobs; i++) {
+		zip_writer_blob_free(&ctx.jobs[i].output);
+	}
+	free(ctx.jobs);
+	mutex_destroy(&ctx.mutex);
+	zip_writer_blob_free(&ticket_der);
+	free(newtmp);
 
 	return res;
 }
@@ -1786,6 +2077,7 @@ static int restore_send_baseband_data(restored_client_t restore, struct idevicer
 	uint64_t bb_nonce_size = 0;
 	uint64_t bb_chip_id = 0;
 	plist_t response = NULL;
+	tss_async_request_t bb_tss_request = NULL;
 	char* buffer = NULL;
 	char* bbfwtmp = NULL;
 	plist_t dict = NULL;
@@ -1853,31 +2145,24 @@ static int restore_send_baseband_data(restored_client_t restore, struct idevicer
 			debug_plist(request);
 
 		info("Sending Baseband TSS request...\n");
-		response = tss_request_send(request, client->tss_url);
+		/* the baseband firmware is extracted while the request is in flight */
+		bb_tss_request = tss_request_send_async_for_client(client, request);
 		plist_free(request);
 		plist_free(parameters);
-		if (response == NULL) {
-			error("ERROR: Unable to fetch Baseband TSS\n");
-			return -1;
-		}
-		info("Received Baseband SHSH blobs\n");
-
-		if (idevicerestore_debug)
-			debug_plist(response);
 	}
 
 	// get baseband firmware file path from build identity
 	plist_t bbfw_path = plist_access_path(build_identity, 4, "Manifest", "BasebandFirmware", "Info", "Path");
 	if (!bbfw_path || plist_get_node_type(bbfw_path) != PLIST_STRING) {
 		error("ERROR: Unable to get BasebandFirmware/Info/Path node\n");
-		plist_free(response);
+		plist_free(tss_request_wait(bb_tss_request));
 		return -1;
 	}
 	char* bbfwpath = NULL;
 	plist_get_string_val(bbfw_path, &bbfwpath);
 	if (!bbfwpath) {
 		error("ERROR: Unable to get baseband path\n");
-		plist_free(response);
+		plist_free(tss_request_wait(bb_tss_request));
 		return -1;
 	}
 
@@ -1891,7 +2176,25 @@ static int restore_send_baseband_data(restored_client_t restore, struct idevicer
 		strcpy(bbfwtmp + 5 + l, ".tmp");
 		error("WARNING: Could not generate temporary filename, using %s in current directory\n", bbfwtmp);
 	}
-	if (ipsw_extract_to_file(client->ipsw, bbfwpath, bbfwtmp) != 0) {
+	uint64_t extract_begin = telemetry_begin();
+	int extracted = (ipsw_extract_to_file(client->ipsw, bbfwpath, bbfwtmp) == 0);
+	telemetry_end(client->telemetry, "ipsw_extract", extract_begin, 0);
+
+	if (bb_tss_request) {
+		uint64_t wait_begin = telemetry_begin();
+		response = tss_request_wait(bb_tss_request);
+		telemetry_end(client->telemetry, "tss_wait", wait_begin, 0);
+		if (response == NULL) {
+			error("ERROR: Unable to fetch Baseband TSS\n");
+			goto leave;
+		}
+		info("Received Baseband SHSH blobs\n");
+
+		if (idevicerestore_debug)
+			debug_plist(response);
+	}
+
+	if (!extracted) {
 		error("ERROR: Unable to extract baseband firmware from ipsw\n");
 		goto leave;
 	}
@@ -1922,7 +2225,7 @@ static int restore_send_baseband_data(restored_client_t restore, struct idevicer
 	buffer = NULL;
 
 	info("Sending BasebandData now...\n");
-	if (restored_send(restore, dict) != RESTORE_E_SUCCESS) {
+	if (restore_send_message(client, restore, dict) != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send BasebandData data\n");
 		goto leave;
 	}
@@ -1942,7 +2245,7 @@ leave:
 	return res;
 }
 
-int restore_send_fdr_trust_data(restored_client_t restore, idevice_t device)
+int restore_send_fdr_trust_data(restored_client_t restore, struct idevicerestore_client_t* client)
 {
 	restored_error_t restore_error;
 	plist_t dict;
@@ -1955,7 +2258,7 @@ int restore_send_fdr_trust_data(restored_client_t restore, idevice_t device)
 	dict = plist_new_dict();
 
 	info("Sending FDR Trust data now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: During sending FDR Trust data (%d)\n", restore_error);
@@ -2041,7 +2344,7 @@ static int restore_send_image_data(restored_client_t restore, struct idevicerest
 						}
 						build_identity_get_component_path(build_identity, component, &path);
 						if (path) {
-							ret = extract_component(client->ipsw, path, &component_data, &component_size);
+							ret = extract_component(client, path, &component_data, &component_size);
 						}
 						free(path);
 						path = NULL;
@@ -2049,7 +2352,7 @@ static int restore_send_image_data(restored_client_t restore, struct idevicerest
 							error("ERROR: Unable to extract component: %s\n", component);
 						}
 
-						ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
+						ret = personalize_component(client, component, component_data, component_size, client->tss, &data, &size);
 						free(component_data);
 						component_data = NULL;
 						if (ret < 0) {
@@ -2084,7 +2387,7 @@ static int restore_send_image_data(restored_client_t restore, struct idevicerest
 		}
 	}
 
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		if (want_image_list) {
@@ -2111,6 +2414,244 @@ static int restore_send_image_data(restored_client_t restore, struct idevicerest
 	return 0;
 }
 
+/* Components an updater used for its last response are extracted again on
+ * worker threads while the TSS request for the next one is out, so a retry
+ * with a new nonce doesn't pay for both one after the other. */
+#define RESTORE_FW_SPECULATE_THREADS 4
+
+enum {
+	FW_COMPONENT_PENDING = 0,
+	FW_COMPONENT_RUNNING,
+	FW_COMPONENT_DONE,
+	/* asked for before a worker got to it, extracted by the caller */
+	FW_COMPONENT_TAKEN
+};
+
+struct restore_fw_component {
+	char* path;
+	unsigned char* data;
+	unsigned int size;
+	int ret;
+	int state;
+};
+
+struct restore_fw_context {
+	struct idevicerestore_client_t* client;
+	struct restore_fw_component* components;
+	int num_components;
+	THREAD_T* workers;
+	int num_workers;
+	mutex_t mutex;
+	/* signaled when a component is done */
+	cond_t cond;
+	/* component paths the updater asked for, one per line */
+	char* used;
+	size_t used_len;
+};
+
+static void* restore_fw_component_worker(void* arg)
+{
+	struct restore_fw_context* ctx = (struct restore_fw_context*)arg;
+	int i;
+	mutex_lock(&ctx->mutex);
+	for (i = 0; i < ctx->num_components; i++) {
+		struct restore_fw_component* comp = &ctx->components[i];
+		if (comp->state != FW_COMPONENT_PENDING) {
+			continue;
+		}
+		comp->state = FW_COMPONENT_RUNNING;
+		mutex_unlock(&ctx->mutex);
+		int ret = extract_component(ctx->client, comp->path, &comp->data, &comp->size);
+		mutex_lock(&ctx->mutex);
+		comp->ret = ret;
+		comp->state = FW_COMPONENT_DONE;
+		cond_signal(&ctx->cond);
+	}
+	mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void restore_fw_context_speculate(struct restore_fw_context* ctx, struct idevicerestore_client_t* client, const unsigned char* list, unsigned int list_size)
+{
+	unsigned int i;
+	int count = 0;
+	for (i = 0; i < list_size; i++) {
+		if (list[i] == '\n') {
+			count++;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+	ctx->components = (struct restore_fw_component*)calloc(count, sizeof(struct restore_fw_component));
+	if (!ctx->components) {
+		return;
+	}
+	const unsigned char* p = list;
+	const unsigned char* end = list + list_size;
+	while (p < end && ctx->num_components < count) {
+		const unsigned char* nl = memchr(p, '\n', end - p);
+		if (!nl) {
+			break;
+		}
+		if (nl > p) {
+			struct restore_fw_component* comp = &ctx->components[ctx->num_components];
+			comp->path = (char*)malloc(nl - p + 1);
+			if (comp->path) {
+				memcpy(comp->path, p, nl - p);
+				comp->path[nl - p] = '\0';
+				debug("DEBUG: %s: extracting %s ahead of the TSS response\n", __func__, comp->path);
+				ctx->num_components++;
+			}
+		}
+		p = nl + 1;
+	}
+	if (ctx->num_components == 0) {
+		return;
+	}
+
+	/* an updater may list a lot of components, a few threads get through
+	 * them while the request is out */
+	int num_workers = get_cpu_count();
+	if (num_workers > RESTORE_FW_SPECULATE_THREADS) {
+		num_workers = RESTORE_FW_SPECULATE_THREADS;
+	}
+	if (num_workers > ctx->num_components) {
+		num_workers = ctx->num_components;
+	}
+	ctx->client = client;
+	mutex_init(&ctx->mutex);
+	cond_init(&ctx->cond);
+	ctx->workers = (THREAD_T*)calloc(num_workers, sizeof(THREAD_T));
+	while (ctx->workers && ctx->num_workers < num_workers && thread_new(&ctx->workers[ctx->num_workers], restore_fw_component_worker, ctx) == 0) {
+		ctx->num_workers++;
+	}
+}
+
+static void restore_fw_context_free(struct restore_fw_context* ctx)
+{
+	int i;
+	if (ctx->client) {
+		/* workers finish the component they are on and find nothing else */
+		mutex_lock(&ctx->mutex);
+		for (i = 0; i < ctx->num_components; i++) {
+			if (ctx->components[i].state == FW_COMPONENT_PENDING) {
+				ctx->components[i].state = FW_COMPONENT_TAKEN;
+			}
+		}
+		mutex_unlock(&ctx->mutex);
+		for (i = 0; i < ctx->num_workers; i++) {
+			thread_join(ctx->workers[i]);
+			thread_free(ctx->workers[i]);
+		}
+		cond_destroy(&ctx->cond);
+		mutex_destroy(&ctx->mutex);
+	}
+	for (i = 0; i < ctx->num_components; i++) {
+		free(ctx->components[i].data);
+		free(ctx->components[i].path);
+	}
+	free(ctx->workers);
+	free(ctx->components);
+	free(ctx->used);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+/* extract_component() for the firmware updaters; takes the result of a
+ * speculative extraction if there is one and records what was used */
+static int restore_fw_extract_component(struct idevicerestore_client_t* client, const char* path, unsigned char** component_data, unsigned int* component_size)
+{
+	struct restore_fw_context* ctx = (client->restore) ? client->restore->fw_context : NULL;
+	int i;
+
+	if (!ctx) {
+		return extract_component(client, path, component_data, component_size);
+	}
+
+	size_t len = strlen(path);
+	char* used = (char*)realloc(ctx->used, ctx->used_len + len + 2);
+	if (used) {
+		memcpy(used + ctx->used_len, path, len);
+		used[ctx->used_len + len] = '\n';
+		ctx->used_len += len + 1;
+		used[ctx->used_len] = '\0';
+		ctx->used = used;
+	}
+
+	if (ctx->num_workers == 0) {
+		return extract_component(client, path, component_data, component_size);
+	}
+
+	mutex_lock(&ctx->mutex);
+	for (i = 0; i < ctx->num_components; i++) {
+		struct restore_fw_component* comp = &ctx->components[i];
+		if (strcmp(comp->path, path) != 0) {
+			continue;
+		}
+		if (comp->state == FW_COMPONENT_PENDING) {
+			/* no worker got to it yet, no point in waiting for one */
+			comp->state = FW_COMPONENT_TAKEN;
+			break;
+		}
+		while (comp->state == FW_COMPONENT_RUNNING) {
+			cond_wait(&ctx->cond, &ctx->mutex);
+		}
+		if (comp->state == FW_COMPONENT_DONE && comp->ret == 0 && comp->data) {
+			*component_data = comp->data;
+			*component_size = comp->size;
+			comp->data = NULL;
+			mutex_unlock(&ctx->mutex);
+			return 0;
+		}
+		break;
+	}
+	mutex_unlock(&ctx->mutex);
+
+	return extract_component(client, path, component_data, component_size);
+}
+
+/* Responses only depend on the device, the build identity and what the
+ * updater sent in MessageArgInfo (nonces included), so the same request on
+ * a retried restore can be answered without going to the TSS server. */
+static int restore_fw_cache_key(struct idevicerestore_client_t* client, const unsigned char* identity_key, const char* updater, plist_t p_info, unsigned char* key)
+{
+	char* bin = NULL;
+	uint32_t bin_size = 0;
+	int i;
+
+	if (p_info) {
+		plist_to_bin(p_info, &bin, &bin_size);
+		if (!bin) {
+			return -1;
+		}
+	}
+
+	size_t updater_len = strlen(updater) + 1;
+	size_t len = 1 + 8 + CACHE_KEY_SIZE + updater_len + bin_size;
+	unsigned char* buf = (unsigned char*)malloc(len);
+	if (!buf) {
+		free(bin);
+		return -1;
+	}
+	unsigned char* p = buf;
+	/* responses and component lists share the cache */
+	*p++ = (p_info) ? 'R' : 'C';
+	for (i = 0; i < 8; i++) {
+		*p++ = (unsigned char)(client->ecid >> (i * 8));
+	}
+	memcpy(p, identity_key, CACHE_KEY_SIZE);
+	p += CACHE_KEY_SIZE;
+	memcpy(p, updater, updater_len);
+	p += updater_len;
+	if (bin) {
+		memcpy(p, bin, bin_size);
+		free(bin);
+	}
+	cache_key_from_data(key, buf, len);
+	free(buf);
+	return 0;
+}
+
 static plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t p_info)
 {
 	const char *comp_name = NULL;
@@ -2148,7 +2689,7 @@ static plist_t restore_get_se_firmware_data(restored_client_t restore, struct id
 		return NULL;
 	}
 
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2178,7 +2719,7 @@ static plist_t restore_get_se_firmware_data(restored_client_t restore, struct id
 	plist_free(parameters);
 
 	info("Sending SE TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch SE ticket\n");
@@ -2240,7 +2781,7 @@ static plist_t restore_get_savage_firmware_data(restored_client_t restore, struc
 	debug("DEBUG: %s: using %s\n", __func__, comp_name);
 
 	info("Sending Savage TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Savage ticket\n");
@@ -2261,7 +2802,7 @@ static plist_t restore_get_savage_firmware_data(restored_client_t restore, struc
 		return NULL;
 	}
 
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2332,7 +2873,7 @@ static plist_t restore_get_yonkers_firmware_data(restored_client_t restore, stru
 	debug("DEBUG: %s: using %s\n", __func__, comp_name);
 
 	info("Sending Yonkers TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Yonkers ticket\n");
@@ -2353,7 +2894,7 @@ static plist_t restore_get_yonkers_firmware_data(restored_client_t restore, stru
 	}
 
 	/* now get actual component data */
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2383,6 +2924,9 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 	unsigned int component_size = 0;
 	ftab_t ftab = NULL;
 	ftab_t rftab = NULL;
+	/* the ftabs point into these */
+	unsigned char* ftab_data = NULL;
+	unsigned char* rftab_data = NULL;
 	uint32_t ftag = 0;
 	plist_t parameters = NULL;
 	plist_t request = NULL;
@@ -2419,7 +2963,7 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 	plist_free(parameters);
 
 	info("Sending Rose TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Rose ticket\n");
@@ -2438,7 +2982,7 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 		error("ERROR: Unable to get path for '%s' component\n", comp_name);
 		return NULL;
 	}
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2450,7 +2994,7 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 		error("ERROR: Failed to parse '%s' component data.\n", comp_name);
 		return NULL;
 	}
-	free(component_data);
+	ftab_data = component_data;
 	component_data = NULL;
 	component_size = 0;
 	if (ftag != 'rkos') {
@@ -2461,14 +3005,16 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 	if (build_identity_has_component(build_identity, comp_name)) {
 		if (build_identity_get_component_path(build_identity, comp_name, &comp_path) < 0) {
 			ftab_free(ftab);
+			free(ftab_data);
 			error("ERROR: Unable to get path for '%s' component\n", comp_name);
 			return NULL;
 		}
-		ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+		ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 		free(comp_path);
 		comp_path = NULL;
 		if (ret < 0) {
 			ftab_free(ftab);
+			free(ftab_data);
 			error("ERROR: Unable to extract '%s' component\n", comp_name);
 			return NULL;
 		}
@@ -2477,10 +3023,11 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 		if (ftab_parse(component_data, component_size, &rftab, &ftag) != 0) {
 			free(component_data);
 			ftab_free(ftab);
+			free(ftab_data);
 			error("ERROR: Failed to parse '%s' component data.\n", comp_name);
 			return NULL;
 		}
-		free(component_data);
+		rftab_data = component_data;
 		component_data = NULL;
 		component_size = 0;
 		if (ftag != 'rkos') {
@@ -2501,6 +3048,8 @@ static plist_t restore_get_rose_firmware_data(restored_client_t restore, struct
 
 	ftab_write(ftab, &component_data, &component_size);
 	ftab_free(ftab);
+	free(ftab_data);
+	free(rftab_data);
 
 	plist_dict_set_item(response, "FirmwareData", plist_new_data((char *)component_data, (uint64_t)component_size));
 	free(component_data);
@@ -2543,7 +3092,7 @@ static plist_t restore_get_veridian_firmware_data(restored_client_t restore, str
 	plist_free(parameters);
 
 	info("Sending Veridian TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Veridian ticket\n");
@@ -2563,7 +3112,7 @@ static plist_t restore_get_veridian_firmware_data(restored_client_t restore, str
 	}
 
 	/* now get actual component data */
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2639,7 +3188,7 @@ static plist_t restore_get_tcon_firmware_data(restored_client_t restore, struct
 	plist_free(parameters);
 
 	info("Sending Baobab TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Baobab ticket\n");
@@ -2659,7 +3208,7 @@ static plist_t restore_get_tcon_firmware_data(restored_client_t restore, struct
 	}
 
 	/* now get actual component data */
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+	ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 	free(comp_path);
 	comp_path = NULL;
 	if (ret < 0) {
@@ -2683,6 +3232,9 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 	unsigned int component_size = 0;
 	ftab_t ftab = NULL;
 	ftab_t rftab = NULL;
+	/* the ftabs point into these */
+	unsigned char* ftab_data = NULL;
+	unsigned char* rftab_data = NULL;
 	uint32_t ftag = 0;
 	plist_t parameters = NULL;
 	plist_t request = NULL;
@@ -2766,7 +3318,7 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 	plist_free(parameters);
 
 	info("Sending %s TSS request...\n", ticket_name);
-	response = tss_request_send(request, client->tss_url);
+	response = tss_request_send_for_client(client, request);
 	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch %s\n", ticket_name);
@@ -2785,7 +3337,7 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 			error("ERROR: Unable to get path for '%s' component\n", comp_name);
 			return NULL;
 		}
-		ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+		ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 		free(comp_path);
 		comp_path = NULL;
 		if (ret < 0) {
@@ -2797,7 +3349,7 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 			error("ERROR: Failed to parse '%s' component data.\n", comp_name);
 			return NULL;
 		}
-		free(component_data);
+		ftab_data = component_data;
 		component_data = NULL;
 		component_size = 0;
 		if (ftag != 'rkos') {
@@ -2811,14 +3363,16 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 	if (build_identity_has_component(build_identity, comp_name)) {
 		if (build_identity_get_component_path(build_identity, comp_name, &comp_path) < 0) {
 			ftab_free(ftab);
+			free(ftab_data);
 			error("ERROR: Unable to get path for '%s' component\n", comp_name);
 			return NULL;
 		}
-		ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
+		ret = restore_fw_extract_component(client, comp_path, &component_data, &component_size);
 		free(comp_path);
 		comp_path = NULL;
 		if (ret < 0) {
 			ftab_free(ftab);
+			free(ftab_data);
 			error("ERROR: Unable to extract '%s' component\n", comp_name);
 			return NULL;
 		}
@@ -2827,10 +3381,11 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 		if (ftab_parse(component_data, component_size, &rftab, &ftag) != 0) {
 			free(component_data);
 			ftab_free(ftab);
+			free(ftab_data);
 			error("ERROR: Failed to parse '%s' component data.\n", comp_name);
 			return NULL;
 		}
-		free(component_data);
+		rftab_data = component_data;
 		component_data = NULL;
 		component_size = 0;
 		if (ftag != 'rkos') {
@@ -2851,6 +3406,8 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 
 	ftab_write(ftab, &component_data, &component_size);
 	ftab_free(ftab);
+	free(ftab_data);
+	free(rftab_data);
 
 	plist_dict_set_item(response, "FirmwareData", plist_new_data((char *)component_data, (uint64_t)component_size));
 	free(component_data);
@@ -2860,67 +3417,15 @@ static plist_t restore_get_timer_firmware_data(restored_client_t restore, struct
 	return response;
 }
 
-static int restore_send_firmware_updater_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message)
+static plist_t restore_get_firmware_updater_response(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, const char* s_updater_name, plist_t p_info)
 {
-	plist_t arguments;
-	plist_t p_type, p_updater_name, p_loop_count, p_info;
-	plist_t loop_count_dict = NULL;
-	char *s_type = NULL;
-	plist_t dict = NULL;
 	plist_t fwdict = NULL;
-	char *s_updater_name = NULL;
-	int restore_error;
-
-	if (idevicerestore_debug) {
-		debug("DEBUG: %s: Got FirmwareUpdaterData request:\n", __func__);
-		debug_plist(message);
-	}
-
-	arguments = plist_dict_get_item(message, "Arguments");
-	if (!arguments || plist_get_node_type(arguments) != PLIST_DICT) {
-		error("ERROR: %s: Arguments missing or has invalid type!\n", __func__);
-		goto error_out;
-	}
-
-	p_type = plist_dict_get_item(arguments, "MessageArgType");
-	if (!p_type || (plist_get_node_type(p_type) != PLIST_STRING)) {
-		error("ERROR: %s: MessageArgType missing or has invalid type!\n", __func__);
-		goto error_out;
-	}
-
-	p_updater_name = plist_dict_get_item(arguments, "MessageArgUpdaterName");
-	if (!p_updater_name || (plist_get_node_type(p_updater_name) != PLIST_STRING)) {
-		error("ERROR: %s: MessageArgUpdaterName missing or has invalid type!\n", __func__);
-		goto error_out;
-	}
-
-	p_loop_count = plist_dict_get_item(arguments, "MessageArgUpdaterLoopCount");
-	if (p_loop_count) {
-		loop_count_dict = plist_new_dict();
-		plist_dict_set_item(loop_count_dict, "LoopCount", plist_copy(p_loop_count));
-	}
-
-	plist_get_string_val(p_type, &s_type);
-	if (!s_type || strcmp(s_type, "FirmwareResponseData")) {
-		error("ERROR: %s: MessageArgType has unexpected value '%s'\n", __func__, s_type);
-		goto error_out;
-	}
-	free(s_type);
-	s_type = NULL;
-
-	p_info = plist_dict_get_item(arguments, "MessageArgInfo");
-	if (!p_info || (plist_get_node_type(p_info) != PLIST_DICT)) {
-		error("ERROR: %s: MessageArgInfo missing or has invalid type!\n", __func__);
-		goto error_out;
-	}
-
-	plist_get_string_val(p_updater_name, &s_updater_name);
 
 	if (strcmp(s_updater_name, "SE") == 0) {
 		fwdict = restore_get_se_firmware_data(restore, client, build_identity, p_info);
 		if (fwdict == NULL) {
 			error("ERROR: %s: Couldn't get SE firmware data\n", __func__);
-			goto error_out;
+			return NULL;
 		}
 	} else if (strcmp(s_updater_name, "Savage") == 0) {
 		const char *fwtype = "Savage";
@@ -2933,161 +3438,187 @@ static int restore_send_firmware_updater_data(restored_client_t restore, struct
 		}
 		if (fwdict == NULL) {
 			error("ERROR: %s: Couldn't get %s firmware data\n", __func__, fwtype);
-			goto error_out;
+			return NULL;
 		}
 	} else if (strcmp(s_updater_name, "Rose") == 0) {
 		fwdict = restore_get_rose_firmware_data(restore, client, build_identity, p_info);
 		if (fwdict == NULL) {
 			error("ERROR: %s: Couldn't get Rose firmware data\n", __func__);
-			goto error_out;
+			return NULL;
 		}
 	} else if (strcmp(s_updater_name, "T200") == 0) {
 		fwdict = restore_get_veridian_firmware_data(restore, client, build_identity, p_info);
 		if (fwdict == NULL) {
 			error("ERROR: %s: Couldn't get Veridian firmware data\n", __func__);
-			goto error_out;
+			return NULL;
 		}
 	} else if (strcmp(s_updater_name, "AppleTCON") == 0) {
 		fwdict = restore_get_tcon_firmware_data(restore, client, build_identity, p_info);
 		if (fwdict == NULL) {
 			error("ERROR: %s: Couldn't get AppleTCON firmware data\n", __func__);
-			goto error_out;
+			return NULL;
 		}
 	} else if (strcmp(s_updater_name, "AppleTypeCRetimer") == 0) {
 		fwdict = restore_get_timer_firmware_data(restore, client, build_identity, p_info);
 		if (fwdict == NULL) {
 			error("ERROR: %s: Couldn't get AppleTypeCRetimer firmware data\n", __func__);
-			goto error_out;
+			return NULL;
 		}
 	} else {
 		error("ERROR: %s: Got unknown updater name '%s'.\n", __func__, s_updater_name);
-		goto error_out;
+		return NULL;
 	}
-	free(s_updater_name);
-	s_updater_name = NULL;
 
-	dict = plist_new_dict();
-	plist_dict_set_item(dict, "FirmwareResponseData", fwdict);
-
-	info("Sending FirmwareResponse data now...\n");
-	restore_error = restored_send(restore, dict);
-	plist_free(dict);
-	if (restore_error != RESTORE_E_SUCCESS) {
-		error("ERROR: Couldn't send FirmwareResponse data (%d)\n", restore_error);
-		goto error_out;
-	}
+	return fwdict;
+}
 
-	info("Done sending FirmwareUpdater data\n");
+static int restore_send_firmware_updater_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message)
+{
+	plist_t arguments;
+	plist_t p_type, p_updater_name, p_loop_count, p_info;
+	plist_t loop_count_dict = NULL;
+	char *s_type = NULL;
+	plist_t dict = NULL;
+	plist_t fwdict = NULL;
+	char *s_updater_name = NULL;
+	int restore_error;
 
-	return 0;
+	if (idevicerestore_debug) {
+		debug("DEBUG: %s: Got FirmwareUpdaterData request:\n", __func__);
+		debug_plist(message);
+	}
 
-error_out:
-	free(s_type);
-	free(s_updater_name);
-	plist_free(loop_count_dict);
-	return -1;
-}
+	arguments = plist_dict_get_item(message, "Arguments");
+	if (!arguments || plist_get_node_type(arguments) != PLIST_DICT) {
+		error("ERROR: %s: Arguments missing or has invalid type!\n", __func__);
+		goto error_out;
+	}
 
-struct cpio_odc_header {
-	char c_magic[6];
-	char c_dev[6];
-	char c_ino[6];
-	char c_mode[6];
-	char c_uid[6];
-	char c_gid[6];
-	char c_nlink[6];
-	char c_rdev[6];
-	char c_mtime[11];
-	char c_namesize[6];
-	char c_filesize[11];
-};
+	p_type = plist_dict_get_item(arguments, "MessageArgType");
+	if (!p_type || (plist_get_node_type(p_type) != PLIST_STRING)) {
+		error("ERROR: %s: MessageArgType missing or has invalid type!\n", __func__);
+		goto error_out;
+	}
 
-static void octal(char *p, int width, int v)
-{
-	char buf[32];
-	snprintf(buf, 32, "%0*o", width, v);
-	memcpy(p, buf, width);
-}
+	p_updater_name = plist_dict_get_item(arguments, "MessageArgUpdaterName");
+	if (!p_updater_name || (plist_get_node_type(p_updater_name) != PLIST_STRING)) {
+		error("ERROR: %s: MessageArgUpdaterName missing or has invalid type!\n", __func__);
+		goto error_out;
+	}
 
-static int cpio_send_file(idevice_connection_t connection, const char *name, struct stat *st, void *data)
-{
-	struct cpio_odc_header hdr;
-
-	memset(&hdr, '0', sizeof(hdr));
-	memcpy(hdr.c_magic, "070707", 6);
-	octal(hdr.c_dev, 6, st->st_dev);
-	octal(hdr.c_ino, 6, st->st_ino);
-	octal(hdr.c_mode, 6, st->st_mode);
-	octal(hdr.c_uid, 6, st->st_uid);
-	octal(hdr.c_gid, 6, st->st_gid);
-	octal(hdr.c_nlink, 6, st->st_nlink);
-	octal(hdr.c_rdev, 6, st->st_rdev);
-	octal(hdr.c_mtime, 11, st->st_mtime);
-	octal(hdr.c_namesize, 6, strlen(name) + 1);
-	if (data)
-		octal(hdr.c_filesize, 11, st->st_size);
-
-	uint32_t bytes = 0;
-	int name_len = strlen(name) + 1;
-	idevice_error_t device_error;
+	p_loop_count = plist_dict_get_item(arguments, "MessageArgUpdaterLoopCount");
+	if (p_loop_count) {
+		loop_count_dict = plist_new_dict();
+		plist_dict_set_item(loop_count_dict, "LoopCount", plist_copy(p_loop_count));
+	}
 
-	device_error = idevice_connection_send(connection, (void *)&hdr, sizeof(hdr), &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != sizeof(hdr)) {
-		error("ERROR: BootabilityBundle unable to send header. (%d) Sent %u of %lu bytes.\n", device_error, bytes, (long)sizeof(hdr));
-		return -1;
+	plist_get_string_val(p_type, &s_type);
+	if (!s_type || strcmp(s_type, "FirmwareResponseData")) {
+		error("ERROR: %s: MessageArgType has unexpected value '%s'\n", __func__, s_type);
+		goto error_out;
 	}
+	free(s_type);
+	s_type = NULL;
 
-	device_error = idevice_connection_send(connection, (void *)name, name_len, &bytes);
-	if (device_error != IDEVICE_E_SUCCESS || bytes != name_len) {
-		error("ERROR: BootabilityBundle unable to send filename. (%d) Sent %u of %u bytes.\n", device_error, bytes, name_len);
-		return -1;
+	p_info = plist_dict_get_item(arguments, "MessageArgInfo");
+	if (!p_info || (plist_get_node_type(p_info) != PLIST_DICT)) {
+		error("ERROR: %s: MessageArgInfo missing or has invalid type!\n", __func__);
+		goto error_out;
 	}
 
-	if (st->st_size && data) {
-		device_error = idevice_connection_send(connection, data, st->st_size, &bytes);
-		if (device_error != IDEVICE_E_SUCCESS || bytes != st->st_size) {
-			error("ERROR: BootabilityBundle unable to send data. (%d) Sent %u of %lu bytes.\n", device_error, bytes, (long)st->st_size);
-			return -1;
+	plist_get_string_val(p_updater_name, &s_updater_name);
+
+	unsigned char response_key[CACHE_KEY_SIZE];
+	unsigned char components_key[CACHE_KEY_SIZE];
+	int cacheable = 0;
+	unsigned char* cached = NULL;
+	unsigned int cached_size = 0;
+	char* response_bin = NULL;
+	uint32_t response_bin_size = 0;
+	char* used = NULL;
+	size_t used_len = 0;
+
+	if (client->fwupdater_cache) {
+		/* both keys share the (large) build identity, it is serialized once */
+		unsigned char identity_key[CACHE_KEY_SIZE];
+		char* bin = NULL;
+		uint32_t bin_size = 0;
+		plist_to_bin(build_identity, &bin, &bin_size);
+		if (bin) {
+			cache_key_from_data(identity_key, bin, bin_size);
+			free(bin);
+			cacheable = (restore_fw_cache_key(client, identity_key, s_updater_name, p_info, response_key) == 0
+					&& restore_fw_cache_key(client, identity_key, s_updater_name, NULL, components_key) == 0);
+		}
+	}
+
+	if (cacheable && cache_get(client->fwupdater_cache, response_key, &cached, &cached_size) == 0) {
+		plist_from_bin((const char*)cached, cached_size, &fwdict);
+		free(cached);
+		cached = NULL;
+		if (fwdict) {
+			info("Using cached %s firmware response\n", s_updater_name);
+		}
+	}
+
+	if (!fwdict) {
+		struct restore_fw_context ctx;
+		memset(&ctx, 0, sizeof(ctx));
+		if (cacheable && cache_get(client->fwupdater_cache, components_key, &cached, &cached_size) == 0) {
+			restore_fw_context_speculate(&ctx, client, cached, cached_size);
+			free(cached);
+			cached = NULL;
+		}
+
+		client->restore->fw_context = &ctx;
+		fwdict = restore_get_firmware_updater_response(restore, client, build_identity, s_updater_name, p_info);
+		client->restore->fw_context = NULL;
+
+		/* the response is only cached once restored took it, see below */
+		if (fwdict && cacheable) {
+			plist_to_bin(fwdict, &response_bin, &response_bin_size);
+			used = ctx.used;
+			used_len = ctx.used_len;
+			ctx.used = NULL;
+		}
+		restore_fw_context_free(&ctx);
+		if (!fwdict) {
+			goto error_out;
 		}
 	}
 
-	return 0;
-}
-
-static int restore_bootability_send_one(void *ctx, const char *ipsw, const char *name, struct stat *stat)
-{
-	idevice_connection_t connection = (idevice_connection_t)ctx;
-	const char *prefix = "BootabilityBundle/Restore/Bootability/";
-	const char *subpath;
+	dict = plist_new_dict();
+	plist_dict_set_item(dict, "FirmwareResponseData", fwdict);
 
-	if (!strcmp(name, "BootabilityBundle/Restore/Firmware/Bootability.dmg.trustcache")) {
-		subpath = "Bootability.trustcache";
-	} else if (strncmp(name, prefix, strlen(prefix))) {
-		return 0;
-	} else {
-		subpath = name + strlen(prefix);
+	info("Sending FirmwareResponse data now...\n");
+	restore_error = restore_send_message(client, restore, dict);
+	plist_free(dict);
+	if (restore_error != RESTORE_E_SUCCESS) {
+		error("ERROR: Couldn't send FirmwareResponse data (%d)\n", restore_error);
+		goto error_out;
 	}
 
-	debug("DEBUG: BootabilityBundle send m=%07o s=%10ld %s\n", stat->st_mode, (long)stat->st_size, subpath);
-
-	unsigned char *buf = NULL;
-	unsigned int size = 0;
-
-	if ((S_ISLNK(stat->st_mode) || S_ISREG(stat->st_mode)) && stat->st_size != 0) {
-		ipsw_extract_to_memory(ipsw, name, &buf, &size);
-		if (size != stat->st_size) {
-			error("ERROR: expected %ld bytes but got %d for file %s\n", (long)stat->st_size, size, name);
-			free(buf);
-			return -1;
-		}
+	if (response_bin) {
+		cache_put(client->fwupdater_cache, response_key, (const unsigned char*)response_bin, response_bin_size);
 	}
+	if (used) {
+		cache_put(client->fwupdater_cache, components_key, (const unsigned char*)used, used_len);
+	}
+	free(response_bin);
+	free(used);
+	free(s_updater_name);
 
-	stat->st_uid = stat->st_gid = 0;
+	info("Done sending FirmwareUpdater data\n");
 
-	int ret = cpio_send_file(connection, subpath, stat, buf);
+	return 0;
 
-	free(buf);
-	return ret;
+error_out:
+	free(response_bin);
+	free(used);
+	free(s_type);
+	free(s_updater_name);
+	plist_free(loop_count_dict);
+	return -1;
 }
 
 static int restore_send_bootability_bundle_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message, idevice_t device)
@@ -3120,19 +3651,18 @@ static int restore_send_bootability_bundle_data(restored_client_t restore, struc
 		return -1;
 	}
 
-	int ret = ipsw_list_contents(client->ipsw, restore_bootability_send_one, connection);
+	struct conn_writer w;
+	conn_writer_init(&w, connection, BOOTABILITY_SEND_BUFFER_SIZE);
+	int ret = bootability_bundle_send(client->ipsw, &w);
+	conn_writer_cleanup(&w);
+	idevice_disconnect(connection);
 
 	if (ret < 0) {
 		error("ERROR: Failed to send BootabilityBundle\n");
 		return ret;
 	}
 
-	struct stat st = {.st_nlink = 1};
-	cpio_send_file(connection, "TRAILER!!!", &st, NULL);
-
-	idevice_disconnect(connection);
-
-    return 0;
+	return 0;
 }
 
 plist_t restore_get_build_identity(struct idevicerestore_client_t* client, uint8_t is_recovery_os)
@@ -3146,8 +3676,8 @@ plist_t restore_get_build_identity(struct idevicerestore_client_t* client, uint8
 	else
 		variant = RESTORE_VARIANT_UPGRADE_INSTALL;
 
-	plist_t build_identity = build_manifest_get_build_identity_for_model_with_variant(
-			client->build_manifest,
+	plist_t build_identity = build_manifest_find_identity(
+			client->manifest,
 			client->device->hardware_model,
 			variant);
 
@@ -3222,6 +3752,262 @@ int extract_global_manifest(struct idevicerestore_client_t* client, plist_t buil
 	return 0;
 }
 
+/* restored before protocol version 14 expects the 8K slices iTunes used to send */
+#define FILE_DATA_CHUNK_SIZE_LEGACY 8192
+#define FILE_DATA_CHUNK_SIZE (1024*1024)
+
+struct restore_file_data_sender {
+	struct idevicerestore_client_t* client;
+	restored_client_t restore;
+	const char* name;
+	plist_t msg;
+	plist_t data;
+	unsigned int chunk_size;
+	/* messages sent so far */
+	unsigned int sent;
+};
+
+static int restore_file_data_sender_init(struct restore_file_data_sender* sender, struct idevicerestore_client_t* client, restored_client_t restore, const char* name)
+{
+	sender->client = client;
+	sender->restore = restore;
+	sender->name = name;
+	sender->chunk_size = (client->restore && client->restore->protocol_version >= 14 && !client->restore->file_data_legacy) ? FILE_DATA_CHUNK_SIZE : FILE_DATA_CHUNK_SIZE_LEGACY;
+	sender->sent = 0;
+	/* one message for all the chunks, only the data node gets replaced */
+	sender->data = plist_new_data(NULL, 0);
+	sender->msg = plist_new_dict();
+	if (!sender->data || !sender->msg) {
+		plist_free(sender->data);
+		plist_free(sender->msg);
+		sender->data = NULL;
+		sender->msg = NULL;
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	plist_dict_set_item(sender->msg, "FileData", sender->data);
+	return 0;
+}
+
+static void restore_file_data_sender_free(struct restore_file_data_sender* sender)
+{
+	plist_free(sender->msg);
+	sender->msg = NULL;
+	sender->data = NULL;
+}
+
+static int restore_file_data_sender_send(struct restore_file_data_sender* sender, const unsigned char* data, unsigned int size)
+{
+	unsigned int offset = 0;
+	while (offset < size) {
+		unsigned int len = (size - offset > sender->chunk_size) ? sender->chunk_size : size - offset;
+		plist_set_data_val(sender->data, (const char*)data + offset, len);
+		if (restore_send_message(sender->client, sender->restore, sender->msg) != RESTORE_E_SUCCESS) {
+			if (sender->sent == 0 && len > FILE_DATA_CHUNK_SIZE_LEGACY) {
+				/* the size of large chunks is not documented, a restored
+				 * that refuses the first one gets the legacy slices */
+				info("Device did not accept %u byte chunks of %s, retrying with %u bytes\n", len, sender->name, FILE_DATA_CHUNK_SIZE_LEGACY);
+				sender->chunk_size = FILE_DATA_CHUNK_SIZE_LEGACY;
+				if (sender->client->restore) {
+					sender->client->restore->file_data_legacy = 1;
+				}
+				continue;
+			}
+			error("ERROR: Unable to send component %s data\n", sender->name);
+			return -1;
+		}
+		sender->sent++;
+		offset += len;
+	}
+	return 0;
+}
+
+static int restore_file_data_sender_done(struct restore_file_data_sender* sender)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "FileDataDone", plist_new_bool(1));
+	restored_error_t restore_error = restore_send_message(sender->client, sender->restore, dict);
+	plist_free(dict);
+	if (restore_error != RESTORE_E_SUCCESS) {
+		error("ERROR: Unable to send component %s data\n", sender->name);
+		return -1;
+	}
+	return 0;
+}
+
+static int restore_send_file_data(struct idevicerestore_client_t* client, restored_client_t restore, const char* name, const unsigned char* data, unsigned int size)
+{
+	struct restore_file_data_sender sender;
+	unsigned int offset = 0;
+	if (restore_file_data_sender_init(&sender, client, restore, name) < 0) {
+		return -1;
+	}
+	while (offset < size) {
+		unsigned int blob_size = (size - offset > sender.chunk_size) ? sender.chunk_size : size - offset;
+		if (restore_file_data_sender_send(&sender, data + offset, blob_size) < 0) {
+			restore_file_data_sender_free(&sender);
+			return -1;
+		}
+		offset += blob_size;
+	}
+	restore_file_data_sender_free(&sender);
+	return restore_file_data_sender_done(&sender);
+}
+
+/* Reads the next chunk of a file from the IPSW while the previous one is
+ * being sent. The reader fills the two buffers in turns. */
+struct restore_file_data_reader {
+	ipsw_file_handle_t file;
+	unsigned int chunk_size;
+	unsigned char* buf[2];
+	unsigned int len[2];
+	int filled[2];
+	int done;
+	int last;
+	int failed;
+	int quit;
+	mutex_t mutex;
+	cond_t cond;
+};
+
+static void* restore_file_data_reader_thread(void* arg)
+{
+	struct restore_file_data_reader* reader = (struct restore_file_data_reader*)arg;
+	int idx = 0;
+	while (1) {
+		mutex_lock(&reader->mutex);
+		while (reader->filled[idx] && !reader->quit) {
+			cond_wait(&reader->cond, &reader->mutex);
+		}
+		if (reader->quit) {
+			mutex_unlock(&reader->mutex);
+			break;
+		}
+		mutex_unlock(&reader->mutex);
+
+		unsigned int got = 0;
+		int eof = 0;
+		int failed = 0;
+		while (got < reader->chunk_size) {
+			int64_t r = ipsw_file_read(reader->file, reader->buf[idx] + got, reader->chunk_size - got);
+			if (r < 0) {
+				failed = 1;
+				break;
+			}
+			if (r == 0) {
+				eof = 1;
+				break;
+			}
+			got += (unsigned int)r;
+		}
+
+		mutex_lock(&reader->mutex);
+		reader->len[idx] = got;
+		reader->filled[idx] = 1;
+		if (eof || failed) {
+			reader->done = 1;
+			reader->last = idx;
+			reader->failed = failed;
+		}
+		cond_signal(&reader->cond);
+		mutex_unlock(&reader->mutex);
+		if (eof || failed) {
+			break;
+		}
+		idx ^= 1;
+	}
+	return NULL;
+}
+
+static int restore_stream_file_data(struct idevicerestore_client_t* client, restored_client_t restore, const char* name, const char* path)
+{
+	struct restore_file_data_sender sender;
+	struct restore_file_data_reader reader;
+	THREAD_T thread = THREAD_T_NULL;
+	uint64_t sent = 0;
+	int res = -1;
+	int idx = 0;
+
+	memset(&reader, 0, sizeof(reader));
+	reader.file = ipsw_file_open(client->ipsw, path);
+	if (!reader.file) {
+		error("ERROR: Unable to open %s in %s\n", path, ipsw_get_path(client->ipsw));
+		return -1;
+	}
+	if (restore_file_data_sender_init(&sender, client, restore, name) < 0) {
+		ipsw_file_close(reader.file);
+		return -1;
+	}
+	reader.chunk_size = sender.chunk_size;
+	reader.buf[0] = malloc(reader.chunk_size);
+	reader.buf[1] = malloc(reader.chunk_size);
+	if (!reader.buf[0] || !reader.buf[1]) {
+		error("ERROR: Out of memory\n");
+		goto leave;
+	}
+	mutex_init(&reader.mutex);
+	cond_init(&reader.cond);
+	uint64_t begin = telemetry_begin();
+	if (thread_new(&thread, restore_file_data_reader_thread, &reader) != 0) {
+		thread = THREAD_T_NULL;
+		error("ERROR: Unable to start reader thread for %s\n", name);
+		goto leave_sync;
+	}
+
+	while (1) {
+		mutex_lock(&reader.mutex);
+		while (!reader.filled[idx]) {
+			cond_wait(&reader.cond, &reader.mutex);
+		}
+		int last = reader.done && reader.last == idx;
+		int failed = last && reader.failed;
+		unsigned int len = reader.len[idx];
+		mutex_unlock(&reader.mutex);
+
+		if (failed) {
+			error("ERROR: Unable to read %s from %s\n", path, ipsw_get_path(client->ipsw));
+			break;
+		}
+		if (len > 0 && restore_file_data_sender_send(&sender, reader.buf[idx], len) < 0) {
+			break;
+		}
+		sent += len;
+
+		mutex_lock(&reader.mutex);
+		reader.filled[idx] = 0;
+		cond_signal(&reader.cond);
+		mutex_unlock(&reader.mutex);
+		if (last) {
+			res = 0;
+			break;
+		}
+		idx ^= 1;
+	}
+
+	mutex_lock(&reader.mutex);
+	reader.quit = 1;
+	cond_signal(&reader.cond);
+	mutex_unlock(&reader.mutex);
+	thread_join(thread);
+	thread_free(thread);
+	if (res == 0) {
+		telemetry_end(client->telemetry, "ipsw_extract", begin, sent);
+	}
+
+leave_sync:
+	cond_destroy(&reader.cond);
+	mutex_destroy(&reader.mutex);
+leave:
+	free(reader.buf[0]);
+	free(reader.buf[1]);
+	ipsw_file_close(reader.file);
+	restore_file_data_sender_free(&sender);
+	if (res == 0) {
+		res = restore_file_data_sender_done(&sender);
+	}
+	return res;
+}
+
 int restore_send_personalized_boot_object_v3(restored_client_t restore, struct idevicerestore_client_t* client, plist_t msg, plist_t build_identity)
 {
 	debug_plist(msg);
@@ -3242,11 +4028,10 @@ int restore_send_personalized_boot_object_v3(restored_client_t restore, struct i
 	unsigned int size = 0;
 	unsigned char *data = NULL;
 	char *path = NULL;
-	plist_t blob = NULL;
-	plist_t dict = NULL;
-	restored_error_t restore_error = RESTORE_E_SUCCESS;
+	struct component_buffer cb;
 	char *component_name = component;
 
+	component_buffer_init(&cb);
 	info("About to send %s...\n", component_name);
 
 	if (strcmp(image_name, "__GlobalManifest__") == 0) {
@@ -3285,10 +4070,8 @@ int restore_send_personalized_boot_object_v3(restored_client_t restore, struct i
 			}
 		}
 
-		// Extract component
-		unsigned char *component_data = NULL;
-		unsigned int component_size = 0;
-		int ret = extract_component(client->ipsw, path, &component_data, &component_size);
+		// Extract component, usually the prefetcher is done with it already
+		int ret = extract_component_buffer(client, path, &cb);
 		free(path);
 		path = NULL;
 		if (ret < 0) {
@@ -3296,52 +4079,25 @@ int restore_send_personalized_boot_object_v3(restored_client_t restore, struct i
 			return -1;
 		}
 
-		// Personalize IMG40
-		ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-		free(component_data);
-		component_data = NULL;
+		// Personalize IMG40 in place
+		ret = personalize_component_buffer(client, component, &cb, client->tss);
 		if (ret < 0) {
+			component_buffer_free(&cb);
 			error("ERROR: Unable to get personalized component %s\n", component);
 			return -1;
 		}
 	}
-
-	// Make plist
-	info("Sending %s now...\n", component_name);
-
-	int64_t i = size;
-	while (i > 0) {
-		int blob_size = i > 8192 ? 8192 : i;
-
-		dict = plist_new_dict();
-		blob = plist_new_data((char *) (data + size - i), blob_size);
-		plist_dict_set_item(dict, "FileData", blob);
-
-		restore_error = restored_send(restore, dict);
-		if (restore_error != RESTORE_E_SUCCESS) {
-			error("ERROR: Unable to send component %s data\n", component_name);
-			return -1;
-		}
-
-		plist_free(dict);
-
-		i -= blob_size;
+	if (data) {
+		component_buffer_attach(&cb, data, size);
 	}
-	debug("\n");
-
-	// Send FileDataDone
-	dict = plist_new_dict();
-	plist_dict_set_item(dict, "FileDataDone", plist_new_bool(1));
 
-	restore_error = restored_send(restore, dict);
-	if (restore_error != RESTORE_E_SUCCESS) {
-		error("ERROR: Unable to send component %s data\n", component_name);
+	info("Sending %s now...\n", component_name);
+	int ret = restore_send_file_data(client, restore, component_name, component_buffer_data(&cb), cb.size);
+	component_buffer_free(&cb);
+	if (ret < 0) {
 		return -1;
 	}
 
-	plist_free(dict);
-	free(data);
-
 	info("Done sending %s\n", component_name);
 	return 0;
 }
@@ -3368,9 +4124,6 @@ int restore_send_source_boot_object_v4(restored_client_t restore, struct idevice
 	unsigned int size = 0;
 	unsigned char *data = NULL;
 	char *path = NULL;
-	plist_t blob = NULL;
-	plist_t dict = NULL;
-	restored_error_t restore_error = RESTORE_E_SUCCESS;
 	char *component_name = component;
 
 	info("About to send %s...\n", component_name);
@@ -3407,51 +4160,30 @@ int restore_send_source_boot_object_v4(restored_client_t restore, struct idevice
 			}
 		}
 
-		int ret = extract_component(client->ipsw, path, &data, &size);
+		// Stream it from the IPSW while sending unless the prefetcher has it already
+		if (!client->prefetch || prefetch_take_component(client->prefetch, path, &data, &size) < 0) {
+			info("Sending %s now...\n", component_name);
+			int ret = restore_stream_file_data(client, restore, component_name, path);
+			free(path);
+			if (ret < 0) {
+				error("ERROR: Unable to send component %s\n", component);
+				return -1;
+			}
+			info("Done sending %s\n", component_name);
+			return 0;
+		}
+		debug("DEBUG: Using prefetched %s\n", path);
 		free(path);
 		path = NULL;
-		if (ret < 0) {
-			error("ERROR: Unable to extract component %s\n", component);
-			return -1;
-		}
 	}
 
-	// Make plist
 	info("Sending %s now...\n", component_name);
-
-	int64_t i = size;
-	while (i > 0) {
-		int blob_size = i > 8192 ? 8192 : i;
-
-		dict = plist_new_dict();
-		blob = plist_new_data((char *) (data + size - i), blob_size);
-		plist_dict_set_item(dict, "FileData", blob);
-
-		restore_error = restored_send(restore, dict);
-		if (restore_error != RESTORE_E_SUCCESS) {
-			error("ERROR: Unable to send component %s data\n", component_name);
-			return -1;
-		}
-
-		plist_free(dict);
-
-		i -= blob_size;
-	}
-	debug("\n");
-
-	// Send FileDataDone
-	dict = plist_new_dict();
-	plist_dict_set_item(dict, "FileDataDone", plist_new_bool(1));
-
-	restore_error = restored_send(restore, dict);
-	if (restore_error != RESTORE_E_SUCCESS) {
-		error("ERROR: Unable to send component %s data\n", component_name);
+	int ret = restore_send_file_data(client, restore, component_name, data, size);
+	free(data);
+	if (ret < 0) {
 		return -1;
 	}
 
-	plist_free(dict);
-	free(data);
-
 	info("Done sending %s\n", component_name);
 	return 0;
 }
@@ -3479,7 +4211,7 @@ int restore_send_restore_local_policy(restored_client_t restore, struct idevicer
 		return -1;
 	}
 
-	ret = personalize_component(component, component_data, component_size, client->tss_localpolicy, &data, &size);
+	ret = personalize_component(client, component, component_data, component_size, client->tss_localpolicy, &data, &size);
 	free(component_data);
 	component_data = NULL;
 	if (ret < 0) {
@@ -3490,7 +4222,7 @@ int restore_send_restore_local_policy(restored_client_t restore, struct idevicer
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Ap,LocalPolicy", plist_new_data((char*)data, size));
 
-	int restore_error = restored_send(restore, dict);
+	int restore_error = restore_send_message(client, restore, dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send component %s data\n", component);
 		return -1;
@@ -3522,7 +4254,7 @@ int restore_send_buildidentity(restored_client_t restore, struct idevicerestore_
 	}
 
 	info("Sending BuildIdentityDict now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(client, restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send BuildIdentityDict (%d)\n", restore_error);
@@ -3533,7 +4265,7 @@ int restore_send_buildidentity(restored_client_t restore, struct idevicerestore_
 	return 0;
 }
 
-int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
+static int restore_handle_data_request(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
 {
 	plist_t node = NULL;
 
@@ -3545,7 +4277,7 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 
 		// this request is sent when restored is ready to receive the filesystem
 		if (!strcmp(type, "SystemImageData")) {
-			if(restore_send_filesystem(client, device, filesystem) < 0) {
+			if(restore_send_filesystem(client, device, build_identity, filesystem) < 0) {
 				error("ERROR: Unable to send filesystem\n");
 				return -2;
 			}
@@ -3581,7 +4313,7 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 
 		// this request is sent when restored is ready to receive the filesystem
 		else if (!strcmp(type, "RecoveryOSASRImage")) {
-			if(restore_send_filesystem(client, device, filesystem) < 0) {
+			if(restore_send_filesystem(client, device, build_identity, filesystem) < 0) {
 				error("ERROR: Unable to send filesystem\n");
 				return -2;
 			}
@@ -3651,7 +4383,7 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 		}
 
 		else if (!strcmp(type, "FDRTrustData")) {
-			if(restore_send_fdr_trust_data(restore, device) < 0) {
+			if(restore_send_fdr_trust_data(restore, client) < 0) {
 				error("ERROR: Unable to send FDR Trust data\n");
 				return -1;
 			}
@@ -3702,6 +4434,25 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 	return 0;
 }
 
+int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
+{
+	const char* type = NULL;
+	plist_t node = plist_dict_get_item(message, "DataType");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		type = plist_get_string_ptr(node, NULL);
+	}
+
+	uint64_t begin = telemetry_begin();
+	int ret = restore_handle_data_request(client, device, restore, message, build_identity, filesystem);
+	if (type) {
+		/* one phase per DataType, covering the restore_send_*() handlers */
+		char phase[128];
+		snprintf(phase, sizeof(phase), "restored_%s", type);
+		telemetry_end(client->telemetry, phase, begin, 0);
+	}
+	return ret;
+}
+
 // Extracted from ac2
 plist_t restore_supported_data_types()
 {
@@ -3796,6 +4547,132 @@ static void rp_status_cb(reverse_proxy_client_t client, reverse_proxy_status_t s
 }
 #endif
 
+/* Data requests that keep their handler busy for a long time run on a
+ * worker thread, so the main loop goes on reading and answering restored
+ * messages in the meantime. One of them runs at a time, a second one
+ * waits for the first to finish. */
+struct restore_dispatcher {
+	struct idevicerestore_client_t* client;
+	idevice_t device;
+	restored_client_t restore;
+	plist_t build_identity;
+	const char* filesystem;
+	mutex_t mutex;
+	THREAD_T thread;
+	plist_t message;
+	int running;
+	int done;
+	int result;
+};
+
+static int restore_dispatcher_is_async(plist_t message)
+{
+	static const char* async_types[] = {
+		"SystemImageData",
+		"RecoveryOSASRImage",
+		"BootabilityBundle",
+		"PersonalizedBootObjectV3",
+		"SourceBootObjectV4",
+		NULL
+	};
+	plist_t node = plist_dict_get_item(message, "DataType");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		return 0;
+	}
+	const char* type = plist_get_string_ptr(node, NULL);
+	int i;
+	for (i = 0; async_types[i]; i++) {
+		if (!strcmp(type, async_types[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void* restore_dispatcher_thread(void* arg)
+{
+	struct restore_dispatcher* d = (struct restore_dispatcher*)arg;
+	int result = restore_handle_data_request_msg(d->client, d->device, d->restore, d->message, d->build_identity, d->filesystem);
+	mutex_lock(&d->mutex);
+	d->result = result;
+	d->done = 1;
+	mutex_unlock(&d->mutex);
+	return NULL;
+}
+
+static void restore_dispatcher_init(struct restore_dispatcher* d, struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t build_identity, const char* filesystem)
+{
+	memset(d, 0, sizeof(struct restore_dispatcher));
+	d->client = client;
+	d->device = device;
+	d->restore = restore;
+	d->build_identity = build_identity;
+	d->filesystem = filesystem;
+	d->thread = THREAD_T_NULL;
+	mutex_init(&d->mutex);
+}
+
+/* waits for the running request, returns its result */
+static int restore_dispatcher_wait(struct restore_dispatcher* d)
+{
+	if (!d->running) {
+		return 0;
+	}
+	thread_join(d->thread);
+	thread_free(d->thread);
+	d->thread = THREAD_T_NULL;
+	d->running = 0;
+	plist_free(d->message);
+	d->message = NULL;
+	return d->result;
+}
+
+/* returns the result of the running request if it finished, 0 otherwise */
+static int restore_dispatcher_poll(struct restore_dispatcher* d)
+{
+	if (!d->running) {
+		return 0;
+	}
+	mutex_lock(&d->mutex);
+	int done = d->done;
+	mutex_unlock(&d->mutex);
+	return (done) ? restore_dispatcher_wait(d) : 0;
+}
+
+static int restore_dispatcher_start(struct restore_dispatcher* d, plist_t message)
+{
+	int res = restore_dispatcher_wait(d);
+	if (res < 0) {
+		return res;
+	}
+
+	plist_t node = plist_dict_get_item(message, "DataType");
+	const char* type = plist_get_string_ptr(node, NULL);
+	if (!strcmp(type, "SystemImageData")) {
+		restore_predict_nor_data(d->client, d->build_identity);
+	}
+
+	d->message = plist_copy(message);
+	d->done = 0;
+	d->result = 0;
+	if (thread_new(&d->thread, restore_dispatcher_thread, d) != 0) {
+		debug("DEBUG: %s: Unable to start worker thread, handling %s right away\n", __func__, type);
+		d->thread = THREAD_T_NULL;
+		plist_free(d->message);
+		d->message = NULL;
+		return restore_handle_data_request_msg(d->client, d->device, d->restore, message, d->build_identity, d->filesystem);
+	}
+	debug("DEBUG: %s: Handling %s in the background\n", __func__, type);
+	d->running = 1;
+	return 0;
+}
+
+static void restore_dispatcher_cleanup(struct restore_dispatcher* d)
+{
+	restore_dispatcher_wait(d);
+	mutex_destroy(&d->mutex);
+}
+
 int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem)
 {
 	int err = 0;
@@ -3810,8 +4687,6 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 	THREAD_T fdr_thread = THREAD_T_NULL;
 #endif
 
-	restore_finished = 0;
-
 	// open our connection to the device and verify we're in restore mode
 	err = restore_open_with_timeout(client);
 	if (err < 0) {
@@ -3822,6 +4697,7 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 
 	restore = client->restore->client;
 	device = client->restore->device;
+	client->restore->finished = 0;
 
 	restore_error = restored_query_value(restore, "HardwareInfo", &hwinfo);
 	if (restore_error == RESTORE_E_SUCCESS) {
@@ -4070,9 +4946,17 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 	plist_free(opts);
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 1.0);
 
+	struct restore_dispatcher dispatcher;
+	restore_dispatcher_init(&dispatcher, client, device, restore, build_identity, filesystem);
+
 	// this is the restore process loop, it reads each message in from
 	// restored and passes that data on to it's specific handler
 	while (!(client->flags & FLAG_QUIT)) {
+		// a request handled in the background counts once it is done
+		int async_err = restore_dispatcher_poll(&dispatcher);
+		if (async_err < 0) {
+			err = async_err;
+		}
 		if (client->flags & FLAG_IGNORE_ERRORS) {
 			error("WARNING: Attempting to continue after critical error, restore might fail...\n");
 			err = 0;
@@ -4119,7 +5003,11 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		// files sent to the server by the client. these data requests include
 		// SystemImageData, RootTicket, KernelCache, NORData and BasebandData requests
 		if (!strcmp(type, "DataRequestMsg")) {
-			err = restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
+			if (restore_dispatcher_is_async(message)) {
+				err = restore_dispatcher_start(&dispatcher, message);
+			} else {
+				err = restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
+			}
 		}
 
 		// restore logs are available if a previous restore failed
@@ -4136,11 +5024,11 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		// status messages usually indicate the current state of the restored
 		// process or often to signal an error has been encountered
 		else if (!strcmp(type, "StatusMsg")) {
-			err = restore_handle_status_msg(restore, message);
-			if (restore_finished) {
+			err = restore_handle_status_msg(client, message);
+			if (client->restore->finished) {
 				plist_t dict = plist_new_dict();
 				plist_dict_set_item(dict, "MsgType", plist_new_string("ReceivedFinalStatusMsg"));
-				restored_send(restore, dict);
+				restore_send_message(client, restore, dict);
 				plist_free(dict);
 				client->flags |= FLAG_QUIT;
 			}
@@ -4154,6 +5042,7 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 			node = plist_dict_get_item(message, "CHECKPOINT_ID");
 			if (!node || plist_get_node_type(node) != PLIST_UINT) {
 				debug("Failed to parse checkpoint id from checkpoint plist\n");
+				restore_dispatcher_cleanup(&dispatcher);
 				return -1;
 			}
 			plist_get_uint_val(node, &ckpt_id);
@@ -4161,6 +5050,7 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 			node = plist_dict_get_item(message, "CHECKPOINT_RESULT");
 			if (!node || plist_get_node_type(node) != PLIST_UINT) {
 				debug("Failed to parse checkpoint result from checkpoint plist\n");
+				restore_dispatcher_cleanup(&dispatcher);
 				return -1;
 			}
 			plist_get_uint_val(node, &ckpt_res);
@@ -4196,6 +5086,13 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		message = NULL;
 	}
 
+	int async_err = restore_dispatcher_wait(&dispatcher);
+	if (err >= 0 && async_err < 0) {
+		error("ERROR: Unable to successfully restore device\n");
+		err = async_err;
+	}
+	restore_dispatcher_cleanup(&dispatcher);
+
 #ifdef HAVE_REVERSE_PROXY
 	reverse_proxy_client_free(rproxy);
 #else
@@ -31,6 +31,12 @@ extern "C" {
 #include <plist/plist.h>
 #include <libimobiledevice/restore.h>
 #include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice-glue/thread.h>
+
+/* FirmwareUpdaterData responses are small, a few hundred KB at most */
+#define FWUPDATER_CACHE_MAX_SIZE (64ULL * 1024 * 1024)
+
+struct restore_fw_context;
 
 struct restore_client_t {
 	plist_t tss;
@@ -41,6 +47,17 @@ struct restore_client_t {
 	const char* filesystem;
 	uint64_t protocol_version;
 	restored_client_t client;
+	int finished;
+	/* messages are sent by the main loop and by data request workers */
+	mutex_t send_mutex;
+	/* NORData prepared ahead of the request, see restore_predict_nor_data() */
+	THREAD_T nor_thread;
+	plist_t nor_data;
+	int nor_predicted;
+	/* set while a FirmwareUpdaterData request is being answered */
+	struct restore_fw_context* fw_context;
+	/* restored refused large FileData chunks, the legacy size is used */
+	int file_data_legacy;
 };
 
 int restore_check_mode(struct idevicerestore_client_t* client);
@@ -50,7 +67,7 @@ void restore_client_free(struct idevicerestore_client_t* client);
 int restore_is_image4_supported(struct idevicerestore_client_t* client);
 int restore_reboot(struct idevicerestore_client_t* client);
 const char* restore_progress_string(unsigned int operation);
-int restore_handle_status_msg(restored_client_t client, plist_t msg);
+int restore_handle_status_msg(struct idevicerestore_client_t* client, plist_t msg);
 int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t msg);
 int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem);
 int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message);
@@ -58,8 +75,8 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 int restore_send_component(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, const char* component, const char* component_name);
 int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem);
 int restore_open_with_timeout(struct idevicerestore_client_t* client);
-int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, const char* filesystem);
-int restore_send_fdr_trust_data(restored_client_t restore, idevice_t device);
+int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, plist_t build_identity, const char* filesystem);
+int restore_send_fdr_trust_data(restored_client_t restore, struct idevicerestore_client_t* client);
 
 #ifdef __cplusplus
 }
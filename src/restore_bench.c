@@ -0,0 +1,725 @@
+/*
+ * restore_bench.c
+ * Throughput of the restore data paths against in-process stand-ins
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/* Instead of libimobiledevice this links its own idevice_connect() and
+ * friends: one kind of connection plays ASR (Initiate, OOB requests,
+ * payload), the other swallows whatever is sent, like the BootabilityBundle
+ * data port does. Everything else is the code the restore runs. Without an
+ * IPSW a synthetic one is generated, with a real one its largest .dmg goes
+ * through ASR and its kernelcache is stitched. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <plist/plist.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "asr.h"
+#include "ipsw.h"
+#include "img4.h"
+#include "bootability.h"
+#include "conn_writer.h"
+#include "zip_writer.h"
+#include "common.h"
+#include "idevicerestore.h"
+
+#define BENCH_DEFAULT_SIZE_MB 256
+#define BENCH_DEFAULT_ROUNDS 3
+#define BENCH_OOB_REQUESTS 16
+#define BENCH_OOB_LENGTH (64 * 1024)
+#define BENCH_STITCH_ROUNDS 16
+/* entries larger than this are left out of the extraction benchmark */
+#define BENCH_EXTRACT_MAX_SIZE (512 * 1024 * 1024)
+
+#ifdef __GLIBC__
+/* Counting wrappers that replace malloc for the whole process, glibc lets
+ * them forward to its own implementation */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static uint64_t bench_allocs = 0;
+
+void* malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+
+static uint64_t bench_get_allocs(void)
+{
+	return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+#define BENCH_HAVE_ALLOCS 1
+#else
+static uint64_t bench_get_allocs(void)
+{
+	return 0;
+}
+#define BENCH_HAVE_ALLOCS 0
+#endif
+
+enum {
+	BENCH_CONN_SINK = 0,
+	BENCH_CONN_ASR
+};
+
+enum {
+	BENCH_ASR_INITIATE = 0,
+	BENCH_ASR_INFO,
+	BENCH_ASR_OOB,
+	BENCH_ASR_PAYLOAD
+};
+
+struct idevice_private {
+	int unused;
+};
+
+struct idevice_connection_private {
+	int kind;
+	int state;
+	uint64_t image_size;
+	int oob_sent;
+	uint64_t oob_pending;
+	uint64_t received;
+	int failed;
+	/* the end of what was sent, to find the cpio trailer */
+	char tail[32];
+	uint32_t tail_len;
+};
+
+static struct idevice_private bench_device;
+static int bench_next_conn = BENCH_CONN_SINK;
+static int bench_checksum_chunks = 1;
+static idevice_connection_t bench_last_conn = NULL;
+
+idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t* connection)
+{
+	if (!device || !connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	idevice_connection_t conn = (idevice_connection_t)calloc(1, sizeof(struct idevice_connection_private));
+	if (!conn) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	conn->kind = bench_next_conn;
+	*connection = conn;
+	bench_last_conn = conn;
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_disconnect(idevice_connection_t connection)
+{
+	if (bench_last_conn == connection) {
+		bench_last_conn = NULL;
+	}
+	free(connection);
+	return IDEVICE_E_SUCCESS;
+}
+
+static idevice_error_t bench_reply(plist_t msg, char* data, uint32_t len, uint32_t* recv_bytes)
+{
+	char* xml = NULL;
+	uint32_t xlen = 0;
+	plist_to_xml(msg, &xml, &xlen);
+	plist_free(msg);
+	if (!xml || xlen > len) {
+		free(xml);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	memcpy(data, xml, xlen);
+	*recv_bytes = xlen;
+	free(xml);
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_connection_receive(idevice_connection_t connection, char* data, uint32_t len, uint32_t* recv_bytes)
+{
+	plist_t msg;
+
+	*recv_bytes = 0;
+	if (connection->kind != BENCH_CONN_ASR) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	switch (connection->state) {
+	case BENCH_ASR_INITIATE:
+		msg = plist_new_dict();
+		plist_dict_set_item(msg, "Command", plist_new_string("Initiate"));
+		plist_dict_set_item(msg, "Checksum Chunks", plist_new_bool(bench_checksum_chunks));
+		connection->state = BENCH_ASR_INFO;
+		return bench_reply(msg, data, len, recv_bytes);
+	case BENCH_ASR_OOB:
+		if (connection->oob_pending > 0) {
+			fprintf(stderr, "ERROR: OOB data incomplete\n");
+			connection->failed = 1;
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		msg = plist_new_dict();
+		if (connection->oob_sent < BENCH_OOB_REQUESTS && connection->image_size > BENCH_OOB_LENGTH) {
+			/* spread over the image, like the volume headers and the
+			 * catalog ASR looks at */
+			uint64_t offset = (connection->image_size - BENCH_OOB_LENGTH) / (BENCH_OOB_REQUESTS - 1) * connection->oob_sent;
+			plist_dict_set_item(msg, "Command", plist_new_string("OOBData"));
+			plist_dict_set_item(msg, "OOB Offset", plist_new_uint(offset));
+			plist_dict_set_item(msg, "OOB Length", plist_new_uint(BENCH_OOB_LENGTH));
+			connection->oob_pending = BENCH_OOB_LENGTH;
+			connection->oob_sent++;
+		} else {
+			plist_dict_set_item(msg, "Command", plist_new_string("Payload"));
+			connection->state = BENCH_ASR_PAYLOAD;
+		}
+		return bench_reply(msg, data, len, recv_bytes);
+	default:
+		break;
+	}
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+idevice_error_t idevice_connection_send(idevice_connection_t connection, const char* data, uint32_t len, uint32_t* sent_bytes)
+{
+	*sent_bytes = len;
+
+	if (connection->kind == BENCH_CONN_ASR) {
+		if (connection->state == BENCH_ASR_INFO) {
+			plist_t info = NULL;
+			plist_from_xml(data, len, &info);
+			plist_t payload = plist_dict_get_item(info, "Payload");
+			plist_t size = plist_dict_get_item(payload, "Size");
+			if (!size || plist_get_node_type(size) != PLIST_UINT) {
+				fprintf(stderr, "ERROR: ASR packet info without payload size\n");
+				plist_free(info);
+				connection->failed = 1;
+				return IDEVICE_E_UNKNOWN_ERROR;
+			}
+			plist_get_uint_val(size, &connection->image_size);
+			plist_free(info);
+			connection->state = BENCH_ASR_OOB;
+			return IDEVICE_E_SUCCESS;
+		}
+		if (connection->state == BENCH_ASR_OOB) {
+			if (len > connection->oob_pending) {
+				fprintf(stderr, "ERROR: more OOB data than requested\n");
+				connection->failed = 1;
+				return IDEVICE_E_UNKNOWN_ERROR;
+			}
+			connection->oob_pending -= len;
+			return IDEVICE_E_SUCCESS;
+		}
+	}
+
+	connection->received += len;
+	if (len >= sizeof(connection->tail)) {
+		memcpy(connection->tail, data + len - sizeof(connection->tail), sizeof(connection->tail));
+		connection->tail_len = sizeof(connection->tail);
+	} else {
+		uint32_t keep = sizeof(connection->tail) - len;
+		if (keep > connection->tail_len) {
+			keep = connection->tail_len;
+		}
+		memmove(connection->tail, connection->tail + connection->tail_len - keep, keep);
+		memcpy(connection->tail + keep, data, len);
+		connection->tail_len = keep + len;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+static double bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static uint64_t bench_peak_rss(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (uint64_t)ru.ru_maxrss;
+#else
+	return (uint64_t)ru.ru_maxrss * 1024;
+#endif
+}
+
+struct bench_result {
+	double best;
+	uint64_t bytes;
+	uint64_t allocs;
+};
+
+static void bench_report(const char* name, struct bench_result* r)
+{
+	printf("%-14s %9.1f MB %9.1f MB/s", name, (double)r->bytes / 1048576.0, (r->best > 0) ? (double)r->bytes / 1048576.0 / r->best : 0);
+	if (BENCH_HAVE_ALLOCS) {
+		printf(" %10" PRIu64 " allocs", r->allocs);
+	}
+	printf("\n");
+}
+
+/* keeps the fastest round, and the allocations of the first one */
+static void bench_round(struct bench_result* r, int round, double elapsed, uint64_t bytes, uint64_t allocs)
+{
+	if (round == 0 || elapsed < r->best) {
+		r->best = elapsed;
+	}
+	if (round == 0) {
+		r->bytes = bytes;
+		r->allocs = allocs;
+	}
+}
+
+static int bench_asr(ipsw_archive_t ipsw, const char* image, int rounds)
+{
+	struct bench_result r;
+	int i;
+
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < rounds; i++) {
+		ipsw_file_handle_t file = ipsw_file_open(ipsw, image);
+		if (!file) {
+			fprintf(stderr, "ERROR: Unable to open %s\n", image);
+			return -1;
+		}
+		uint64_t size = ipsw_file_size(file);
+		uint64_t allocs = bench_get_allocs();
+		double start = bench_now();
+
+		asr_client_t asr = NULL;
+		bench_next_conn = BENCH_CONN_ASR;
+		if (asr_open_with_timeout(&bench_device, &asr) < 0) {
+			ipsw_file_close(file);
+			return -1;
+		}
+		idevice_connection_t conn = bench_last_conn;
+		int res = asr_perform_validation(asr, file);
+		if (res == 0) {
+			res = asr_send_payload(asr, file);
+		}
+		uint64_t chunks = (size + 131071) / 131072;
+		if (res == 0 && (conn->failed || conn->received != size + chunks * 20)) {
+			fprintf(stderr, "ERROR: ASR received %" PRIu64 " bytes, expected %" PRIu64 "\n", conn->received, size + chunks * 20);
+			res = -1;
+		}
+		asr_free(asr);
+
+		double elapsed = bench_now() - start;
+		ipsw_file_close(file);
+		if (res < 0) {
+			return -1;
+		}
+		bench_round(&r, i, elapsed, size, bench_get_allocs() - allocs);
+	}
+	bench_report("asr_payload", &r);
+	return 0;
+}
+
+static int bench_bootability(ipsw_archive_t ipsw, int rounds)
+{
+	struct bench_result r;
+	int i;
+
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < rounds; i++) {
+		idevice_connection_t conn = NULL;
+		struct conn_writer w;
+		uint64_t allocs = bench_get_allocs();
+		double start = bench_now();
+
+		bench_next_conn = BENCH_CONN_SINK;
+		idevice_connect(&bench_device, 0, &conn);
+		conn_writer_init(&w, conn, BOOTABILITY_SEND_BUFFER_SIZE);
+		int res = bootability_bundle_send(ipsw, &w);
+		conn_writer_cleanup(&w);
+		uint64_t received = conn->received;
+		/* the trailer entry is the last thing in the archive */
+		int trailer = (conn->tail_len >= 11 && !memcmp(conn->tail + conn->tail_len - 11, "TRAILER!!!", 11));
+		idevice_disconnect(conn);
+
+		double elapsed = bench_now() - start;
+		if (res < 0 || !trailer) {
+			fprintf(stderr, "ERROR: BootabilityBundle stream %s\n", (res < 0) ? "failed" : "has no trailer");
+			return -1;
+		}
+		bench_round(&r, i, elapsed, received, bench_get_allocs() - allocs);
+	}
+	bench_report("bootability", &r);
+	return 0;
+}
+
+struct bench_entries {
+	char** names;
+	int count;
+	int capacity;
+	char* largest_dmg;
+	uint64_t largest_dmg_size;
+	char* kernelcache;
+};
+
+static int bench_collect(void* ctx, ipsw_archive_t ipsw, const char* name, struct stat* st)
+{
+	struct bench_entries* e = (struct bench_entries*)ctx;
+	if (!S_ISREG(st->st_mode)) {
+		return 0;
+	}
+	size_t len = strlen(name);
+	if (len > 4 && !strcmp(name + len - 4, ".dmg") && (uint64_t)st->st_size > e->largest_dmg_size) {
+		free(e->largest_dmg);
+		e->largest_dmg = strdup(name);
+		e->largest_dmg_size = st->st_size;
+	}
+	if (!e->kernelcache && !strncmp(name, "kernelcache", 11)) {
+		e->kernelcache = strdup(name);
+	}
+	if ((uint64_t)st->st_size > BENCH_EXTRACT_MAX_SIZE) {
+		return 0;
+	}
+	if (e->count == e->capacity) {
+		int capacity = (e->capacity) ? e->capacity * 2 : 64;
+		char** names = (char**)realloc(e->names, capacity * sizeof(char*));
+		if (!names) {
+			return -1;
+		}
+		e->names = names;
+		e->capacity = capacity;
+	}
+	e->names[e->count++] = strdup(name);
+	return 0;
+}
+
+static void bench_entries_free(struct bench_entries* e)
+{
+	int i;
+	for (i = 0; i < e->count; i++) {
+		free(e->names[i]);
+	}
+	free(e->names);
+	free(e->largest_dmg);
+	free(e->kernelcache);
+}
+
+static int bench_extract(ipsw_archive_t ipsw, struct bench_entries* e, int rounds)
+{
+	struct bench_result r;
+	int i, j;
+
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < rounds; i++) {
+		uint64_t bytes = 0;
+		uint64_t allocs = bench_get_allocs();
+		double start = bench_now();
+		for (j = 0; j < e->count; j++) {
+			unsigned char* data = NULL;
+			unsigned int size = 0;
+			if (e->largest_dmg && !strcmp(e->names[j], e->largest_dmg)) {
+				continue;
+			}
+			if (ipsw_extract_to_memory(ipsw, e->names[j], &data, &size) < 0) {
+				return -1;
+			}
+			bytes += size;
+			free(data);
+		}
+		bench_round(&r, i, bench_now() - start, bytes, bench_get_allocs() - allocs);
+	}
+	bench_report("ipsw_extract", &r);
+	return 0;
+}
+
+static int bench_stitch(ipsw_archive_t ipsw, const char* component, int rounds)
+{
+	struct bench_result r;
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+	unsigned char blob[8192];
+	int i, j;
+
+	if (ipsw_extract_to_memory(ipsw, component, &data, &size) < 0) {
+		return -1;
+	}
+	/* stitching doesn't look inside the ticket */
+	memset(blob, 0xA5, sizeof(blob));
+
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < rounds; i++) {
+		uint64_t allocs = bench_get_allocs();
+		double start = bench_now();
+		for (j = 0; j < BENCH_STITCH_ROUNDS; j++) {
+			unsigned char* img4 = NULL;
+			unsigned int img4_size = 0;
+			if (img4_stitch_component("KernelCache", data, size, blob, sizeof(blob), &img4, &img4_size) < 0) {
+				free(data);
+				return -1;
+			}
+			free(img4);
+		}
+		bench_round(&r, i, bench_now() - start, (uint64_t)size * BENCH_STITCH_ROUNDS, bench_get_allocs() - allocs);
+	}
+	free(data);
+	bench_report("img4_stitch", &r);
+	return 0;
+}
+
+/* half random, half runs of a repeated byte, so it deflates about as well
+ * as firmware does */
+static void bench_fill(unsigned char* p, size_t size, uint32_t* state)
+{
+	size_t i;
+	for (i = 0; i < size; i++) {
+		if ((i & 0x7f) == 0) {
+			*state ^= *state << 13;
+			*state ^= *state >> 17;
+			*state ^= *state << 5;
+		}
+		p[i] = (i & 0x40) ? (unsigned char)*state : (unsigned char)(*state >> ((i & 3) * 8) ^ i);
+	}
+}
+
+static int bench_add_entry(struct zip_writer* zw, const char* name, size_t size, uint32_t* state)
+{
+	struct zip_writer_blob blob;
+	unsigned char* data = (unsigned char*)malloc(size ? size : 1);
+	if (!data) {
+		return -1;
+	}
+	bench_fill(data, size, state);
+	int res = zip_writer_compress(data, size, &blob);
+	free(data);
+	if (res < 0) {
+		return -1;
+	}
+	res = zip_writer_add_blob(zw, name, time(NULL), &blob);
+	zip_writer_blob_free(&blob);
+	return res;
+}
+
+/* IM4P with a payload of size bytes: SEQUENCE { "IM4P", "krnl", "desc", OCTET STRING } */
+static int bench_add_im4p(struct zip_writer* zw, const char* name, size_t size, uint32_t* state)
+{
+	unsigned char hdr[64];
+	unsigned char* p = hdr + 6;
+	const char* strings[3] = { "IM4P", "krnl", "desc" };
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		*p++ = 0x16;
+		*p++ = 4;
+		memcpy(p, strings[i], 4);
+		p += 4;
+	}
+	*p++ = 0x04;
+	*p++ = 0x84;
+	*p++ = (unsigned char)(size >> 24);
+	*p++ = (unsigned char)(size >> 16);
+	*p++ = (unsigned char)(size >> 8);
+	*p++ = (unsigned char)size;
+	size_t content = (p - hdr - 6) + size;
+	hdr[0] = 0x30;
+	hdr[1] = 0x84;
+	hdr[2] = (unsigned char)(content >> 24);
+	hdr[3] = (unsigned char)(content >> 16);
+	hdr[4] = (unsigned char)(content >> 8);
+	hdr[5] = (unsigned char)content;
+	size_t hlen = p - hdr;
+
+	unsigned char* data = (unsigned char*)malloc(hlen + size);
+	if (!data) {
+		return -1;
+	}
+	memcpy(data, hdr, hlen);
+	bench_fill(data + hlen, size, state);
+
+	struct zip_writer_blob blob;
+	int res = zip_writer_compress(data, hlen + size, &blob);
+	free(data);
+	if (res < 0) {
+		return -1;
+	}
+	res = zip_writer_add_blob(zw, name, time(NULL), &blob);
+	zip_writer_blob_free(&blob);
+	return res;
+}
+
+static int bench_create_ipsw(const char* path, unsigned int size_mb)
+{
+	uint32_t state = 2463534242u;
+	char name[128];
+	int i;
+
+	struct zip_writer* zw = zip_writer_open(path);
+	if (!zw) {
+		return -1;
+	}
+	int res = bench_add_entry(zw, "Restore.dmg", (size_t)size_mb * 1024 * 1024, &state);
+	if (res == 0) {
+		res = bench_add_im4p(zw, "kernelcache.release.bench", 24 * 1024 * 1024, &state);
+	}
+	for (i = 0; res == 0 && i < 32; i++) {
+		snprintf(name, sizeof(name), "Firmware/all_flash/component%02d.im4p", i);
+		res = bench_add_im4p(zw, name, 256 * 1024 + i * 8192, &state);
+	}
+	if (res == 0) {
+		res = bench_add_entry(zw, "BootabilityBundle/Restore/Firmware/Bootability.dmg.trustcache", 16384, &state);
+	}
+	/* many small files, which the cpio stream has to cope with */
+	for (i = 0; res == 0 && i < 256; i++) {
+		snprintf(name, sizeof(name), "BootabilityBundle/Restore/Bootability/usr/lib/lib%03d.dylib", i);
+		res = bench_add_entry(zw, name, 512 + (i * 1237) % 65536, &state);
+	}
+	if (res < 0) {
+		zip_writer_discard(zw);
+		return -1;
+	}
+	return zip_writer_close(zw);
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [OPTIONS] [IPSW]\n\n", name);
+	printf("Measures the ASR payload, BootabilityBundle, extraction and IMG4 stitching\n");
+	printf("paths against in-process stand-ins. Without IPSW a synthetic one is used.\n\n");
+	printf("  -r, --rounds N        Run every benchmark N times, the best run counts (%d)\n", BENCH_DEFAULT_ROUNDS);
+	printf("  -s, --size MB         Size of the synthetic filesystem image (%d)\n", BENCH_DEFAULT_SIZE_MB);
+	printf("  -n, --no-checksums    Let the fake ASR ask for no chunk checksums\n");
+	printf("  -h, --help            Prints this usage information\n");
+}
+
+int main(int argc, char* argv[])
+{
+	static struct option longopts[] = {
+		{ "rounds",       required_argument, NULL, 'r' },
+		{ "size",         required_argument, NULL, 's' },
+		{ "no-checksums", no_argument,       NULL, 'n' },
+		{ "help",         no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int rounds = BENCH_DEFAULT_ROUNDS;
+	unsigned int size_mb = BENCH_DEFAULT_SIZE_MB;
+	char synthetic[512] = "";
+	const char* path = NULL;
+	int opt;
+	int res = 0;
+
+	while ((opt = getopt_long(argc, argv, "r:s:nh", longopts, NULL)) > 0) {
+		switch (opt) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			size_mb = (unsigned int)atoi(optarg);
+			break;
+		case 'n':
+			bench_checksum_chunks = 0;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (rounds < 1 || size_mb < 1 || size_mb > 4000) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (optind < argc) {
+		path = argv[optind];
+	} else {
+		const char* tmpdir = getenv("TMPDIR");
+		snprintf(synthetic, sizeof(synthetic), "%s/restore_bench-%d.ipsw", (tmpdir) ? tmpdir : "/tmp", (int)getpid());
+		printf("Creating synthetic IPSW with a %u MB filesystem image...\n", size_mb);
+		if (bench_create_ipsw(synthetic, size_mb) < 0) {
+			fprintf(stderr, "ERROR: Unable to create %s\n", synthetic);
+			return 1;
+		}
+		path = synthetic;
+	}
+
+	/* the restore code's own output would drown the numbers */
+	idevicerestore_set_info_stream(NULL);
+
+	ipsw_archive_t ipsw = ipsw_open(path);
+	if (!ipsw) {
+		if (synthetic[0]) {
+			remove(synthetic);
+		}
+		return 1;
+	}
+
+	struct bench_entries entries;
+	memset(&entries, 0, sizeof(entries));
+	if (ipsw_list_contents(ipsw, bench_collect, &entries) < 0) {
+		fprintf(stderr, "ERROR: Unable to list %s\n", path);
+		res = -1;
+	}
+
+	if (res == 0 && entries.largest_dmg) {
+		res = bench_asr(ipsw, entries.largest_dmg, rounds);
+	}
+	if (res == 0) {
+		res = bench_bootability(ipsw, rounds);
+	}
+	if (res == 0) {
+		res = bench_extract(ipsw, &entries, rounds);
+	}
+	if (res == 0 && entries.kernelcache) {
+		res = bench_stitch(ipsw, entries.kernelcache, rounds);
+	}
+	printf("%-14s %9.1f MB\n", "peak RSS", (double)bench_peak_rss() / 1048576.0);
+
+	bench_entries_free(&entries);
+	ipsw_close(ipsw);
+	if (synthetic[0]) {
+		remove(synthetic);
+	}
+
+	return (res == 0) ? 0 : 1;
+}
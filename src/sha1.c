@@ -16,6 +16,9 @@ A million repetitions of "a"
 
 #define SHA1HANDSOFF
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 
@@ -23,6 +26,14 @@ A million repetitions of "a"
 #include <stdint.h>
 
 #include "sha1.h"
+#include "sha_hw.h"
+
+#ifdef HAVE_SHA_X86_INTRINSICS
+#include <immintrin.h>
+#endif
+#ifdef HAVE_SHA1_ARMV8_INTRINSICS
+#include <arm_neon.h>
+#endif
 
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -176,6 +187,305 @@ void SHA1Transform(
 }
 
 
+/* Hash consecutive blocks, the implementation is picked at runtime */
+
+typedef void (*sha1_blocks_func)(uint32_t state[5], const unsigned char *data, size_t blocks);
+
+static void sha1_blocks_generic(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    while (blocks--)
+    {
+        SHA1Transform(state, data);
+        data += 64;
+    }
+}
+
+#ifdef HAVE_SHA_X86_INTRINSICS
+/* Based on the public domain SHA-NI sample code by Intel and Jeffrey Walton */
+
+#define SHA1_X86_LOAD(m, i) \
+    m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * (i))), mask);
+
+/* four rounds without message schedule updates */
+#define SHA1_X86_ROUNDS(e_in, e_out, m, f) \
+    e_in = _mm_sha1nexte_epu32(e_in, m); \
+    e_out = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_in, f);
+
+SHA_HW_TARGET_X86_SHA
+static void sha1_blocks_x86(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i m0, m1, m2, m3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    while (blocks--)
+    {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        /* rounds 0-3 */
+        SHA1_X86_LOAD(m0, 0);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        /* rounds 4-7 */
+        SHA1_X86_LOAD(m1, 1);
+        SHA1_X86_ROUNDS(e1, e0, m1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        /* rounds 8-11 */
+        SHA1_X86_LOAD(m2, 2);
+        SHA1_X86_ROUNDS(e0, e1, m2, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        /* rounds 12-15 */
+        SHA1_X86_LOAD(m3, 3);
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        /* rounds 16-67, the message schedule runs alongside */
+#define SHA1_X86_STEP(e_in, e_out, ma, mb, mc, md, f) \
+        e_in = _mm_sha1nexte_epu32(e_in, ma); \
+        e_out = abcd; \
+        mb = _mm_sha1msg2_epu32(mb, ma); \
+        abcd = _mm_sha1rnds4_epu32(abcd, e_in, f); \
+        md = _mm_sha1msg1_epu32(md, ma); \
+        mc = _mm_xor_si128(mc, ma);
+
+        SHA1_X86_STEP(e0, e1, m0, m1, m2, m3, 0);
+        SHA1_X86_STEP(e1, e0, m1, m2, m3, m0, 1);
+        SHA1_X86_STEP(e0, e1, m2, m3, m0, m1, 1);
+        SHA1_X86_STEP(e1, e0, m3, m0, m1, m2, 1);
+        SHA1_X86_STEP(e0, e1, m0, m1, m2, m3, 1);
+        SHA1_X86_STEP(e1, e0, m1, m2, m3, m0, 1);
+        SHA1_X86_STEP(e0, e1, m2, m3, m0, m1, 2);
+        SHA1_X86_STEP(e1, e0, m3, m0, m1, m2, 2);
+        SHA1_X86_STEP(e0, e1, m0, m1, m2, m3, 2);
+        SHA1_X86_STEP(e1, e0, m1, m2, m3, m0, 2);
+        SHA1_X86_STEP(e0, e1, m2, m3, m0, m1, 2);
+        SHA1_X86_STEP(e1, e0, m3, m0, m1, m2, 3);
+        SHA1_X86_STEP(e0, e1, m0, m1, m2, m3, 3);
+#undef SHA1_X86_STEP
+
+        /* rounds 68-71 */
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        m3 = _mm_xor_si128(m3, m1);
+
+        /* rounds 72-75 */
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        /* rounds 76-79 */
+        SHA1_X86_ROUNDS(e1, e0, m3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i *)state, abcd);
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#undef SHA1_X86_LOAD
+#undef SHA1_X86_ROUNDS
+#endif
+
+#ifdef HAVE_SHA1_ARMV8_INTRINSICS
+/* four rounds, computing k+w for two groups ahead; su1 finishes the words
+   needed three groups ahead and su0 starts the ones four groups ahead */
+#define SHA1_ARM_ROUNDS(op, e_in, e_out, t, mnext, knext) \
+    e_out = vsha1h_u32(vgetq_lane_u32(abcd, 0)); \
+    abcd = op(abcd, e_in, t); \
+    t = vaddq_u32(mnext, vdupq_n_u32(knext));
+#define SHA1_ARM_SU0(ma, mb, mc) ma = vsha1su0q_u32(ma, mb, mc);
+#define SHA1_ARM_SU1(ma, mb) ma = vsha1su1q_u32(ma, mb);
+
+SHA_HW_TARGET_ARMV8_SHA1
+static void sha1_blocks_armv8(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    const uint32_t k0 = 0x5A827999, k1 = 0x6ED9EBA1, k2 = 0x8F1BBCDC, k3 = 0xCA62C1D6;
+    uint32x4_t abcd, abcd_save, t0, t1;
+    uint32x4_t m0, m1, m2, m3;
+    uint32_t e0, e0_save, e1;
+
+    abcd = vld1q_u32(state);
+    e0 = state[4];
+
+    while (blocks--)
+    {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+        m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+        m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+        m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+        t0 = vaddq_u32(m0, vdupq_n_u32(k0));
+        t1 = vaddq_u32(m1, vdupq_n_u32(k0));
+
+        /* rounds 0-19 */
+        SHA1_ARM_ROUNDS(vsha1cq_u32, e0, e1, t0, m2, k0);
+        SHA1_ARM_SU0(m0, m1, m2);
+        SHA1_ARM_ROUNDS(vsha1cq_u32, e1, e0, t1, m3, k0);
+        SHA1_ARM_SU1(m0, m3); SHA1_ARM_SU0(m1, m2, m3);
+        SHA1_ARM_ROUNDS(vsha1cq_u32, e0, e1, t0, m0, k0);
+        SHA1_ARM_SU1(m1, m0); SHA1_ARM_SU0(m2, m3, m0);
+        SHA1_ARM_ROUNDS(vsha1cq_u32, e1, e0, t1, m1, k1);
+        SHA1_ARM_SU1(m2, m1); SHA1_ARM_SU0(m3, m0, m1);
+        SHA1_ARM_ROUNDS(vsha1cq_u32, e0, e1, t0, m2, k1);
+        SHA1_ARM_SU1(m3, m2); SHA1_ARM_SU0(m0, m1, m2);
+
+        /* rounds 20-39 */
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e1, e0, t1, m3, k1);
+        SHA1_ARM_SU1(m0, m3); SHA1_ARM_SU0(m1, m2, m3);
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e0, e1, t0, m0, k1);
+        SHA1_ARM_SU1(m1, m0); SHA1_ARM_SU0(m2, m3, m0);
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e1, e0, t1, m1, k1);
+        SHA1_ARM_SU1(m2, m1); SHA1_ARM_SU0(m3, m0, m1);
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e0, e1, t0, m2, k2);
+        SHA1_ARM_SU1(m3, m2); SHA1_ARM_SU0(m0, m1, m2);
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e1, e0, t1, m3, k2);
+        SHA1_ARM_SU1(m0, m3); SHA1_ARM_SU0(m1, m2, m3);
+
+        /* rounds 40-59 */
+        SHA1_ARM_ROUNDS(vsha1mq_u32, e0, e1, t0, m0, k2);
+        SHA1_ARM_SU1(m1, m0); SHA1_ARM_SU0(m2, m3, m0);
+        SHA1_ARM_ROUNDS(vsha1mq_u32, e1, e0, t1, m1, k2);
+        SHA1_ARM_SU1(m2, m1); SHA1_ARM_SU0(m3, m0, m1);
+        SHA1_ARM_ROUNDS(vsha1mq_u32, e0, e1, t0, m2, k2);
+        SHA1_ARM_SU1(m3, m2); SHA1_ARM_SU0(m0, m1, m2);
+        SHA1_ARM_ROUNDS(vsha1mq_u32, e1, e0, t1, m3, k3);
+        SHA1_ARM_SU1(m0, m3); SHA1_ARM_SU0(m1, m2, m3);
+        SHA1_ARM_ROUNDS(vsha1mq_u32, e0, e1, t0, m0, k3);
+        SHA1_ARM_SU1(m1, m0); SHA1_ARM_SU0(m2, m3, m0);
+
+        /* rounds 60-79 */
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e1, e0, t1, m1, k3);
+        SHA1_ARM_SU1(m2, m1); SHA1_ARM_SU0(m3, m0, m1);
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e0, e1, t0, m2, k3);
+        SHA1_ARM_SU1(m3, m2);
+        SHA1_ARM_ROUNDS(vsha1pq_u32, e1, e0, t1, m3, k3);
+        e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+        abcd = vsha1pq_u32(abcd, e0, t0);
+        e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+        abcd = vsha1pq_u32(abcd, e1, t1);
+
+        e0 += e0_save;
+        abcd = vaddq_u32(abcd_save, abcd);
+
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+#undef SHA1_ARM_ROUNDS
+#undef SHA1_ARM_SU0
+#undef SHA1_ARM_SU1
+#endif
+
+static const struct {
+    const char *name;
+    unsigned int features;
+    sha1_blocks_func blocks;
+} sha1_backends[] = {
+#ifdef HAVE_SHA_X86_INTRINSICS
+    { "x86-sha", SHA_HW_X86_SHA, sha1_blocks_x86 },
+#endif
+#ifdef HAVE_SHA1_ARMV8_INTRINSICS
+    { "armv8-sha1", SHA_HW_ARMV8_SHA1, sha1_blocks_armv8 },
+#endif
+    { "generic", 0, sha1_blocks_generic },
+    { NULL, 0, NULL }
+};
+
+static volatile int sha1_backend = -1;
+
+static sha1_blocks_func sha1_blocks_get(void)
+{
+    if (sha1_backend < 0)
+    {
+        /* backends are ordered by preference, the generic one always works */
+        unsigned int features = sha_hw_features();
+        int i;
+        for (i = 0; sha1_backends[i].name; i++)
+        {
+            if ((sha1_backends[i].features & features) == sha1_backends[i].features)
+                break;
+        }
+        sha1_backend = i;
+    }
+    return sha1_backends[sha1_backend].blocks;
+}
+
+const char *SHA1GetBackend(
+    int index
+)
+{
+    int i;
+    for (i = 0; sha1_backends[i].name; i++)
+    {
+        if (i == index)
+            return sha1_backends[i].name;
+    }
+    if (index < 0)
+    {
+        sha1_blocks_get();
+        return sha1_backends[sha1_backend].name;
+    }
+    return NULL;
+}
+
+int SHA1SetBackend(
+    const char *name
+)
+{
+    unsigned int features = sha_hw_features();
+    int i;
+    for (i = 0; sha1_backends[i].name; i++)
+    {
+        if (strcmp(sha1_backends[i].name, name) == 0)
+        {
+            if ((sha1_backends[i].features & features) != sha1_backends[i].features)
+                return -1;
+            sha1_backend = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
 /* SHA1Init - Initialize new context */
 
 void SHA1Init(
@@ -213,9 +523,11 @@ void SHA1Update(
     {
         memcpy(&context->buffer[j], data, (i = 64 - j));
         SHA1Transform(context->state, context->buffer);
-        for (; i + 63 < len; i += 64)
+        if (i + 63 < len)
         {
-            SHA1Transform(context->state, &data[i]);
+            size_t blocks = (len - i) / 64;
+            sha1_blocks_get()(context->state, &data[i], blocks);
+            i += blocks * 64;
         }
         j = 0;
     }
@@ -285,10 +597,8 @@ void SHA1(
 )
 {
     SHA1_CTX ctx;
-    size_t ii;
 
     SHA1Init(&ctx);
-    for (ii=0; ii<len; ii+=1)
-        SHA1Update(&ctx, str + ii, 1);
+    SHA1Update(&ctx, str, len);
     SHA1Final(hash_out, &ctx);
 }
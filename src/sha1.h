@@ -41,4 +41,15 @@ void SHA1(
     size_t len,
     unsigned char *hash_out);
 
+/* Name of the block function backend with the given index, or of the one
+   in use if index is negative. Returns NULL past the last backend. */
+const char *SHA1GetBackend(
+    int index
+    );
+
+/* Returns -1 if the backend is unknown or not supported by this CPU */
+int SHA1SetBackend(
+    const char *name
+    );
+
 #endif /* SHA1_H */
@@ -9,8 +9,18 @@
  * Tom St Denis, tomstdenis@gmail.com, http://libtom.org
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+
 #include "fixedint.h"
 #include "sha512.h"
+#include "sha_hw.h"
+
+#ifdef HAVE_SHA512_ARMV8_INTRINSICS
+#include <arm_neon.h>
+#endif
 
 /* the K array */
 static const uint64_t K[80] = {
@@ -88,14 +98,14 @@ static const uint64_t K[80] = {
 #endif
 
 /* compress 1024-bits */
-static int sha512_compress(sha512_context *md, unsigned char *buf)
+static void sha512_compress_generic(uint64_t state[8], const unsigned char *buf)
 {
     uint64_t S[8], W[80], t0, t1;
     int i;
 
     /* copy state into S */
     for (i = 0; i < 8; i++) {
-        S[i] = md->state[i];
+        S[i] = state[i];
     }
 
     /* copy the state into 1024-bits into W[0..15] */
@@ -132,9 +142,162 @@ static int sha512_compress(sha512_context *md, unsigned char *buf)
 
     /* feedback */
    for (i = 0; i < 8; i++) {
-        md->state[i] = md->state[i] + S[i];
+        state[i] = state[i] + S[i];
     }
+}
+
+typedef void (*sha512_blocks_func)(uint64_t state[8], const unsigned char *in, size_t blocks);
+
+static void sha512_blocks_generic(uint64_t state[8], const unsigned char *in, size_t blocks)
+{
+    while (blocks--) {
+        sha512_compress_generic(state, in);
+        in += 128;
+    }
+}
+
+#ifdef HAVE_SHA512_ARMV8_INTRINSICS
+/* Two rounds per step with the state kept as ab/cd/ef/gh pairs. Each step
+   renames the pairs instead of moving them: afterwards cd is the old ab,
+   gh the old ef, and ab/ef hold the new values. */
+#define SHA512_ARM_STEP(ab, cd, ef, gh, m, k) \
+    mk = vaddq_u64(m, vld1q_u64(k)); \
+    t1 = vaddq_u64(vextq_u64(mk, mk, 1), gh); \
+    t0 = vsha512hq_u64(t1, vextq_u64(ef, gh, 1), vextq_u64(cd, ef, 1)); \
+    gh = vsha512h2q_u64(t0, cd, ab); \
+    cd = vaddq_u64(cd, t0);
+
+/* next message words for m, from the sixteen words ending right before it */
+#define SHA512_ARM_SCHEDULE(m0, m1, m4, m5, m7) \
+    m0 = vsha512su1q_u64(vsha512su0q_u64(m0, m1), m7, vextq_u64(m4, m5, 1));
+
+SHA_HW_TARGET_ARMV8_SHA512
+static void sha512_blocks_armv8(uint64_t state[8], const unsigned char *in, size_t blocks)
+{
+    uint64x2_t ab, cd, ef, gh, ab_save, cd_save, ef_save, gh_save;
+    uint64x2_t m0, m1, m2, m3, m4, m5, m6, m7, mk, t0, t1;
+    int i;
+
+    ab = vld1q_u64(&state[0]);
+    cd = vld1q_u64(&state[2]);
+    ef = vld1q_u64(&state[4]);
+    gh = vld1q_u64(&state[6]);
+
+    while (blocks--) {
+        ab_save = ab; cd_save = cd; ef_save = ef; gh_save = gh;
+
+        m0 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in)));
+        m1 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 16)));
+        m2 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 32)));
+        m3 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 48)));
+        m4 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 64)));
+        m5 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 80)));
+        m6 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 96)));
+        m7 = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(in + 112)));
+
+        for (i = 0; i < 80; i += 16) {
+            /* after four steps the pairs are back in their original places */
+            SHA512_ARM_STEP(ab, cd, ef, gh, m0, &K[i]);
+            SHA512_ARM_STEP(gh, ab, cd, ef, m1, &K[i + 2]);
+            SHA512_ARM_STEP(ef, gh, ab, cd, m2, &K[i + 4]);
+            SHA512_ARM_STEP(cd, ef, gh, ab, m3, &K[i + 6]);
+            SHA512_ARM_STEP(ab, cd, ef, gh, m4, &K[i + 8]);
+            SHA512_ARM_STEP(gh, ab, cd, ef, m5, &K[i + 10]);
+            SHA512_ARM_STEP(ef, gh, ab, cd, m6, &K[i + 12]);
+            SHA512_ARM_STEP(cd, ef, gh, ab, m7, &K[i + 14]);
+            if (i < 64) {
+                SHA512_ARM_SCHEDULE(m0, m1, m4, m5, m7);
+                SHA512_ARM_SCHEDULE(m1, m2, m5, m6, m0);
+                SHA512_ARM_SCHEDULE(m2, m3, m6, m7, m1);
+                SHA512_ARM_SCHEDULE(m3, m4, m7, m0, m2);
+                SHA512_ARM_SCHEDULE(m4, m5, m0, m1, m3);
+                SHA512_ARM_SCHEDULE(m5, m6, m1, m2, m4);
+                SHA512_ARM_SCHEDULE(m6, m7, m2, m3, m5);
+                SHA512_ARM_SCHEDULE(m7, m0, m3, m4, m6);
+            }
+        }
+
+        ab = vaddq_u64(ab, ab_save);
+        cd = vaddq_u64(cd, cd_save);
+        ef = vaddq_u64(ef, ef_save);
+        gh = vaddq_u64(gh, gh_save);
+
+        in += 128;
+    }
+
+    vst1q_u64(&state[0], ab);
+    vst1q_u64(&state[2], cd);
+    vst1q_u64(&state[4], ef);
+    vst1q_u64(&state[6], gh);
+}
+#undef SHA512_ARM_STEP
+#undef SHA512_ARM_SCHEDULE
+#endif
+
+static const struct {
+    const char *name;
+    unsigned int features;
+    sha512_blocks_func blocks;
+} sha512_backends[] = {
+#ifdef HAVE_SHA512_ARMV8_INTRINSICS
+    { "armv8-sha512", SHA_HW_ARMV8_SHA512, sha512_blocks_armv8 },
+#endif
+    { "generic", 0, sha512_blocks_generic },
+    { NULL, 0, NULL }
+};
+
+static volatile int sha512_backend = -1;
 
+static sha512_blocks_func sha512_blocks_get(void)
+{
+    if (sha512_backend < 0) {
+        /* backends are ordered by preference, the generic one always works */
+        unsigned int features = sha_hw_features();
+        int i;
+        for (i = 0; sha512_backends[i].name; i++) {
+            if ((sha512_backends[i].features & features) == sha512_backends[i].features) {
+                break;
+            }
+        }
+        sha512_backend = i;
+    }
+    return sha512_backends[sha512_backend].blocks;
+}
+
+const char *sha512_get_backend(int index)
+{
+    int i;
+    for (i = 0; sha512_backends[i].name; i++) {
+        if (i == index) {
+            return sha512_backends[i].name;
+        }
+    }
+    if (index < 0) {
+        sha512_blocks_get();
+        return sha512_backends[sha512_backend].name;
+    }
+    return NULL;
+}
+
+int sha512_set_backend(const char *name)
+{
+    unsigned int features = sha_hw_features();
+    int i;
+    for (i = 0; sha512_backends[i].name; i++) {
+        if (strcmp(sha512_backends[i].name, name) == 0) {
+            if ((sha512_backends[i].features & features) != sha512_backends[i].features) {
+                return -1;
+            }
+            sha512_backend = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int sha512_compress(sha512_context *md, const unsigned char *buf)
+{
+    sha512_blocks_get()(md->state, buf, 1);
     return 0;
 }
 
@@ -172,7 +335,6 @@ int sha512_init(sha512_context * md) {
 int sha512_update (sha512_context * md, const unsigned char *in, size_t inlen)
 {
     size_t n;
-    size_t i;
     int           err;
     if (md == NULL) return 1;
     if (in == NULL) return 1;
@@ -181,20 +343,14 @@ int sha512_update (sha512_context * md, const unsigned char *in, size_t inlen)
     }
     while (inlen > 0) {
         if (md->curlen == 0 && inlen >= 128) {
-           if ((err = sha512_compress (md, (unsigned char *)in)) != 0) {
-              return err;
-           }
-           md->length += 128 * 8;
-           in             += 128;
-           inlen          -= 128;
+           size_t blocks = inlen / 128;
+           sha512_blocks_get()(md->state, in, blocks);
+           md->length += blocks * 128 * 8;
+           in             += blocks * 128;
+           inlen          -= blocks * 128;
         } else {
            n = MIN(inlen, (128 - md->curlen));
-
-           for (i = 0; i < n; i++) {
-            md->buf[i + md->curlen] = in[i];
-           }
-
-
+           memcpy(md->buf + md->curlen, in, n);
            md->curlen += n;
            in             += n;
            inlen          -= n;
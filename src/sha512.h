@@ -20,6 +20,12 @@ int sha512_final(sha512_context * md, unsigned char *out);
 int sha512_update(sha512_context * md, const unsigned char *in, size_t inlen);
 int sha512(const unsigned char *message, size_t message_len, unsigned char *out);
 
+/* Name of the compression backend with the given index, or of the one in
+   use if index is negative. Returns NULL past the last backend. */
+const char *sha512_get_backend(int index);
+/* Returns -1 if the backend is unknown or not supported by this CPU */
+int sha512_set_backend(const char *name);
+
 typedef sha512_context sha384_context;
 
 #define SHA384_DIGEST_LENGTH 48
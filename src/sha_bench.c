@@ -0,0 +1,117 @@
+/*
+ * sha_bench.c
+ * Throughput of the internal SHA backends
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "sha1.h"
+#include "sha512.h"
+
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_ROUNDS 4
+
+static double bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench_sha1(const unsigned char* data, size_t size, unsigned char* digest)
+{
+	SHA1_CTX ctx;
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, data, size);
+	SHA1Final(digest, &ctx);
+}
+
+static void bench_sha384(const unsigned char* data, size_t size, unsigned char* digest)
+{
+	sha384(data, size, digest);
+}
+
+static int bench_run(const char* algo, const char* backend, void (*hash)(const unsigned char*, size_t, unsigned char*), size_t dlen, const unsigned char* data, unsigned char* reference)
+{
+	unsigned char digest[64];
+	double best = 0;
+	int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		double start = bench_now();
+		hash(data, BENCH_SIZE, digest);
+		double elapsed = bench_now() - start;
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	/* the first backend is the reference for the others */
+	int ok = 1;
+	if (reference[0] == 0 && reference[1] == 0) {
+		memcpy(reference, digest, dlen);
+	} else {
+		ok = (memcmp(reference, digest, dlen) == 0);
+	}
+	printf("%-7s %-14s %6.2f GB/s%s\n", algo, backend, (double)BENCH_SIZE / best / 1e9, ok ? "" : "  DIGEST MISMATCH");
+	return ok ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned char reference[64];
+	const char* name;
+	int res = 0;
+	int i;
+
+	unsigned char* data = (unsigned char*)malloc(BENCH_SIZE);
+	if (!data) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < BENCH_SIZE; i++) {
+		data[i] = (unsigned char)(i * 2654435761u >> 13);
+	}
+
+	memset(reference, 0, sizeof(reference));
+	for (i = 0; (name = SHA1GetBackend(i)) != NULL; i++) {
+		if (SHA1SetBackend(name) < 0) {
+			printf("%-7s %-14s not supported by this CPU\n", "SHA1", name);
+			continue;
+		}
+		res |= bench_run("SHA1", name, bench_sha1, 20, data, reference);
+	}
+
+	memset(reference, 0, sizeof(reference));
+	for (i = 0; (name = sha512_get_backend(i)) != NULL; i++) {
+		if (sha512_set_backend(name) < 0) {
+			printf("%-7s %-14s not supported by this CPU\n", "SHA384", name);
+			continue;
+		}
+		res |= bench_run("SHA384", name, bench_sha384, 48, data, reference);
+	}
+
+	free(data);
+	return (res == 0) ? 0 : 1;
+}
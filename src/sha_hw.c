@@ -0,0 +1,89 @@
+/*
+ * sha_hw.c
+ * CPU feature detection for the internal SHA implementation
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__)
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__)
+#if defined(__linux__)
+#include <sys/auxv.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#elif defined(WIN32)
+#include <windows.h>
+#endif
+#endif
+
+#include "sha_hw.h"
+
+static unsigned int sha_hw_detect(void)
+{
+	unsigned int features = 0;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		/* the SHA-NI code also needs SSSE3 (bit 9) and SSE4.1 (bit 19) */
+		int sse = ((ecx & (1 << 9)) && (ecx & (1 << 19)));
+		if (sse && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29))) {
+			features |= SHA_HW_X86_SHA;
+		}
+	}
+#elif defined(__aarch64__)
+#if defined(__linux__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	/* HWCAP_SHA1 and HWCAP_SHA512 from asm/hwcap.h */
+	if (hwcap & (1 << 5)) {
+		features |= SHA_HW_ARMV8_SHA1;
+	}
+	if (hwcap & (1 << 21)) {
+		features |= SHA_HW_ARMV8_SHA512;
+	}
+#elif defined(__APPLE__)
+	int val = 0;
+	size_t len = sizeof(val);
+	/* every arm64 Mac has the SHA1 instructions */
+	features |= SHA_HW_ARMV8_SHA1;
+	if (sysctlbyname("hw.optional.arm.FEAT_SHA512", &val, &len, NULL, 0) == 0 && val) {
+		features |= SHA_HW_ARMV8_SHA512;
+	}
+#elif defined(WIN32)
+	if (IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE)) {
+		features |= SHA_HW_ARMV8_SHA1;
+	}
+#endif
+#endif
+	return features;
+}
+
+unsigned int sha_hw_features(void)
+{
+	/* detection has no side effects, so racing threads just do it twice */
+	static volatile int features = -1;
+	if (features < 0) {
+		features = (int)sha_hw_detect();
+	}
+	return (unsigned int)features;
+}
@@ -0,0 +1,51 @@
+/*
+ * sha_hw.h
+ * CPU feature detection for the internal SHA implementation (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_SHA_HW_H
+#define IDEVICERESTORE_SHA_HW_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHA_HW_X86_SHA		(1 << 0)
+#define SHA_HW_ARMV8_SHA1	(1 << 1)
+#define SHA_HW_ARMV8_SHA512	(1 << 2)
+
+/* The hardware implementations are only compiled in if configure found
+ * that the compiler accepts these target attributes. */
+#define SHA_HW_TARGET_X86_SHA __attribute__((target("sha,sse4.1,ssse3")))
+#ifdef __clang__
+#define SHA_HW_TARGET_ARMV8_SHA1 __attribute__((target("crypto")))
+#define SHA_HW_TARGET_ARMV8_SHA512 __attribute__((target("sha3")))
+#else
+#define SHA_HW_TARGET_ARMV8_SHA1 __attribute__((target("+crypto")))
+#define SHA_HW_TARGET_ARMV8_SHA512 __attribute__((target("+sha3")))
+#endif
+
+/* Returns the SHA_HW_* instructions the CPU we're running on supports */
+unsigned int sha_hw_features(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
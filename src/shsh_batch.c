@@ -0,0 +1,547 @@
+/*
+ * shsh_batch.c
+ * Saves SHSH blobs for many devices and builds without the devices attached
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include "sha1.h"
+#include "sha512.h"
+#define SHA384 sha384
+#endif
+
+#include "tss.h"
+#include "common.h"
+#include "shsh_batch.h"
+#include "idevicerestore.h"
+#include "build_manifest.h"
+
+/* used for devices that come without a generator or ApNonce */
+#define SHSH_BATCH_DEFAULT_GENERATOR 0x1111111111111111ULL
+
+struct shsh_batch_device {
+	uint64_t ecid;
+	char* product_type;
+	char* board;
+	uint64_t generator;
+	int have_generator;
+	unsigned char nonce[64];
+	unsigned int nonce_size;
+};
+
+struct shsh_batch_build {
+	build_manifest_t manifest;
+	char* version;
+};
+
+struct shsh_batch_ctx {
+	struct shsh_batch_device* devices;
+	int num_devices;
+	struct shsh_batch_build* builds;
+	int num_builds;
+	const char* shsh_dir;
+	const char* tss_url;
+	/* the next (device, build) pair to look at */
+	int next_device;
+	int next_build;
+	int saved;
+	int skipped;
+	int failed;
+	mutex_t mutex;
+};
+
+static int shsh_batch_parse_hex(const char* str, unsigned char* buf, unsigned int bufsize, unsigned int* size)
+{
+	if (!strncmp(str, "0x", 2) || !strncmp(str, "0X", 2)) {
+		str += 2;
+	}
+	size_t len = strlen(str);
+	if (len == 0 || (len & 1) || len / 2 > bufsize) {
+		return -1;
+	}
+	unsigned int i;
+	for (i = 0; i < len / 2; i++) {
+		char byte[3] = { str[i*2], str[i*2+1], '\0' };
+		if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1])) {
+			return -1;
+		}
+		buf[i] = (unsigned char)strtoul(byte, NULL, 16);
+	}
+	*size = (unsigned int)(len / 2);
+	return 0;
+}
+
+static int shsh_batch_parse_line(char* line, struct shsh_batch_device* device)
+{
+	char* fields[5] = { NULL, NULL, NULL, NULL, NULL };
+	int num_fields = 0;
+	char* p = line;
+	char* field = NULL;
+
+	char* comment = strchr(line, '#');
+	if (comment) {
+		*comment = '\0';
+	}
+	while ((field = strsep(&p, " \t\r\n")) != NULL) {
+		if (*field == '\0') {
+			continue;
+		}
+		if (num_fields == 5) {
+			return -1;
+		}
+		fields[num_fields++] = field;
+	}
+	if (num_fields == 0) {
+		return 0;
+	}
+	if (num_fields < 3) {
+		return -1;
+	}
+
+	memset(device, '\0', sizeof(struct shsh_batch_device));
+	char* tail = NULL;
+	device->ecid = strtoull(fields[0], &tail, 0);
+	if (device->ecid == 0 || (tail && *tail != '\0')) {
+		return -1;
+	}
+	if (num_fields > 3) {
+		device->generator = strtoull(fields[3], &tail, 0);
+		if (tail && *tail != '\0') {
+			return -1;
+		}
+		device->have_generator = 1;
+	}
+	if (num_fields > 4 && shsh_batch_parse_hex(fields[4], device->nonce, sizeof(device->nonce), &device->nonce_size) < 0) {
+		return -1;
+	}
+	device->product_type = strdup(fields[1]);
+	device->board = strdup(fields[2]);
+	if (!device->product_type || !device->board) {
+		free(device->product_type);
+		free(device->board);
+		return -1;
+	}
+	return 1;
+}
+
+static int shsh_batch_load_devices(struct shsh_batch_ctx* ctx, const char* devices_file)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	if (read_file(devices_file, (void**)&buf, &len) != 0) {
+		return -1;
+	}
+	char* bufz = (char*)realloc(buf, len + 1);
+	if (!bufz) {
+		free(buf);
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	buf = bufz;
+	buf[len] = '\0';
+
+	int res = 0;
+	int lineno = 0;
+	char* p = buf;
+	char* line = NULL;
+	while ((line = strsep(&p, "\n")) != NULL) {
+		struct shsh_batch_device device;
+		lineno++;
+		int ret = shsh_batch_parse_line(line, &device);
+		if (ret == 0) {
+			continue;
+		}
+		if (ret < 0) {
+			error("ERROR: %s:%d: expected ECID PRODUCT_TYPE BOARD_CONFIG [GENERATOR [APNONCE]]\n", devices_file, lineno);
+			res = -1;
+			break;
+		}
+		struct shsh_batch_device* devices = (struct shsh_batch_device*)realloc(ctx->devices, sizeof(struct shsh_batch_device) * (ctx->num_devices + 1));
+		if (!devices) {
+			free(device.product_type);
+			free(device.board);
+			error("ERROR: Out of memory\n");
+			res = -1;
+			break;
+		}
+		ctx->devices = devices;
+		ctx->devices[ctx->num_devices++] = device;
+	}
+	free(buf);
+	return res;
+}
+
+static int shsh_batch_load_builds(struct shsh_batch_ctx* ctx, char* const* manifests, int num_manifests)
+{
+	ctx->builds = (struct shsh_batch_build*)calloc(num_manifests, sizeof(struct shsh_batch_build));
+	if (!ctx->builds) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	int i;
+	for (i = 0; i < num_manifests; i++) {
+		char* buf = NULL;
+		size_t len = 0;
+		if (read_file(manifests[i], (void**)&buf, &len) != 0) {
+			return -1;
+		}
+		plist_t plist = NULL;
+		plist_from_memory(buf, len, &plist);
+		free(buf);
+		if (!plist || plist_get_node_type(plist) != PLIST_DICT) {
+			error("ERROR: %s is not a BuildManifest\n", manifests[i]);
+			plist_free(plist);
+			return -1;
+		}
+		plist_t node = plist_dict_get_item(plist, "ProductVersion");
+		if (!node || plist_get_node_type(node) != PLIST_STRING) {
+			error("ERROR: Unable to find ProductVersion in %s\n", manifests[i]);
+			plist_free(plist);
+			return -1;
+		}
+		struct shsh_batch_build* build = &ctx->builds[ctx->num_builds];
+		plist_get_string_val(node, &build->version);
+		build->manifest = build_manifest_new(plist, 1);
+		if (!build->manifest) {
+			free(build->version);
+			build->version = NULL;
+			return -1;
+		}
+		ctx->num_builds++;
+	}
+	return 0;
+}
+
+static uint64_t shsh_batch_identity_uint(plist_t build_identity, const char* key)
+{
+	plist_t node = plist_dict_get_item(build_identity, key);
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		const char* str = plist_get_string_ptr(node, NULL);
+		return (str) ? strtoull(str, NULL, 0) : 0;
+	}
+	return _plist_dict_get_uint(build_identity, key);
+}
+
+/* returns 1 if the ApNonce is derived from a generator, which is stored in *generator */
+static int shsh_batch_nonce_generator(struct shsh_batch_device* device, int image4, uint64_t* generator)
+{
+	if (device->nonce_size > 0 || !image4) {
+		return 0;
+	}
+	*generator = (device->have_generator) ? device->generator : SHSH_BATCH_DEFAULT_GENERATOR;
+	return 1;
+}
+
+/* the request is serialized from the build's request template where possible */
+static char* shsh_batch_request_new(struct shsh_batch_device* device, plist_t build_identity, int image4, uint32_t* size)
+{
+	plist_t request = NULL;
+	char* xml = NULL;
+	plist_t parameters = plist_new_dict();
+	plist_dict_set_item(parameters, "ApECID", plist_new_uint(device->ecid));
+
+	unsigned char nonce[64];
+	unsigned int nonce_size = device->nonce_size;
+	uint64_t generator = 0;
+	if (nonce_size > 0) {
+		memcpy(nonce, device->nonce, nonce_size);
+	} else if (shsh_batch_nonce_generator(device, image4, &generator)) {
+		/* the ApNonce is the hash of the generator, SHA384 truncated to 32 bytes on A12 and later */
+		unsigned char gen[8];
+		unsigned char hash[48];
+		int i;
+		for (i = 0; i < 8; i++) {
+			gen[i] = (unsigned char)(generator >> (i * 8));
+		}
+		if (shsh_batch_identity_uint(build_identity, "ApChipID") >= 0x8020) {
+			SHA384(gen, sizeof(gen), hash);
+			nonce_size = 32;
+		} else {
+			SHA1(gen, sizeof(gen), hash);
+			nonce_size = 20;
+		}
+		memcpy(nonce, hash, nonce_size);
+	}
+	if (nonce_size > 0) {
+		plist_dict_set_item(parameters, "ApNonce", plist_new_data((const char*)nonce, nonce_size));
+	}
+
+	plist_dict_set_item(parameters, "ApProductionMode", plist_new_bool(1));
+	if (image4) {
+		plist_dict_set_item(parameters, "ApSecurityMode", plist_new_bool(1));
+		plist_dict_set_item(parameters, "ApSupportsImg4", plist_new_bool(1));
+	} else {
+		plist_dict_set_item(parameters, "ApSupportsImg4", plist_new_bool(0));
+	}
+
+	unsigned int template_flags = TSS_TEMPLATE_PRODUCTION_MODE;
+	if (image4) {
+		template_flags |= TSS_TEMPLATE_IMG4 | TSS_TEMPLATE_SECURITY_MODE;
+	}
+	tss_request_template_t tmpl = tss_request_template_get(build_identity, template_flags);
+	if (tmpl) {
+		xml = tss_request_template_to_xml(tmpl, parameters, size);
+		if (!xml) {
+			error("ERROR: Unable to create TSS request for %" PRIu64 "\n", device->ecid);
+		}
+		plist_free(parameters);
+		return xml;
+	}
+
+	tss_parameters_add_from_manifest(parameters, build_identity);
+
+	request = tss_request_new(NULL);
+	if (!request) {
+		error("ERROR: Unable to create TSS request\n");
+		plist_free(parameters);
+		return NULL;
+	}
+	if (tss_request_add_common_tags(request, parameters, NULL) < 0
+	    || tss_request_add_ap_tags(request, parameters, NULL) < 0
+	    || ((image4) ? tss_request_add_ap_img4_tags(request, parameters) : tss_request_add_ap_img3_tags(request, parameters)) < 0) {
+		error("ERROR: Unable to add tags to TSS request for %" PRIu64 "\n", device->ecid);
+	} else {
+		plist_to_xml(request, &xml, size);
+	}
+	plist_free(request);
+	plist_free(parameters);
+	return xml;
+}
+
+static int shsh_batch_write(const char* path, plist_t response, struct shsh_batch_device* device, int image4)
+{
+	/* the blob can only be used again with the generator its nonce came from */
+	uint64_t generator = 0;
+	if (shsh_batch_nonce_generator(device, image4, &generator)) {
+		char s_generator[24];
+		snprintf(s_generator, sizeof(s_generator), "0x%016" PRIx64, generator);
+		plist_dict_set_item(response, "generator", plist_new_string(s_generator));
+	}
+	char* bin = NULL;
+	uint32_t blen = 0;
+	plist_to_bin(response, &bin, &blen);
+	if (!bin) {
+		error("ERROR: could not get TSS record data\n");
+		return -1;
+	}
+
+	/* a blob that is there is complete, the batch can be interrupted any time */
+	size_t plen = strlen(path);
+	char* tmp = (char*)malloc(plen + 5);
+	if (!tmp) {
+		free(bin);
+		return -1;
+	}
+	memcpy(tmp, path, plen);
+	memcpy(tmp + plen, ".tmp", 5);
+	int res = -1;
+	gzFile zf = gzopen(tmp, "wb");
+	if (zf) {
+		res = (gzwrite(zf, bin, blen) == (int)blen) ? 0 : -1;
+		if (gzclose(zf) != Z_OK) {
+			res = -1;
+		}
+	}
+	free(bin);
+	if (res == 0) {
+		remove(path);
+		res = (rename(tmp, path) == 0) ? 0 : -1;
+	}
+	if (res < 0) {
+		error("ERROR: Unable to write %s\n", path);
+		remove(tmp);
+	}
+	free(tmp);
+	return res;
+}
+
+/* must be called with the mutex held, returns 0 when there is nothing left */
+static int shsh_batch_next(struct shsh_batch_ctx* ctx, struct shsh_batch_device** device, struct shsh_batch_build** build, plist_t* build_identity)
+{
+	while (ctx->next_device < ctx->num_devices) {
+		struct shsh_batch_device* d = &ctx->devices[ctx->next_device];
+		struct shsh_batch_build* b = &ctx->builds[ctx->next_build];
+		if (++ctx->next_build >= ctx->num_builds) {
+			ctx->next_build = 0;
+			ctx->next_device++;
+		}
+		if (build_manifest_check_compatibility(build_manifest_get_plist(b->manifest), d->product_type) < 0) {
+			continue;
+		}
+		plist_t identity = build_manifest_find_identity(b->manifest, d->board, RESTORE_VARIANT_ERASE_INSTALL);
+		if (!identity) {
+			identity = build_manifest_find_identity(b->manifest, d->board, NULL);
+		}
+		if (!identity) {
+			continue;
+		}
+		*device = d;
+		*build = b;
+		*build_identity = identity;
+		return 1;
+	}
+	return 0;
+}
+
+static void* shsh_batch_worker(void* arg)
+{
+	struct shsh_batch_ctx* ctx = (struct shsh_batch_ctx*)arg;
+	char path[1024];
+
+	while (1) {
+		struct shsh_batch_device* device = NULL;
+		struct shsh_batch_build* build = NULL;
+		plist_t build_identity = NULL;
+
+		mutex_lock(&ctx->mutex);
+		int more = shsh_batch_next(ctx, &device, &build, &build_identity);
+		mutex_unlock(&ctx->mutex);
+		if (!more) {
+			break;
+		}
+		idevicerestore_log_set_ecid(device->ecid);
+
+		snprintf(path, sizeof(path), "%s/%" PRIu64 "-%s-%s.shsh", ctx->shsh_dir, device->ecid, device->product_type, build->version);
+		struct stat fst;
+		if (stat(path, &fst) == 0) {
+			mutex_lock(&ctx->mutex);
+			ctx->skipped++;
+			mutex_unlock(&ctx->mutex);
+			continue;
+		}
+
+		/* everything but the oldest chips boot IMG4 */
+		uint64_t chip_id = shsh_batch_identity_uint(build_identity, "ApChipID");
+		int image4 = !(chip_id >= 0x8900 && chip_id < 0x8960);
+
+		int res = -1;
+		uint32_t request_size = 0;
+		char* request = shsh_batch_request_new(device, build_identity, image4, &request_size);
+		if (request) {
+			plist_t response = tss_request_send_xml(request, request_size, ctx->tss_url);
+			free(request);
+			if (response) {
+				res = shsh_batch_write(path, response, device, image4);
+				plist_free(response);
+			}
+		}
+
+		mutex_lock(&ctx->mutex);
+		if (res == 0) {
+			ctx->saved++;
+			info("SHSH saved to '%s'\n", path);
+		} else {
+			ctx->failed++;
+			error("ERROR: could not fetch TSS record for %" PRIu64 " (%s, %s)\n", device->ecid, device->product_type, build->version);
+		}
+		mutex_unlock(&ctx->mutex);
+	}
+	idevicerestore_log_set_ecid(0);
+	return NULL;
+}
+
+static void shsh_batch_free(struct shsh_batch_ctx* ctx)
+{
+	int i;
+	for (i = 0; i < ctx->num_devices; i++) {
+		free(ctx->devices[i].product_type);
+		free(ctx->devices[i].board);
+	}
+	free(ctx->devices);
+	for (i = 0; i < ctx->num_builds; i++) {
+		build_manifest_free(ctx->builds[i].manifest);
+		free(ctx->builds[i].version);
+	}
+	free(ctx->builds);
+	mutex_destroy(&ctx->mutex);
+}
+
+int shsh_batch_run(const char* devices_file, char* const* manifests, int num_manifests, const char* cache_dir, const char* tss_url, int concurrency)
+{
+	struct shsh_batch_ctx ctx;
+	char shsh_dir[1024];
+	int i;
+
+	if (!devices_file || !manifests || num_manifests <= 0) {
+		return -1;
+	}
+
+	memset(&ctx, '\0', sizeof(ctx));
+	mutex_init(&ctx.mutex);
+	ctx.tss_url = tss_url;
+	if (shsh_batch_load_devices(&ctx, devices_file) < 0 || shsh_batch_load_builds(&ctx, manifests, num_manifests) < 0) {
+		shsh_batch_free(&ctx);
+		return -1;
+	}
+	if (ctx.num_devices == 0) {
+		error("ERROR: No devices listed in %s\n", devices_file);
+		shsh_batch_free(&ctx);
+		return -1;
+	}
+
+	snprintf(shsh_dir, sizeof(shsh_dir), "%s/shsh", (cache_dir) ? cache_dir : ".");
+	mkdir_with_parents(shsh_dir, 0755);
+	ctx.shsh_dir = shsh_dir;
+	if (cache_dir) {
+		char health_file[1024];
+		snprintf(health_file, sizeof(health_file), "%s/tss_health.plist", cache_dir);
+		tss_set_health_file(health_file);
+	}
+
+	info("Saving SHSH blobs for %d devices and %d builds\n", ctx.num_devices, ctx.num_builds);
+
+	/* the requests only wait for the TSS server, so the workers don't scale with the CPU count */
+	if (concurrency <= 0) {
+		concurrency = SHSH_BATCH_DEFAULT_CONCURRENCY;
+	}
+	idevicerestore_log_set_async(1);
+	THREAD_T* workers = (THREAD_T*)calloc(concurrency, sizeof(THREAD_T));
+	int started = 0;
+	while (workers && started < concurrency && thread_new(&workers[started], shsh_batch_worker, &ctx) == 0) {
+		started++;
+	}
+	if (started == 0) {
+		shsh_batch_worker(&ctx);
+	}
+	for (i = 0; i < started; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+	free(workers);
+	idevicerestore_log_set_async(0);
+
+	info("SHSH blobs saved: %d, already present: %d, failed: %d\n", ctx.saved, ctx.skipped, ctx.failed);
+	int res = ctx.failed;
+	shsh_batch_free(&ctx);
+	return res;
+}
@@ -0,0 +1,51 @@
+/*
+ * shsh_batch.h
+ * Saves SHSH blobs for many devices and builds without the devices attached (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_SHSH_BATCH_H
+#define IDEVICERESTORE_SHSH_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* TSS requests in flight at the same time unless told otherwise */
+#define SHSH_BATCH_DEFAULT_CONCURRENCY 8
+
+/* Requests a blob for every device listed in devices_file and every build
+ * in manifests that supports it, and writes each one as soon as it arrives
+ * to <cache_dir>/shsh/<ecid>-<product>-<version>.shsh, the same file
+ * --shsh writes. Blobs that are present already are skipped.
+ *
+ * devices_file has one device per line, '#' starts a comment:
+ *   ECID PRODUCT_TYPE BOARD_CONFIG [GENERATOR [APNONCE]]
+ * e.g. 0x1a2b3c4d5e6f iPhone10,3 d22ap 0x1111111111111111
+ * The ApNonce is derived from the generator if it is not given. ECID and
+ * generator can be hex or decimal, the ApNonce is hex.
+ *
+ * Returns the number of blobs that could not be saved, or -1 if the input
+ * could not be read. */
+int shsh_batch_run(const char* devices_file, char* const* manifests, int num_manifests, const char* cache_dir, const char* tss_url, int concurrency);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * supervisor.c
+ * Restore several devices concurrently
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libirecovery.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "common.h"
+#include "normal.h"
+#include "supervisor.h"
+#include "idevicerestore.h"
+
+struct supervisor_event {
+	uint64_t ecid;
+	char* udid;
+	struct idevicerestore_mode_t* mode;
+	struct supervisor_event* next;
+};
+
+struct supervisor_worker {
+	struct idevicerestore_client_t* client;
+	THREAD_T thread;
+	int finished;
+	int result;
+	struct supervisor_worker* next;
+};
+
+struct supervisor {
+	struct idevicerestore_client_t* config;
+	mutex_t mutex;
+	cond_t cond;
+	struct supervisor_event* events;
+	struct supervisor_event** events_tail;
+	struct supervisor_worker* workers;
+	uint64_t* done;
+	int num_done;
+	int succeeded;
+	int failed;
+};
+
+static void supervisor_queue_event(struct supervisor* sv, uint64_t ecid, const char* udid, struct idevicerestore_mode_t* mode)
+{
+	struct supervisor_event* ev = (struct supervisor_event*)calloc(1, sizeof(struct supervisor_event));
+	if (!ev) {
+		return;
+	}
+	ev->ecid = ecid;
+	ev->udid = (udid) ? strdup(udid) : NULL;
+	ev->mode = mode;
+	mutex_lock(&sv->mutex);
+	*sv->events_tail = ev;
+	sv->events_tail = &ev->next;
+	cond_signal(&sv->cond);
+	mutex_unlock(&sv->mutex);
+}
+
+static void supervisor_irecv_event_cb(const irecv_device_event_t* event, void* userdata)
+{
+	struct supervisor* sv = (struct supervisor*)userdata;
+	if (event->type != IRECV_DEVICE_ADD) {
+		return;
+	}
+	struct idevicerestore_mode_t* mode = MODE_UNKNOWN;
+	switch (event->mode) {
+		case IRECV_K_WTF_MODE:
+			mode = MODE_WTF;
+			break;
+		case IRECV_K_DFU_MODE:
+			mode = MODE_DFU;
+			break;
+		case IRECV_K_RECOVERY_MODE_1:
+		case IRECV_K_RECOVERY_MODE_2:
+		case IRECV_K_RECOVERY_MODE_3:
+		case IRECV_K_RECOVERY_MODE_4:
+			mode = MODE_RECOVERY;
+			break;
+		default:
+			return;
+	}
+	supervisor_queue_event(sv, event->device_info->ecid, NULL, mode);
+}
+
+static void supervisor_idevice_event_cb(const idevice_event_t* event, void* userdata)
+{
+	struct supervisor* sv = (struct supervisor*)userdata;
+#ifdef HAVE_ENUM_IDEVICE_CONNECTION_TYPE
+	if (event->conn_type != CONNECTION_USBMUXD) {
+		// ignore everything but devices connected through USB
+		return;
+	}
+#endif
+	if (event->event != IDEVICE_DEVICE_ADD) {
+		return;
+	}
+	/* the ECID is looked up from the supervisor thread, lockdownd is too slow to query from here */
+	supervisor_queue_event(sv, 0, event->udid, MODE_NORMAL);
+}
+
+static int supervisor_is_busy(struct supervisor* sv, uint64_t ecid, const char* udid)
+{
+	struct supervisor_worker* worker;
+	for (worker = sv->workers; worker; worker = worker->next) {
+		if (ecid && worker->client->ecid == ecid) {
+			return 1;
+		}
+		if (udid && worker->client->udid && !strcmp(worker->client->udid, udid)) {
+			return 1;
+		}
+	}
+	if (ecid) {
+		int i;
+		for (i = 0; i < sv->num_done; i++) {
+			if (sv->done[i] == ecid) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* <path>-<ECID>.<ext>, so concurrent restores don't overwrite each other */
+static char* supervisor_metrics_path(const char* path, uint64_t ecid)
+{
+	if (!path) {
+		return NULL;
+	}
+	const char* ext = strrchr(path, '.');
+	const char* slash = strrchr(path, '/');
+	if (!ext || (slash && ext < slash)) {
+		ext = path + strlen(path);
+	}
+	char* result = (char*)malloc(strlen(path) + 18);
+	if (result) {
+		sprintf(result, "%.*s-%016" PRIx64 "%s", (int)(ext - path), path, ecid, ext);
+	}
+	return result;
+}
+
+static struct idevicerestore_client_t* supervisor_client_new(struct idevicerestore_client_t* config, uint64_t ecid, const char* udid, struct idevicerestore_mode_t* mode)
+{
+	struct idevicerestore_client_t* client = idevicerestore_client_new();
+	if (!client) {
+		return NULL;
+	}
+	/* nobody could answer prompts from several restores at once */
+	client->flags = config->flags & ~FLAG_INTERACTIVE;
+	client->ecid = ecid;
+	client->udid = (udid) ? strdup(udid) : NULL;
+	client->mode = mode;
+	client->tss_url = (config->tss_url) ? strdup(config->tss_url) : NULL;
+	client->cache_dir = (config->cache_dir) ? strdup(config->cache_dir) : NULL;
+	client->restore_boot_args = (config->restore_boot_args) ? strdup(config->restore_boot_args) : NULL;
+	client->metrics_path = supervisor_metrics_path(config->metrics_path, ecid);
+	if (config->root_ticket) {
+		client->root_ticket = (unsigned char*)malloc(config->root_ticket_len);
+		if (client->root_ticket) {
+			memcpy(client->root_ticket, config->root_ticket, config->root_ticket_len);
+			client->root_ticket_len = config->root_ticket_len;
+		}
+	}
+	client->ipsw = ipsw_ref(config->ipsw);
+	client->component_cache = cache_ref(config->component_cache);
+	client->fwupdater_cache = cache_ref(config->fwupdater_cache);
+	client->progress_cb = config->progress_cb;
+	client->progress_cb_data = config->progress_cb_data;
+	return client;
+}
+
+struct supervisor_worker_arg {
+	struct supervisor* sv;
+	struct supervisor_worker* worker;
+};
+
+static void* supervisor_worker_thread(void* arg)
+{
+	struct supervisor_worker_arg* warg = (struct supervisor_worker_arg*)arg;
+	struct supervisor* sv = warg->sv;
+	struct supervisor_worker* worker = warg->worker;
+	free(warg);
+
+	idevicerestore_log_set_ecid(worker->client->ecid);
+	int result = idevicerestore_start(worker->client);
+	idevicerestore_write_metrics(worker->client, result);
+
+	mutex_lock(&sv->mutex);
+	worker->result = result;
+	worker->finished = 1;
+	cond_signal(&sv->cond);
+	mutex_unlock(&sv->mutex);
+
+	return NULL;
+}
+
+static void supervisor_start_worker(struct supervisor* sv, uint64_t ecid, const char* udid, struct idevicerestore_mode_t* mode)
+{
+	struct supervisor_worker* worker = (struct supervisor_worker*)calloc(1, sizeof(struct supervisor_worker));
+	struct supervisor_worker_arg* warg = (struct supervisor_worker_arg*)malloc(sizeof(struct supervisor_worker_arg));
+	if (!worker || !warg) {
+		error("ERROR: Out of memory\n");
+		free(worker);
+		free(warg);
+		return;
+	}
+	worker->client = supervisor_client_new(sv->config, ecid, udid, mode);
+	if (!worker->client) {
+		free(worker);
+		free(warg);
+		return;
+	}
+	warg->sv = sv;
+	warg->worker = worker;
+
+	info("Starting restore of device %016" PRIx64 " (%s mode)\n", ecid, mode->string);
+	if (thread_new(&worker->thread, supervisor_worker_thread, warg) != 0) {
+		error("ERROR: Unable to start restore thread for device %016" PRIx64 "\n", ecid);
+		idevicerestore_client_free(worker->client);
+		free(worker);
+		free(warg);
+		return;
+	}
+
+	mutex_lock(&sv->mutex);
+	worker->next = sv->workers;
+	sv->workers = worker;
+	mutex_unlock(&sv->mutex);
+}
+
+static void supervisor_handle_event(struct supervisor* sv, struct supervisor_event* ev)
+{
+	uint64_t ecid = ev->ecid;
+
+	mutex_lock(&sv->mutex);
+	int busy = supervisor_is_busy(sv, ecid, ev->udid);
+	mutex_unlock(&sv->mutex);
+	if (busy) {
+		return;
+	}
+
+	if (!ecid && ev->udid) {
+		struct idevicerestore_client_t* probe = idevicerestore_client_new();
+		if (!probe) {
+			return;
+		}
+		probe->udid = strdup(ev->udid);
+		if (normal_get_ecid(probe, &ecid) < 0) {
+			debug("DEBUG: %s: ignoring device %s, unable to get ECID\n", __func__, ev->udid);
+			ecid = 0;
+		}
+		idevicerestore_client_free(probe);
+		if (!ecid) {
+			return;
+		}
+		mutex_lock(&sv->mutex);
+		busy = supervisor_is_busy(sv, ecid, NULL);
+		mutex_unlock(&sv->mutex);
+		if (busy) {
+			return;
+		}
+	}
+
+	supervisor_start_worker(sv, ecid, ev->udid, ev->mode);
+}
+
+/* must be called with the supervisor mutex held */
+static void supervisor_reap(struct supervisor* sv, int all)
+{
+	struct supervisor_worker** pw = &sv->workers;
+	while (*pw) {
+		struct supervisor_worker* worker = *pw;
+		if (!all && !worker->finished) {
+			pw = &worker->next;
+			continue;
+		}
+		*pw = worker->next;
+
+		mutex_unlock(&sv->mutex);
+		thread_join(worker->thread);
+		thread_free(worker->thread);
+		mutex_lock(&sv->mutex);
+
+		uint64_t ecid = worker->client->ecid;
+		if (worker->result == 0) {
+			info("Restore of device %016" PRIx64 " succeeded\n", ecid);
+			sv->succeeded++;
+		} else {
+			error("ERROR: Restore of device %016" PRIx64 " failed\n", ecid);
+			sv->failed++;
+		}
+		/* a device is restored only once, it will show up again after rebooting.
+		 * a failed one is forgotten so the next event for it starts over */
+		if (worker->result == 0) {
+			uint64_t* done = (uint64_t*)realloc(sv->done, sizeof(uint64_t) * (sv->num_done + 1));
+			if (done) {
+				sv->done = done;
+				sv->done[sv->num_done++] = ecid;
+			}
+		}
+		idevicerestore_client_free(worker->client);
+		free(worker);
+	}
+}
+
+int idevicerestore_supervise(struct idevicerestore_client_t* config)
+{
+	if (!config || !config->ipsw) {
+		error("ERROR: %s: an IPSW is required\n", __func__);
+		return -1;
+	}
+
+	struct supervisor sv;
+	memset(&sv, 0, sizeof(sv));
+	sv.config = config;
+	sv.events_tail = &sv.events;
+	mutex_init(&sv.mutex);
+	cond_init(&sv.cond);
+
+	if (device_events_subscribe(supervisor_irecv_event_cb, supervisor_idevice_event_cb, &sv) < 0) {
+		cond_destroy(&sv.cond);
+		mutex_destroy(&sv.mutex);
+		return -1;
+	}
+
+	info("Waiting for devices, press Ctrl+C to stop...\n");
+	/* the restores should not wait for each other's output */
+	idevicerestore_log_set_async(1);
+
+	mutex_lock(&sv.mutex);
+	while (!(config->flags & FLAG_QUIT)) {
+		if (!sv.events) {
+			cond_wait_timeout(&sv.cond, &sv.mutex, 1000);
+		}
+		struct supervisor_event* ev = sv.events;
+		sv.events = NULL;
+		sv.events_tail = &sv.events;
+		mutex_unlock(&sv.mutex);
+
+		while (ev) {
+			struct supervisor_event* next = ev->next;
+			if (!(config->flags & FLAG_QUIT)) {
+				supervisor_handle_event(&sv, ev);
+			}
+			free(ev->udid);
+			free(ev);
+			ev = next;
+		}
+
+		mutex_lock(&sv.mutex);
+		supervisor_reap(&sv, 0);
+	}
+
+	struct supervisor_worker* worker;
+	for (worker = sv.workers; worker; worker = worker->next) {
+		worker->client->flags |= FLAG_QUIT;
+	}
+	supervisor_reap(&sv, 1);
+	mutex_unlock(&sv.mutex);
+
+	device_events_unsubscribe(&sv);
+	idevicerestore_log_set_async(0);
+
+	while (sv.events) {
+		struct supervisor_event* next = sv.events->next;
+		free(sv.events->udid);
+		free(sv.events);
+		sv.events = next;
+	}
+	free(sv.done);
+	cond_destroy(&sv.cond);
+	mutex_destroy(&sv.mutex);
+
+	info("Restored %d device(s), %d failed\n", sv.succeeded, sv.failed);
+
+	return (sv.failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * supervisor.h
+ * Restore several devices concurrently (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_SUPERVISOR_H
+#define IDEVICERESTORE_SUPERVISOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct idevicerestore_client_t;
+
+/* Waits for devices to show up and restores each of them in its own client,
+ * using config as the template (flags, IPSW, caches and options). Blocks
+ * until FLAG_QUIT is set on config and all running restores have finished.
+ * Returns 0 if every restore succeeded. */
+int idevicerestore_supervise(struct idevicerestore_client_t* config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * telemetry.c
+ * Per-phase timing and throughput counters
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "telemetry.h"
+#include "common.h"
+
+struct telemetry_phase {
+	char* name;
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t bytes;
+};
+
+struct telemetry {
+	mutex_t mutex;
+	uint64_t created;
+	struct telemetry_phase* phases;
+	int num_phases;
+	int capacity;
+	/* makes the names of temporary files unique within the process */
+	unsigned int tmp_serial;
+};
+
+telemetry_t telemetry_new(void)
+{
+	telemetry_t telemetry = (telemetry_t)calloc(1, sizeof(struct telemetry));
+	if (!telemetry) {
+		return NULL;
+	}
+	mutex_init(&telemetry->mutex);
+	telemetry->created = get_monotonic_time_us();
+	return telemetry;
+}
+
+void telemetry_free(telemetry_t telemetry)
+{
+	int i;
+	if (!telemetry) {
+		return;
+	}
+	for (i = 0; i < telemetry->num_phases; i++) {
+		free(telemetry->phases[i].name);
+	}
+	free(telemetry->phases);
+	mutex_destroy(&telemetry->mutex);
+	free(telemetry);
+}
+
+uint64_t telemetry_begin(void)
+{
+	return get_monotonic_time_us();
+}
+
+/* must be called with telemetry->mutex held */
+static struct telemetry_phase* telemetry_get_phase(telemetry_t telemetry, const char* name)
+{
+	int i;
+	for (i = 0; i < telemetry->num_phases; i++) {
+		if (!strcmp(telemetry->phases[i].name, name)) {
+			return &telemetry->phases[i];
+		}
+	}
+	if (telemetry->num_phases == telemetry->capacity) {
+		int capacity = (telemetry->capacity) ? telemetry->capacity * 2 : 16;
+		struct telemetry_phase* phases = (struct telemetry_phase*)realloc(telemetry->phases, capacity * sizeof(struct telemetry_phase));
+		if (!phases) {
+			return NULL;
+		}
+		telemetry->phases = phases;
+		telemetry->capacity = capacity;
+	}
+	struct telemetry_phase* phase = &telemetry->phases[telemetry->num_phases];
+	memset(phase, 0, sizeof(*phase));
+	phase->name = strdup(name);
+	if (!phase->name) {
+		return NULL;
+	}
+	telemetry->num_phases++;
+	return phase;
+}
+
+void telemetry_end(telemetry_t telemetry, const char* phase_name, uint64_t begin, uint64_t bytes)
+{
+	if (!telemetry || !phase_name) {
+		return;
+	}
+	uint64_t elapsed = get_monotonic_time_us() - begin;
+
+	mutex_lock(&telemetry->mutex);
+	struct telemetry_phase* phase = telemetry_get_phase(telemetry, phase_name);
+	if (phase) {
+		phase->count++;
+		phase->total_us += elapsed;
+		if (elapsed > phase->max_us) {
+			phase->max_us = elapsed;
+		}
+		phase->bytes += bytes;
+	}
+	mutex_unlock(&telemetry->mutex);
+}
+
+/* phase names come from DataType strings and the like; anything that
+ * would need escaping is replaced */
+static void telemetry_print_name(FILE* f, const char* name)
+{
+	const char* p;
+	for (p = name; *p; p++) {
+		fputc((*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) ? '_' : *p, f);
+	}
+}
+
+static void telemetry_write_json(telemetry_t telemetry, FILE* f, uint64_t ecid, const char* product_type, int result, uint64_t elapsed)
+{
+	int i;
+	fprintf(f, "{\n");
+	fprintf(f, "  \"ecid\": \"0x%" PRIx64 "\",\n", ecid);
+	fprintf(f, "  \"product_type\": \"");
+	telemetry_print_name(f, product_type);
+	fprintf(f, "\",\n");
+	fprintf(f, "  \"result\": %d,\n", result);
+	fprintf(f, "  \"elapsed_us\": %" PRIu64 ",\n", elapsed);
+	fprintf(f, "  \"phases\": [");
+	for (i = 0; i < telemetry->num_phases; i++) {
+		struct telemetry_phase* phase = &telemetry->phases[i];
+		fprintf(f, "%s\n    { \"name\": \"", (i > 0) ? "," : "");
+		telemetry_print_name(f, phase->name);
+		fprintf(f, "\", \"count\": %" PRIu64 ", \"total_us\": %" PRIu64 ", \"max_us\": %" PRIu64 ", \"bytes\": %" PRIu64,
+			phase->count, phase->total_us, phase->max_us, phase->bytes);
+		if (phase->bytes > 0 && phase->total_us > 0) {
+			fprintf(f, ", \"bytes_per_second\": %.0f", (double)phase->bytes * 1000000.0 / (double)phase->total_us);
+		}
+		fprintf(f, " }");
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+static void telemetry_write_labels(FILE* f, uint64_t ecid, const char* product_type, const char* phase)
+{
+	fprintf(f, "{ecid=\"0x%" PRIx64 "\",product_type=\"", ecid);
+	telemetry_print_name(f, product_type);
+	fprintf(f, "\"");
+	if (phase) {
+		fprintf(f, ",phase=\"");
+		telemetry_print_name(f, phase);
+		fprintf(f, "\"");
+	}
+	fprintf(f, "}");
+}
+
+static void telemetry_write_openmetrics(telemetry_t telemetry, FILE* f, uint64_t ecid, const char* product_type, int result, uint64_t elapsed)
+{
+	int i;
+
+	fprintf(f, "# TYPE idevicerestore_restore_duration_seconds gauge\n");
+	fprintf(f, "idevicerestore_restore_duration_seconds");
+	telemetry_write_labels(f, ecid, product_type, NULL);
+	fprintf(f, " %.6f\n", (double)elapsed / 1000000.0);
+
+	fprintf(f, "# TYPE idevicerestore_restore_result gauge\n");
+	fprintf(f, "idevicerestore_restore_result");
+	telemetry_write_labels(f, ecid, product_type, NULL);
+	fprintf(f, " %d\n", result);
+
+	fprintf(f, "# TYPE idevicerestore_phase_duration_seconds counter\n");
+	for (i = 0; i < telemetry->num_phases; i++) {
+		fprintf(f, "idevicerestore_phase_duration_seconds_total");
+		telemetry_write_labels(f, ecid, product_type, telemetry->phases[i].name);
+		fprintf(f, " %.6f\n", (double)telemetry->phases[i].total_us / 1000000.0);
+	}
+
+	fprintf(f, "# TYPE idevicerestore_phase_max_duration_seconds gauge\n");
+	for (i = 0; i < telemetry->num_phases; i++) {
+		fprintf(f, "idevicerestore_phase_max_duration_seconds");
+		telemetry_write_labels(f, ecid, product_type, telemetry->phases[i].name);
+		fprintf(f, " %.6f\n", (double)telemetry->phases[i].max_us / 1000000.0);
+	}
+
+	fprintf(f, "# TYPE idevicerestore_phase_calls counter\n");
+	for (i = 0; i < telemetry->num_phases; i++) {
+		fprintf(f, "idevicerestore_phase_calls_total");
+		telemetry_write_labels(f, ecid, product_type, telemetry->phases[i].name);
+		fprintf(f, " %" PRIu64 "\n", telemetry->phases[i].count);
+	}
+
+	fprintf(f, "# TYPE idevicerestore_phase_bytes counter\n");
+	for (i = 0; i < telemetry->num_phases; i++) {
+		if (telemetry->phases[i].bytes == 0) {
+			continue;
+		}
+		fprintf(f, "idevicerestore_phase_bytes_total");
+		telemetry_write_labels(f, ecid, product_type, telemetry->phases[i].name);
+		fprintf(f, " %" PRIu64 "\n", telemetry->phases[i].bytes);
+	}
+
+	fprintf(f, "# EOF\n");
+}
+
+int telemetry_write(telemetry_t telemetry, const char* path, uint64_t ecid, const char* product_type, int result)
+{
+	if (!telemetry || !path) {
+		return -1;
+	}
+	if (!product_type) {
+		product_type = "Unknown";
+	}
+
+	char* tmp = (char*)malloc(strlen(path) + 48);
+	if (!tmp) {
+		return -1;
+	}
+	/* restores of other devices may write the same file */
+	mutex_lock(&telemetry->mutex);
+	unsigned int serial = telemetry->tmp_serial++;
+	mutex_unlock(&telemetry->mutex);
+	sprintf(tmp, "%s.%d-%" PRIx64 "-%u.tmp", path, (int)getpid(), ecid, serial);
+	FILE* f = fopen(tmp, "w");
+	if (!f) {
+		error("ERROR: Unable to write metrics to %s\n", path);
+		free(tmp);
+		return -1;
+	}
+
+	size_t len = strlen(path);
+	int json = (len > 5 && !strcmp(path + len - 5, ".json"));
+
+	mutex_lock(&telemetry->mutex);
+	uint64_t elapsed = get_monotonic_time_us() - telemetry->created;
+	if (json) {
+		telemetry_write_json(telemetry, f, ecid, product_type, result, elapsed);
+	} else {
+		telemetry_write_openmetrics(telemetry, f, ecid, product_type, result, elapsed);
+	}
+	mutex_unlock(&telemetry->mutex);
+
+	int failed = ferror(f);
+	if (fclose(f) != 0 || failed) {
+		error("ERROR: Unable to write metrics to %s\n", path);
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	/* whoever collects the file never sees half of it */
+	if (rename(tmp, path) != 0) {
+		error("ERROR: Unable to write metrics to %s\n", path);
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	info("Metrics written to %s\n", path);
+	return 0;
+}
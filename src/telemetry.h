@@ -0,0 +1,53 @@
+/*
+ * telemetry.h
+ * Per-phase timing and throughput counters (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_TELEMETRY_H
+#define IDEVICERESTORE_TELEMETRY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* One set of counters per restore. Phases are created on first use and
+ * can be recorded from any thread. */
+typedef struct telemetry* telemetry_t;
+
+telemetry_t telemetry_new(void);
+void telemetry_free(telemetry_t telemetry);
+
+/* Returns the start time of a phase to pass to telemetry_end() */
+uint64_t telemetry_begin(void);
+
+/* Adds one call of phase taking from begin until now and moving bytes.
+ * A NULL telemetry is ignored, so callers don't need to check. */
+void telemetry_end(telemetry_t telemetry, const char* phase, uint64_t begin, uint64_t bytes);
+
+/* Writes a summary to path, as JSON if it ends in .json and in the
+ * OpenMetrics text format otherwise */
+int telemetry_write(telemetry_t telemetry, const char* path, uint64_t ecid, const char* product_type, int result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * transition.c
+ * Waiting for device mode transitions
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "transition.h"
+#include "common.h"
+
+/* samples needed before the timeout is derived from them */
+#define TRANSITION_MIN_SAMPLES 3
+#define TRANSITION_MIN_TIMEOUT 5000
+/* weight of a new sample in the running average */
+#define TRANSITION_AVERAGE_WEIGHT 0.25
+
+static mutex_t transition_mutex;
+static thread_once_t transition_once = THREAD_ONCE_INIT;
+static plist_t transition_latencies = NULL;
+static char* transition_latency_file = NULL;
+
+static void transition_init(void)
+{
+	mutex_init(&transition_mutex);
+	transition_latencies = plist_new_dict();
+}
+
+void transition_set_latency_file(const char* path)
+{
+	thread_once(&transition_once, transition_init);
+
+	mutex_lock(&transition_mutex);
+	if (!transition_latency_file && path) {
+		char* buf = NULL;
+		size_t len = 0;
+		transition_latency_file = strdup(path);
+		if (read_file(transition_latency_file, (void**)&buf, &len) == 0) {
+			plist_t latencies = NULL;
+			plist_from_memory(buf, len, &latencies);
+			free(buf);
+			if (latencies && plist_get_node_type(latencies) == PLIST_DICT) {
+				plist_free(transition_latencies);
+				transition_latencies = latencies;
+			} else {
+				plist_free(latencies);
+			}
+		}
+	}
+	mutex_unlock(&transition_mutex);
+}
+
+static char* transition_key(struct idevicerestore_client_t* client, const char* name)
+{
+	const char* product_type = (client->device && client->device->product_type) ? client->device->product_type : "Unknown";
+	char* key = (char*)malloc(strlen(product_type) + 1 + strlen(name) + 1);
+	if (key) {
+		sprintf(key, "%s:%s", product_type, name);
+	}
+	return key;
+}
+
+static unsigned int transition_timeout(struct idevicerestore_client_t* client, const char* name, unsigned int timeout_ms)
+{
+	char* key = transition_key(client, name);
+	if (!key) {
+		return timeout_ms;
+	}
+
+	mutex_lock(&transition_mutex);
+	plist_t entry = plist_dict_get_item(transition_latencies, key);
+	if (entry && plist_get_node_type(entry) == PLIST_DICT && _plist_dict_get_uint(entry, "Count") >= TRANSITION_MIN_SAMPLES) {
+		double average = 0;
+		plist_t node = plist_dict_get_item(entry, "Average");
+		if (node && plist_get_node_type(node) == PLIST_REAL) {
+			plist_get_real_val(node, &average);
+		}
+		uint64_t max = _plist_dict_get_uint(entry, "Max");
+		/* generous enough for an unusually slow attempt, but a device that
+		 * got stuck is noticed long before the worst case fixed limit */
+		uint64_t adapted = max * 2;
+		if (adapted < (uint64_t)(average * 3)) {
+			adapted = (uint64_t)(average * 3);
+		}
+		if (adapted < TRANSITION_MIN_TIMEOUT) {
+			adapted = TRANSITION_MIN_TIMEOUT;
+		}
+		if (adapted > (uint64_t)timeout_ms * 3) {
+			adapted = (uint64_t)timeout_ms * 3;
+		}
+		debug("DEBUG: %s: %s usually takes %.0f ms, waiting up to %u ms\n", __func__, key, average, (unsigned int)adapted);
+		timeout_ms = (unsigned int)adapted;
+	}
+	mutex_unlock(&transition_mutex);
+
+	free(key);
+	return timeout_ms;
+}
+
+static void transition_record(struct idevicerestore_client_t* client, const char* name, uint64_t elapsed_ms)
+{
+	char* key = transition_key(client, name);
+	if (!key) {
+		return;
+	}
+
+	mutex_lock(&transition_mutex);
+	plist_t entry = plist_dict_get_item(transition_latencies, key);
+	if (!entry || plist_get_node_type(entry) != PLIST_DICT) {
+		entry = plist_new_dict();
+		plist_dict_set_item(transition_latencies, key, entry);
+	}
+	uint64_t count = _plist_dict_get_uint(entry, "Count");
+	uint64_t max = _plist_dict_get_uint(entry, "Max");
+	double average = (double)elapsed_ms;
+	plist_t node = plist_dict_get_item(entry, "Average");
+	if (count > 0 && node && plist_get_node_type(node) == PLIST_REAL) {
+		plist_get_real_val(node, &average);
+		average += ((double)elapsed_ms - average) * TRANSITION_AVERAGE_WEIGHT;
+	}
+	if (elapsed_ms > max) {
+		max = elapsed_ms;
+	}
+	plist_dict_set_item(entry, "Average", plist_new_real(average));
+	plist_dict_set_item(entry, "Max", plist_new_uint(max));
+	plist_dict_set_item(entry, "Count", plist_new_uint(count + 1));
+
+	if (transition_latency_file) {
+		char* xml = NULL;
+		uint32_t xlen = 0;
+		plist_to_xml(transition_latencies, &xml, &xlen);
+		if (xml) {
+			/* other processes share the cache directory */
+			char* tmp = (char*)malloc(strlen(transition_latency_file) + 16);
+			if (tmp) {
+				sprintf(tmp, "%s.%d.tmp", transition_latency_file, (int)getpid());
+				if (write_file(tmp, xml, xlen) != (int)xlen || rename(tmp, transition_latency_file) != 0) {
+					remove(tmp);
+				}
+				free(tmp);
+			}
+			free(xml);
+		}
+	}
+	mutex_unlock(&transition_mutex);
+
+	free(key);
+}
+
+int transition_wait(struct idevicerestore_client_t* client, const char* name, unsigned int modes, unsigned int timeout_ms)
+{
+	thread_once(&transition_once, transition_init);
+
+	timeout_ms = transition_timeout(client, name, timeout_ms);
+
+	char phase[64];
+	snprintf(phase, sizeof(phase), "wait_%s", name);
+
+	uint64_t start = get_monotonic_time_us();
+	uint64_t deadline = start + (uint64_t)timeout_ms * 1000;
+	int waited = 0;
+	while (!(TRANSITION_MODE(client->mode) & modes)) {
+		if (client->flags & FLAG_QUIT) {
+			return -1;
+		}
+		uint64_t now = get_monotonic_time_us();
+		if (now >= deadline) {
+			debug("DEBUG: %s: %s timed out after %u ms in %s mode\n", __func__, name, timeout_ms, client->mode->string);
+			telemetry_end(client->telemetry, phase, start, 0);
+			return -1;
+		}
+		unsigned int remaining = (unsigned int)((deadline - now + 999) / 1000);
+		cond_wait_timeout(&client->device_event_cond, &client->device_event_mutex, remaining);
+		waited = 1;
+	}
+	if (client->flags & FLAG_QUIT) {
+		return -1;
+	}
+
+	telemetry_end(client->telemetry, phase, start, 0);
+
+	/* a transition that was already over says nothing about its latency */
+	if (waited) {
+		uint64_t elapsed_ms = (get_monotonic_time_us() - start) / 1000;
+		debug("DEBUG: %s: %s took %u ms\n", __func__, name, (unsigned int)elapsed_ms);
+		transition_record(client, name, elapsed_ms);
+	}
+
+	return 0;
+}
+
+int transition_backoff(unsigned int attempt, unsigned int* budget_ms)
+{
+	unsigned int delay = 1000;
+	if (attempt < 5) {
+		delay = 50U << attempt;
+	}
+	if (*budget_ms == 0) {
+		return -1;
+	}
+	if (delay > *budget_ms) {
+		delay = *budget_ms;
+	}
+	*budget_ms -= delay;
+	__usleep(delay * 1000);
+	return 0;
+}
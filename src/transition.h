@@ -0,0 +1,56 @@
+/*
+ * transition.h
+ * Waiting for device mode transitions (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_TRANSITION_H
+#define IDEVICERESTORE_TRANSITION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+#define TRANSITION_MODE(m) (1U << (m)->index)
+#define TRANSITION_ANY_MODE (TRANSITION_MODE(MODE_WTF) | TRANSITION_MODE(MODE_DFU) | TRANSITION_MODE(MODE_RECOVERY) | TRANSITION_MODE(MODE_RESTORE) | TRANSITION_MODE(MODE_NORMAL))
+/* any mode other than m, including no device at all */
+#define TRANSITION_ANY_MODE_BUT(m) ((TRANSITION_ANY_MODE | TRANSITION_MODE(MODE_UNKNOWN)) & ~TRANSITION_MODE(m))
+
+/* Observed latencies are kept per product type in this file */
+void transition_set_latency_file(const char* path);
+
+/* Waits until client->mode is one of modes (a mask of TRANSITION_MODE()
+ * bits), woken by the device event callbacks. Must be called with
+ * client->device_event_mutex held. The timeout is derived from earlier
+ * transitions of the same name on the same model once there are enough of
+ * them, otherwise timeout_ms is used. Returns 0 when the mode was reached,
+ * -1 on timeout or when FLAG_QUIT was set. */
+int transition_wait(struct idevicerestore_client_t* client, const char* name, unsigned int modes, unsigned int timeout_ms);
+
+/* Delay between attempts to open a device that just showed up, 50 ms
+ * doubling up to 1 s. Returns -1 without sleeping once budget_ms is used
+ * up. */
+int transition_backoff(unsigned int attempt, unsigned int* budget_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
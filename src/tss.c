@@ -25,13 +25,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <plist/plist.h>
+#include <libimobiledevice-glue/thread.h>
 
 #include "tss.h"
 #include "img3.h"
 #include "common.h"
 #include "idevicerestore.h"
+#include "download.h"
+#include "build_manifest.h"
 
 #include "endianness.h"
 
@@ -44,11 +48,6 @@
 #endif
 #define ECID_STRSIZE 0x20
 
-typedef struct {
-	int length;
-	char* content;
-} tss_response;
-
 char* ecid_to_string(uint64_t ecid)
 {
 	char* ecid_string = malloc(ECID_STRSIZE);
@@ -1354,49 +1353,517 @@ int tss_request_add_timer_tags(plist_t request, plist_t parameters, plist_t over
 	return 0;
 }
 
-static size_t tss_write_callback(char* data, size_t size, size_t nmemb, tss_response* response)
+/* Handles are kept for reuse so that consecutive requests (and concurrent
+ * clients) reuse live connections, DNS lookups and TLS sessions. */
+struct tss_request_template {
+	plist_t skeleton;
+	char* xml;
+	uint32_t xml_size;
+	/* offset of the closing </dict> of the serialized skeleton */
+	uint32_t splice;
+	int image4;
+};
+
+static void tss_request_template_free(void* data)
 {
-	size_t total = size * nmemb;
-	if (total != 0) {
-		response->content = realloc(response->content, response->length + total + 1);
-		memcpy(response->content + response->length, data, total);
-		response->content[response->length + total] = '\0';
-		response->length += total;
+	struct tss_request_template* tmpl = (struct tss_request_template*)data;
+	if (!tmpl) {
+		return;
 	}
+	plist_free(tmpl->skeleton);
+	free(tmpl->xml);
+	free(tmpl);
+}
 
-	return total;
+/* the position of the last occurence of needle in the first size bytes of haystack */
+static const char* tss_memrstr(const char* haystack, uint32_t size, const char* needle)
+{
+	size_t len = strlen(needle);
+	const char* p;
+	if (size < len) {
+		return NULL;
+	}
+	for (p = haystack + size - len; p >= haystack; p--) {
+		if (memcmp(p, needle, len) == 0) {
+			return p;
+		}
+	}
+	return NULL;
 }
 
-plist_t tss_request_send(plist_t tss_request, const char* server_url_string)
+static struct tss_request_template* tss_request_template_build(plist_t build_identity, unsigned int flags)
 {
-	if (idevicerestore_debug) {
-		debug_plist(tss_request);
+	struct tss_request_template* tmpl = (struct tss_request_template*)calloc(1, sizeof(struct tss_request_template));
+	if (!tmpl) {
+		error("ERROR: Out of memory\n");
+		return NULL;
 	}
+	tmpl->image4 = (flags & TSS_TEMPLATE_IMG4) ? 1 : 0;
 
-	char* request = NULL;
+	plist_t parameters = plist_new_dict();
+	/* stands in for the device nonce, removed again below */
+	plist_dict_set_item(parameters, "ApNonce", plist_new_data("\0", 1));
+	plist_dict_set_item(parameters, "ApProductionMode", plist_new_bool((flags & TSS_TEMPLATE_PRODUCTION_MODE) ? 1 : 0));
+	if (tmpl->image4) {
+		plist_dict_set_item(parameters, "ApSecurityMode", plist_new_bool((flags & TSS_TEMPLATE_SECURITY_MODE) ? 1 : 0));
+	}
+	plist_dict_set_item(parameters, "ApSupportsImg4", plist_new_bool(tmpl->image4));
+	if (tss_parameters_add_from_manifest(parameters, build_identity) < 0) {
+		plist_free(parameters);
+		tss_request_template_free(tmpl);
+		return NULL;
+	}
+
+	plist_t request = tss_request_new(NULL);
+	plist_dict_remove_item(request, "@UUID");
+	int res = tss_request_add_common_tags(request, parameters, NULL);
+	if (res == 0) {
+		res = tss_request_add_ap_tags(request, parameters, NULL);
+	}
+	if (res == 0) {
+		if (tmpl->image4) {
+			res = tss_request_add_ap_img4_tags(request, parameters);
+		} else {
+			res = tss_request_add_ap_img3_tags(request, parameters);
+		}
+	}
+	plist_free(parameters);
+	if (res < 0) {
+		error("ERROR: Unable to create TSS request template\n");
+		plist_free(request);
+		tss_request_template_free(tmpl);
+		return NULL;
+	}
+	plist_dict_remove_item(request, "ApNonce");
+	tmpl->skeleton = request;
+
+	plist_to_xml(tmpl->skeleton, &tmpl->xml, &tmpl->xml_size);
+	const char* end = (tmpl->xml) ? tss_memrstr(tmpl->xml, tmpl->xml_size, "</dict>") : NULL;
+	if (!end) {
+		error("ERROR: Unable to serialize TSS request template\n");
+		tss_request_template_free(tmpl);
+		return NULL;
+	}
+	tmpl->splice = (uint32_t)(end - tmpl->xml);
+
+	return tmpl;
+}
+
+tss_request_template_t tss_request_template_get(plist_t build_identity, unsigned int flags)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "tss-ap-template-%u", flags);
+
+	struct tss_request_template* tmpl = (struct tss_request_template*)build_manifest_identity_get_data(build_identity, key);
+	if (tmpl) {
+		return tmpl;
+	}
+
+	tmpl = tss_request_template_build(build_identity, flags);
+	if (!tmpl) {
+		return NULL;
+	}
+	/* another thread might have been faster, use the attached one then */
+	struct tss_request_template* attached = (struct tss_request_template*)build_manifest_identity_set_data(build_identity, key, tmpl, tss_request_template_free);
+	if (attached != tmpl) {
+		tss_request_template_free(tmpl);
+	}
+	if (attached) {
+		debug("DEBUG: %s: using TSS request template %s\n", __func__, key);
+	}
+
+	return attached;
+}
+
+static plist_t tss_request_template_device_fields(tss_request_template_t tmpl, plist_t parameters)
+{
+	plist_t fields = plist_new_dict();
+
+	_plist_dict_copy_uint(fields, parameters, "ApECID", NULL);
+	if (_plist_dict_copy_data(fields, parameters, "ApNonce", NULL) < 0) {
+		error("ERROR: Unable to find required ApNonce in parameters\n");
+		plist_free(fields);
+		return NULL;
+	}
+	if (tmpl->image4) {
+		_plist_dict_copy_data(fields, parameters, "SepNonce", "ApSepNonce");
+	}
+
+	char* guid = generate_guid();
+	if (guid) {
+		plist_dict_set_item(fields, "@UUID", plist_new_string(guid));
+		free(guid);
+	}
+
+	return fields;
+}
+
+plist_t tss_request_template_new_request(tss_request_template_t tmpl, plist_t parameters)
+{
+	if (!tmpl || !parameters) {
+		return NULL;
+	}
+
+	plist_t fields = tss_request_template_device_fields(tmpl, parameters);
+	if (!fields) {
+		return NULL;
+	}
+	plist_t request = plist_copy(tmpl->skeleton);
+	plist_dict_merge(&request, fields);
+	plist_free(fields);
+
+	return request;
+}
+
+char* tss_request_template_to_xml(tss_request_template_t tmpl, plist_t parameters, uint32_t* size)
+{
+	if (!tmpl || !parameters || !size) {
+		return NULL;
+	}
+
+	plist_t fields = tss_request_template_device_fields(tmpl, parameters);
+	if (!fields) {
+		return NULL;
+	}
+	char* fields_xml = NULL;
+	uint32_t fields_size = 0;
+	plist_to_xml(fields, &fields_xml, &fields_size);
+	plist_free(fields);
+
+	/* the entries of the device dict, at the same depth as the skeleton's */
+	const char* begin = (fields_xml) ? strstr(fields_xml, "<dict>") : NULL;
+	const char* end = (begin) ? tss_memrstr(fields_xml, fields_size, "</dict>") : NULL;
+	if (!end || end < begin) {
+		error("ERROR: Unable to serialize TSS request\n");
+		free(fields_xml);
+		return NULL;
+	}
+	begin += strlen("<dict>");
+	if (*begin == '\n') {
+		begin++;
+	}
+	uint32_t len = (uint32_t)(end - begin);
+
+	char* xml = (char*)malloc(tmpl->xml_size + len + 1);
+	if (!xml) {
+		error("ERROR: Out of memory\n");
+		free(fields_xml);
+		return NULL;
+	}
+	memcpy(xml, tmpl->xml, tmpl->splice);
+	memcpy(xml + tmpl->splice, begin, len);
+	memcpy(xml + tmpl->splice + len, tmpl->xml + tmpl->splice, tmpl->xml_size - tmpl->splice);
+	*size = tmpl->xml_size + len;
+	xml[*size] = '\0';
+	free(fields_xml);
+
+	return xml;
+}
+
+#define TSS_HANDLE_POOL_SIZE 8
+
+static thread_once_t tss_pool_once = THREAD_ONCE_INIT;
+static mutex_t tss_pool_mutex;
+static CURLSH* tss_share = NULL;
+static mutex_t tss_share_mutex[CURL_LOCK_DATA_LAST];
+static CURL* tss_handle_pool[TSS_HANDLE_POOL_SIZE];
+static int tss_handle_pool_count = 0;
+
+static void tss_share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+	mutex_lock(&tss_share_mutex[data]);
+}
+
+static void tss_share_unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+	mutex_unlock(&tss_share_mutex[data]);
+}
+
+static void tss_pool_init(void)
+{
+	int i;
+	mutex_init(&tss_pool_mutex);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		mutex_init(&tss_share_mutex[i]);
+	}
+	tss_share = curl_share_init();
+	if (tss_share) {
+		curl_share_setopt(tss_share, CURLSHOPT_LOCKFUNC, tss_share_lock);
+		curl_share_setopt(tss_share, CURLSHOPT_UNLOCKFUNC, tss_share_unlock);
+		curl_share_setopt(tss_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(tss_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+		curl_share_setopt(tss_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	}
+}
+
+static CURL* tss_handle_acquire(void)
+{
+	CURL* handle = NULL;
+
+	thread_once(&tss_pool_once, tss_pool_init);
+
+	mutex_lock(&tss_pool_mutex);
+	if (tss_handle_pool_count > 0) {
+		handle = tss_handle_pool[--tss_handle_pool_count];
+	}
+	mutex_unlock(&tss_pool_mutex);
+
+	if (!handle) {
+		handle = curl_easy_init();
+		if (!handle) {
+			return NULL;
+		}
+	}
+	/* options are cleared when a handle is put back, set the shared ones again */
+	if (tss_share) {
+		curl_easy_setopt(handle, CURLOPT_SHARE, tss_share);
+	}
+#if LIBCURL_VERSION_NUM >= 0x071900
+	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+	return handle;
+}
+
+static void tss_handle_release(CURL* handle)
+{
+	if (!handle) {
+		return;
+	}
+	/* a reset handle keeps its connection and session caches */
+	curl_easy_reset(handle);
+	mutex_lock(&tss_pool_mutex);
+	if (tss_handle_pool_count < TSS_HANDLE_POOL_SIZE) {
+		tss_handle_pool[tss_handle_pool_count++] = handle;
+		handle = NULL;
+	}
+	mutex_unlock(&tss_pool_mutex);
+	if (handle) {
+		curl_easy_cleanup(handle);
+	}
+}
+
+void tss_cleanup(void)
+{
+	thread_once(&tss_pool_once, tss_pool_init);
+
+	mutex_lock(&tss_pool_mutex);
+	while (tss_handle_pool_count > 0) {
+		curl_easy_cleanup(tss_handle_pool[--tss_handle_pool_count]);
+	}
+	if (tss_share) {
+		curl_share_cleanup(tss_share);
+		tss_share = NULL;
+	}
+	mutex_unlock(&tss_pool_mutex);
+}
+
+/* Health of the signing server endpoints, shared by all requests of the
+ * process and optionally persisted so the next run starts where this one
+ * left off. Endpoints that fail repeatedly are skipped for a while. */
+#define TSS_NUM_ENDPOINTS 6
+#define TSS_BREAKER_THRESHOLD 3
+#define TSS_BREAKER_MIN_OPEN 30
+#define TSS_BREAKER_MAX_OPEN 600
+#define TSS_BACKOFF_BASE_MS 500
+#define TSS_BACKOFF_MAX_MS 16000
+
+struct tss_endpoint {
+	const char* url;
+	/* smoothed response time in ms, 0 if unknown */
+	double latency;
+	unsigned int failures;
+	/* unix time until which the endpoint is skipped */
+	uint64_t open_until;
+};
+
+static struct tss_endpoint tss_endpoints[TSS_NUM_ENDPOINTS] = {
+	{ "https://gs.apple.com/TSS/controller?action=2", 0, 0, 0 },
+	{ "https://17.171.36.30/TSS/controller?action=2", 0, 0, 0 },
+	{ "https://17.151.36.30/TSS/controller?action=2", 0, 0, 0 },
+	{ "http://gs.apple.com/TSS/controller?action=2", 0, 0, 0 },
+	{ "http://17.171.36.30/TSS/controller?action=2", 0, 0, 0 },
+	{ "http://17.151.36.30/TSS/controller?action=2", 0, 0, 0 }
+};
+static char* tss_health_file = NULL;
+static uint32_t tss_jitter_state = 0;
+
+static void tss_health_load(void)
+{
+	char* buf = NULL;
+	size_t len = 0;
+	if (read_file(tss_health_file, (void**)&buf, &len) != 0) {
+		return;
+	}
+	plist_t health = NULL;
+	plist_from_memory(buf, len, &health);
+	free(buf);
+	if (!health || plist_get_node_type(health) != PLIST_DICT) {
+		plist_free(health);
+		return;
+	}
+	int i;
+	for (i = 0; i < TSS_NUM_ENDPOINTS; i++) {
+		plist_t entry = plist_dict_get_item(health, tss_endpoints[i].url);
+		if (!entry || plist_get_node_type(entry) != PLIST_DICT) {
+			continue;
+		}
+		plist_t node = plist_dict_get_item(entry, "Latency");
+		if (node && plist_get_node_type(node) == PLIST_REAL) {
+			plist_get_real_val(node, &tss_endpoints[i].latency);
+		}
+		tss_endpoints[i].failures = (unsigned int)_plist_dict_get_uint(entry, "Failures");
+		tss_endpoints[i].open_until = _plist_dict_get_uint(entry, "OpenUntil");
+	}
+	plist_free(health);
+}
+
+/* must be called with tss_pool_mutex held */
+static void tss_health_save(void)
+{
+	if (!tss_health_file) {
+		return;
+	}
+	plist_t health = plist_new_dict();
+	int i;
+	for (i = 0; i < TSS_NUM_ENDPOINTS; i++) {
+		plist_t entry = plist_new_dict();
+		plist_dict_set_item(entry, "Latency", plist_new_real(tss_endpoints[i].latency));
+		plist_dict_set_item(entry, "Failures", plist_new_uint(tss_endpoints[i].failures));
+		plist_dict_set_item(entry, "OpenUntil", plist_new_uint(tss_endpoints[i].open_until));
+		plist_dict_set_item(health, tss_endpoints[i].url, entry);
+	}
+	char* xml = NULL;
+	uint32_t xlen = 0;
+	plist_to_xml(health, &xml, &xlen);
+	plist_free(health);
+	if (xml) {
+		/* other processes read the file while it gets replaced */
+		char* tmp = (char*)malloc(strlen(tss_health_file) + 16);
+		if (tmp) {
+			sprintf(tmp, "%s.%d.tmp", tss_health_file, (int)getpid());
+			if (write_file(tmp, xml, xlen) != (int)xlen || rename(tmp, tss_health_file) != 0) {
+				remove(tmp);
+			}
+			free(tmp);
+		}
+		free(xml);
+	}
+}
+
+void tss_set_health_file(const char* path)
+{
+	thread_once(&tss_pool_once, tss_pool_init);
+
+	mutex_lock(&tss_pool_mutex);
+	/* the first client that has a cache directory decides */
+	if (!tss_health_file && path) {
+		tss_health_file = strdup(path);
+		tss_health_load();
+	}
+	mutex_unlock(&tss_pool_mutex);
+}
+
+/* healthy endpoints with the lowest latency first, otherwise the one that
+ * will be tried again the soonest */
+static int tss_endpoint_select(void)
+{
+	uint64_t now = (uint64_t)time(NULL);
+	int best = -1;
+	int i;
+
+	mutex_lock(&tss_pool_mutex);
+	for (i = 0; i < TSS_NUM_ENDPOINTS; i++) {
+		if (tss_endpoints[i].open_until > now) {
+			continue;
+		}
+		/* unknown endpoints are tried in list order before slow ones */
+		if (best < 0 || (tss_endpoints[i].latency > 0 && tss_endpoints[best].latency > tss_endpoints[i].latency)) {
+			best = i;
+		}
+	}
+	if (best < 0) {
+		best = 0;
+		for (i = 1; i < TSS_NUM_ENDPOINTS; i++) {
+			if (tss_endpoints[i].open_until < tss_endpoints[best].open_until) {
+				best = i;
+			}
+		}
+	}
+	mutex_unlock(&tss_pool_mutex);
+
+	return best;
+}
+
+static void tss_endpoint_report(int index, int success, uint64_t elapsed_us)
+{
+	if (index < 0) {
+		return;
+	}
+	struct tss_endpoint* ep = &tss_endpoints[index];
+
+	mutex_lock(&tss_pool_mutex);
+	if (success) {
+		double ms = (double)elapsed_us / 1000.0;
+		ep->latency = (ep->latency > 0) ? (ep->latency * 0.7 + ms * 0.3) : ms;
+		ep->failures = 0;
+		ep->open_until = 0;
+	} else {
+		ep->failures++;
+		if (ep->failures >= TSS_BREAKER_THRESHOLD) {
+			unsigned int shift = ep->failures - TSS_BREAKER_THRESHOLD;
+			uint64_t open_for = (shift < 5) ? ((uint64_t)TSS_BREAKER_MIN_OPEN << shift) : TSS_BREAKER_MAX_OPEN;
+			if (open_for > TSS_BREAKER_MAX_OPEN) {
+				open_for = TSS_BREAKER_MAX_OPEN;
+			}
+			ep->open_until = (uint64_t)time(NULL) + open_for;
+			debug("DEBUG: %s: skipping %s for %" PRIu64 " seconds\n", __func__, ep->url, open_for);
+		}
+	}
+	tss_health_save();
+	mutex_unlock(&tss_pool_mutex);
+}
+
+/* exponential backoff with full jitter */
+static void tss_backoff(int attempt)
+{
+	unsigned int cap = TSS_BACKOFF_BASE_MS << ((attempt < 6) ? attempt : 6);
+	if (cap > TSS_BACKOFF_MAX_MS) {
+		cap = TSS_BACKOFF_MAX_MS;
+	}
+
+	mutex_lock(&tss_pool_mutex);
+	if (tss_jitter_state == 0) {
+		tss_jitter_state = (uint32_t)time(NULL) ^ (uint32_t)get_monotonic_time_us() ^ 0x9e3779b9;
+	}
+	/* xorshift32 */
+	tss_jitter_state ^= tss_jitter_state << 13;
+	tss_jitter_state ^= tss_jitter_state >> 17;
+	tss_jitter_state ^= tss_jitter_state << 5;
+	unsigned int delay = tss_jitter_state % cap;
+	mutex_unlock(&tss_pool_mutex);
+
+	__usleep(delay * 1000);
+}
+
+plist_t tss_request_send_xml(const char* request, uint32_t size, const char* server_url_string)
+{
 	int status_code = -1;
 	int retry = 0;
 	int max_retries = 15;
-	unsigned int size = 0;
 	char curl_error_message[CURL_ERROR_SIZE];
+	int endpoint = -1;
 
-	const char* urls[6] = {
-		"https://gs.apple.com/TSS/controller?action=2",
-		"https://17.171.36.30/TSS/controller?action=2",
-		"https://17.151.36.30/TSS/controller?action=2",
-		"http://gs.apple.com/TSS/controller?action=2",
-		"http://17.171.36.30/TSS/controller?action=2",
-		"http://17.151.36.30/TSS/controller?action=2"
-	};
-
-	plist_to_xml(tss_request, &request, &size);
+	if (!request || size == 0) {
+		return NULL;
+	}
 
-	tss_response* response = NULL;
+	struct download_buffer response = DOWNLOAD_BUFFER_INIT;
 	memset(curl_error_message, '\0', CURL_ERROR_SIZE);
 
 	while (retry++ < max_retries) {
-		response = NULL;
-		CURL* handle = curl_easy_init();
+		CURL* handle = tss_handle_acquire();
 		if (handle == NULL) {
 			break;
 		}
@@ -1405,61 +1872,60 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string)
 		header = curl_slist_append(header, "Content-type: text/xml; charset=\"utf-8\"");
 		header = curl_slist_append(header, "Expect:");
 
-		response = malloc(sizeof(tss_response));
-		if (response == NULL) {
-			fprintf(stderr, "Unable to allocate sufficient memory\n");
-			return NULL;
+		/* the buffer is kept across retries, large responses are only grown once */
+		download_buffer_attach(&response, handle);
+		if (!response.data) {
+			error("ERROR: Unable to allocate sufficient memory\n");
+			curl_slist_free_all(header);
+			tss_handle_release(handle);
+			break;
 		}
 
-		response->length = 0;
-		response->content = malloc(1);
-		response->content[0] = '\0';
-
 		/* disable SSL verification to allow download from untrusted https locations */
 		curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0);
 
 		curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, curl_error_message);
-		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, (curl_write_callback)&tss_write_callback);
-		curl_easy_setopt(handle, CURLOPT_WRITEDATA, response);
 		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, header);
 		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request);
 		curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
-		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, strlen(request));
+		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long)size);
 		if (server_url_string) {
 			curl_easy_setopt(handle, CURLOPT_URL, server_url_string);
 		} else {
-			int url_index = (retry - 1) % 6;
-			curl_easy_setopt(handle, CURLOPT_URL, urls[url_index]);
-			info("Request URL set to %s\n", urls[url_index]);
+			endpoint = tss_endpoint_select();
+			curl_easy_setopt(handle, CURLOPT_URL, tss_endpoints[endpoint].url);
+			info("Request URL set to %s\n", tss_endpoints[endpoint].url);
 		}
 
 		info("Sending TSS request attempt %d... ", retry);
 
+		uint64_t start = get_monotonic_time_us();
 		curl_easy_perform(handle);
+		uint64_t elapsed = get_monotonic_time_us() - start;
 		curl_slist_free_all(header);
-		curl_easy_cleanup(handle);
+		tss_handle_release(handle);
 
-		if (strstr(response->content, "MESSAGE=SUCCESS")) {
+		/* any answer from the server means the endpoint works */
+		tss_endpoint_report(endpoint, (strstr(response.data, "STATUS=") != NULL), elapsed);
+
+		if (strstr(response.data, "MESSAGE=SUCCESS")) {
 			status_code = 0;
 			info("response successfully received\n");
 			break;
 		}
 
-		if (response->length > 0) {
-			error("TSS server returned: %s\n", response->content);
+		if (response.length > 0) {
+			error("TSS server returned: %s\n", response.data);
 		}
 
-		char* status = strstr(response->content, "STATUS=");
+		char* status = strstr(response.data, "STATUS=");
 		if (status) {
 			sscanf(status+7, "%d&%*s", &status_code);
 		}
 		if (status_code == -1) {
 			error("%s\n", curl_error_message);
 			// no status code in response. retry
-			free(response->content);
-			free(response);
-			response = NULL;
-			sleep(2);
+			tss_backoff(retry);
 			continue;
 		} else if (status_code == 8) {
 			// server error (invalid bb request?)
@@ -1482,43 +1948,334 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string)
 	}
 
 	if (status_code != 0) {
-		if (response && strstr(response->content, "MESSAGE=") != NULL) {
-			char* message = strstr(response->content, "MESSAGE=") + strlen("MESSAGE=");
+		if (response.data && strstr(response.data, "MESSAGE=") != NULL) {
+			char* message = strstr(response.data, "MESSAGE=") + strlen("MESSAGE=");
 			error("ERROR: TSS request failed (status=%d, message=%s)\n", status_code, message);
 		} else {
 			error("ERROR: TSS request failed: %s (status=%d)\n", curl_error_message, status_code);
 		}
-		free(request);
-		if (response) free(response->content);
-		if (response) free(response);
+		download_buffer_free(&response);
 		return NULL;
 	}
 
-	char* tss_data = strstr(response->content, "<?xml");
+	char* tss_data = strstr(response.data, "<?xml");
 	if (tss_data == NULL) {
 		error("ERROR: Incorrectly formatted TSS response\n");
-		free(request);
-		free(response->content);
-		free(response);
+		download_buffer_free(&response);
 		return NULL;
 	}
 
 	uint32_t tss_size = 0;
 	plist_t tss_response = NULL;
-	tss_size = response->length - (tss_data - response->content);
+	tss_size = response.length - (tss_data - response.data);
 	plist_from_xml(tss_data, tss_size, &tss_response);
-	free(response->content);
-	free(response);
+	download_buffer_free(&response);
 
 	if (idevicerestore_debug) {
 		debug_plist(tss_response);
 	}
 
+	return tss_response;
+}
+
+plist_t tss_request_send(plist_t tss_request, const char* server_url_string)
+{
+	if (idevicerestore_debug) {
+		debug_plist(tss_request);
+	}
+
+	char* request = NULL;
+	uint32_t size = 0;
+	plist_to_xml(tss_request, &request, &size);
+	if (!request) {
+		error("ERROR: Unable to serialize TSS request\n");
+		return NULL;
+	}
+
+	plist_t tss_response = tss_request_send_xml(request, size, server_url_string);
 	free(request);
 
 	return tss_response;
 }
 
+struct tss_canonical_buffer {
+	unsigned char* data;
+	size_t length;
+	size_t capacity;
+	int failed;
+};
+
+static void tss_canonical_append(struct tss_canonical_buffer* buf, const void* data, size_t size)
+{
+	if (buf->failed) {
+		return;
+	}
+	if (buf->length + size > buf->capacity) {
+		size_t capacity = (buf->capacity) ? buf->capacity : 4096;
+		while (capacity < buf->length + size) {
+			capacity *= 2;
+		}
+		unsigned char* newdata = (unsigned char*)realloc(buf->data, capacity);
+		if (!newdata) {
+			buf->failed = 1;
+			return;
+		}
+		buf->data = newdata;
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->length, data, size);
+	buf->length += size;
+}
+
+static void tss_canonical_append_header(struct tss_canonical_buffer* buf, char type, uint64_t length)
+{
+	unsigned char header[9];
+	int i;
+	header[0] = (unsigned char)type;
+	for (i = 0; i < 8; i++) {
+		header[1+i] = (unsigned char)(length >> (i * 8));
+	}
+	tss_canonical_append(buf, header, sizeof(header));
+}
+
+static int tss_canonical_strcmp(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Serializes node with sorted dictionary keys, so equal requests give equal
+ * bytes no matter in which order the tags were added. */
+static void tss_canonical_append_node(struct tss_canonical_buffer* buf, plist_t node, int toplevel)
+{
+	switch (plist_get_node_type(node)) {
+	case PLIST_DICT: {
+		uint32_t count = plist_dict_get_size(node);
+		char** keys = (char**)calloc((count) ? count : 1, sizeof(char*));
+		uint32_t num = 0;
+		plist_dict_iter iter = NULL;
+		if (!keys) {
+			buf->failed = 1;
+			return;
+		}
+		plist_dict_new_iter(node, &iter);
+		while (iter && num < count) {
+			char* key = NULL;
+			plist_dict_next_item(node, iter, &key, NULL);
+			if (!key) {
+				break;
+			}
+			/* differs with every request */
+			if (toplevel && !strcmp(key, "@UUID")) {
+				free(key);
+				continue;
+			}
+			keys[num++] = key;
+		}
+		free(iter);
+		qsort(keys, num, sizeof(char*), tss_canonical_strcmp);
+		tss_canonical_append_header(buf, 'd', num);
+		uint32_t i;
+		for (i = 0; i < num; i++) {
+			size_t len = strlen(keys[i]);
+			tss_canonical_append_header(buf, 'k', len);
+			tss_canonical_append(buf, keys[i], len);
+			tss_canonical_append_node(buf, plist_dict_get_item(node, keys[i]), 0);
+			free(keys[i]);
+		}
+		free(keys);
+		break;
+	}
+	case PLIST_ARRAY: {
+		uint32_t count = plist_array_get_size(node);
+		uint32_t i;
+		tss_canonical_append_header(buf, 'a', count);
+		for (i = 0; i < count; i++) {
+			tss_canonical_append_node(buf, plist_array_get_item(node, i), 0);
+		}
+		break;
+	}
+	case PLIST_BOOLEAN: {
+		uint8_t val = 0;
+		plist_get_bool_val(node, &val);
+		tss_canonical_append_header(buf, 'b', val);
+		break;
+	}
+	case PLIST_UINT: {
+		uint64_t val = 0;
+		plist_get_uint_val(node, &val);
+		tss_canonical_append_header(buf, 'i', val);
+		break;
+	}
+	case PLIST_STRING: {
+		char* val = NULL;
+		plist_get_string_val(node, &val);
+		size_t len = (val) ? strlen(val) : 0;
+		tss_canonical_append_header(buf, 's', len);
+		tss_canonical_append(buf, val, len);
+		free(val);
+		break;
+	}
+	case PLIST_DATA: {
+		char* val = NULL;
+		uint64_t len = 0;
+		plist_get_data_val(node, &val, &len);
+		tss_canonical_append_header(buf, 'D', len);
+		tss_canonical_append(buf, val, len);
+		free(val);
+		break;
+	}
+	default: {
+		/* anything else is rare in requests, compare the serialized form */
+		char* xml = NULL;
+		uint32_t len = 0;
+		plist_to_xml(node, &xml, &len);
+		tss_canonical_append_header(buf, 'x', len);
+		tss_canonical_append(buf, xml, len);
+		free(xml);
+		break;
+	}
+	}
+}
+
+static int tss_request_cache_key(plist_t request, unsigned char* key)
+{
+	if (!request || plist_get_node_type(request) != PLIST_DICT) {
+		return -1;
+	}
+	struct tss_canonical_buffer buf = { NULL, 0, 0, 0 };
+	tss_canonical_append_node(&buf, request, 1);
+	if (buf.failed) {
+		free(buf.data);
+		return -1;
+	}
+	cache_key_from_data(key, buf.data, buf.length);
+	free(buf.data);
+	return 0;
+}
+
+static plist_t tss_response_cache_get(cache_t cache, const unsigned char* key)
+{
+	unsigned char* data = NULL;
+	unsigned int size = 0;
+	if (cache_get(cache, key, &data, &size) < 0) {
+		return NULL;
+	}
+	plist_t response = NULL;
+	plist_from_memory((const char*)data, size, &response);
+	free(data);
+	if (response && plist_get_node_type(response) != PLIST_DICT) {
+		plist_free(response);
+		response = NULL;
+	}
+	if (response) {
+		fixup_tss(response);
+	}
+	return response;
+}
+
+static void tss_response_cache_put(cache_t cache, const unsigned char* key, plist_t response)
+{
+	char* bin = NULL;
+	uint32_t size = 0;
+	plist_to_bin(response, &bin, &size);
+	if (bin) {
+		cache_put(cache, key, (const unsigned char*)bin, size);
+		free(bin);
+	}
+}
+
+plist_t tss_request_send_for_client(struct idevicerestore_client_t* client, plist_t request)
+{
+	unsigned char key[CACHE_KEY_SIZE];
+	int have_key = (client->tss_cache && tss_request_cache_key(request, key) == 0);
+	if (have_key) {
+		plist_t response = tss_response_cache_get(client->tss_cache, key);
+		if (response) {
+			info("Using cached TSS response\n");
+			return response;
+		}
+	}
+
+	uint64_t begin = telemetry_begin();
+	plist_t response = tss_request_send(request, client->tss_url);
+	telemetry_end(client->telemetry, "tss", begin, 0);
+
+	if (response && have_key) {
+		tss_response_cache_put(client->tss_cache, key, response);
+	}
+	return response;
+}
+
+struct tss_async_request {
+	THREAD_T thread;
+	int have_thread;
+	plist_t request;
+	char* server_url_string;
+	struct idevicerestore_client_t* client;
+	plist_t response;
+	uint64_t log_ecid;
+};
+
+static plist_t tss_async_send(struct tss_async_request* areq)
+{
+	if (areq->client) {
+		return tss_request_send_for_client(areq->client, areq->request);
+	}
+	return tss_request_send(areq->request, areq->server_url_string);
+}
+
+static void* tss_async_thread(void* arg)
+{
+	struct tss_async_request* areq = (struct tss_async_request*)arg;
+	idevicerestore_log_set_ecid(areq->log_ecid);
+	areq->response = tss_async_send(areq);
+	return NULL;
+}
+
+static tss_async_request_t tss_async_request_start(plist_t tss_request, const char* server_url_string, struct idevicerestore_client_t* client)
+{
+	struct tss_async_request* areq = (struct tss_async_request*)calloc(1, sizeof(struct tss_async_request));
+	if (!areq) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	areq->request = plist_copy(tss_request);
+	areq->server_url_string = (server_url_string) ? strdup(server_url_string) : NULL;
+	areq->client = client;
+	areq->log_ecid = idevicerestore_log_get_ecid();
+	/* without a thread the request is sent by tss_request_wait() */
+	areq->have_thread = (thread_new(&areq->thread, tss_async_thread, areq) == 0);
+	return areq;
+}
+
+tss_async_request_t tss_request_send_async(plist_t tss_request, const char* server_url_string)
+{
+	return tss_async_request_start(tss_request, server_url_string, NULL);
+}
+
+tss_async_request_t tss_request_send_async_for_client(struct idevicerestore_client_t* client, plist_t tss_request)
+{
+	return tss_async_request_start(tss_request, NULL, client);
+}
+
+plist_t tss_request_wait(tss_async_request_t areq)
+{
+	if (!areq) {
+		return NULL;
+	}
+	if (areq->have_thread) {
+		thread_join(areq->thread);
+		thread_free(areq->thread);
+	} else {
+		areq->response = tss_async_send(areq);
+	}
+	plist_t response = areq->response;
+	plist_free(areq->request);
+	free(areq->server_url_string);
+	free(areq);
+	return response;
+}
+
 static int tss_response_get_data_by_key(plist_t response, const char* name, unsigned char** buffer, unsigned int* length)
 {
 	plist_t node = plist_dict_get_item(response, name);
@@ -1637,14 +2394,17 @@ int tss_response_get_blob_by_path(plist_t tss, const char* path, unsigned char**
 	return 0;
 }
 
-int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob)
+int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob, unsigned int* blob_size)
 {
-	uint64_t blob_size = 0;
+	uint64_t blob_len = 0;
 	char* blob_data = NULL;
 	plist_t blob_node = NULL;
 	plist_t tss_entry = NULL;
 
 	*blob = NULL;
+	if (blob_size) {
+		*blob_size = 0;
+	}
 
 	tss_entry = plist_dict_get_item(response, entry);
 	if (!tss_entry || plist_get_node_type(tss_entry) != PLIST_DICT) {
@@ -1657,8 +2417,11 @@ int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned
 		error("ERROR: Unable to find blob in %s entry\n", entry);
 		return -1;
 	}
-	plist_get_data_val(blob_node, &blob_data, &blob_size);
+	plist_get_data_val(blob_node, &blob_data, &blob_len);
 
 	*blob = (unsigned char*)blob_data;
+	if (blob_size) {
+		*blob_size = (unsigned int)blob_len;
+	}
 	return 0;
 }
@@ -53,8 +53,40 @@ int tss_request_add_timer_tags(plist_t request, plist_t parameters, plist_t over
 int tss_request_add_ap_img4_tags(plist_t request, plist_t parameters);
 int tss_request_add_ap_img3_tags(plist_t request, plist_t parameters);
 
+#define TSS_CACHE_MAX_SIZE (64ULL * 1024 * 1024)
+
+/* request templates */
+#define TSS_TEMPLATE_IMG4 (1 << 0)
+#define TSS_TEMPLATE_PRODUCTION_MODE (1 << 1)
+#define TSS_TEMPLATE_SECURITY_MODE (1 << 2)
+/* The AP request for build_identity without the device specific values,
+ * built once and kept with the build manifest the identity belongs to.
+ * Returns NULL if build_identity is not part of a live build manifest. */
+typedef struct tss_request_template* tss_request_template_t;
+tss_request_template_t tss_request_template_get(plist_t build_identity, unsigned int flags);
+/* A new request from tmpl with ApECID, ApNonce and ApSepNonce of parameters */
+plist_t tss_request_template_new_request(tss_request_template_t tmpl, plist_t parameters);
+/* Same as tss_request_template_new_request(), serialized without building the plist */
+char* tss_request_template_to_xml(tss_request_template_t tmpl, plist_t parameters, uint32_t* size);
+
 /* i/o */
 plist_t tss_request_send(plist_t request, const char* server_url_string);
+plist_t tss_request_send_xml(const char* request, uint32_t size, const char* server_url_string);
+/* tss_request_send() to client->tss_url, with the time spent counted in
+ * the client's telemetry. Responses are kept in client->tss_cache and
+ * served from there again for an identical request. */
+struct idevicerestore_client_t;
+plist_t tss_request_send_for_client(struct idevicerestore_client_t* client, plist_t request);
+/* Sends a copy of request on a separate thread, tss_request_wait() returns
+ * the response (or NULL) and frees the handle. */
+typedef struct tss_async_request* tss_async_request_t;
+tss_async_request_t tss_request_send_async(plist_t request, const char* server_url_string);
+tss_async_request_t tss_request_send_async_for_client(struct idevicerestore_client_t* client, plist_t request);
+plist_t tss_request_wait(tss_async_request_t areq);
+/* Persists the health of the signing server endpoints in path */
+void tss_set_health_file(const char* path);
+/* releases the pooled connections, call before curl_global_cleanup() */
+void tss_cleanup(void);
 
 /* response */
 int tss_response_get_ap_img4_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
@@ -62,7 +94,7 @@ int tss_response_get_ap_ticket(plist_t response, unsigned char** ticket, unsigne
 int tss_response_get_baseband_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
 int tss_response_get_path_by_entry(plist_t response, const char* entry, char** path);
 int tss_response_get_blob_by_path(plist_t response, const char* path, unsigned char** blob);
-int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob);
+int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob, unsigned int* blob_size);
 
 /* helpers */
 char* ecid_to_string(uint64_t ecid);
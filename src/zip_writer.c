@@ -0,0 +1,386 @@
+/*
+ * zip_writer.c
+ * Streaming ZIP archive writer
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zip.h>
+#include <zlib.h>
+
+#include "zip_writer.h"
+#include "common.h"
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_RECORD_SIZE 22
+#define ZIP_VERSION_NEEDED 20
+#define ZIP_DEFAULT_ATTRIBUTES (0100644u << 16)
+#define ZIP_COPY_BUFFER_SIZE 0x10000
+#define ZIP_MAX_OFFSET 0xFFFFFFFFULL
+
+struct zip_writer_entry {
+	char* name;
+	uint16_t version_made_by;
+	uint16_t method;
+	uint16_t dostime;
+	uint16_t dosdate;
+	uint32_t crc;
+	uint32_t comp_size;
+	uint32_t size;
+	uint32_t attributes;
+	uint32_t offset;
+};
+
+struct zip_writer {
+	FILE* f;
+	char* path;
+	uint64_t offset;
+	struct zip_writer_entry* entries;
+	int num_entries;
+	int max_entries;
+	unsigned char* buf;
+	int failed;
+};
+
+static unsigned char* put16(unsigned char* p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	return p + 2;
+}
+
+static unsigned char* put32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+	return p + 4;
+}
+
+static void zip_writer_dos_time(time_t t, uint16_t* dostime, uint16_t* dosdate)
+{
+	struct tm* tm = localtime(&t);
+	if (!tm || tm->tm_year < 80) {
+		/* 1980-01-01 00:00:00 is as early as it gets */
+		*dostime = 0;
+		*dosdate = (1 << 5) | 1;
+		return;
+	}
+	*dostime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1);
+	*dosdate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+static int zip_writer_write(struct zip_writer* w, const void* data, size_t size)
+{
+	if (w->failed) {
+		return -1;
+	}
+	if (size > 0 && fwrite(data, 1, size, w->f) != size) {
+		error("ERROR: Unable to write to %s\n", w->path);
+		w->failed = 1;
+		return -1;
+	}
+	w->offset += size;
+	return 0;
+}
+
+struct zip_writer* zip_writer_open(const char* path)
+{
+	struct zip_writer* w = (struct zip_writer*)calloc(1, sizeof(struct zip_writer));
+	if (!w) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		return NULL;
+	}
+	w->path = strdup(path);
+	w->f = fopen(path, "wb");
+	if (!w->f) {
+		error("ERROR: Unable to open %s for writing\n", path);
+		free(w->path);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static void zip_writer_free(struct zip_writer* w)
+{
+	int i;
+	for (i = 0; i < w->num_entries; i++) {
+		free(w->entries[i].name);
+	}
+	free(w->entries);
+	free(w->buf);
+	free(w->path);
+	free(w);
+}
+
+void zip_writer_discard(struct zip_writer* w)
+{
+	if (!w) {
+		return;
+	}
+	fclose(w->f);
+	remove(w->path);
+	zip_writer_free(w);
+}
+
+/* records the entry for the central directory and writes its local header */
+static int zip_writer_begin_entry(struct zip_writer* w, const char* name, uint16_t version_made_by, uint32_t attributes, time_t mtime, uint16_t method, uint32_t crc, uint64_t comp_size, uint64_t size)
+{
+	if (w->failed) {
+		return -1;
+	}
+	size_t name_len = strlen(name);
+	if (size > ZIP_MAX_OFFSET || w->offset + ZIP_LOCAL_HEADER_SIZE + name_len + comp_size > ZIP_MAX_OFFSET || name_len > 0xFFFF || w->num_entries == 0xFFFF) {
+		error("ERROR: %s: %s doesn't fit in a ZIP archive without ZIP64\n", __func__, name);
+		w->failed = 1;
+		return -1;
+	}
+	if (w->num_entries == w->max_entries) {
+		int max_entries = (w->max_entries) ? w->max_entries * 2 : 16;
+		struct zip_writer_entry* entries = (struct zip_writer_entry*)realloc(w->entries, max_entries * sizeof(struct zip_writer_entry));
+		if (!entries) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			w->failed = 1;
+			return -1;
+		}
+		w->entries = entries;
+		w->max_entries = max_entries;
+	}
+	struct zip_writer_entry* entry = &w->entries[w->num_entries];
+	entry->name = strdup(name);
+	if (!entry->name) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		w->failed = 1;
+		return -1;
+	}
+	w->num_entries++;
+	entry->version_made_by = version_made_by;
+	entry->method = method;
+	zip_writer_dos_time(mtime, &entry->dostime, &entry->dosdate);
+	entry->crc = crc;
+	entry->comp_size = (uint32_t)comp_size;
+	entry->size = (uint32_t)size;
+	entry->attributes = attributes;
+	entry->offset = (uint32_t)w->offset;
+
+	unsigned char hdr[ZIP_LOCAL_HEADER_SIZE];
+	unsigned char* p = hdr;
+	p = put32(p, 0x04034b50);
+	p = put16(p, ZIP_VERSION_NEEDED);
+	p = put16(p, 0);
+	p = put16(p, entry->method);
+	p = put16(p, entry->dostime);
+	p = put16(p, entry->dosdate);
+	p = put32(p, entry->crc);
+	p = put32(p, entry->comp_size);
+	p = put32(p, entry->size);
+	p = put16(p, (uint16_t)name_len);
+	put16(p, 0);
+	if (zip_writer_write(w, hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+	return zip_writer_write(w, name, name_len);
+}
+
+int zip_writer_copy_entry(struct zip_writer* w, struct zip* za, zip_uint64_t index)
+{
+	struct zip_stat zst;
+	zip_stat_init(&zst);
+	if (zip_stat_index(za, index, 0, &zst) != 0) {
+		error("ERROR: zip_stat_index failed for index %d\n", (int)index);
+		return -1;
+	}
+	zip_uint64_t required = ZIP_STAT_NAME | ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE | ZIP_STAT_CRC | ZIP_STAT_COMP_METHOD;
+	if ((zst.valid & required) != required || ((zst.valid & ZIP_STAT_ENCRYPTION_METHOD) && zst.encryption_method != ZIP_EM_NONE)) {
+		error("ERROR: %s: Can't copy %s\n", __func__, (zst.valid & ZIP_STAT_NAME) ? zst.name : "entry");
+		return -1;
+	}
+	zip_uint8_t opsys = ZIP_OPSYS_UNIX;
+	zip_uint32_t attributes = ZIP_DEFAULT_ATTRIBUTES;
+	zip_file_get_external_attributes(za, index, 0, &opsys, &attributes);
+	time_t mtime = (zst.valid & ZIP_STAT_MTIME) ? zst.mtime : time(NULL);
+
+	if (!w->buf) {
+		w->buf = (unsigned char*)malloc(ZIP_COPY_BUFFER_SIZE);
+		if (!w->buf) {
+			error("ERROR: %s: Out of memory\n", __func__);
+			w->failed = 1;
+			return -1;
+		}
+	}
+	struct zip_file* zfile = zip_fopen_index(za, index, ZIP_FL_COMPRESSED);
+	if (!zfile) {
+		error("ERROR: zip_fopen_index failed for index %d\n", (int)index);
+		return -1;
+	}
+	if (zip_writer_begin_entry(w, zst.name, (opsys << 8) | ZIP_VERSION_NEEDED, attributes, mtime, zst.comp_method, zst.crc, zst.comp_size, zst.size) < 0) {
+		zip_fclose(zfile);
+		return -1;
+	}
+	uint64_t done = 0;
+	while (done < zst.comp_size) {
+		zip_uint64_t chunk = zst.comp_size - done;
+		if (chunk > ZIP_COPY_BUFFER_SIZE) {
+			chunk = ZIP_COPY_BUFFER_SIZE;
+		}
+		zip_int64_t r = zip_fread(zfile, w->buf, chunk);
+		if (r <= 0) {
+			error("ERROR: zip_fread: failed for %s\n", zst.name);
+			w->failed = 1;
+			break;
+		}
+		if (zip_writer_write(w, w->buf, (size_t)r) < 0) {
+			break;
+		}
+		done += r;
+	}
+	zip_fclose(zfile);
+	return (done == zst.comp_size) ? 0 : -1;
+}
+
+int zip_writer_compress(const unsigned char* data, uint64_t size, struct zip_writer_blob* blob)
+{
+	memset(blob, 0, sizeof(struct zip_writer_blob));
+	if (size > ZIP_MAX_OFFSET) {
+		error("ERROR: %s: Data too large\n", __func__);
+		return -1;
+	}
+
+	z_stream zstrm;
+	memset(&zstrm, 0, sizeof(z_stream));
+	if (deflateInit2(&zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		error("ERROR: deflateInit2 failed\n");
+		return -1;
+	}
+	/* never smaller than size, so the data can still be stored instead */
+	uLong bound = deflateBound(&zstrm, (uLong)size);
+	blob->data = (unsigned char*)malloc(bound);
+	if (!blob->data) {
+		error("ERROR: %s: Out of memory\n", __func__);
+		deflateEnd(&zstrm);
+		return -1;
+	}
+	zstrm.next_in = (Bytef*)data;
+	zstrm.avail_in = (uInt)size;
+	zstrm.next_out = blob->data;
+	zstrm.avail_out = (uInt)bound;
+	int zr = deflate(&zstrm, Z_FINISH);
+	uint64_t comp_size = zstrm.total_out;
+	deflateEnd(&zstrm);
+	if (zr != Z_STREAM_END) {
+		error("ERROR: deflate failed (%d)\n", zr);
+		zip_writer_blob_free(blob);
+		return -1;
+	}
+
+	blob->size = size;
+	blob->crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), data, (uInt)size);
+	if (comp_size < size) {
+		blob->method = ZIP_CM_DEFLATE;
+		blob->comp_size = comp_size;
+	} else {
+		blob->method = ZIP_CM_STORE;
+		blob->comp_size = size;
+		memcpy(blob->data, data, size);
+	}
+	return 0;
+}
+
+void zip_writer_blob_free(struct zip_writer_blob* blob)
+{
+	free(blob->data);
+	memset(blob, 0, sizeof(struct zip_writer_blob));
+}
+
+int zip_writer_add_blob(struct zip_writer* w, const char* name, time_t mtime, const struct zip_writer_blob* blob)
+{
+	if (zip_writer_begin_entry(w, name, (ZIP_OPSYS_UNIX << 8) | ZIP_VERSION_NEEDED, ZIP_DEFAULT_ATTRIBUTES, mtime, blob->method, blob->crc, blob->comp_size, blob->size) < 0) {
+		return -1;
+	}
+	return zip_writer_write(w, blob->data, (size_t)blob->comp_size);
+}
+
+int zip_writer_close(struct zip_writer* w)
+{
+	int i;
+	uint64_t cd_offset = w->offset;
+
+	for (i = 0; i < w->num_entries && !w->failed; i++) {
+		struct zip_writer_entry* entry = &w->entries[i];
+		size_t name_len = strlen(entry->name);
+		unsigned char hdr[ZIP_CENTRAL_HEADER_SIZE];
+		unsigned char* p = hdr;
+		p = put32(p, 0x02014b50);
+		p = put16(p, entry->version_made_by);
+		p = put16(p, ZIP_VERSION_NEEDED);
+		p = put16(p, 0);
+		p = put16(p, entry->method);
+		p = put16(p, entry->dostime);
+		p = put16(p, entry->dosdate);
+		p = put32(p, entry->crc);
+		p = put32(p, entry->comp_size);
+		p = put32(p, entry->size);
+		p = put16(p, (uint16_t)name_len);
+		p = put16(p, 0);
+		p = put16(p, 0);
+		p = put16(p, 0);
+		p = put16(p, 0);
+		p = put32(p, entry->attributes);
+		put32(p, entry->offset);
+		if (zip_writer_write(w, hdr, sizeof(hdr)) < 0 || zip_writer_write(w, entry->name, name_len) < 0) {
+			break;
+		}
+	}
+
+	uint64_t cd_size = w->offset - cd_offset;
+	if (!w->failed && w->offset > ZIP_MAX_OFFSET) {
+		error("ERROR: %s: Archive too large without ZIP64\n", __func__);
+		w->failed = 1;
+	}
+	unsigned char end[ZIP_END_RECORD_SIZE];
+	unsigned char* p = end;
+	p = put32(p, 0x06054b50);
+	p = put16(p, 0);
+	p = put16(p, 0);
+	p = put16(p, (uint16_t)w->num_entries);
+	p = put16(p, (uint16_t)w->num_entries);
+	p = put32(p, (uint32_t)cd_size);
+	p = put32(p, (uint32_t)cd_offset);
+	put16(p, 0);
+	zip_writer_write(w, end, sizeof(end));
+
+	if (fclose(w->f) != 0 && !w->failed) {
+		error("ERROR: Unable to write to %s\n", w->path);
+		w->failed = 1;
+	}
+	int res = (w->failed) ? -1 : 0;
+	if (res < 0) {
+		remove(w->path);
+	}
+	zip_writer_free(w);
+	return res;
+}
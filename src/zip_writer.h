@@ -0,0 +1,71 @@
+/*
+ * zip_writer.h
+ * Streaming ZIP archive writer (header file)
+ *
+ * Copyright (c) 2026 idevicerestore contributors. All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_ZIP_WRITER_H
+#define IDEVICERESTORE_ZIP_WRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+#include <zip.h>
+
+/* Writes a new archive front to back, without the temporary copy and the
+ * recompression libzip does in zip_close(). Entries taken over from another
+ * archive are copied as stored, compressed data. Archives larger than 4 GB
+ * (ZIP64) are not supported, which is plenty for the baseband firmware. */
+struct zip_writer;
+
+/* An entry compressed up front, possibly on another thread */
+struct zip_writer_blob {
+	unsigned char* data;
+	uint64_t size;
+	uint64_t comp_size;
+	uint32_t crc;
+	uint16_t method;
+};
+
+struct zip_writer* zip_writer_open(const char* path);
+
+/* Finishes the archive with the central directory and frees the writer.
+ * Fails if anything written before failed. */
+int zip_writer_close(struct zip_writer* w);
+
+/* Closes and removes an unfinished archive */
+void zip_writer_discard(struct zip_writer* w);
+
+/* Copies entry index of za without decompressing it */
+int zip_writer_copy_entry(struct zip_writer* w, struct zip* za, zip_uint64_t index);
+
+/* Deflates data into blob, or stores it if it doesn't get any smaller.
+ * Thread-safe, as it doesn't touch a writer. */
+int zip_writer_compress(const unsigned char* data, uint64_t size, struct zip_writer_blob* blob);
+void zip_writer_blob_free(struct zip_writer_blob* blob);
+
+int zip_writer_add_blob(struct zip_writer* w, const char* name, time_t mtime, const struct zip_writer_blob* blob);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif